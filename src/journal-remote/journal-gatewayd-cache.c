@@ -0,0 +1,354 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+
+#include "journal-gatewayd-cache.h"
+#include "hashmap.h"
+#include "log.h"
+
+/* A known entry at some distance from the cursor a request is
+ * anchored at, so that requests skipping further than that don't have
+ * to walk all the way from the anchor again. */
+typedef struct LocationHint {
+        int64_t pos;
+        char *cursor;
+} LocationHint;
+
+typedef struct LocationEntry {
+        char *key;
+        uint64_t generation;
+        LocationHint hints[LOCATION_HINTS_MAX];
+        unsigned n_hints;
+        unsigned next_hint;
+} LocationEntry;
+
+struct LocationCache {
+        pthread_mutex_t mutex;
+        OrderedHashmap *entries;
+
+        /* Bumped on every flush, entries of older generations are
+         * ignored and reused */
+        uint64_t generation;
+};
+
+struct JournalPool {
+        pthread_mutex_t mutex;
+        sd_journal *journals[JOURNAL_POOL_MAX];
+        unsigned n_journals;
+
+        LocationCache *cache;
+};
+
+static void location_entry_reset(LocationEntry *e) {
+        unsigned i;
+
+        assert(e);
+
+        for (i = 0; i < e->n_hints; i++) {
+                free(e->hints[i].cursor);
+                e->hints[i].cursor = NULL;
+        }
+
+        e->n_hints = e->next_hint = 0;
+}
+
+static LocationEntry* location_entry_free(LocationEntry *e) {
+        if (!e)
+                return NULL;
+
+        location_entry_reset(e);
+
+        free(e->key);
+        free(e);
+
+        return NULL;
+}
+
+LocationCache *location_cache_new(void) {
+        LocationCache *c;
+
+        c = new0(LocationCache, 1);
+        if (!c)
+                return NULL;
+
+        c->entries = ordered_hashmap_new(&string_hash_ops);
+        if (!c->entries) {
+                free(c);
+                return NULL;
+        }
+
+        assert_se(pthread_mutex_init(&c->mutex, NULL) == 0);
+
+        return c;
+}
+
+LocationCache *location_cache_free(LocationCache *c) {
+        LocationEntry *e;
+
+        if (!c)
+                return NULL;
+
+        while ((e = ordered_hashmap_steal_first(c->entries)))
+                location_entry_free(e);
+
+        ordered_hashmap_free(c->entries);
+        assert_se(pthread_mutex_destroy(&c->mutex) == 0);
+        free(c);
+
+        return NULL;
+}
+
+uint64_t location_cache_generation(LocationCache *c) {
+        uint64_t g;
+
+        assert(c);
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        g = c->generation;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return g;
+}
+
+uint64_t location_cache_flush(LocationCache *c) {
+        uint64_t g;
+
+        assert(c);
+
+        /* The entries are dropped lazily, when they are looked up
+         * or reused next */
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        g = ++c->generation;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return g;
+}
+
+void location_cache_put(LocationCache *c, uint64_t generation, const char *key, int64_t pos, const char *cursor) {
+        LocationEntry *e;
+        LocationHint *h;
+        unsigned i;
+        char *k = NULL, *s;
+
+        assert(c);
+        assert(key);
+        assert(cursor);
+
+        if (pos == 0)
+                return;
+
+        s = strdup(cursor);
+        if (!s)
+                return;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+        /* Learnt from a journal which did not know about files which
+         * appeared or went away since */
+        if (generation != c->generation)
+                goto finish;
+
+        e = ordered_hashmap_get(c->entries, key);
+        if (!e) {
+                /* Forget the anchor we learnt about first */
+                if (ordered_hashmap_size(c->entries) >= LOCATION_CACHE_MAX)
+                        location_entry_free(ordered_hashmap_steal_first(c->entries));
+
+                k = strdup(key);
+                e = new0(LocationEntry, 1);
+                if (!k || !e) {
+                        free(e);
+                        goto finish;
+                }
+
+                e->key = k;
+                k = NULL;
+
+                if (ordered_hashmap_put(c->entries, e->key, e) < 0) {
+                        location_entry_free(e);
+                        goto finish;
+                }
+        } else if (e->generation != generation)
+                location_entry_reset(e);
+
+        e->generation = generation;
+
+        for (i = 0; i < e->n_hints; i++)
+                if (e->hints[i].pos == pos)
+                        break;
+
+        if (i >= e->n_hints) {
+                if (e->n_hints < LOCATION_HINTS_MAX)
+                        i = e->n_hints++;
+                else {
+                        i = e->next_hint;
+                        e->next_hint = (e->next_hint + 1) % LOCATION_HINTS_MAX;
+                }
+        }
+
+        h = e->hints + i;
+        free(h->cursor);
+        h->cursor = s;
+        h->pos = pos;
+        s = NULL;
+
+finish:
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+        free(k);
+        free(s);
+}
+
+/* Finds the closest known entry between the anchor and the entry we
+ * are supposed to skip to */
+int location_cache_get(LocationCache *c, const char *key, int64_t skip, int64_t *ret_pos, char **ret_cursor) {
+        LocationEntry *e;
+        LocationHint *best = NULL;
+        unsigned i;
+        int r = 0;
+
+        assert(c);
+        assert(key);
+        assert(ret_pos);
+        assert(ret_cursor);
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+        e = ordered_hashmap_get(c->entries, key);
+        if (!e || e->generation != c->generation)
+                goto finish;
+
+        for (i = 0; i < e->n_hints; i++) {
+                LocationHint *h = e->hints + i;
+
+                if (skip > 0 ? (h->pos <= 0 || h->pos > skip) : (h->pos >= 0 || h->pos < skip))
+                        continue;
+
+                if (!best || llabs(h->pos) > llabs(best->pos))
+                        best = h;
+        }
+
+        if (!best)
+                goto finish;
+
+        *ret_cursor = strdup(best->cursor);
+        if (!*ret_cursor) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        *ret_pos = best->pos;
+        r = 1;
+
+finish:
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+        return r;
+}
+
+JournalPool *journal_pool_new(LocationCache *cache) {
+        JournalPool *p;
+
+        assert(cache);
+
+        p = new0(JournalPool, 1);
+        if (!p)
+                return NULL;
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        p->cache = cache;
+
+        return p;
+}
+
+JournalPool *journal_pool_free(JournalPool *p) {
+        unsigned i;
+
+        if (!p)
+                return NULL;
+
+        for (i = 0; i < p->n_journals; i++)
+                sd_journal_close(p->journals[i]);
+
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+        free(p);
+
+        return NULL;
+}
+
+int journal_pool_get(JournalPool *p, sd_journal **ret, uint64_t *ret_generation) {
+        sd_journal *j;
+        uint64_t g;
+        int r;
+
+        assert(p);
+        assert(ret);
+        assert(ret_generation);
+
+        for (;;) {
+                j = NULL;
+
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+                if (p->n_journals > 0)
+                        j = p->journals[--p->n_journals];
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                /* Read before looking at the journal, so that
+                 * locations learnt from it are dropped if some other
+                 * request sees files change in the meantime */
+                g = location_cache_generation(p->cache);
+
+                if (!j) {
+                        *ret = NULL;
+                        *ret_generation = g;
+                        return 0;
+                }
+
+                r = sd_journal_process(j);
+                if (r >= 0)
+                        break;
+
+                log_debug_errno(r, "Failed to process journal changes, dropping journal: %m");
+                sd_journal_close(j);
+        }
+
+        /* Files went away or appeared, so entries may have vanished
+         * between the cached locations */
+        if (r == SD_JOURNAL_INVALIDATE)
+                g = location_cache_flush(p->cache);
+
+        *ret = j;
+        *ret_generation = g;
+        return 1;
+}
+
+void journal_pool_put(JournalPool *p, sd_journal *j) {
+        assert(p);
+        assert(j);
+
+        sd_journal_flush_matches(j);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        if (p->n_journals < JOURNAL_POOL_MAX) {
+                p->journals[p->n_journals++] = j;
+                j = NULL;
+        }
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        sd_journal_close(j);
+}
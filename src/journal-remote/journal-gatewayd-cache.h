@@ -0,0 +1,56 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "sd-journal.h"
+#include "util.h"
+
+/* How many idle journal objects to keep around for later requests */
+#define JOURNAL_POOL_MAX 16
+
+/* How many anchor cursors to remember locations for, and how many
+ * locations relative to each of them */
+#define LOCATION_CACHE_MAX 256
+#define LOCATION_HINTS_MAX 8
+
+typedef struct LocationCache LocationCache;
+typedef struct JournalPool JournalPool;
+
+/* Both are shared by the connection threads, and do their own
+ * locking. */
+
+LocationCache *location_cache_new(void);
+LocationCache *location_cache_free(LocationCache *c);
+
+/* Locations learnt from a journal are only valid as long as no files
+ * appeared or went away in between. Pass the generation returned when
+ * the journal was taken from the pool when storing them, they are
+ * dropped if the cache was flushed since. */
+uint64_t location_cache_generation(LocationCache *c);
+uint64_t location_cache_flush(LocationCache *c);
+
+void location_cache_put(LocationCache *c, uint64_t generation, const char *key, int64_t pos, const char *cursor);
+int location_cache_get(LocationCache *c, const char *key, int64_t skip, int64_t *ret_pos, char **ret_cursor);
+
+JournalPool *journal_pool_new(LocationCache *cache);
+JournalPool *journal_pool_free(JournalPool *p);
+
+int journal_pool_get(JournalPool *p, sd_journal **ret, uint64_t *ret_generation);
+void journal_pool_put(JournalPool *p, sd_journal *j);
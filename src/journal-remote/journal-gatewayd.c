@@ -43,13 +43,18 @@
 #include "fileio.h"
 #include "sigbus.h"
 #include "hostname-util.h"
+#include "journal-gatewayd-cache.h"
 
 static char *arg_key_pem = NULL;
 static char *arg_cert_pem = NULL;
 static char *arg_trust_pem = NULL;
 
+static LocationCache *location_cache = NULL;
+static JournalPool *journal_pool = NULL;
+
 typedef struct RequestMeta {
         sd_journal *journal;
+        bool journal_pooled;
 
         OutputMode mode;
 
@@ -68,6 +73,18 @@ typedef struct RequestMeta {
 
         uint64_t n_fields;
         bool n_fields_set;
+
+        /* The matches, and the cursor and skip we started from, as
+         * key into the location cache */
+        char *matches;
+        char *location_key;
+        uint64_t location_generation;
+        int64_t skip;
+        int64_t position;
+        bool location_cached;
+
+        uint64_t n_served;
+        usec_t start, seek_usec;
 } RequestMeta;
 
 static const char* const mime_types[_OUTPUT_MODE_MAX] = {
@@ -77,6 +94,20 @@ static const char* const mime_types[_OUTPUT_MODE_MAX] = {
         [OUTPUT_EXPORT] = "application/vnd.fdo.journal",
 };
 
+static void location_cache_remember(RequestMeta *m) {
+        _cleanup_free_ char *cursor = NULL;
+
+        assert(m);
+
+        if (!m->location_key)
+                return;
+
+        if (sd_journal_get_cursor(m->journal, &cursor) < 0)
+                return;
+
+        location_cache_put(location_cache, m->location_generation, m->location_key, m->position, cursor);
+}
+
 static RequestMeta *request_meta(void **connection_cls) {
         RequestMeta *m;
 
@@ -88,6 +119,8 @@ static RequestMeta *request_meta(void **connection_cls) {
         if (!m)
                 return NULL;
 
+        m->start = now(CLOCK_MONOTONIC);
+
         *connection_cls = m;
         return m;
 }
@@ -99,27 +132,62 @@ static void request_meta_free(
                 enum MHD_RequestTerminationCode toe) {
 
         RequestMeta *m = *connection_cls;
+        char a[FORMAT_TIMESPAN_MAX], b[FORMAT_TIMESPAN_MAX];
 
         if (!m)
                 return;
 
-        if (m->journal)
-                sd_journal_close(m->journal);
+        if (m->journal) {
+                log_debug("Served %"PRIu64" items (%"PRIu64" bytes) in %s, seeking took %s%s.",
+                          m->n_served, m->delta + m->size,
+                          format_timespan(a, sizeof(a), now(CLOCK_MONOTONIC) - m->start, USEC_PER_MSEC),
+                          format_timespan(b, sizeof(b), m->seek_usec, USEC_PER_MSEC),
+                          m->location_cached ? " (using cached location)" : "");
+
+                if (m->journal_pooled)
+                        journal_pool_put(journal_pool, m->journal);
+                else
+                        sd_journal_close(m->journal);
+        }
 
         if (m->tmp)
                 fclose(m->tmp);
 
         free(m->cursor);
+        free(m->matches);
+        free(m->location_key);
         free(m);
 }
 
 static int open_journal(RequestMeta *m) {
+        int r;
+
         assert(m);
 
         if (m->journal)
                 return 0;
 
-        return sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY|SD_JOURNAL_SYSTEM);
+        /* Opening the journal means enumerating and mapping all
+         * files, hence reuse the journal objects of earlier requests.
+         * They keep track of new and removed files via inotify. */
+        r = journal_pool_get(journal_pool, &m->journal, &m->location_generation);
+        if (r > 0) {
+                m->journal_pooled = true;
+                return 0;
+        }
+
+        r = sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY|SD_JOURNAL_SYSTEM);
+        if (r < 0)
+                return r;
+
+        /* Only journals which get notified about changes may be reused */
+        r = sd_journal_get_fd(m->journal);
+        if (r < 0)
+                log_debug_errno(r, "Failed to watch journal, not reusing it: %m");
+        else
+                m->journal_pooled = true;
+
+        return 0;
 }
 
 static int request_meta_ensure_tmp(RequestMeta *m) {
@@ -132,7 +200,7 @@ static int request_meta_ensure_tmp(RequestMeta *m) {
                 if (fd < 0)
                         return fd;
 
-                m->tmp = fdopen(fd, "rw");
+                m->tmp = fdopen(fd, "w+");
                 if (!m->tmp) {
                         safe_close(fd);
                         return -errno;
@@ -162,12 +230,21 @@ static ssize_t request_reader_entries(
         while (pos >= m->size) {
                 off_t sz;
 
+                usec_t ts = 0;
+
                 /* End of this entry, so let's serialize the next
                  * one */
 
                 if (m->n_entries_set &&
-                    m->n_entries <= 0)
+                    m->n_entries <= 0) {
+                        /* Remember where this page ended, the next
+                         * one likely starts there */
+                        location_cache_remember(m);
                         return MHD_CONTENT_READER_END_OF_STREAM;
+                }
+
+                if (m->n_served == 0)
+                        ts = now(CLOCK_MONOTONIC);
 
                 if (m->n_skip < 0)
                         r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
@@ -213,6 +290,16 @@ static ssize_t request_reader_entries(
                 if (m->n_entries_set)
                         m->n_entries -= 1;
 
+                if (m->n_served == 0) {
+                        m->seek_usec += now(CLOCK_MONOTONIC) - ts;
+                        m->position = m->skip;
+
+                        if (m->n_skip != 0)
+                                location_cache_remember(m);
+                } else
+                        m->position++;
+
+                m->n_served++;
                 m->n_skip = 0;
 
                 r = request_meta_ensure_tmp(m);
@@ -422,6 +509,11 @@ static int request_parse_arguments_iterator(
                                 m->argument_parse_error = r;
                                 return MHD_NO;
                         }
+
+                        if (!strextend(&m->matches, match, "\n", NULL)) {
+                                m->argument_parse_error = log_oom();
+                                return MHD_NO;
+                        }
                 }
 
                 return MHD_YES;
@@ -439,6 +531,11 @@ static int request_parse_arguments_iterator(
                 return MHD_NO;
         }
 
+        if (!strextend(&m->matches, p, "\n", NULL)) {
+                m->argument_parse_error = log_oom();
+                return MHD_NO;
+        }
+
         return MHD_YES;
 }
 
@@ -455,12 +552,51 @@ static int request_parse_arguments(
         return m->argument_parse_error;
 }
 
+static int request_seek_cached(RequestMeta *m) {
+        _cleanup_free_ char *cursor = NULL;
+        int64_t pos;
+        int r;
+
+        assert(m);
+        assert(m->location_key);
+
+        if (m->n_skip == 0)
+                return 0;
+
+        r = location_cache_get(location_cache, m->location_key, m->n_skip, &pos, &cursor);
+        if (r <= 0)
+                return r;
+
+        /* Make sure the entry is still around before relying on it */
+        r = sd_journal_seek_cursor(m->journal, cursor);
+        if (r < 0)
+                return r;
+
+        r = sd_journal_next(m->journal);
+        if (r <= 0)
+                return r;
+
+        r = sd_journal_test_cursor(m->journal, cursor);
+        if (r <= 0)
+                return r;
+
+        r = sd_journal_seek_cursor(m->journal, cursor);
+        if (r < 0)
+                return r;
+
+        m->n_skip -= pos;
+        m->location_cached = true;
+
+        return 1;
+}
+
 static int request_handler_entries(
                 struct MHD_Connection *connection,
                 void *connection_cls) {
 
         struct MHD_Response *response;
         RequestMeta *m = connection_cls;
+        usec_t ts;
         int r;
 
         assert(connection);
@@ -485,16 +621,32 @@ static int request_handler_entries(
 
                 m->n_entries = 1;
                 m->n_entries_set = true;
+        } else if (m->cursor) {
+                /* Paging through the entries relative to a cursor,
+                 * look for a location closer to where we should skip
+                 * to. */
+                m->location_key = strjoin(strempty(m->matches), "\n", m->cursor, NULL);
+                if (!m->location_key)
+                        return respond_oom(connection);
+
+                m->skip = m->n_skip;
         }
 
-        if (m->cursor)
-                r = sd_journal_seek_cursor(m->journal, m->cursor);
-        else if (m->n_skip >= 0)
-                r = sd_journal_seek_head(m->journal);
-        else if (m->n_skip < 0)
-                r = sd_journal_seek_tail(m->journal);
-        if (r < 0)
-                return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to seek in journal.\n");
+        ts = now(CLOCK_MONOTONIC);
+
+        r = m->location_key ? request_seek_cached(m) : 0;
+        if (r <= 0) {
+                if (m->cursor)
+                        r = sd_journal_seek_cursor(m->journal, m->cursor);
+                else if (m->n_skip >= 0)
+                        r = sd_journal_seek_head(m->journal);
+                else if (m->n_skip < 0)
+                        r = sd_journal_seek_tail(m->journal);
+                if (r < 0)
+                        return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to seek in journal.\n");
+        }
+
+        m->seek_usec = now(CLOCK_MONOTONIC) - ts;
 
         response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_entries, m, NULL);
         if (!response)
@@ -572,6 +724,8 @@ static ssize_t request_reader_fields(
                 if (m->n_fields_set)
                         m->n_fields -= 1;
 
+                m->n_served++;
+
                 r = request_meta_ensure_tmp(m);
                 if (r < 0) {
                         log_error_errno(r, "Failed to create temporary file: %m");
@@ -999,6 +1153,19 @@ int main(int argc, char *argv[]) {
         if (r < 0)
                 return EXIT_FAILURE;
 
+        location_cache = location_cache_new();
+        if (!location_cache) {
+                log_oom();
+                return EXIT_FAILURE;
+        }
+
+        journal_pool = journal_pool_new(location_cache);
+        if (!journal_pool) {
+                log_oom();
+                r = EXIT_FAILURE;
+                goto finish;
+        }
+
         n = sd_listen_fds(1);
         if (n < 0) {
                 log_error_errno(n, "Failed to determine passed sockets: %m");
@@ -1057,5 +1224,8 @@ finish:
         if (d)
                 MHD_stop_daemon(d);
 
+        journal_pool_free(journal_pool);
+        location_cache_free(location_cache);
+
         return r;
 }
@@ -35,6 +35,7 @@ void source_free(RemoteSource *source) {
 
         free(source->name);
         free(source->buf);
+        free(source->compressed);
         iovw_free_contents(&source->iovw);
 
         log_debug("Writer ref count %i", source->writer->n_ref);
@@ -444,7 +445,12 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
         assert(source);
         assert(source->writer);
 
-        r = process_data(source);
+        /* Parse until we have a full event, or run out of data. Going
+         * back to the caller after every line would mean a trip
+         * through the event loop for each field. */
+        do
+                r = process_data(source);
+        while (r == 0 && source->state != STATE_EOF);
         if (r <= 0)
                 return r;
 
@@ -468,7 +474,9 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
                 r = 1;
 
  freeing:
-        iovw_free_contents(&source->iovw);
+        /* Keep the iovec array around for the next event, the entries
+         * point into our buffer anyway */
+        source->iovw.count = 0;
 
         /* possibly reset buffer position */
         remain = source->filled - source->offset;
@@ -482,8 +490,9 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
                 source->filled = remain;
         }
 
+        /* Shrink the buffer, but never below the data still in it */
         target = source->size;
-        while (target > 16 * LINE_CHUNK && remain < target / 2)
+        while (target > 16 * LINE_CHUNK && source->filled < target / 2)
                 target /= 2;
         if (target < source->size) {
                 char *tmp;
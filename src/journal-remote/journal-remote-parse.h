@@ -53,6 +53,12 @@ typedef struct RemoteSource {
 
         Writer *writer;
 
+        /* HTTP uploads with a Content-Encoding are collected here
+         * and decompressed as a whole once complete */
+        int compression;
+        char *compressed;
+        size_t compressed_size, compressed_allocated;
+
         sd_event_source *event;
         sd_event_source *buffer_event;
 } RemoteSource;
@@ -147,7 +147,7 @@ int writer_write(Writer *w,
                                       &w->seqnum, NULL, NULL);
         if (r >= 0) {
                 if (w->server)
-                        w->server->event_count += 1;
+                        __atomic_add_fetch(&w->server->event_count, 1, __ATOMIC_RELAXED);
                 return 1;
         }
 
@@ -165,6 +165,6 @@ int writer_write(Writer *w,
                 return r;
 
         if (w->server)
-                w->server->event_count += 1;
+                __atomic_add_fetch(&w->server->event_count, 1, __ATOMIC_RELAXED);
         return 1;
 }
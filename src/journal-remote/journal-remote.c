@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -39,6 +40,7 @@
 #include "strv.h"
 #include "fileio.h"
 #include "conf-parser.h"
+#include "compress.h"
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
@@ -53,6 +55,11 @@
 #define CERT_FILE     CERTIFICATE_ROOT "/certs/journal-remote.pem"
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 
+/* Uploads with a Content-Encoding are kept in memory until they are
+ * complete, hence limit their size */
+#define UPLOAD_COMPRESSED_MAX (64U*1024U*1024U)
+#define UPLOAD_DECOMPRESSED_MAX (256U*1024U*1024U)
+
 static char* arg_url = NULL;
 static char* arg_getter = NULL;
 static char* arg_listen_raw = NULL;
@@ -66,6 +73,7 @@ static char** arg_gnutls_log = NULL;
 
 static JournalWriteSplitMode arg_split_mode = JOURNAL_WRITE_SPLIT_HOST;
 static char* arg_output = NULL;
+static unsigned arg_threads = 1;
 
 static char *arg_key = NULL;
 static char *arg_cert = NULL;
@@ -302,6 +310,8 @@ static int dispatch_http_event(sd_event_source *event,
                                int fd,
                                uint32_t revents,
                                void *userdata);
+static int shard_add_source(RemoteServer *s, int fd, char *name);
+static void shard_connection_done(RemoteServer *s);
 
 static int get_source_for_fd(RemoteServer *s,
                              int fd, char *name, RemoteSource **source) {
@@ -329,6 +339,10 @@ static int get_source_for_fd(RemoteServer *s,
                 }
 
                 s->active++;
+
+                /* Keep the main loop running while we process this */
+                if (s->parent)
+                        __atomic_add_fetch(&s->parent->n_shard_connections, 1, __ATOMIC_SEQ_CST);
         }
 
         *source = s->sources[fd];
@@ -347,6 +361,9 @@ static int remove_source(RemoteServer *s, int fd) {
                 source_free(source);
                 s->sources[fd] = NULL;
                 s->active--;
+
+                if (s->parent)
+                        shard_connection_done(s->parent);
         }
 
         return 0;
@@ -357,7 +374,8 @@ static int add_source(RemoteServer *s, int fd, char* name, bool own_name) {
         RemoteSource *source = NULL;
         int r;
 
-        /* This takes ownership of name, even on failure, if own_name is true. */
+        /* This takes ownership of fd, even on failure, and of name,
+         * even on failure, if own_name is true. */
 
         assert(s);
         assert(fd >= 0);
@@ -365,14 +383,17 @@ static int add_source(RemoteServer *s, int fd, char* name, bool own_name) {
 
         if (!own_name) {
                 name = strdup(name);
-                if (!name)
+                if (!name) {
+                        safe_close(fd);
                         return log_oom();
+                }
         }
 
         r = get_source_for_fd(s, fd, name, &source);
         if (r < 0) {
                 log_error_errno(r, "Failed to create source for fd:%d (%s): %m",
                                 fd, name);
+                safe_close(fd);
                 free(name);
                 return r;
         }
@@ -493,6 +514,65 @@ static void request_meta_free(void *cls,
         }
 }
 
+static int compression_from_header(const char *header) {
+        int c;
+
+        if (strcaseeq(header, "identity"))
+                return 0;
+
+        for (c = OBJECT_COMPRESSED_XZ; c < _OBJECT_COMPRESSED_MAX; c <<= 1)
+                if (strcaseeq(header, object_compressed_to_string(c)))
+                        return c;
+
+        return -EINVAL;
+}
+
+static int decompress_http_upload(
+                struct MHD_Connection *connection,
+                RemoteSource *source) {
+
+        _cleanup_free_ void *buf = NULL;
+        size_t allocated = 0, size = 0;
+        int r;
+
+        assert(source);
+
+        /* The decompressors stop at the limit we pass, so ask for
+         * one byte more to tell if the upload is larger than the
+         * maximum, instead of silently truncating it */
+        r = decompress_blob(source->compression,
+                            source->compressed, source->compressed_size,
+                            &buf, &allocated, &size, UPLOAD_DECOMPRESSED_MAX + 1, NULL);
+        if (r >= 0 && size > UPLOAD_DECOMPRESSED_MAX)
+                r = -EFBIG;
+        if (r < 0) {
+                log_warning_errno(r, "Failed to decompress upload for connection %p: %m", connection);
+                if (r == -EPROTONOSUPPORT)
+                        return mhd_respondf(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                            "Content-Encoding: %s is not supported.\n",
+                                            object_compressed_to_string(source->compression));
+                else if (r == -EFBIG)
+                        return mhd_respondf(connection, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                                            "Decompressed upload is too large, maximum is %u bytes.\n",
+                                            UPLOAD_DECOMPRESSED_MAX);
+                else
+                        return mhd_respondf(connection, MHD_HTTP_UNPROCESSABLE_ENTITY,
+                                            "Decompression failed: %s.\n", strerror(-r));
+        }
+
+        log_trace("Decompressed %zu bytes to %zu bytes", source->compressed_size, size);
+
+        free(source->compressed);
+        source->compressed = NULL;
+        source->compressed_size = source->compressed_allocated = 0;
+
+        r = push_data(source, buf, size);
+        if (r < 0)
+                return mhd_respond_oom(connection);
+
+        return MHD_YES;
+}
+
 static int process_http_upload(
                 struct MHD_Connection *connection,
                 const char *upload_data,
@@ -508,7 +588,28 @@ static int process_http_upload(
         log_trace("%s: connection %p, %zu bytes",
                   __func__, connection, *upload_data_size);
 
-        if (*upload_data_size) {
+        if (*upload_data_size && source->compression) {
+                log_trace("Received %zu compressed bytes", *upload_data_size);
+
+                /* Compressed uploads can only be parsed once they
+                 * are complete */
+                if (source->compressed_size + *upload_data_size > UPLOAD_COMPRESSED_MAX)
+                        return mhd_respondf(connection,
+                                            MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                                            "Compressed upload is too large, maximum is %u bytes.\n",
+                                            UPLOAD_COMPRESSED_MAX);
+
+                if (!GREEDY_REALLOC(source->compressed, source->compressed_allocated,
+                                    source->compressed_size + *upload_data_size))
+                        return mhd_respond_oom(connection);
+
+                memcpy(source->compressed + source->compressed_size, upload_data, *upload_data_size);
+                source->compressed_size += *upload_data_size;
+
+                *upload_data_size = 0;
+                return MHD_YES;
+
+        } else if (*upload_data_size) {
                 log_trace("Received %zu bytes", *upload_data_size);
 
                 r = push_data(source, upload_data, *upload_data_size);
@@ -516,9 +617,16 @@ static int process_http_upload(
                         return mhd_respond_oom(connection);
 
                 *upload_data_size = 0;
-        } else
+        } else {
                 finished = true;
 
+                if (source->compressed_size > 0) {
+                        r = decompress_http_upload(connection, source);
+                        if (r != MHD_YES)
+                                return r;
+                }
+        }
+
         while (true) {
                 r = process_source(source, arg_compress, arg_seal);
                 if (r == -EAGAIN)
@@ -564,7 +672,7 @@ static int request_handler(
                 void **connection_cls) {
 
         const char *header;
-        int r, code, fd;
+        int r, code, fd, compression = 0;
         _cleanup_free_ char *hostname = NULL;
 
         assert(connection);
@@ -594,6 +702,16 @@ static int request_handler(
                                    "Content-Type: application/vnd.fdo.journal"
                                    " is required.\n");
 
+        header = MHD_lookup_connection_value(connection,
+                                             MHD_HEADER_KIND, "Content-Encoding");
+        if (header) {
+                compression = compression_from_header(header);
+                if (compression < 0)
+                        return mhd_respondf(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                            "Content-Encoding: %s is not supported.\n",
+                                            header);
+        }
+
         {
                 const union MHD_ConnectionInfo *ci;
 
@@ -631,6 +749,8 @@ static int request_handler(
                                    strerror(-r));
 
         hostname = NULL;
+
+        ((RemoteSource*) *connection_cls)->compression = compression;
         return MHD_YES;
 }
 
@@ -823,6 +943,314 @@ static int negative_fd(const char *spec) {
                 return -fd;
 }
 
+static void server_destroy(RemoteServer *s);
+
+struct PendingConnection {
+        int fd;
+        char *name;
+
+        LIST_FIELDS(PendingConnection, pending);
+};
+
+static void pending_connection_free(PendingConnection *c) {
+        assert(c);
+
+        safe_close(c->fd);
+        free(c->name);
+        free(c);
+}
+
+static int dispatch_shard_wakeup(sd_event_source *event,
+                                 int fd,
+                                 uint32_t revents,
+                                 void *userdata) {
+        RemoteShard *shard = userdata;
+        LIST_HEAD(PendingConnection, list);
+        PendingConnection *c;
+        uint64_t x;
+        bool quit;
+        int r;
+
+        (void) read(fd, &x, sizeof(x));
+
+        assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+        list = shard->pending;
+        shard->pending = NULL;
+        quit = shard->quit;
+        assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+        while ((c = list)) {
+                LIST_REMOVE(pending, list, c);
+
+                if (!quit) {
+                        /* This takes ownership of fd and name. Once
+                         * it succeeded, the connection is accounted
+                         * for by its source. */
+                        r = add_source(&shard->server, c->fd, c->name, true);
+                        if (r < 0)
+                                log_warning_errno(r, "Failed to add source for fd:%d: %m", c->fd);
+
+                        c->fd = -1;
+                        c->name = NULL;
+                }
+
+                pending_connection_free(c);
+                shard_connection_done(shard->server.parent);
+        }
+
+        if (quit)
+                return sd_event_exit(shard->server.events, 0);
+
+        return 0;
+}
+
+static void *shard_thread(void *userdata) {
+        RemoteShard *shard = userdata;
+        sigset_t fullset;
+        int r;
+
+        /* Signals are handled by the main thread */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, NULL) == 0);
+
+        prctl(PR_SET_NAME, (unsigned long) "journal-remote");
+
+        r = sd_event_loop(shard->server.events);
+        if (r < 0)
+                log_error_errno(r, "Failed to run event loop of shard: %m");
+
+        return NULL;
+}
+
+static void shard_connection_done(RemoteServer *s) {
+        uint64_t one = 1;
+
+        assert(s);
+
+        /* Called from the shard threads whenever a connection handed
+         * to them ends, so that the main loop can update the status
+         * and exit once the last one is gone */
+
+        assert_se(__atomic_sub_fetch(&s->n_shard_connections, 1, __ATOMIC_SEQ_CST) != (unsigned) -1);
+
+        if (write(s->shard_done_fd, &one, sizeof(one)) < 0)
+                log_warning_errno(errno, "Failed to wake up main loop: %m");
+}
+
+static uint64_t server_event_count(RemoteServer *s) {
+        uint64_t n;
+        unsigned i;
+
+        assert(s);
+
+        n = __atomic_load_n(&s->event_count, __ATOMIC_RELAXED);
+        for (i = 0; i < s->n_shards; i++)
+                n += __atomic_load_n(&s->shards[i].server.event_count, __ATOMIC_RELAXED);
+
+        return n;
+}
+
+static bool server_busy(RemoteServer *s) {
+        assert(s);
+
+        return s->active > 0 ||
+               __atomic_load_n(&s->n_shard_connections, __ATOMIC_SEQ_CST) > 0;
+}
+
+static int dispatch_shard_done(sd_event_source *event,
+                               int fd,
+                               uint32_t revents,
+                               void *userdata) {
+        RemoteServer *s = userdata;
+        uint64_t x;
+
+        (void) read(fd, &x, sizeof(x));
+
+        sd_notifyf(false,
+                   "STATUS=Processing requests, %u connections, %" PRIu64 " entries written so far...",
+                   __atomic_load_n(&s->n_shard_connections, __ATOMIC_SEQ_CST),
+                   server_event_count(s));
+
+        return 0;
+}
+
+static int setup_shards(RemoteServer *s, unsigned n) {
+        unsigned i;
+        int r;
+
+        assert(s);
+        assert(n > 0);
+
+        s->shard_done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (s->shard_done_fd < 0)
+                return log_error_errno(errno, "Failed to allocate eventfd: %m");
+
+        r = sd_event_add_io(s->events, &s->shard_done_event,
+                            s->shard_done_fd, EPOLLIN,
+                            dispatch_shard_done, s);
+        if (r < 0) {
+                s->shard_done_fd = safe_close(s->shard_done_fd);
+                return log_error_errno(r, "Failed to watch eventfd: %m");
+        }
+
+        s->shards = new0(RemoteShard, n);
+        if (!s->shards)
+                return log_oom();
+
+        for (i = 0; i < n; i++) {
+                RemoteShard *shard = s->shards + i;
+
+                shard->wakeup_fd = -1;
+                shard->server.parent = s;
+                assert_se(pthread_mutex_init(&shard->mutex, NULL) == 0);
+                s->n_shards++;
+
+                r = sd_event_new(&shard->server.events);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to allocate event loop: %m");
+
+                r = init_writer_hashmap(&shard->server);
+                if (r < 0)
+                        return r;
+
+                shard->wakeup_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+                if (shard->wakeup_fd < 0)
+                        return log_error_errno(errno, "Failed to allocate eventfd: %m");
+
+                r = sd_event_add_io(shard->server.events, &shard->wakeup_event,
+                                    shard->wakeup_fd, EPOLLIN,
+                                    dispatch_shard_wakeup, shard);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to watch eventfd: %m");
+        }
+
+        return 0;
+}
+
+static int start_shards(RemoteServer *s) {
+        sigset_t fullset, saved;
+        unsigned i;
+        int r = 0;
+
+        assert(s);
+
+        /* Connections handed off before this are queued, and picked
+         * up once the threads run */
+
+        /* Start the threads with all signals blocked, so that they
+         * don't steal them from the main thread */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+        for (i = 0; i < s->n_shards; i++) {
+                r = -pthread_create(&s->shards[i].thread, NULL, shard_thread, s->shards + i);
+                if (r < 0)
+                        break;
+
+                s->shards[i].running = true;
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+        if (r < 0)
+                return log_error_errno(r, "Failed to start thread: %m");
+
+        log_debug("Started %u shards", s->n_shards);
+
+        return 0;
+}
+
+static int shard_add_source(RemoteServer *s, int fd, char *name) {
+        static const uint8_t hash_key[HASH_KEY_SIZE] = {};
+        PendingConnection *c;
+        RemoteShard *shard;
+        uint64_t one = 1;
+
+        /* This takes ownership of fd and name, even on failure. */
+
+        assert(s);
+        assert(s->n_shards > 0);
+        assert(fd >= 0);
+        assert(name);
+
+        c = new0(PendingConnection, 1);
+        if (!c) {
+                safe_close(fd);
+                free(name);
+                return log_oom();
+        }
+
+        c->fd = fd;
+        c->name = name;
+
+        /* Accounted for until the shard picked it up */
+        __atomic_add_fetch(&s->n_shard_connections, 1, __ATOMIC_SEQ_CST);
+
+        /* Pick the shard by the host name, so that all connections
+         * from one host share its writer */
+        shard = s->shards + string_hash_func(name, hash_key) % s->n_shards;
+
+        log_debug("Handing off fd:%d (%s) to shard %u", fd, name, (unsigned) (shard - s->shards));
+
+        assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+        LIST_PREPEND(pending, shard->pending, c);
+        assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+        if (write(shard->wakeup_fd, &one, sizeof(one)) < 0)
+                return log_error_errno(errno, "Failed to wake up shard: %m");
+
+        return 1;
+}
+
+static void stop_shards(RemoteServer *s) {
+        uint64_t one = 1;
+        unsigned i;
+
+        assert(s);
+
+        for (i = 0; i < s->n_shards; i++) {
+                RemoteShard *shard = s->shards + i;
+
+                if (!shard->running)
+                        continue;
+
+                assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+                shard->quit = true;
+                assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+                if (write(shard->wakeup_fd, &one, sizeof(one)) < 0)
+                        log_warning_errno(errno, "Failed to wake up shard: %m");
+        }
+
+        for (i = 0; i < s->n_shards; i++) {
+                RemoteShard *shard = s->shards + i;
+
+                if (!shard->running)
+                        continue;
+
+                assert_se(pthread_join(shard->thread, NULL) == 0);
+                shard->running = false;
+        }
+}
+
+static void shard_free(RemoteShard *shard) {
+        PendingConnection *c;
+
+        assert(shard);
+        assert(!shard->running);
+
+        while ((c = shard->pending)) {
+                LIST_REMOVE(pending, shard->pending, c);
+                pending_connection_free(c);
+        }
+
+        sd_event_source_unref(shard->wakeup_event);
+        server_destroy(&shard->server);
+        safe_close(shard->wakeup_fd);
+
+        pthread_mutex_destroy(&shard->mutex);
+}
+
 static int remoteserver_init(RemoteServer *s,
                              const char* key,
                              const char* cert,
@@ -850,6 +1278,12 @@ static int remoteserver_init(RemoteServer *s,
         if (r < 0)
                 return r;
 
+        if (arg_threads > 1) {
+                r = setup_shards(s, arg_threads);
+                if (r < 0)
+                        return r;
+        }
+
         n = sd_listen_fds(true);
         if (n < 0)
                 return log_error_errno(n, "Failed to read listening file descriptors from environment: %m");
@@ -880,7 +1314,10 @@ static int remoteserver_init(RemoteServer *s,
 
                         log_debug("Received a connection socket (fd:%d) from %s", fd, hostname);
 
-                        r = add_source(s, fd, hostname, true);
+                        if (s->n_shards > 0)
+                                r = shard_add_source(s, fd, hostname);
+                        else
+                                r = add_source(s, fd, hostname, true);
                 } else {
                         log_error("Unknown socket passed on fd:%d", fd);
 
@@ -958,7 +1395,7 @@ static int remoteserver_init(RemoteServer *s,
                         return r;
         }
 
-        if (s->active == 0) {
+        if (!server_busy(s)) {
                 log_error("Zarro sources specified");
                 return -EINVAL;
         }
@@ -972,6 +1409,12 @@ static int remoteserver_init(RemoteServer *s,
                         return r;
         }
 
+        if (s->n_shards > 0) {
+                r = start_shards(s);
+                if (r < 0)
+                        return r;
+        }
+
         return 0;
 }
 
@@ -979,6 +1422,17 @@ static void server_destroy(RemoteServer *s) {
         size_t i;
         MHDDaemonWrapper *d;
 
+        stop_shards(s);
+
+        for (i = 0; i < s->n_shards; i++)
+                shard_free(s->shards + i);
+        free(s->shards);
+
+        if (s->shard_done_event) {
+                sd_event_source_unref(s->shard_done_event);
+                safe_close(s->shard_done_fd);
+        }
+
         while ((d = hashmap_steal_first(s->daemons))) {
                 MHD_stop_daemon(d->daemon);
                 sd_event_source_unref(d->event);
@@ -1043,7 +1497,7 @@ static int handle_raw_source(sd_event_source *event,
                 return 0;
         } else if (r < 0) {
                 log_debug_errno(r, "Closing connection: %m");
-                remove_source(server, fd);
+                remove_source(s, fd);
                 return 0;
         } else
                 return 1;
@@ -1057,7 +1511,7 @@ static int dispatch_raw_source_until_block(sd_event_source *event,
         /* Make sure event stays around even if source is destroyed */
         sd_event_source_ref(event);
 
-        r = handle_raw_source(event, source->fd, EPOLLIN, server);
+        r = handle_raw_source(event, source->fd, EPOLLIN, source->writer->server);
         if (r != 1)
                 /* No more data for now */
                 sd_event_source_set_enabled(event, SD_EVENT_OFF);
@@ -1077,7 +1531,7 @@ static int dispatch_raw_source_event(sd_event_source *event,
         assert(source->event);
         assert(source->buffer_event);
 
-        r = handle_raw_source(event, fd, EPOLLIN, server);
+        r = handle_raw_source(event, fd, EPOLLIN, source->writer->server);
         if (r == 1)
                 /* Might have more data. We need to rerun the handler
                  * until we are sure the buffer is exhausted. */
@@ -1090,7 +1544,7 @@ static int dispatch_blocking_source_event(sd_event_source *event,
                                           void *userdata) {
         RemoteSource *source = userdata;
 
-        return handle_raw_source(event, source->fd, EPOLLIN, server);
+        return handle_raw_source(event, source->fd, EPOLLIN, source->writer->server);
 }
 
 static int accept_connection(const char* type, int fd,
@@ -1155,6 +1609,9 @@ static int dispatch_raw_connection_event(sd_event_source *event,
         if (fd2 < 0)
                 return fd2;
 
+        if (s->n_shards > 0)
+                return shard_add_source(s, fd2, hostname);
+
         return add_source(s, fd2, hostname, true);
 }
 
@@ -1179,6 +1636,7 @@ static int parse_config(void) {
                 { "Remote",  "ServerKeyFile",          config_parse_path,             0, &arg_key        },
                 { "Remote",  "ServerCertificateFile",  config_parse_path,             0, &arg_cert       },
                 { "Remote",  "TrustedCertificateFile", config_parse_path,             0, &arg_trust      },
+                { "Remote",  "Threads",                config_parse_unsigned,         0, &arg_threads    },
                 {}};
 
         return config_parse_many(PKGSYSCONFDIR "/journal-remote.conf",
@@ -1209,6 +1667,7 @@ static void help(void) {
                "     --gnutls-log=CATEGORY...\n"
                "                            Specify a list of gnutls logging categories\n"
                "     --split-mode=none|host How many output files to create\n"
+               "     --threads=N            Spread raw connections over N threads\n"
                "\n"
                "Note: file descriptors from sd_listen_fds() will be consumed, too.\n"
                , program_invocation_short_name);
@@ -1229,6 +1688,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_CERT,
                 ARG_TRUST,
                 ARG_GNUTLS_LOG,
+                ARG_THREADS,
         };
 
         static const struct option options[] = {
@@ -1247,6 +1707,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "cert",         required_argument, NULL, ARG_CERT         },
                 { "trust",        required_argument, NULL, ARG_TRUST        },
                 { "gnutls-log",   required_argument, NULL, ARG_GNUTLS_LOG   },
+                { "threads",      required_argument, NULL, ARG_THREADS      },
                 {}
         };
 
@@ -1433,6 +1894,15 @@ static int parse_argv(int argc, char *argv[]) {
 #endif
                 }
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0 || arg_threads <= 0) {
+                                log_error("Failed to parse --threads= parameter: %s", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -1474,11 +1944,27 @@ static int parse_argv(int argc, char *argv[]) {
                 return -EINVAL;
         }
 
-        log_debug("Full config: SplitMode=%s Key=%s Cert=%s Trust=%s",
+        if (arg_threads > 1) {
+                /* Only raw connections are spread over threads, and
+                 * each output file must only be written to from one
+                 * of them */
+                if (arg_split_mode != JOURNAL_WRITE_SPLIT_HOST) {
+                        log_error("Multiple threads may only be used with SplitMode=host.");
+                        return -EINVAL;
+                }
+
+                if (arg_listen_http || arg_listen_https || http_socket >= 0 || https_socket >= 0) {
+                        log_error("Multiple threads may not be combined with --listen-http= or --listen-https=.");
+                        return -EINVAL;
+                }
+        }
+
+        log_debug("Full config: SplitMode=%s Key=%s Cert=%s Trust=%s Threads=%u",
                   journal_write_split_mode_to_string(arg_split_mode),
                   strna(arg_key),
                   strna(arg_cert),
-                  strna(arg_trust));
+                  strna(arg_trust),
+                  arg_threads);
 
         return 1 /* work to do */;
 }
@@ -1550,7 +2036,7 @@ int main(int argc, char **argv) {
                   "READY=1\n"
                   "STATUS=Processing requests...");
 
-        while (s.active) {
+        while (server_busy(&s)) {
                 r = sd_event_get_state(s.events);
                 if (r < 0)
                         break;
@@ -1564,10 +2050,12 @@ int main(int argc, char **argv) {
                 }
         }
 
+        stop_shards(&s);
+
         sd_notifyf(false,
                    "STOPPING=1\n"
-                   "STATUS=Shutting down after writing %" PRIu64 " entries...", s.event_count);
-        log_info("Finishing after writing %" PRIu64 " entries", s.event_count);
+                   "STATUS=Shutting down after writing %" PRIu64 " entries...", server_event_count(&s));
+        log_info("Finishing after writing %" PRIu64 " entries", server_event_count(&s));
 
         server_destroy(&s);
 
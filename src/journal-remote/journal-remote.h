@@ -21,15 +21,19 @@
 
 #pragma once
 
+#include <pthread.h>
 
 #include "sd-event.h"
 #include "hashmap.h"
+#include "list.h"
 #include "microhttpd-util.h"
 
 #include "journal-remote-parse.h"
 #include "journal-remote-write.h"
 
 typedef struct MHDDaemonWrapper MHDDaemonWrapper;
+typedef struct RemoteShard RemoteShard;
+typedef struct PendingConnection PendingConnection;
 
 struct MHDDaemonWrapper {
         uint64_t fd;
@@ -52,4 +56,40 @@ struct RemoteServer {
 
         bool check_trust;
         Hashmap *daemons;
+
+        /* When running with more than one thread, raw connections
+         * are handed off to the shards instead of being processed
+         * on this event loop */
+        RemoteShard *shards;
+        unsigned n_shards;
+
+        /* Connections handed off to the shards that did not end yet,
+         * updated atomically from all threads. The shards wake us
+         * up through the eventfd whenever one ends. */
+        unsigned n_shard_connections;
+        int shard_done_fd;
+        sd_event_source *shard_done_event;
+
+        /* Set for the server of a shard, points to the main one */
+        RemoteServer *parent;
+};
+
+/* A shard runs its own event loop on a worker thread, with its own
+ * sources and writers. Connections from the same host always end up
+ * in the same shard, so that every output file is only ever written
+ * to from one thread. */
+struct RemoteShard {
+        RemoteServer server;
+
+        pthread_t thread;
+        bool running;
+
+        int wakeup_fd;
+        sd_event_source *wakeup_event;
+
+        /* Connections accepted by the main thread that the shard has
+         * not picked up yet, protected by the mutex */
+        pthread_mutex_t mutex;
+        LIST_HEAD(PendingConnection, pending);
+        bool quit;
 };
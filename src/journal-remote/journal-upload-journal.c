@@ -121,10 +121,9 @@ static ssize_t write_entry(char *buf, size_t size, Uploader *u) {
 
                 case ENTRY_NEW_FIELD: {
                         u->field_pos = 0;
+                        u->field = journal_data_unref(u->field);
 
-                        r = sd_journal_enumerate_data(u->journal,
-                                                      &u->field_data,
-                                                      &u->field_length);
+                        r = journal_enumerate_data_ref(u->journal, &u->field);
                         if (r < 0)
                                 return log_error_errno(r, "Failed to move to next field in entry: %m");
                         else if (r == 0) {
@@ -132,6 +131,9 @@ static ssize_t write_entry(char *buf, size_t size, Uploader *u) {
                                 continue;
                         }
 
+                        u->field_data = u->field->data;
+                        u->field_length = u->field->size;
+
                         if (!utf8_is_printable_newline(u->field_data,
                                                        u->field_length, false)) {
                                 u->entry_state = ENTRY_BINARY_FIELD_START;
@@ -224,25 +226,34 @@ static ssize_t write_entry(char *buf, size_t size, Uploader *u) {
         assert_not_reached("WTF?");
 }
 
-static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
-        Uploader *u = userp;
-        int r;
-        sd_journal *j;
-        size_t filled = 0;
+/* How much free space to make in the batch buffer before formatting
+ * the next part of an entry into it */
+#define BATCH_ALLOC_STEP (64U*1024U)
+
+int format_journal_batch(Uploader *u, UploadBatch **ret) {
+        _cleanup_(upload_batch_freep) UploadBatch *b = NULL;
+        size_t allocated = 0;
         ssize_t w;
+        int r;
 
         assert(u);
-        assert(nmemb <= SSIZE_MAX / size);
+        assert(u->journal);
+        assert(ret);
+
+        b = new0(UploadBatch, 1);
+        if (!b)
+                return log_oom();
 
-        j = u->journal;
+        b->uploader = u;
 
-        while (j && filled < size * nmemb) {
+        /* Batches only ever end in between entries */
+        while (u->entry_state != ENTRY_DONE ||
+               (b->n_entries < u->batch_size && b->size < UPLOAD_BATCH_BYTES_MAX)) {
                 if (u->entry_state == ENTRY_DONE) {
-                        r = sd_journal_next(j);
-                        if (r < 0) {
-                                log_error_errno(r, "Failed to move to next entry in journal: %m");
-                                return CURL_READFUNC_ABORT;
-                        } else if (r == 0) {
+                        r = sd_journal_next(u->journal);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to move to next entry in journal: %m");
+                        else if (r == 0) {
                                 if (u->input_event)
                                         log_debug("No more entries, waiting for journal.");
                                 else {
@@ -258,28 +269,46 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
                         u->entry_state = ENTRY_CURSOR;
                 }
 
-                w = write_entry((char*)buf + filled, size * nmemb - filled, u);
-                if (w < 0)
-                        return CURL_READFUNC_ABORT;
-                filled += w;
+                if (!GREEDY_REALLOC(b->buf, allocated, b->size + BATCH_ALLOC_STEP))
+                        return log_oom();
 
-                if (filled == 0) {
+                w = write_entry((char*) b->buf + b->size, allocated - b->size, u);
+                if (w < 0)
+                        return w;
+                if (w == 0 && u->entry_state != ENTRY_DONE) {
                         log_error("Buffer space is too small to write entry.");
-                        return CURL_READFUNC_ABORT;
-                } else if (u->entry_state != ENTRY_DONE)
-                        /* This means that all available space was used up */
-                        break;
+                        return -ENOBUFS;
+                }
 
-                log_debug("Entry %zu (%s) has been uploaded.",
-                          u->entries_sent, u->current_cursor);
+                b->size += w;
+
+                if (u->entry_state == ENTRY_DONE)
+                        b->n_entries++;
+        }
+
+        if (b->n_entries == 0) {
+                *ret = NULL;
+                return 0;
         }
 
-        return filled;
+        b->cursor = strdup(u->current_cursor);
+        if (!b->cursor)
+                return log_oom();
+
+        log_debug("Formatted batch of %zu entries (%zu bytes) up to %s.",
+                  b->n_entries, b->size, b->cursor);
+
+        *ret = b;
+        b = NULL;
+
+        return 1;
 }
 
 void close_journal_input(Uploader *u) {
         assert(u);
 
+        u->field = journal_data_unref(u->field);
+
         if (u->journal) {
                 log_debug("Closing journal input.");
 
@@ -289,20 +318,6 @@ void close_journal_input(Uploader *u) {
         u->timeout = 0;
 }
 
-static int process_journal_input(Uploader *u, int skip) {
-        int r;
-
-        r = sd_journal_next_skip(u->journal, skip);
-        if (r < 0)
-                return log_error_errno(r, "Failed to skip to next entry: %m");
-        else if (r < skip)
-                return 0;
-
-        /* have data */
-        u->entry_state = ENTRY_CURSOR;
-        return start_upload(u, journal_input_callback, u);
-}
-
 int check_journal_input(Uploader *u) {
         if (u->input_event) {
                 int r;
@@ -318,7 +333,12 @@ int check_journal_input(Uploader *u) {
                         return 0;
         }
 
-        return process_journal_input(u, 1);
+        /* There might be data. We only move on in the journal when
+         * the entries are formatted into batches as they are
+         * uploaded, so that none is skipped. */
+        u->uploading = true;
+
+        return 0;
 }
 
 static int dispatch_journal_input(sd_event_source *event,
@@ -379,7 +399,20 @@ int open_journal_for_upload(Uploader *u,
                         return log_error_errno(r, "Failed to seek to cursor %s: %m",
                                                cursor);
                 }
+
+                /* Step onto the entry of the cursor, so that the
+                 * first batch starts right after it */
+                if (after_cursor) {
+                        r = sd_journal_next(j);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to move to cursor %s: %m",
+                                                       cursor);
+                }
         }
 
-        return process_journal_input(u, 1 + !!after_cursor);
+        /* Upload what is there already, whether we follow or not */
+        u->entry_state = ENTRY_DONE;
+        u->uploading = true;
+
+        return 0;
 }
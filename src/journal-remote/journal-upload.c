@@ -35,6 +35,7 @@
 #include "sigbus.h"
 #include "formats-util.h"
 #include "signal-util.h"
+#include "compress.h"
 #include "journal-upload.h"
 
 #define PRIV_KEY_FILE CERTIFICATE_ROOT "/private/journal-upload.pem"
@@ -42,6 +43,8 @@
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 #define DEFAULT_PORT  19532
 
+#define DEFAULT_BATCH_SIZE 1000
+
 static const char* arg_url = NULL;
 static const char *arg_key = NULL;
 static const char *arg_cert = NULL;
@@ -55,6 +58,10 @@ static const char *arg_machine = NULL;
 static bool arg_merge = false;
 static int arg_follow = -1;
 static const char *arg_save_state = NULL;
+static unsigned arg_batch_size = DEFAULT_BATCH_SIZE;
+static unsigned arg_parallel_uploads = 1;
+static const char *arg_compression = NULL;
+static int arg_compress = 0;
 
 static void close_fd_input(Uploader *u);
 
@@ -77,16 +84,16 @@ static size_t output_callback(char *buf,
                               size_t size,
                               size_t nmemb,
                               void *userp) {
-        Uploader *u = userp;
+        char **answer = userp;
 
-        assert(u);
+        assert(answer);
 
         log_debug("The server answers (%zu bytes): %.*s",
                   size*nmemb, (int)(size*nmemb), buf);
 
-        if (nmemb && !u->answer) {
-                u->answer = strndup(buf, size*nmemb);
-                if (!u->answer)
+        if (nmemb && !*answer) {
+                *answer = strndup(buf, size*nmemb);
+                if (!*answer)
                         log_warning_errno(ENOMEM, "Failed to store server answer (%zu bytes): %m",
                                           size*nmemb);
         }
@@ -171,6 +178,73 @@ static int load_cursor_state(Uploader *u) {
 
 
 
+static int setup_curl(Uploader *u, char *error, char **answer, CURL **ret) {
+        CURLcode code;
+        CURL *curl;
+
+        assert(u);
+        assert(error);
+        assert(answer);
+        assert(ret);
+
+        curl = curl_easy_init();
+        if (!curl) {
+                log_error("Call to curl_easy_init failed.");
+                return -ENOSR;
+        }
+
+        /* tell it to POST to the URL */
+        easy_setopt(curl, CURLOPT_POST, 1L,
+                    LOG_ERR, goto fail);
+
+        easy_setopt(curl, CURLOPT_ERRORBUFFER, error,
+                    LOG_ERR, goto fail);
+
+        /* set where to write to */
+        easy_setopt(curl, CURLOPT_WRITEFUNCTION, output_callback,
+                    LOG_ERR, goto fail);
+
+        easy_setopt(curl, CURLOPT_WRITEDATA, answer,
+                    LOG_ERR, goto fail);
+
+        if (_unlikely_(log_get_max_level() >= LOG_DEBUG))
+                /* enable verbose for easier tracing */
+                easy_setopt(curl, CURLOPT_VERBOSE, 1L, LOG_WARNING, );
+
+        easy_setopt(curl, CURLOPT_USERAGENT,
+                    "systemd-journal-upload " PACKAGE_STRING,
+                    LOG_WARNING, );
+
+        if (arg_key || startswith(u->url, "https://")) {
+                easy_setopt(curl, CURLOPT_SSLKEY, arg_key ?: PRIV_KEY_FILE,
+                            LOG_ERR, goto fail);
+                easy_setopt(curl, CURLOPT_SSLCERT, arg_cert ?: CERT_FILE,
+                            LOG_ERR, goto fail);
+        }
+
+        if (streq_ptr(arg_trust, "all"))
+                easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0,
+                            LOG_ERR, goto fail);
+        else if (arg_trust || startswith(u->url, "https://"))
+                easy_setopt(curl, CURLOPT_CAINFO, arg_trust ?: TRUST_FILE,
+                            LOG_ERR, goto fail);
+
+        if (arg_key || arg_trust)
+                easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1,
+                            LOG_WARNING, );
+
+        /* upload to this place */
+        easy_setopt(curl, CURLOPT_URL, u->url,
+                    LOG_ERR, goto fail);
+
+        *ret = curl;
+        return 0;
+
+fail:
+        curl_easy_cleanup(curl);
+        return -EXFULL;
+}
+
 int start_upload(Uploader *u,
                  size_t (*input_callback)(void *ptr,
                                           size_t size,
@@ -178,6 +252,7 @@ int start_upload(Uploader *u,
                                           void *userdata),
                  void *data) {
         CURLcode code;
+        int r;
 
         assert(u);
         assert(input_callback);
@@ -207,25 +282,11 @@ int start_upload(Uploader *u,
         if (!u->easy) {
                 CURL *curl;
 
-                curl = curl_easy_init();
-                if (!curl) {
-                        log_error("Call to curl_easy_init failed.");
-                        return -ENOSR;
-                }
-
-                /* tell it to POST to the URL */
-                easy_setopt(curl, CURLOPT_POST, 1L,
-                            LOG_ERR, return -EXFULL);
-
-                easy_setopt(curl, CURLOPT_ERRORBUFFER, u->error,
-                            LOG_ERR, return -EXFULL);
-
-                /* set where to write to */
-                easy_setopt(curl, CURLOPT_WRITEFUNCTION, output_callback,
-                            LOG_ERR, return -EXFULL);
+                r = setup_curl(u, u->error, &u->answer, &curl);
+                if (r < 0)
+                        return r;
 
-                easy_setopt(curl, CURLOPT_WRITEDATA, data,
-                            LOG_ERR, return -EXFULL);
+                u->easy = curl;
 
                 /* set where to read from */
                 easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
@@ -237,34 +298,6 @@ int start_upload(Uploader *u,
                 /* use our special own mime type and chunked transfer */
                 easy_setopt(curl, CURLOPT_HTTPHEADER, u->header,
                             LOG_ERR, return -EXFULL);
-
-                if (_unlikely_(log_get_max_level() >= LOG_DEBUG))
-                        /* enable verbose for easier tracing */
-                        easy_setopt(curl, CURLOPT_VERBOSE, 1L, LOG_WARNING, );
-
-                easy_setopt(curl, CURLOPT_USERAGENT,
-                            "systemd-journal-upload " PACKAGE_STRING,
-                            LOG_WARNING, );
-
-                if (arg_key || startswith(u->url, "https://")) {
-                        easy_setopt(curl, CURLOPT_SSLKEY, arg_key ?: PRIV_KEY_FILE,
-                                    LOG_ERR, return -EXFULL);
-                        easy_setopt(curl, CURLOPT_SSLCERT, arg_cert ?: CERT_FILE,
-                                    LOG_ERR, return -EXFULL);
-                }
-
-                if (streq_ptr(arg_trust, "all"))
-                        easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0,
-                                    LOG_ERR, return -EUCLEAN);
-                else if (arg_trust || startswith(u->url, "https://"))
-                        easy_setopt(curl, CURLOPT_CAINFO, arg_trust ?: TRUST_FILE,
-                                    LOG_ERR, return -EXFULL);
-
-                if (arg_key || arg_trust)
-                        easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1,
-                                    LOG_WARNING, );
-
-                u->easy = curl;
         } else {
                 /* truncate the potential old error message */
                 u->error[0] = '\0';
@@ -273,14 +306,6 @@ int start_upload(Uploader *u,
                 u->answer = 0;
         }
 
-        /* upload to this place */
-        code = curl_easy_setopt(u->easy, CURLOPT_URL, u->url);
-        if (code) {
-                log_error("curl_easy_setopt CURLOPT_URL failed: %s",
-                          curl_easy_strerror(code));
-                return -EXFULL;
-        }
-
         u->uploading = true;
 
         return 0;
@@ -449,6 +474,10 @@ static int setup_uploader(Uploader *u, const char *url, const char *state_file)
 
         u->state_file = state_file;
 
+        u->batch_size = arg_batch_size;
+        u->max_batches = arg_parallel_uploads;
+        u->compression = arg_compress;
+
         r = sd_event_default(&u->events);
         if (r < 0)
                 return log_error_errno(r, "sd_event_default failed: %m");
@@ -463,6 +492,17 @@ static int setup_uploader(Uploader *u, const char *url, const char *state_file)
 static void destroy_uploader(Uploader *u) {
         assert(u);
 
+        while (u->batches) {
+                UploadBatch *b = u->batches;
+
+                LIST_REMOVE(batches, u->batches, b);
+                upload_batch_free(b);
+        }
+
+        curl_multi_cleanup(u->multi);
+        curl_slist_free_all(u->batch_header);
+        curl_slist_free_all(u->batch_header_compressed);
+
         curl_easy_cleanup(u->easy);
         curl_slist_free_all(u->header);
         free(u->answer);
@@ -482,24 +522,24 @@ static void destroy_uploader(Uploader *u) {
         sd_event_unref(u->events);
 }
 
-static int perform_upload(Uploader *u) {
-        CURLcode code;
+static int check_upload(Uploader *u, CURL *easy, CURLcode code,
+                        const char *error, const char *answer) {
         long status;
 
         assert(u);
+        assert(easy);
 
-        code = curl_easy_perform(u->easy);
         if (code) {
-                if (u->error[0])
+                if (error[0])
                         log_error("Upload to %s failed: %.*s",
-                                  u->url, (int) sizeof(u->error), u->error);
+                                  u->url, CURL_ERROR_SIZE, error);
                 else
                         log_error("Upload to %s failed: %s",
                                   u->url, curl_easy_strerror(code));
                 return -EIO;
         }
 
-        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, &status);
+        code = curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
         if (code) {
                 log_error("Failed to retrieve response code: %s",
                           curl_easy_strerror(code));
@@ -508,15 +548,30 @@ static int perform_upload(Uploader *u) {
 
         if (status >= 300) {
                 log_error("Upload to %s failed with code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, status, strna(answer));
                 return -EIO;
         } else if (status < 200) {
                 log_error("Upload to %s finished with unexpected code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, status, strna(answer));
                 return -EIO;
         } else
                 log_debug("Upload finished successfully with code %ld: %s",
-                          status, strna(u->answer));
+                          status, strna(answer));
+
+        return 0;
+}
+
+static int perform_upload(Uploader *u) {
+        CURLcode code;
+        int r;
+
+        assert(u);
+
+        code = curl_easy_perform(u->easy);
+
+        r = check_upload(u, u->easy, code, u->error, u->answer);
+        if (r < 0)
+                return r;
 
         free(u->last_cursor);
         u->last_cursor = u->current_cursor;
@@ -525,12 +580,319 @@ static int perform_upload(Uploader *u) {
         return update_cursor_state(u);
 }
 
+UploadBatch* upload_batch_free(UploadBatch *b) {
+        if (!b)
+                return NULL;
+
+        if (b->easy) {
+                if (b->uploader->multi)
+                        curl_multi_remove_handle(b->uploader->multi, b->easy);
+                curl_easy_cleanup(b->easy);
+        }
+
+        free(b->answer);
+        free(b->buf);
+        free(b->cursor);
+        free(b);
+
+        return NULL;
+}
+
+static int compress_batch(Uploader *u, UploadBatch *b) {
+        _cleanup_free_ void *buf = NULL;
+        size_t size;
+        int r;
+
+        assert(u);
+        assert(b);
+
+        buf = malloc(b->size);
+        if (!buf)
+                return log_oom();
+
+        if (u->compression == OBJECT_COMPRESSED_XZ)
+                r = compress_blob_xz(b->buf, b->size, buf, &size);
+        else if (u->compression == OBJECT_COMPRESSED_LZ4)
+                r = compress_blob_lz4(b->buf, b->size, buf, &size);
+        else
+                r = compress_blob_zstd(b->buf, b->size, buf, &size);
+        if (r == -ENOBUFS) {
+                /* Send it as it is, if it doesn't get any smaller */
+                log_debug("Batch of %zu bytes is not compressible.", b->size);
+                return 0;
+        } else if (r < 0)
+                return log_error_errno(r, "Failed to compress batch: %m");
+
+        log_debug("Compressed batch from %zu to %zu bytes.", b->size, size);
+
+        free(b->buf);
+        b->buf = buf;
+        b->size = size;
+        b->compressed = true;
+        buf = NULL;
+
+        return 0;
+}
+
+static int start_batch(Uploader *u, UploadBatch *b) {
+        CURLMcode mcode;
+        CURLcode code;
+        int r;
+
+        assert(u);
+        assert(b);
+
+        if (u->compression > 0) {
+                r = compress_batch(u, b);
+                if (r < 0)
+                        return r;
+        }
+
+        r = setup_curl(u, b->error, &b->answer, &b->easy);
+        if (r < 0)
+                return r;
+
+        easy_setopt(b->easy, CURLOPT_HTTPHEADER,
+                    b->compressed ? u->batch_header_compressed : u->batch_header,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(b->easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) b->size,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(b->easy, CURLOPT_POSTFIELDS, b->buf,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(b->easy, CURLOPT_PRIVATE, b,
+                    LOG_ERR, return -EXFULL);
+
+        mcode = curl_multi_add_handle(u->multi, b->easy);
+        if (mcode) {
+                log_error("curl_multi_add_handle failed: %s",
+                          curl_multi_strerror(mcode));
+                return -EXFULL;
+        }
+
+        return 0;
+}
+
+static int batch_header_new(const char *encoding, struct curl_slist **ret) {
+        struct curl_slist *h = NULL, *n;
+        const char *t;
+
+        assert(ret);
+
+        /* The batches have a known size, so no chunked transfer. curl
+         * would wait for a "100 Continue" from the server before
+         * sending larger bodies, which costs a full round trip per
+         * batch, hence disable that. */
+        NULSTR_FOREACH(t, "Content-Type: application/vnd.fdo.journal\0"
+                          "Accept: text/plain\0"
+                          "Expect:\0") {
+                n = curl_slist_append(h, t);
+                if (!n)
+                        goto oom;
+                h = n;
+        }
+
+        if (encoding) {
+                n = curl_slist_append(h, strjoina("Content-Encoding: ", encoding));
+                if (!n)
+                        goto oom;
+                h = n;
+        }
+
+        *ret = h;
+        return 0;
+
+oom:
+        curl_slist_free_all(h);
+        return log_oom();
+}
+
+static int setup_multi(Uploader *u) {
+        CURLMcode mcode;
+        int r;
+
+        assert(u);
+
+        if (u->multi)
+                return 0;
+
+        r = batch_header_new(NULL, &u->batch_header);
+        if (r < 0)
+                return r;
+
+        if (u->compression > 0) {
+                _cleanup_free_ char *encoding = NULL;
+
+                encoding = strdup(object_compressed_to_string(u->compression));
+                if (!encoding)
+                        return log_oom();
+
+                r = batch_header_new(ascii_strlower(encoding), &u->batch_header_compressed);
+                if (r < 0)
+                        return r;
+        }
+
+        u->multi = curl_multi_init();
+        if (!u->multi) {
+                log_error("Call to curl_multi_init failed.");
+                return -ENOSR;
+        }
+
+        mcode = curl_multi_setopt(u->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) u->max_batches);
+        if (mcode)
+                log_warning("curl_multi_setopt CURLMOPT_MAX_HOST_CONNECTIONS failed: %s",
+                            curl_multi_strerror(mcode));
+
+        return 0;
+}
+
+static int acknowledge_batches(Uploader *u) {
+        UploadBatch *b;
+        bool moved = false;
+
+        assert(u);
+
+        /* Only move the cursor up to the first batch which is still
+         * in flight, so that everything before the saved cursor is
+         * known to have arrived */
+        while ((b = u->batches) && b->done) {
+                log_debug("Batch of %zu entries up to %s has been uploaded.",
+                          b->n_entries, b->cursor);
+
+                free(u->last_cursor);
+                u->last_cursor = b->cursor;
+                b->cursor = NULL;
+
+                LIST_REMOVE(batches, u->batches, b);
+                u->n_batches--;
+                upload_batch_free(b);
+
+                moved = true;
+        }
+
+        if (!moved)
+                return 0;
+
+        return update_cursor_state(u);
+}
+
+static int perform_batch_upload(Uploader *u) {
+        int r;
+
+        assert(u);
+
+        r = setup_multi(u);
+        if (r < 0)
+                return r;
+
+        for (;;) {
+                unsigned n_finished = 0;
+                CURLMcode mcode;
+                CURLMsg *msg;
+                int running, n;
+
+                /* Keep as many batches in flight as we may */
+                while (u->uploading && u->n_batches < u->max_batches) {
+                        UploadBatch *b;
+
+                        r = format_journal_batch(u, &b);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                break;
+
+                        LIST_APPEND(batches, u->batches, b);
+                        u->n_batches++;
+
+                        r = start_batch(u, b);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (u->n_batches == 0)
+                        return 0;
+
+                mcode = curl_multi_perform(u->multi, &running);
+                if (mcode) {
+                        log_error("curl_multi_perform failed: %s",
+                                  curl_multi_strerror(mcode));
+                        return -EIO;
+                }
+
+                while ((msg = curl_multi_info_read(u->multi, &n))) {
+                        UploadBatch *b;
+                        char *p = NULL;
+
+                        if (msg->msg != CURLMSG_DONE)
+                                continue;
+
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p);
+                        b = (UploadBatch*) p;
+                        assert(b);
+
+                        r = check_upload(u, b->easy, msg->data.result, b->error, b->answer);
+                        if (r < 0)
+                                return r;
+
+                        b->done = true;
+                        n_finished++;
+                }
+
+                r = acknowledge_batches(u);
+                if (r < 0)
+                        return r;
+
+                if (n_finished == 0 && running > 0) {
+                        mcode = curl_multi_wait(u->multi, NULL, 0, 1000, NULL);
+                        if (mcode) {
+                                log_error("curl_multi_wait failed: %s",
+                                          curl_multi_strerror(mcode));
+                                return -EIO;
+                        }
+                }
+        }
+}
+
+static int compression_from_string(const char *s) {
+        int c;
+
+        if (parse_boolean(s) == 0)
+                return 0;
+
+        for (c = OBJECT_COMPRESSED_XZ; c < _OBJECT_COMPRESSED_MAX; c <<= 1)
+                if (strcaseeq(s, object_compressed_to_string(c)))
+                        break;
+
+        if (c >= _OBJECT_COMPRESSED_MAX)
+                return -EINVAL;
+
+#ifndef HAVE_XZ
+        if (c == OBJECT_COMPRESSED_XZ)
+                return -EPROTONOSUPPORT;
+#endif
+#ifndef HAVE_LZ4
+        if (c == OBJECT_COMPRESSED_LZ4)
+                return -EPROTONOSUPPORT;
+#endif
+#ifndef HAVE_ZSTD
+        if (c == OBJECT_COMPRESSED_ZSTD)
+                return -EPROTONOSUPPORT;
+#endif
+
+        return c;
+}
+
 static int parse_config(void) {
         const ConfigTableItem items[] = {
                 { "Upload",  "URL",                    config_parse_string, 0, &arg_url    },
                 { "Upload",  "ServerKeyFile",          config_parse_path,   0, &arg_key    },
                 { "Upload",  "ServerCertificateFile",  config_parse_path,   0, &arg_cert   },
                 { "Upload",  "TrustedCertificateFile", config_parse_path,   0, &arg_trust  },
+                { "Upload",  "BatchSize",              config_parse_unsigned, 0, &arg_batch_size },
+                { "Upload",  "ParallelUploads",        config_parse_unsigned, 0, &arg_parallel_uploads },
+                { "Upload",  "Compression",            config_parse_string, 0, &arg_compression },
                 {}};
 
         return config_parse_many(PKGSYSCONFDIR "/journal-upload.conf",
@@ -563,6 +925,11 @@ static void help(void) {
                "     --follow[=BOOL]        Do [not] wait for input\n"
                "     --save-state[=FILE]    Save uploaded cursors (default \n"
                "                            " STATE_FILE ")\n"
+               "     --batch-size=ENTRIES   Upload journal entries in batches of this size\n"
+               "                            (default: " STRINGIFY(DEFAULT_BATCH_SIZE) ")\n"
+               "     --parallel-uploads=N   Keep this many batches in flight (default: 1)\n"
+               "     --compress=xz|lz4|zstd|no\n"
+               "                            Compress batches before uploading them\n"
                "  -h --help                 Show this help and exit\n"
                "     --version              Print version string and exit\n"
                , program_invocation_short_name);
@@ -581,6 +948,9 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_AFTER_CURSOR,
                 ARG_FOLLOW,
                 ARG_SAVE_STATE,
+                ARG_BATCH_SIZE,
+                ARG_PARALLEL_UPLOADS,
+                ARG_COMPRESS,
         };
 
         static const struct option options[] = {
@@ -600,6 +970,9 @@ static int parse_argv(int argc, char *argv[]) {
                 { "after-cursor", required_argument, NULL, ARG_AFTER_CURSOR   },
                 { "follow",       optional_argument, NULL, ARG_FOLLOW         },
                 { "save-state",   optional_argument, NULL, ARG_SAVE_STATE     },
+                { "batch-size",   required_argument, NULL, ARG_BATCH_SIZE     },
+                { "parallel-uploads", required_argument, NULL, ARG_PARALLEL_UPLOADS },
+                { "compress",     required_argument, NULL, ARG_COMPRESS       },
                 {}
         };
 
@@ -730,6 +1103,28 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_save_state = optarg ?: STATE_FILE;
                         break;
 
+                case ARG_BATCH_SIZE:
+                        r = safe_atou(optarg, &arg_batch_size);
+                        if (r < 0) {
+                                log_error("Failed to parse --batch-size= parameter.");
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_PARALLEL_UPLOADS:
+                        r = safe_atou(optarg, &arg_parallel_uploads);
+                        if (r < 0) {
+                                log_error("Failed to parse --parallel-uploads= parameter.");
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_COMPRESS:
+                        arg_compression = optarg;
+                        break;
+
                 case '?':
                         log_error("Unknown option %s.", argv[optind-1]);
                         return -EINVAL;
@@ -752,6 +1147,22 @@ static int parse_argv(int argc, char *argv[]) {
                 return -EINVAL;
         }
 
+        if (arg_batch_size == 0 || arg_parallel_uploads == 0) {
+                log_error("Batch size and number of parallel uploads must be positive.");
+                return -EINVAL;
+        }
+
+        if (arg_compression) {
+                arg_compress = compression_from_string(arg_compression);
+                if (arg_compress == -EPROTONOSUPPORT) {
+                        log_error("Compression %s is not supported by this build.", arg_compression);
+                        return -EINVAL;
+                } else if (arg_compress < 0) {
+                        log_error("Unknown compression %s.", arg_compression);
+                        return -EINVAL;
+                }
+        }
+
         if (optind < argc && (arg_directory || arg_file || arg_machine || arg_journal_type)) {
                 log_error("Input arguments make no sense with journal input.");
                 return -EINVAL;
@@ -849,7 +1260,10 @@ int main(int argc, char **argv) {
                         goto cleanup;
 
                 if (u.uploading) {
-                        r = perform_upload(&u);
+                        if (use_journal)
+                                r = perform_batch_upload(&u);
+                        else
+                                r = perform_upload(&u);
                         if (r < 0)
                                 break;
                 }
@@ -4,6 +4,8 @@
 
 #include "sd-journal.h"
 #include "sd-event.h"
+#include "journal-internal.h"
+#include "list.h"
 
 typedef enum {
         ENTRY_CURSOR = 0,           /* Nothing actually written yet. */
@@ -19,7 +21,32 @@ typedef enum {
         ENTRY_DONE,                 /* Need to move to a new field. */
 } entry_state;
 
-typedef struct Uploader {
+typedef struct Uploader Uploader;
+typedef struct UploadBatch UploadBatch;
+
+/* A batch of journal entries in export format, uploaded with a
+ * single POST request */
+struct UploadBatch {
+        Uploader *uploader;
+
+        CURL *easy;
+        char error[CURL_ERROR_SIZE];
+        char *answer;
+
+        void *buf;
+        size_t size;
+        bool compressed;
+
+        size_t n_entries;
+        /* The cursor of the last entry in the batch */
+        char *cursor;
+
+        bool done;
+
+        LIST_FIELDS(UploadBatch, batches);
+};
+
+struct Uploader {
         sd_event *events;
         sd_event_source *sigint_event, *sigterm_event;
 
@@ -40,6 +67,10 @@ typedef struct Uploader {
         sd_journal* journal;
 
         entry_state entry_state;
+        /* The field currently being written. It may be written out over
+         * several callbacks, in between which the journal is processed,
+         * hence keep a reference to it. */
+        JournalData *field;
         const void *field_data;
         size_t field_pos, field_length;
 
@@ -48,10 +79,27 @@ typedef struct Uploader {
 
         size_t entries_sent;
         char *last_cursor, *current_cursor;
-} Uploader;
+
+        /* Journal entries are uploaded in batches, several of which
+         * may be in flight at the same time. The list is kept in the
+         * order the batches were formatted in, so that the saved
+         * cursor only ever moves past acknowledged entries. */
+        CURLM *multi;
+        struct curl_slist *batch_header, *batch_header_compressed;
+        LIST_HEAD(UploadBatch, batches);
+        unsigned n_batches;
+
+        unsigned max_batches;
+        size_t batch_size;
+        int compression;
+};
 
 #define JOURNAL_UPLOAD_POLL_TIMEOUT (10 * USEC_PER_SEC)
 
+/* Batches are closed once they grow beyond this size, whatever the
+ * number of entries in them */
+#define UPLOAD_BATCH_BYTES_MAX (8U*1024U*1024U)
+
 int start_upload(Uploader *u,
                  size_t (*input_callback)(void *ptr,
                                           size_t size,
@@ -59,6 +107,11 @@ int start_upload(Uploader *u,
                                           void *userdata),
                  void *data);
 
+UploadBatch* upload_batch_free(UploadBatch *b);
+DEFINE_TRIVIAL_CLEANUP_FUNC(UploadBatch*, upload_batch_free);
+
+int format_journal_batch(Uploader *u, UploadBatch **ret);
+
 int open_journal_for_upload(Uploader *u,
                             sd_journal *j,
                             const char *cursor,
@@ -0,0 +1,98 @@
+#!/usr/bin/python
+# Replays journal export streams from many simulated hosts to
+# systemd-journal-remote --listen-raw=ADDR and reports the throughput.
+#
+# Every host connects from its own loopback address (127.0.x.y), so
+# that with --split-mode=host each of them ends up in its own output
+# file. Compare runs with different --threads= settings of the receiver.
+
+from __future__ import print_function
+import sys
+import socket
+import argparse
+import threading
+import time
+
+PARSER = argparse.ArgumentParser()
+PARSER.add_argument('address', help='host:port the receiver listens on')
+PARSER.add_argument('--hosts', type=int, default=100)
+PARSER.add_argument('--entries', type=int, default=1000,
+                    help='number of entries per host')
+OPTIONS = PARSER.parse_args()
+
+template = """\
+__CURSOR=s=6863c726210b4560b7048889d8ada5c5;i={i:x};b=f446871715504074bf7049ef0718fa93;m={m:x};t=4fd05c
+__REALTIME_TIMESTAMP={realtime_ts}
+__MONOTONIC_TIMESTAMP={monotonic_ts}
+_BOOT_ID=f446871715504074bf7049ef0718fa93
+_TRANSPORT=syslog
+PRIORITY={priority}
+SYSLOG_FACILITY=3
+SYSLOG_IDENTIFIER=sshd
+MESSAGE=Accepted publickey for user{user} from 10.0.{a}.{b} port {port} ssh2
+_UID=0
+_GID=0
+_MACHINE_ID=69121ca41d12c1b69a7960174c27b618
+_HOSTNAME=host{host}
+SYSLOG_PID={pid}
+_PID={pid}
+
+"""
+
+def make_stream(host):
+    entries = []
+    for i in range(OPTIONS.entries):
+        entries.append(template.format(i=i,
+                                       m=0x198603b12d7 + i,
+                                       realtime_ts=1404101101501873 + i,
+                                       monotonic_ts=1753961140951 + i,
+                                       priority=3 + i % 4,
+                                       user=i % 17,
+                                       a=i % 256,
+                                       b=host % 256,
+                                       port=1024 + i,
+                                       host=host,
+                                       pid=100 + i % 1000))
+    return ''.join(entries).encode('utf-8')
+
+def send(host, data, address, errors):
+    try:
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.bind(('127.0.{}.{}'.format(host // 250, host % 250 + 1), 0))
+        s.connect(address)
+        s.sendall(data)
+        s.shutdown(socket.SHUT_WR)
+
+        # The receiver closes the connection once it processed
+        # everything we sent
+        while s.recv(4096):
+            pass
+        s.close()
+    except socket.error as e:
+        errors.append((host, e))
+
+host, port = OPTIONS.address.rsplit(':', 1)
+address = (host, int(port))
+
+streams = [make_stream(i) for i in range(OPTIONS.hosts)]
+total = sum(len(s) for s in streams)
+errors = []
+
+threads = [threading.Thread(target=send, args=(i, streams[i], address, errors))
+           for i in range(OPTIONS.hosts)]
+
+start = time.time()
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+elapsed = time.time() - start
+
+for host, e in errors:
+    print('host {}: {}'.format(host, e), file=sys.stderr)
+
+print('{} hosts, {} entries, {} bytes in {:.2f}s: {:.0f} entries/s, {:.2f} MiB/s'.format(
+    OPTIONS.hosts, OPTIONS.hosts * OPTIONS.entries, total, elapsed,
+    OPTIONS.hosts * OPTIONS.entries / elapsed, total / 1024. / 1024 / elapsed))
+
+sys.exit(1 if errors else 0)
@@ -0,0 +1,292 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal-gatewayd-cache.h"
+#include "journal-file.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define N_ENTRIES 10U
+
+static void assert_location(LocationCache *c, const char *key, int64_t skip, int64_t pos, const char *cursor) {
+        _cleanup_free_ char *s = NULL;
+        int64_t p = 0;
+        int r;
+
+        r = location_cache_get(c, key, skip, &p, &s);
+        log_debug("%s %+"PRIi64": %i %+"PRIi64" %s", key, skip, r, p, strna(s));
+
+        if (!cursor) {
+                assert_se(r == 0);
+                return;
+        }
+
+        assert_se(r == 1);
+        assert_se(p == pos);
+        assert_se(streq(s, cursor));
+}
+
+static void test_location_cache(void) {
+        LocationCache *c;
+        uint64_t g;
+        unsigned i;
+
+        assert_se(c = location_cache_new());
+        g = location_cache_generation(c);
+
+        assert_location(c, "a", 7, 0, NULL);
+
+        location_cache_put(c, g, "a", 10, "c10");
+        location_cache_put(c, g, "a", 5, "c5");
+        location_cache_put(c, g, "a", -3, "c-3");
+        /* The anchor itself is not worth remembering */
+        location_cache_put(c, g, "a", 0, "c0");
+
+        /* The closest hint between the anchor and the target */
+        assert_location(c, "a", 4, 0, NULL);
+        assert_location(c, "a", 5, 5, "c5");
+        assert_location(c, "a", 7, 5, "c5");
+        assert_location(c, "a", 10, 10, "c10");
+        assert_location(c, "a", 100, 10, "c10");
+        assert_location(c, "a", -2, 0, NULL);
+        assert_location(c, "a", -3, -3, "c-3");
+        assert_location(c, "a", -100, -3, "c-3");
+        assert_location(c, "b", 7, 0, NULL);
+
+        /* Updated in place */
+        location_cache_put(c, g, "a", 5, "c5'");
+        assert_location(c, "a", 7, 5, "c5'");
+
+        /* The oldest hint makes room for new ones */
+        for (i = 1; i <= LOCATION_HINTS_MAX + 1; i++) {
+                char cursor[DECIMAL_STR_MAX(unsigned) + 1];
+
+                xsprintf(cursor, "h%u", i);
+                location_cache_put(c, g, "h", i, cursor);
+        }
+        assert_location(c, "h", 1, 0, NULL);
+        assert_location(c, "h", 2, 2, "h2");
+        assert_location(c, "h", 100, LOCATION_HINTS_MAX + 1, "h9");
+
+        /* And so does the oldest anchor */
+        for (i = 0; i < LOCATION_CACHE_MAX; i++) {
+                char key[DECIMAL_STR_MAX(unsigned) + 2];
+
+                xsprintf(key, "k%u", i);
+                location_cache_put(c, g, key, 1, "x");
+        }
+        assert_location(c, "a", 7, 0, NULL);
+        assert_location(c, "k0", 7, 1, "x");
+
+        location_cache_free(c);
+}
+
+static void test_location_cache_flush(void) {
+        LocationCache *c;
+        uint64_t g, h;
+
+        assert_se(c = location_cache_new());
+        g = location_cache_generation(c);
+
+        location_cache_put(c, g, "a", 5, "c5");
+        assert_location(c, "a", 7, 5, "c5");
+
+        h = location_cache_flush(c);
+        assert_se(h != g);
+        assert_se(location_cache_generation(c) == h);
+        assert_location(c, "a", 7, 0, NULL);
+
+        /* Learnt by a request which started before the flush */
+        location_cache_put(c, g, "a", 5, "c5");
+        location_cache_put(c, g, "b", 5, "c5");
+        assert_location(c, "a", 7, 0, NULL);
+        assert_location(c, "b", 7, 0, NULL);
+
+        /* The stale hints are not mixed with the new ones */
+        location_cache_put(c, h, "a", 3, "c3");
+        assert_location(c, "a", 7, 3, "c3");
+        assert_location(c, "a", 5, 3, "c3");
+
+        location_cache_free(c);
+}
+
+static void write_journal(const char *directory, const char *name) {
+        _cleanup_free_ char *path = NULL;
+        JournalFile *f;
+        uint64_t seqnum = 0;
+        unsigned i;
+
+        assert_se(path = strjoin(directory, "/", name, NULL));
+        assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char number[DECIMAL_STR_MAX(unsigned) + 8];
+                struct iovec iovec;
+                dual_timestamp ts;
+
+                xsprintf(number, "NUMBER=%u", i);
+                IOVEC_SET_STRING(iovec, number);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, &iovec, 1, &seqnum, NULL, NULL) == 0);
+        }
+
+        journal_file_close(f);
+}
+
+static sd_journal *open_watched(const char *directory) {
+        sd_journal *j;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(sd_journal_get_fd(j) >= 0);
+
+        return j;
+}
+
+static unsigned count_entries(sd_journal *j) {
+        unsigned n = 0;
+        int r;
+
+        assert_se(sd_journal_seek_head(j) >= 0);
+
+        while ((r = sd_journal_next(j)) > 0)
+                n++;
+        assert_se(r == 0);
+
+        return n;
+}
+
+static void test_journal_pool(const char *directory) {
+        sd_journal *journals[JOURNAL_POOL_MAX + 1], *j, *k;
+        LocationCache *c;
+        JournalPool *p;
+        uint64_t g;
+        unsigned i;
+
+        assert_se(c = location_cache_new());
+        assert_se(p = journal_pool_new(c));
+
+        /* Nothing to reuse yet */
+        assert_se(journal_pool_get(p, &j, &g) == 0);
+        assert_se(!j);
+        assert_se(g == location_cache_generation(c));
+
+        j = open_watched(directory);
+        assert_se(count_entries(j) == N_ENTRIES);
+        assert_se(sd_journal_add_match(j, "NUMBER=0", 0) >= 0);
+        assert_se(count_entries(j) == 1);
+
+        /* The same object comes back, without the matches of the
+         * previous request */
+        journal_pool_put(p, j);
+        assert_se(journal_pool_get(p, &k, &g) == 1);
+        assert_se(k == j);
+        assert_se(g == location_cache_generation(c));
+        assert_se(count_entries(k) == N_ENTRIES);
+
+        assert_se(journal_pool_get(p, &k, &g) == 0);
+        assert_se(!k);
+
+        /* Only so many are kept around, the rest is closed */
+        journals[0] = j;
+        for (i = 1; i < ELEMENTSOF(journals); i++)
+                journals[i] = open_watched(directory);
+        for (i = 0; i < ELEMENTSOF(journals); i++)
+                journal_pool_put(p, journals[i]);
+
+        for (i = 0; i < JOURNAL_POOL_MAX; i++) {
+                assert_se(journal_pool_get(p, &k, &g) == 1);
+                assert_se(k != journals[JOURNAL_POOL_MAX]);
+                journals[i] = k;
+        }
+        assert_se(journal_pool_get(p, &k, &g) == 0);
+
+        /* Those still in the pool are closed along with it */
+        for (i = 0; i < JOURNAL_POOL_MAX; i++)
+                journal_pool_put(p, journals[i]);
+
+        journal_pool_free(p);
+        location_cache_free(c);
+}
+
+static void test_journal_pool_invalidate(const char *directory) {
+        LocationCache *c;
+        JournalPool *p;
+        sd_journal *j;
+        uint64_t g, h;
+
+        assert_se(c = location_cache_new());
+        assert_se(p = journal_pool_new(c));
+
+        j = open_watched(directory);
+        g = location_cache_generation(c);
+        location_cache_put(c, g, "a", 5, "c5");
+
+        /* Nothing changed, the cached locations stay valid */
+        journal_pool_put(p, j);
+        assert_se(journal_pool_get(p, &j, &h) == 1);
+        assert_se(h == g);
+        assert_location(c, "a", 7, 5, "c5");
+
+        /* Another file shows up while the journal is idle */
+        journal_pool_put(p, j);
+        write_journal(directory, "second.journal");
+
+        assert_se(journal_pool_get(p, &j, &h) == 1);
+        assert_se(h != g);
+        assert_se(h == location_cache_generation(c));
+        assert_location(c, "a", 7, 0, NULL);
+        assert_se(count_entries(j) == 2 * N_ENTRIES);
+
+        /* What the request learns from now on is kept */
+        location_cache_put(c, h, "a", 5, "c5'");
+        assert_location(c, "a", 7, 5, "c5'");
+
+        journal_pool_put(p, j);
+        journal_pool_free(p);
+        location_cache_free(c);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-gatewayd-cache-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+
+        test_location_cache();
+        test_location_cache_flush();
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        assert_se(mkdtemp(t));
+        write_journal(t, "first.journal");
+
+        test_journal_pool(t);
+        test_journal_pool_invalidate(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
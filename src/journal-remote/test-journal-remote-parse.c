@@ -0,0 +1,281 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+#include "journal-internal.h"
+#include "journal-remote-parse.h"
+#include "journal-remote-write.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define N_ENTRIES_DEFAULT 20000U
+#define BLOB_SIZE 300
+
+static void make_blob(unsigned i, uint8_t blob[static BLOB_SIZE]) {
+        unsigned k;
+
+        /* Binary data, with newlines and '=' in it */
+        for (k = 0; k < BLOB_SIZE; k++)
+                blob[k] = (uint8_t) (i * 31 + k * 7);
+}
+
+static void make_stream(unsigned n_entries, char **ret, size_t *ret_size) {
+        FILE *f;
+        unsigned i;
+
+        f = open_memstream(ret, ret_size);
+        assert_se(f);
+
+        for (i = 0; i < n_entries; i++) {
+                fprintf(f,
+                        "__CURSOR=s=6863c726210b4560b7048889d8ada5c5;i=%x\n"
+                        "__REALTIME_TIMESTAMP=%llu\n"
+                        "__MONOTONIC_TIMESTAMP=%llu\n"
+                        "_BOOT_ID=f446871715504074bf7049ef0718fa93\n"
+                        "PRIORITY=%u\n"
+                        "SYSLOG_IDENTIFIER=sshd\n"
+                        "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u\n"
+                        "_HOSTNAME=host\n",
+                        i, 1404101101501873ULL + i, 1753961140951ULL + i,
+                        i % 8, i % 17, i % 256, i * 7 % 256);
+
+                if (i % 10 == 0) {
+                        uint8_t blob[BLOB_SIZE];
+                        le64_t le64;
+
+                        make_blob(i, blob);
+                        le64 = htole64(BLOB_SIZE);
+
+                        fputs("BLOB\n", f);
+                        fwrite(&le64, sizeof(le64), 1, f);
+                        fwrite(blob, BLOB_SIZE, 1, f);
+                        fputc('\n', f);
+                }
+
+                fputc('\n', f);
+        }
+
+        assert_se(fclose(f) == 0);
+}
+
+static Writer* make_writer(const char *path) {
+        Writer *w;
+
+        assert_se(w = writer_new(NULL));
+        assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, false, false, &w->metrics, w->mmap, NULL, &w->journal) == 0);
+
+        return w;
+}
+
+static void verify(const char *path, unsigned n_entries) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        const char *paths[] = { path, NULL };
+        unsigned i = 0;
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                char message[LINE_MAX];
+                const void *d;
+                size_t l;
+                uint64_t t;
+
+                assert_se(sd_journal_get_realtime_usec(j, &t) >= 0);
+                assert_se(t == 1404101101501873ULL + i);
+
+                xsprintf(message, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u",
+                         i % 17, i % 256, i * 7 % 256);
+                assert_se(sd_journal_get_data(j, "MESSAGE", &d, &l) >= 0);
+                assert_se(l == strlen(message));
+                assert_se(memcmp(d, message, l) == 0);
+
+                if (i % 10 == 0) {
+                        uint8_t blob[BLOB_SIZE];
+
+                        make_blob(i, blob);
+                        assert_se(sd_journal_get_data(j, "BLOB", &d, &l) >= 0);
+                        assert_se(l == 5 + BLOB_SIZE);
+                        assert_se(memcmp((const uint8_t*) d + 5, blob, BLOB_SIZE) == 0);
+                } else
+                        assert_se(sd_journal_get_data(j, "BLOB", &d, &l) == -ENOENT);
+
+                i++;
+        }
+
+        assert_se(i == n_entries);
+}
+
+/* Reads the stream from a file, like journal-remote does for raw connections */
+static usec_t parse_fd(const char *dir, const char *stream, size_t size, unsigned n_entries) {
+        _cleanup_free_ char *path = NULL, *input = NULL;
+        _cleanup_close_ int fd = -1;
+        RemoteSource *source;
+        Writer *w;
+        usec_t a, b;
+        unsigned n = 0;
+        int r;
+
+        assert_se(input = strappend(dir, "/input"));
+        assert_se(write_string_file(input, "") >= 0);
+        fd = open(input, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, stream, size, false) >= 0);
+        assert_se(lseek(fd, 0, SEEK_SET) == 0);
+
+        assert_se(path = strappend(dir, "/fd.journal"));
+        w = make_writer(path);
+
+        assert_se(source = source_new(fd, false, strdup("input"), w));
+        fd = -1;
+
+        a = now(CLOCK_MONOTONIC);
+
+        while (source->state != STATE_EOF) {
+                r = process_source(source, false, false);
+                assert_se(r >= 0);
+                if (r > 0)
+                        n++;
+        }
+
+        b = now(CLOCK_MONOTONIC);
+
+        assert_se(n == n_entries);
+        assert_se(source_non_empty(source) == 0);
+
+        source_free(source);
+
+        verify(path, n_entries);
+
+        return b - a;
+}
+
+/* Pushes the stream in randomly sized chunks, like HTTP uploads do,
+ * so that lines and binary fields are split in every possible way */
+static void parse_chunks(const char *dir, const char *stream, size_t size, unsigned n_entries, unsigned seed) {
+        _cleanup_free_ char *path = NULL;
+        RemoteSource *source;
+        size_t pos = 0;
+        unsigned n = 0;
+        Writer *w;
+        int r;
+
+        assert_se(asprintf(&path, "%s/chunks-%u.journal", dir, seed) >= 0);
+        w = make_writer(path);
+
+        assert_se(source = source_new(STDIN_FILENO, true, strdup("chunks"), w));
+
+        while (pos < size) {
+                size_t chunk;
+
+                chunk = MIN(size - pos, (size_t) rand_r(&seed) % 1024 + 1);
+                assert_se(push_data(source, stream + pos, chunk) >= 0);
+                pos += chunk;
+
+                while ((r = process_source(source, false, false)) != -EAGAIN) {
+                        assert_se(r >= 0);
+                        if (r > 0)
+                                n++;
+                }
+        }
+
+        assert_se(n == n_entries);
+        assert_se(source_non_empty(source) == 0);
+
+        source_free(source);
+
+        verify(path, n_entries);
+}
+
+/* Corrupts the stream in random places. Parsing may fail, but must do
+ * so cleanly. */
+static void parse_garbage(const char *dir, const char *stream, size_t size, unsigned seed) {
+        _cleanup_free_ char *path = NULL, *copy = NULL;
+        RemoteSource *source;
+        size_t pos = 0;
+        unsigned k;
+        Writer *w;
+        int r = 0;
+
+        assert_se(copy = memdup(stream, size));
+        for (k = 0; k < 64; k++)
+                copy[rand_r(&seed) % size] = rand_r(&seed);
+
+        assert_se(asprintf(&path, "%s/garbage-%u.journal", dir, seed) >= 0);
+        w = make_writer(path);
+
+        assert_se(source = source_new(STDIN_FILENO, true, strdup("garbage"), w));
+
+        while (pos < size && (r >= 0 || r == -EAGAIN || r == -E2BIG)) {
+                size_t chunk;
+
+                chunk = MIN(size - pos, (size_t) rand_r(&seed) % 4096 + 1);
+                assert_se(push_data(source, copy + pos, chunk) >= 0);
+                pos += chunk;
+
+                do
+                        r = process_source(source, false, false);
+                while (r >= 0);
+        }
+
+        source_free(source);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-remote-parse-XXXXXX";
+        unsigned n_entries = N_ENTRIES_DEFAULT, seed;
+        _cleanup_free_ char *stream = NULL, *small = NULL;
+        size_t size = 0, small_size = 0;
+        usec_t u;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_entries) >= 0);
+
+        assert_se(mkdtemp(t));
+
+        make_stream(n_entries, &stream, &size);
+
+        u = parse_fd(t, stream, size, n_entries);
+        log_info("Parsed %u entries, %zu bytes, %.2f MiB/s",
+                 n_entries, size, size / 1024. / 1024 / (MAX(u, 1u) / 1e6));
+
+        make_stream(200, &small, &small_size);
+
+        for (seed = 0; seed < 20; seed++)
+                parse_chunks(t, small, small_size, 200, seed);
+
+        /* Don't flood the log with complaints about the garbage */
+        log_set_max_level(LOG_CRIT);
+
+        for (seed = 0; seed < 100; seed++)
+                parse_garbage(t, small, small_size, seed);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
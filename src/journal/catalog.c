@@ -47,6 +47,10 @@ const char * const catalog_file_dirs[] = {
 
 #define CATALOG_SIGNATURE (uint8_t[]) { 'R', 'H', 'H', 'H', 'K', 'S', 'L', 'P' }
 
+enum {
+        CATALOG_HEADER_COMPATIBLE_INDEX = 1 << 0,
+};
+
 typedef struct CatalogHeader {
         uint8_t signature[8];  /* "RHHHKSLP" */
         le32_t compatible_flags;
@@ -54,8 +58,39 @@ typedef struct CatalogHeader {
         le64_t header_size;
         le64_t n_items;
         le64_t catalog_item_size;
+        /* Added later, only valid with CATALOG_HEADER_COMPATIBLE_INDEX */
+        le64_t index_offset;
 } CatalogHeader;
 
+/* Databases written before the index was added end here */
+#define CATALOG_HEADER_SIZE_MIN offsetof(CatalogHeader, index_offset)
+
+/* The index is a minimal perfect hash over (id, language): n_items
+ * le32_t bucket values, followed by n_items le32_t item numbers, one
+ * per slot. A bucket value of 0 marks an empty bucket, one with
+ * CATALOG_INDEX_DIRECT set the slot of the only item in the bucket,
+ * anything else the displacement that puts all items of the bucket
+ * into distinct slots. */
+#define CATALOG_INDEX_DIRECT UINT32_C(0x80000000)
+#define CATALOG_INDEX_DISPLACEMENT_MAX UINT32_C(0x1000000)
+
+struct Catalog {
+        void *map;
+        size_t size;
+        dev_t dev;
+        ino_t ino;
+
+        const CatalogHeader *header;
+        const uint8_t *items;
+        const char *strings;
+        size_t item_size, n_items, strings_size;
+        const le32_t *index;
+
+        /* The language part of LC_MESSAGES at the time the catalog
+         * was opened, with and without the territory */
+        char language[32], language_short[32];
+};
+
 typedef struct CatalogItem {
         sd_id128_t id;
         char language[32];
@@ -98,6 +133,141 @@ const struct hash_ops catalog_hash_ops = {
         .compare = catalog_compare_func
 };
 
+static uint64_t catalog_index_hash(sd_id128_t id, const char *language) {
+        static const uint8_t key[16] = {};
+        uint8_t buf[sizeof(id) + 32];
+        uint64_t u;
+        size_t l;
+
+        l = strnlen(language, 32);
+        memcpy(mempcpy(buf, &id, sizeof(id)), language, l);
+
+        siphash24((uint8_t*) &u, buf, sizeof(id) + l, key);
+
+        return le64toh(u);
+}
+
+static uint32_t catalog_index_slot(uint64_t h, uint32_t displacement, uint32_t n) {
+        /* Mix the displacement in, and finish like MurmurHash3 */
+        h ^= displacement * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 33;
+        h *= UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+
+        return (uint32_t) (h % n);
+}
+
+static int bucket_compare_func(const void *a, const void *b, void *userdata) {
+        const unsigned *sizes = userdata;
+        unsigned x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+        /* Largest buckets first, they are the hardest to place */
+        if (sizes[x] > sizes[y])
+                return -1;
+        if (sizes[x] < sizes[y])
+                return 1;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Builds the perfect hash index for the sorted items, see above.
+ * Returns -E2BIG if no displacement could be found, in which case
+ * the database is written without an index. */
+static int build_index(const CatalogItem *items, uint32_t n, le32_t **ret) {
+        _cleanup_free_ uint64_t *hashes = NULL;
+        _cleanup_free_ uint32_t *order = NULL, *members = NULL, *start = NULL, *slots = NULL;
+        _cleanup_free_ unsigned *sizes = NULL;
+        _cleanup_free_ bool *taken = NULL;
+        _cleanup_free_ le32_t *index = NULL;
+        uint32_t i, k, next_free = 0;
+
+        assert(items);
+        assert(n > 0);
+        assert(ret);
+
+        hashes = new(uint64_t, n);
+        order = new(uint32_t, n);
+        members = new(uint32_t, n);
+        start = new0(uint32_t, n + 1);
+        slots = new(uint32_t, n);
+        sizes = new0(unsigned, n);
+        taken = new0(bool, n);
+        index = new0(le32_t, 2 * (size_t) n);
+        if (!hashes || !order || !members || !start || !slots || !sizes || !taken || !index)
+                return -ENOMEM;
+
+        for (i = 0; i < n; i++) {
+                hashes[i] = catalog_index_hash(items[i].id, items[i].language);
+                sizes[hashes[i] % n]++;
+        }
+
+        /* Group the items by bucket */
+        for (i = 0; i < n; i++)
+                start[i + 1] = start[i] + sizes[i];
+        for (i = 0; i < n; i++) {
+                uint32_t b = hashes[i] % n;
+
+                members[start[b] + --sizes[b]] = i;
+        }
+        for (i = 0; i < n; i++) {
+                sizes[i] = start[i + 1] - start[i];
+                order[i] = i;
+        }
+
+        qsort_r(order, n, sizeof(uint32_t), bucket_compare_func, sizes);
+
+        for (i = 0; i < n && sizes[order[i]] > 0; i++) {
+                uint32_t b = order[i], d;
+                const uint32_t *m = members + start[b];
+
+                if (sizes[b] == 1) {
+                        while (taken[next_free])
+                                next_free++;
+
+                        taken[next_free] = true;
+                        index[b] = htole32(CATALOG_INDEX_DIRECT | next_free);
+                        index[n + next_free] = htole32(m[0]);
+                        continue;
+                }
+
+                for (d = 1; d < CATALOG_INDEX_DISPLACEMENT_MAX; d++) {
+
+                        for (k = 0; k < sizes[b]; k++) {
+                                uint32_t l;
+
+                                slots[k] = catalog_index_slot(hashes[m[k]], d, n);
+                                if (taken[slots[k]])
+                                        break;
+
+                                for (l = 0; l < k; l++)
+                                        if (slots[l] == slots[k])
+                                                break;
+                                if (l < k)
+                                        break;
+                        }
+
+                        if (k >= sizes[b])
+                                break;
+                }
+
+                if (d >= CATALOG_INDEX_DISPLACEMENT_MAX)
+                        return -E2BIG;
+
+                index[b] = htole32(d);
+                for (k = 0; k < sizes[b]; k++) {
+                        taken[slots[k]] = true;
+                        index[n + slots[k]] = htole32(m[k]);
+                }
+        }
+
+        *ret = index;
+        index = NULL;
+
+        return 0;
+}
+
 static int finish_item(
                 Hashmap *h,
                 struct strbuf *sb,
@@ -325,12 +495,13 @@ int catalog_import_file(Hashmap *h, struct strbuf *sb, const char *path) {
 }
 
 static long write_catalog(const char *database, Hashmap *h, struct strbuf *sb,
-                          CatalogItem *items, size_t n) {
+                          CatalogItem *items, size_t n, const le32_t *index) {
+        static const uint8_t padding[8] = {};
         CatalogHeader header;
         _cleanup_fclose_ FILE *w = NULL;
         int r;
         _cleanup_free_ char *d, *p = NULL;
-        size_t k;
+        size_t k, offset;
 
         d = dirname_malloc(database);
         if (!d)
@@ -351,6 +522,12 @@ static long write_catalog(const char *database, Hashmap *h, struct strbuf *sb,
         header.catalog_item_size = htole64(sizeof(CatalogItem));
         header.n_items = htole64(hashmap_size(h));
 
+        offset = ALIGN_TO(sizeof(CatalogHeader), 8) + n * sizeof(CatalogItem) + sb->len;
+        if (index) {
+                header.compatible_flags = htole32(CATALOG_HEADER_COMPATIBLE_INDEX);
+                header.index_offset = htole64(ALIGN_TO(offset, 8));
+        }
+
         r = -EIO;
 
         k = fwrite(&header, 1, sizeof(header), w);
@@ -371,6 +548,15 @@ static long write_catalog(const char *database, Hashmap *h, struct strbuf *sb,
                 goto error;
         }
 
+        if (index) {
+                k = fwrite(padding, 1, ALIGN_TO(offset, 8) - offset, w);
+                k += fwrite(index, 1, 2 * n * sizeof(le32_t), w);
+                if (k != ALIGN_TO(offset, 8) - offset + 2 * n * sizeof(le32_t)) {
+                        log_error("%s: failed to write index.", p);
+                        goto error;
+                }
+        }
+
         fflush(w);
 
         if (ferror(w)) {
@@ -399,6 +585,7 @@ int catalog_update(const char* database, const char* root, const char* const* di
         struct strbuf *sb = NULL;
         _cleanup_hashmap_free_free_ Hashmap *h = NULL;
         _cleanup_free_ CatalogItem *items = NULL;
+        _cleanup_free_ le32_t *index = NULL;
         CatalogItem *i;
         Iterator j;
         unsigned n;
@@ -453,7 +640,14 @@ int catalog_update(const char* database, const char* root, const char* const* di
         assert(n == hashmap_size(h));
         qsort_safe(items, n, sizeof(CatalogItem), catalog_compare_func);
 
-        r = write_catalog(database, h, sb, items, n);
+        r = build_index(items, n, &index);
+        if (r == -ENOMEM) {
+                r = log_oom();
+                goto finish;
+        } else if (r < 0)
+                log_warning_errno(r, "Failed to build catalog index, lookups will use binary search: %m");
+
+        r = write_catalog(database, h, sb, items, n, index);
         if (r < 0)
                 log_error_errno(r, "Failed to write %s: %m", database);
         else
@@ -467,128 +661,228 @@ finish:
         return r < 0 ? r : 0;
 }
 
-static int open_mmap(const char *database, int *_fd, struct stat *_st, void **_p) {
+static void catalog_set_language(Catalog *c) {
+        const char *loc;
+        char *e;
+
+        loc = setlocale(LC_MESSAGES, NULL);
+        if (!loc || !loc[0] || streq(loc, "C") || streq(loc, "POSIX"))
+                return;
+
+        strncpy(c->language, loc, sizeof(c->language) - 1);
+        c->language[strcspn(c->language, ".@")] = 0;
+
+        e = strchr(c->language, '_');
+        if (e)
+                memcpy(c->language_short, c->language, e - c->language);
+}
+
+int catalog_open(const char *database, Catalog **ret) {
+        _cleanup_(catalog_closep) Catalog *c = NULL;
+        _cleanup_close_ int fd = -1;
         const CatalogHeader *h;
-        int fd;
-        void *p;
+        uint64_t header_size, item_size, n_items, strings, index_offset;
         struct stat st;
 
-        assert(_fd);
-        assert(_st);
-        assert(_p);
+        assert(database);
+        assert(ret);
 
         fd = open(database, O_RDONLY|O_CLOEXEC);
         if (fd < 0)
                 return -errno;
 
-        if (fstat(fd, &st) < 0) {
-                safe_close(fd);
+        if (fstat(fd, &st) < 0)
                 return -errno;
-        }
 
-        if (st.st_size < (off_t) sizeof(CatalogHeader)) {
-                safe_close(fd);
+        if (st.st_size < (off_t) CATALOG_HEADER_SIZE_MIN)
                 return -EINVAL;
-        }
 
-        p = mmap(NULL, PAGE_ALIGN(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
-        if (p == MAP_FAILED) {
-                safe_close(fd);
+        c = new0(Catalog, 1);
+        if (!c)
+                return -ENOMEM;
+
+        c->map = mmap(NULL, PAGE_ALIGN(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (c->map == MAP_FAILED) {
+                c->map = NULL;
                 return -errno;
         }
 
-        h = p;
+        c->size = st.st_size;
+        c->dev = st.st_dev;
+        c->ino = st.st_ino;
+
+        h = c->map;
+        header_size = le64toh(h->header_size);
+        item_size = le64toh(h->catalog_item_size);
+        n_items = le64toh(h->n_items);
+
         if (memcmp(h->signature, CATALOG_SIGNATURE, sizeof(h->signature)) != 0 ||
-            le64toh(h->header_size) < sizeof(CatalogHeader) ||
-            le64toh(h->catalog_item_size) < sizeof(CatalogItem) ||
+            header_size < CATALOG_HEADER_SIZE_MIN ||
+            item_size < sizeof(CatalogItem) ||
             h->incompatible_flags != 0 ||
-            le64toh(h->n_items) <= 0 ||
-            st.st_size < (off_t) (le64toh(h->header_size) + le64toh(h->catalog_item_size) * le64toh(h->n_items))) {
-                safe_close(fd);
-                munmap(p, st.st_size);
+            n_items <= 0 ||
+            header_size > c->size ||
+            n_items > (c->size - header_size) / item_size)
                 return -EBADMSG;
+
+        strings = header_size + item_size * n_items;
+
+        c->header = h;
+        c->items = (const uint8_t*) c->map + header_size;
+        c->item_size = item_size;
+        c->n_items = n_items;
+        c->strings = (const char*) c->map + strings;
+        c->strings_size = c->size - strings;
+
+        /* Use the index only if it is fully there, otherwise fall
+         * back to binary search */
+        if ((le32toh(h->compatible_flags) & CATALOG_HEADER_COMPATIBLE_INDEX) &&
+            header_size >= sizeof(CatalogHeader) &&
+            n_items < CATALOG_INDEX_DIRECT) {
+
+                index_offset = le64toh(h->index_offset);
+
+                if (index_offset >= strings &&
+                    index_offset % sizeof(le32_t) == 0 &&
+                    index_offset <= c->size &&
+                    (c->size - index_offset) / (2 * sizeof(le32_t)) >= n_items) {
+                        c->index = (const le32_t*) ((const uint8_t*) c->map + index_offset);
+                        c->strings_size = index_offset - strings;
+                }
         }
 
-        *_fd = fd;
-        *_st = st;
-        *_p = p;
+        catalog_set_language(c);
+
+        *ret = c;
+        c = NULL;
 
         return 0;
 }
 
-static const char *find_id(void *p, sd_id128_t id) {
-        CatalogItem key, *f = NULL;
-        const CatalogHeader *h = p;
-        const char *loc;
+Catalog *catalog_close(Catalog *c) {
+        if (!c)
+                return NULL;
+
+        if (c->map)
+                munmap(c->map, c->size);
+
+        free(c);
+        return NULL;
+}
+
+bool catalog_changed(Catalog *c, const char *database) {
+        struct stat st;
+
+        assert(c);
+        assert(database);
+
+        /* catalog_update() replaces the database as a whole, hence
+         * it suffices to compare the inode */
+        if (stat(database, &st) < 0)
+                return true;
+
+        return st.st_dev != c->dev || st.st_ino != c->ino;
+}
+
+static const CatalogItem *catalog_item(Catalog *c, size_t i) {
+        return (const CatalogItem*) (c->items + i * c->item_size);
+}
+
+static const CatalogItem *find_item(Catalog *c, const CatalogItem *key) {
+        const CatalogItem *f;
+        uint32_t n, v, slot, i;
+        uint64_t h;
+
+        if (!c->index)
+                return bsearch(key, c->items, c->n_items, c->item_size, catalog_compare_func);
+
+        n = c->n_items;
+        h = catalog_index_hash(key->id, key->language);
+
+        v = le32toh(c->index[h % n]);
+        if (v == 0)
+                return NULL;
+
+        if (v & CATALOG_INDEX_DIRECT)
+                slot = v & ~CATALOG_INDEX_DIRECT;
+        else
+                slot = catalog_index_slot(h, v, n);
+        if (slot >= n)
+                return NULL;
+
+        i = le32toh(c->index[n + slot]);
+        if (i >= n)
+                return NULL;
+
+        /* Anything not in the catalog hashes to some slot too */
+        f = catalog_item(c, i);
+        if (!sd_id128_equal(f->id, key->id) ||
+            strncmp(f->language, key->language, sizeof(key->language)) != 0)
+                return NULL;
+
+        return f;
+}
+
+int catalog_get_text(Catalog *c, sd_id128_t id, const char **ret) {
+        const CatalogItem *f = NULL;
+        CatalogItem key;
+        uint64_t offset;
+
+        assert(c);
+        assert(ret);
 
         zero(key);
         key.id = id;
 
-        loc = setlocale(LC_MESSAGES, NULL);
-        if (loc && loc[0] && !streq(loc, "C") && !streq(loc, "POSIX")) {
-                strncpy(key.language, loc, sizeof(key.language));
-                key.language[strcspn(key.language, ".@")] = 0;
-
-                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
-                if (!f) {
-                        char *e;
-
-                        e = strchr(key.language, '_');
-                        if (e) {
-                                *e = 0;
-                                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
-                        }
+        if (c->language[0]) {
+                strncpy(key.language, c->language, sizeof(key.language));
+                f = find_item(c, &key);
+
+                if (!f && c->language_short[0]) {
+                        strncpy(key.language, c->language_short, sizeof(key.language));
+                        f = find_item(c, &key);
                 }
         }
 
         if (!f) {
                 zero(key.language);
-                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
+                f = find_item(c, &key);
         }
 
         if (!f)
-                return NULL;
+                return -ENOENT;
 
-        return (const char*) p +
-                le64toh(h->header_size) +
-                le64toh(h->n_items) * le64toh(h->catalog_item_size) +
-                le64toh(f->offset);
+        offset = le64toh(f->offset);
+        if (offset >= c->strings_size ||
+            !memchr(c->strings + offset, 0, c->strings_size - offset))
+                return -EBADMSG;
+
+        *ret = c->strings + offset;
+        return 0;
 }
 
 int catalog_get(const char* database, sd_id128_t id, char **_text) {
-        _cleanup_close_ int fd = -1;
-        void *p = NULL;
-        struct stat st = {};
-        char *text = NULL;
-        int r;
+        _cleanup_(catalog_closep) Catalog *c = NULL;
         const char *s;
+        char *text;
+        int r;
 
         assert(_text);
 
-        r = open_mmap(database, &fd, &st, &p);
+        r = catalog_open(database, &c);
         if (r < 0)
                 return r;
 
-        s = find_id(p, id);
-        if (!s) {
-                r = -ENOENT;
-                goto finish;
-        }
+        r = catalog_get_text(c, id, &s);
+        if (r < 0)
+                return r;
 
         text = strdup(s);
-        if (!text) {
-                r = -ENOMEM;
-                goto finish;
-        }
+        if (!text)
+                return -ENOMEM;
 
         *_text = text;
-        r = 0;
-
-finish:
-        if (p)
-                munmap(p, st.st_size);
-
-        return r;
+        return 0;
 }
 
 static char *find_header(const char *s, const char *header) {
@@ -632,50 +926,49 @@ static void dump_catalog_entry(FILE *f, sd_id128_t id, const char *s, bool oneli
 
 
 int catalog_list(FILE *f, const char *database, bool oneline) {
-        _cleanup_close_ int fd = -1;
-        void *p = NULL;
-        struct stat st;
-        const CatalogHeader *h;
-        const CatalogItem *items;
+        _cleanup_(catalog_closep) Catalog *c = NULL;
         int r;
-        unsigned n;
+        size_t n;
         sd_id128_t last_id;
         bool last_id_set = false;
 
-        r = open_mmap(database, &fd, &st, &p);
+        r = catalog_open(database, &c);
         if (r < 0)
                 return r;
 
-        h = p;
-        items = (const CatalogItem*) ((const uint8_t*) p + le64toh(h->header_size));
-
-        for (n = 0; n < le64toh(h->n_items); n++) {
+        for (n = 0; n < c->n_items; n++) {
+                sd_id128_t id = catalog_item(c, n)->id;
                 const char *s;
 
-                if (last_id_set && sd_id128_equal(last_id, items[n].id))
+                if (last_id_set && sd_id128_equal(last_id, id))
                         continue;
 
-                assert_se(s = find_id(p, items[n].id));
+                r = catalog_get_text(c, id, &s);
+                if (r < 0)
+                        return r;
 
-                dump_catalog_entry(f, items[n].id, s, oneline);
+                dump_catalog_entry(f, id, s, oneline);
 
                 last_id_set = true;
-                last_id = items[n].id;
+                last_id = id;
         }
 
-        munmap(p, st.st_size);
-
         return 0;
 }
 
 int catalog_list_items(FILE *f, const char *database, bool oneline, char **items) {
+        _cleanup_(catalog_closep) Catalog *c = NULL;
         char **item;
         int r = 0;
 
+        r = catalog_open(database, &c);
+        if (r < 0)
+                return r;
+
         STRV_FOREACH(item, items) {
                 sd_id128_t id;
                 int k;
-                _cleanup_free_ char *msg = NULL;
+                const char *msg;
 
                 k = sd_id128_from_string(*item, &id);
                 if (k < 0) {
@@ -686,7 +979,7 @@ int catalog_list_items(FILE *f, const char *database, bool oneline, char **items
                         continue;
                 }
 
-                k = catalog_get(database, id, &msg);
+                k = catalog_get_text(c, id, &msg);
                 if (k < 0) {
                         log_full(k == -ENOENT ? LOG_NOTICE : LOG_ERR,
                                  "Failed to retrieve catalog entry for '%s': %s",
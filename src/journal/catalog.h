@@ -24,11 +24,22 @@
 #include <stdbool.h>
 
 #include "sd-id128.h"
+#include "macro.h"
 #include "hashmap.h"
 #include "strbuf.h"
 
+typedef struct Catalog Catalog;
+
 int catalog_import_file(Hashmap *h, struct strbuf *sb, const char *path);
 int catalog_update(const char* database, const char* root, const char* const* dirs);
+
+int catalog_open(const char *database, Catalog **ret);
+Catalog *catalog_close(Catalog *c);
+bool catalog_changed(Catalog *c, const char *database);
+int catalog_get_text(Catalog *c, sd_id128_t id, const char **ret);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(Catalog*, catalog_close);
+
 int catalog_get(const char* database, sd_id128_t id, char **data);
 int catalog_list(FILE *f, const char* database, bool oneline);
 int catalog_list_items(FILE *f, const char* database, bool oneline, char **items);
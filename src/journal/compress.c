@@ -31,6 +31,11 @@
 #  include <lz4.h>
 #endif
 
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#  include <zdict.h>
+#endif
+
 #include "compress.h"
 #include "macro.h"
 #include "util.h"
@@ -39,9 +44,35 @@
 
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
+#ifdef HAVE_ZSTD
+/* Journal objects are compressed synchronously on the logging path,
+ * hence prefer speed there. Streams (i.e. coredumps) are compressed
+ * asynchronously and can afford zstd's default level. */
+#  define ZSTD_BLOB_LEVEL 1
+#  define ZSTD_STREAM_LEVEL 3
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_CCtx*, ZSTD_freeCCtx);
+DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_DCtx*, ZSTD_freeDCtx);
+#endif
+
+struct CompressDict {
+        void *data;
+        size_t size;
+#ifdef HAVE_ZSTD
+        /* The (de)compression contexts are kept around with the
+         * dictionary, so that small objects don't pay for setting
+         * them up again every time. */
+        ZSTD_CDict *cdict;
+        ZSTD_DDict *ddict;
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+#endif
+};
+
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
         [OBJECT_COMPRESSED_XZ] = "XZ",
         [OBJECT_COMPRESSED_LZ4] = "LZ4",
+        [OBJECT_COMPRESSED_ZSTD] = "ZSTD",
 };
 
 DEFINE_STRING_TABLE_LOOKUP(object_compressed, int);
@@ -109,6 +140,33 @@ int compress_blob_lz4(const void *src, uint64_t src_size, void *dst, size_t *dst
 #endif
 }
 
+int compress_blob_zstd(const void *src, uint64_t src_size, void *dst, size_t *dst_size) {
+#ifdef HAVE_ZSTD
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_size);
+
+        /* Returns < 0 if we couldn't compress the data or the
+         * compressed result is longer than the original. The frame
+         * header records the uncompressed size for us. */
+
+        if (src_size < 16)
+                return -ENOBUFS;
+
+        k = ZSTD_compress(dst, src_size - 1, src, src_size, ZSTD_BLOB_LEVEL);
+        if (ZSTD_isError(k))
+                return -ENOBUFS;
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
@@ -146,6 +204,8 @@ int decompress_blob_xz(const void *src, uint64_t src_size,
 
                 if (ret == LZMA_STREAM_END)
                         break;
+                else if (IN_SET(ret, LZMA_FORMAT_ERROR, LZMA_DATA_ERROR, LZMA_BUF_ERROR))
+                        return -EBADMSG;
                 else if (ret != LZMA_OK)
                         return -ENOMEM;
 
@@ -175,7 +235,7 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 
 #ifdef HAVE_LZ4
         char* out;
-        int r, size; /* LZ4 uses int for size */
+        int r, size, full; /* LZ4 uses int for size */
 
         assert(src);
         assert(src_size > 0);
@@ -187,9 +247,15 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
         if (src_size <= 8)
                 return -EBADMSG;
 
-        size = le64toh( *(le64_t*)src );
+        size = full = le64toh( *(le64_t*)src );
         if (size < 0 || (le64_t) size != *(le64_t*)src)
                 return -EFBIG;
+
+        /* Like with XZ, decompress no more than dst_max, so that the
+         * size in the header doesn't decide how much we allocate */
+        if (dst_max > 0 && (size_t) size > dst_max)
+                size = (int) dst_max;
+
         if ((size_t) size > *dst_alloc_size) {
                 out = realloc(*dst, size);
                 if (!out)
@@ -199,7 +265,10 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
         } else
                 out = *dst;
 
-        r = LZ4_decompress_safe(src + 8, out, src_size - 8, size);
+        if (size == full)
+                r = LZ4_decompress_safe(src + 8, out, src_size - 8, size);
+        else
+                r = LZ4_decompress_safe_partial(src + 8, out, src_size - 8, size, size);
         if (r < 0 || r != size)
                 return -EBADMSG;
 
@@ -210,15 +279,209 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int compress_blob_zstd_dict(const void *src, uint64_t src_size, void *dst, size_t *dst_size, CompressDict *dict) {
+#ifdef HAVE_ZSTD
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_size);
+        assert(dict);
+
+        /* Like compress_blob_zstd(), but primes the compressor with
+         * the dictionary. This pays off even for very small blobs,
+         * hence the lower limit is only the frame overhead. */
+
+        if (src_size < 16)
+                return -ENOBUFS;
+
+        if (!dict->cctx) {
+                dict->cctx = ZSTD_createCCtx();
+                if (!dict->cctx)
+                        return -ENOMEM;
+        }
+
+        if (!dict->cdict) {
+                dict->cdict = ZSTD_createCDict(dict->data, dict->size, ZSTD_BLOB_LEVEL);
+                if (!dict->cdict)
+                        return -ENOMEM;
+        }
+
+        k = ZSTD_compress_usingCDict(dict->cctx, dst, src_size - 1, src, src_size, dict->cdict);
+        if (ZSTD_isError(k))
+                return -ENOBUFS;
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+#ifdef HAVE_ZSTD
+static int compress_dict_prepare_decompress(CompressDict *dict, const void *src, uint64_t src_size) {
+        unsigned id;
+
+        /* Returns > 0 if the frame references a dictionary, in which
+         * case the caller should decompress with dict->ddict. */
+
+        id = ZSTD_getDictID_fromFrame(src, src_size);
+        if (id == 0)
+                return 0;
+
+        if (!dict)
+                return -ENOKEY;
+
+        if (id != ZSTD_getDictID_fromDict(dict->data, dict->size))
+                return -ENOKEY;
+
+        if (!dict->dctx) {
+                dict->dctx = ZSTD_createDCtx();
+                if (!dict->dctx)
+                        return -ENOMEM;
+        }
+
+        if (!dict->ddict) {
+                dict->ddict = ZSTD_createDDict(dict->data, dict->size);
+                if (!dict->ddict)
+                        return -ENOMEM;
+        }
+
+        return 1;
+}
+
+static ssize_t decompress_zstd_prefix(const void *src, uint64_t src_size, void *dst, size_t n, CompressDict *dict) {
+        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *own_dctx = NULL;
+        ZSTD_DCtx *dctx;
+        ZSTD_inBuffer input = {
+                .src = src,
+                .size = src_size,
+        };
+        ZSTD_outBuffer output = {
+                .dst = dst,
+                .size = n,
+        };
+        ssize_t r;
+
+        /* Decompresses no more than the first n bytes of the frame,
+         * returns how many we got */
+
+        r = compress_dict_prepare_decompress(dict, src, src_size);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                size_t k;
+
+                dctx = dict->dctx;
+
+                k = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+                if (!ZSTD_isError(k))
+                        k = ZSTD_DCtx_refDDict(dctx, dict->ddict);
+                if (ZSTD_isError(k))
+                        return -EBADMSG;
+        } else {
+                dctx = own_dctx = ZSTD_createDCtx();
+                if (!dctx)
+                        return -ENOMEM;
+        }
+
+        while (output.pos < output.size) {
+                size_t in_pos = input.pos, out_pos = output.pos, k;
+
+                k = ZSTD_decompressStream(dctx, &output, &input);
+                if (ZSTD_isError(k))
+                        return -EBADMSG;
+
+                if (k == 0 || (input.pos == in_pos && output.pos == out_pos))
+                        break;
+        }
+
+        return (ssize_t) output.pos;
+}
+#endif
+
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+        return decompress_blob_zstd_dict(src, src_size, dst, dst_alloc_size, dst_size, dst_max, NULL);
+}
+
+int decompress_blob_zstd_dict(const void *src, uint64_t src_size,
+                              void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                              CompressDict *dict) {
+
+#ifdef HAVE_ZSTD
+        unsigned long long size;
+        size_t k;
+        ssize_t l;
+        int r;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+        assert(*dst_alloc_size == 0 || *dst);
+
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+                return -EBADMSG;
+
+        /* Like with XZ and LZ4, decompress no more than dst_max, so
+         * that the size in the frame header doesn't decide how much
+         * we allocate */
+        if (dst_max > 0 && size > dst_max) {
+                if (!greedy_realloc(dst, dst_alloc_size, dst_max, 1))
+                        return -ENOMEM;
+
+                l = decompress_zstd_prefix(src, src_size, *dst, dst_max, dict);
+                if (l < 0)
+                        return (int) l;
+                if ((size_t) l != dst_max)
+                        return -EBADMSG;
+
+                *dst_size = dst_max;
+                return 0;
+        }
+
+        if ((size_t) size != size)
+                return -EFBIG;
+
+        r = compress_dict_prepare_decompress(dict, src, src_size);
+        if (r < 0)
+                return r;
+
+        if (!greedy_realloc(dst, dst_alloc_size, MAX((size_t) size, 1u), 1))
+                return -ENOMEM;
+
+        if (r > 0)
+                k = ZSTD_decompress_usingDDict(dict->dctx, *dst, size, src, src_size, dict->ddict);
+        else
+                k = ZSTD_decompress(*dst, size, src, src_size);
+        if (ZSTD_isError(k) || k != size)
+                return -EBADMSG;
+
+        *dst_size = size;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    CompressDict *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_blob_xz(src, src_size,
                                           dst, dst_alloc_size, dst_size, dst_max);
         else if (compression == OBJECT_COMPRESSED_LZ4)
                 return decompress_blob_lz4(src, src_size,
                                            dst, dst_alloc_size, dst_size, dst_max);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_blob_zstd_dict(src, src_size,
+                                                 dst, dst_alloc_size, dst_size, dst_max,
+                                                 dict);
         else
                 return -EBADMSG;
 }
@@ -323,11 +586,66 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra) {
+        return decompress_startswith_zstd_dict(src, src_size,
+                                               buffer, buffer_size,
+                                               prefix, prefix_len,
+                                               extra, NULL);
+}
+
+int decompress_startswith_zstd_dict(const void *src, uint64_t src_size,
+                                    void **buffer, size_t *buffer_size,
+                                    const void *prefix, size_t prefix_len,
+                                    uint8_t extra,
+                                    CompressDict *dict) {
+#ifdef HAVE_ZSTD
+        unsigned long long size;
+        ssize_t l;
+
+        /* Checks whether the decompressed blob starts with the
+         * mentioned prefix. The byte extra needs to follow the
+         * prefix */
+
+        assert(src);
+        assert(src_size > 0);
+        assert(buffer);
+        assert(buffer_size);
+        assert(prefix);
+        assert(*buffer_size == 0 || *buffer);
+
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+                return -EBADMSG;
+
+        if (size < prefix_len + 1)
+                return 0;
+
+        if (!(greedy_realloc(buffer, buffer_size, ALIGN_8(prefix_len + 1), 1)))
+                return -ENOMEM;
+
+        /* Only decompress as much as we need for the comparison */
+        l = decompress_zstd_prefix(src, src_size, *buffer, prefix_len + 1, dict);
+        if (l < 0)
+                return (int) l;
+        if ((size_t) l < prefix_len + 1)
+                return -EBADMSG;
+
+        return memcmp(*buffer, prefix, prefix_len) == 0 &&
+                ((const uint8_t*) *buffer)[prefix_len] == extra;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra) {
+                          uint8_t extra,
+                          CompressDict *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_startswith_xz(src, src_size,
                                                 buffer, buffer_size,
@@ -338,10 +656,96 @@ int decompress_startswith(int compression,
                                                  buffer, buffer_size,
                                                  prefix, prefix_len,
                                                  extra);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_startswith_zstd_dict(src, src_size,
+                                                       buffer, buffer_size,
+                                                       prefix, prefix_len,
+                                                       extra, dict);
         else
                 return -EBADMSG;
 }
 
+int compress_dict_train(const void *samples, const size_t *sample_sizes, unsigned n_samples,
+                        size_t max_size, void **ret, size_t *ret_size) {
+#ifdef HAVE_ZSTD
+        _cleanup_free_ void *buf = NULL;
+        size_t k;
+
+        assert(samples);
+        assert(sample_sizes);
+        assert(max_size > 0);
+        assert(ret);
+        assert(ret_size);
+
+        buf = malloc(max_size);
+        if (!buf)
+                return -ENOMEM;
+
+        k = ZDICT_trainFromBuffer(buf, max_size, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(k)) {
+                log_debug("Failed to train ZSTD dictionary from %u samples: %s",
+                          n_samples, ZDICT_getErrorName(k));
+                return -EINVAL;
+        }
+
+        *ret = buf;
+        *ret_size = k;
+        buf = NULL;
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_dict_new(const void *data, size_t size, CompressDict **ret) {
+#ifdef HAVE_ZSTD
+        CompressDict *d;
+
+        assert(data);
+        assert(ret);
+
+        /* Only dictionaries in zstd's own format carry an ID which
+         * frames can refer to, refuse anything else. */
+        if (ZSTD_getDictID_fromDict(data, size) == 0)
+                return -EBADMSG;
+
+        d = new0(CompressDict, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->data = memdup(data, size);
+        if (!d->data) {
+                free(d);
+                return -ENOMEM;
+        }
+
+        d->size = size;
+
+        *ret = d;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDict* compress_dict_free(CompressDict *d) {
+        if (!d)
+                return NULL;
+
+#ifdef HAVE_ZSTD
+        ZSTD_freeCDict(d->cdict);
+        ZSTD_freeDDict(d->ddict);
+        ZSTD_freeCCtx(d->cctx);
+        ZSTD_freeDCtx(d->dctx);
+#endif
+
+        free(d->data);
+        free(d);
+
+        return NULL;
+}
+
 int compress_stream_xz(int fdf, int fdt, off_t max_bytes) {
 #ifdef HAVE_XZ
         _cleanup_(lzma_end) lzma_stream s = LZMA_STREAM_INIT;
@@ -497,6 +901,139 @@ int compress_stream_lz4(int fdf, int fdt, off_t max_bytes) {
 #endif
 }
 
+int compress_stream_zstd(int fdf, int fdt, off_t max_bytes) {
+
+#ifdef HAVE_ZSTD
+        _cleanup_(ZSTD_freeCCtxp) ZSTD_CCtx *cctx = NULL;
+        _cleanup_free_ void *in_buff = NULL, *out_buff = NULL;
+        size_t in_allocsize, out_allocsize, k;
+        uint64_t total_in = 0, total_out = 0;
+        bool finished = false;
+        int r;
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        in_allocsize = ZSTD_CStreamInSize();
+        out_allocsize = ZSTD_CStreamOutSize();
+        in_buff = malloc(in_allocsize);
+        out_buff = malloc(out_allocsize);
+        if (!in_buff || !out_buff)
+                return log_oom();
+
+        cctx = ZSTD_createCCtx();
+        if (!cctx)
+                return log_oom();
+
+        k = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_STREAM_LEVEL);
+        if (!ZSTD_isError(k))
+                k = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+        if (ZSTD_isError(k)) {
+                log_error("Failed to initialize ZSTD encoder: %s", ZSTD_getErrorName(k));
+                return -EINVAL;
+        }
+
+        while (!finished) {
+                ZSTD_inBuffer input = {
+                        .src = in_buff,
+                };
+                size_t m = in_allocsize;
+                ssize_t n;
+
+                if (max_bytes != -1 && m > (uint64_t) max_bytes - total_in)
+                        m = max_bytes - total_in;
+
+                n = read(fdf, in_buff, m);
+                if (n < 0)
+                        return -errno;
+
+                input.size = n;
+                total_in += n;
+                finished = n == 0 || (max_bytes != -1 && total_in >= (uint64_t) max_bytes);
+
+                /* Feed everything we read to the encoder, and when
+                 * we are at the end, keep going until the frame is
+                 * completely flushed out. */
+                for (;;) {
+                        ZSTD_outBuffer output = {
+                                .dst = out_buff,
+                                .size = out_allocsize,
+                        };
+                        size_t remaining;
+
+                        remaining = ZSTD_compressStream2(cctx, &output, &input,
+                                                         finished ? ZSTD_e_end : ZSTD_e_continue);
+                        if (ZSTD_isError(remaining)) {
+                                log_error("ZSTD compression failed: %s", ZSTD_getErrorName(remaining));
+                                return -EBADMSG;
+                        }
+
+                        if (output.pos > 0) {
+                                r = loop_write(fdt, output.dst, output.pos, false);
+                                if (r < 0)
+                                        return r;
+
+                                total_out += output.pos;
+                        }
+
+                        if (finished ? remaining == 0 : input.pos == input.size)
+                                break;
+                }
+        }
+
+        if (total_in == 0)
+                log_debug("ZSTD compression finished (no input data)");
+        else
+                log_debug("ZSTD compression finished (%"PRIu64" -> %"PRIu64" bytes, %.1f%%)",
+                          total_in, total_out,
+                          (double) total_out / total_in * 100);
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_frame_zstd(const void *src, size_t src_size, void **dst, size_t *dst_alloc_size, size_t *dst_size) {
+
+#ifdef HAVE_ZSTD
+        _cleanup_(ZSTD_freeCCtxp) ZSTD_CCtx *cctx = NULL;
+        size_t k;
+
+        assert(src || src_size == 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+
+        /* Compresses a block into a complete frame, in the format
+         * compress_stream_zstd() produces. Frames compressed
+         * independently of each other may simply be concatenated to
+         * form a stream. */
+
+        if (!greedy_realloc(dst, dst_alloc_size, ZSTD_compressBound(src_size), 1))
+                return -ENOMEM;
+
+        cctx = ZSTD_createCCtx();
+        if (!cctx)
+                return -ENOMEM;
+
+        k = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_STREAM_LEVEL);
+        if (!ZSTD_isError(k))
+                k = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+        if (!ZSTD_isError(k))
+                k = ZSTD_compress2(cctx, *dst, *dst_alloc_size, src, src_size);
+        if (ZSTD_isError(k)) {
+                log_error("ZSTD compression failed: %s", ZSTD_getErrorName(k));
+                return -EBADMSG;
+        }
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_stream_xz(int fdf, int fdt, off_t max_bytes) {
 
 #ifdef HAVE_XZ
@@ -647,12 +1184,96 @@ int decompress_stream_lz4(int fdf, int fdt, off_t max_bytes) {
 #endif
 }
 
+int decompress_stream_zstd(int fdf, int fdt, off_t max_bytes) {
+
+#ifdef HAVE_ZSTD
+        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = NULL;
+        _cleanup_free_ void *in_buff = NULL, *out_buff = NULL;
+        size_t in_allocsize, out_allocsize, last_result = 0;
+        uint64_t total_in = 0, total_out = 0;
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        in_allocsize = ZSTD_DStreamInSize();
+        out_allocsize = ZSTD_DStreamOutSize();
+        in_buff = malloc(in_allocsize);
+        out_buff = malloc(out_allocsize);
+        if (!in_buff || !out_buff)
+                return log_oom();
+
+        dctx = ZSTD_createDCtx();
+        if (!dctx)
+                return log_oom();
+
+        for (;;) {
+                ZSTD_inBuffer input = {
+                        .src = in_buff,
+                };
+                ssize_t n;
+
+                n = read(fdf, in_buff, in_allocsize);
+                if (n < 0)
+                        return -errno;
+                if (n == 0)
+                        break;
+
+                input.size = n;
+                total_in += n;
+
+                while (input.pos < input.size) {
+                        ZSTD_outBuffer output = {
+                                .dst = out_buff,
+                                .size = out_allocsize,
+                        };
+                        int r;
+
+                        /* A return value of 0 means a frame was
+                         * completely decoded and flushed. There
+                         * might be more frames following it. */
+                        last_result = ZSTD_decompressStream(dctx, &output, &input);
+                        if (ZSTD_isError(last_result)) {
+                                log_error("ZSTD decompression failed: %s", ZSTD_getErrorName(last_result));
+                                return -EBADMSG;
+                        }
+
+                        total_out += output.pos;
+
+                        if (max_bytes != -1 && total_out > (uint64_t) max_bytes) {
+                                log_debug("Decompressed stream longer than %zd bytes", max_bytes);
+                                return -EFBIG;
+                        }
+
+                        r = loop_write(fdt, output.dst, output.pos, false);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        if (last_result != 0) {
+                log_error("ZSTD decompression failed: premature end of input");
+                return -EBADMSG;
+        }
+
+        log_debug("ZSTD decompression finished (%"PRIu64" -> %"PRIu64" bytes, %.1f%%)",
+                  total_in, total_out,
+                  total_in > 0 ? (double) total_out / total_in * 100 : 0.0);
+
+        return 0;
+#else
+        log_error("Cannot decompress file. Compiled without ZSTD support.");
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_stream(const char *filename, int fdf, int fdt, off_t max_bytes) {
 
         if (endswith(filename, ".lz4"))
                 return decompress_stream_lz4(fdf, fdt, max_bytes);
         else if (endswith(filename, ".xz"))
                 return decompress_stream_xz(fdf, fdt, max_bytes);
+        else if (endswith(filename, ".zst"))
+                return decompress_stream_zstd(fdf, fdt, max_bytes);
         else
                 return -EPROTONOSUPPORT;
 }
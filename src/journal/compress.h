@@ -25,15 +25,30 @@
 
 #include "journal-def.h"
 
+/* A compression dictionary, shared by all small objects of a journal
+ * file. Only supported by the ZSTD backend. */
+typedef struct CompressDict CompressDict;
+
+int compress_dict_train(const void *samples, const size_t *sample_sizes, unsigned n_samples,
+                        size_t max_size, void **ret, size_t *ret_size);
+int compress_dict_new(const void *data, size_t size, CompressDict **ret);
+CompressDict* compress_dict_free(CompressDict *d);
+
 const char* object_compressed_to_string(int compression);
 int object_compressed_from_string(const char *compression);
 
 int compress_blob_xz(const void *src, uint64_t src_size, void *dst, size_t *dst_size);
 int compress_blob_lz4(const void *src, uint64_t src_size, void *dst, size_t *dst_size);
+int compress_blob_zstd(const void *src, uint64_t src_size, void *dst, size_t *dst_size);
+int compress_blob_zstd_dict(const void *src, uint64_t src_size, void *dst, size_t *dst_size, CompressDict *dict);
 
 static inline int compress_blob(const void *src, uint64_t src_size, void *dst, size_t *dst_size) {
         int r;
-#ifdef HAVE_LZ4
+#if defined(HAVE_ZSTD)
+        r = compress_blob_zstd(src, src_size, dst, dst_size);
+        if (r == 0)
+                return OBJECT_COMPRESSED_ZSTD;
+#elif defined(HAVE_LZ4)
         r = compress_blob_lz4(src, src_size, dst, dst_size);
         if (r == 0)
                 return OBJECT_COMPRESSED_LZ4;
@@ -49,9 +64,15 @@ int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob_lz4(const void *src, uint64_t src_size,
                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd_dict(const void *src, uint64_t src_size,
+                              void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                              CompressDict *dict);
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    CompressDict *dict);
 
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer, size_t *buffer_size,
@@ -61,19 +82,36 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
                               void **buffer, size_t *buffer_size,
                               const void *prefix, size_t prefix_len,
                               uint8_t extra);
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra);
+int decompress_startswith_zstd_dict(const void *src, uint64_t src_size,
+                                    void **buffer, size_t *buffer_size,
+                                    const void *prefix, size_t prefix_len,
+                                    uint8_t extra,
+                                    CompressDict *dict);
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra);
+                          uint8_t extra,
+                          CompressDict *dict);
 
 int compress_stream_xz(int fdf, int fdt, off_t max_bytes);
 int compress_stream_lz4(int fdf, int fdt, off_t max_bytes);
+int compress_stream_zstd(int fdf, int fdt, off_t max_bytes);
+
+int compress_frame_zstd(const void *src, size_t src_size, void **dst, size_t *dst_alloc_size, size_t *dst_size);
 
 int decompress_stream_xz(int fdf, int fdt, off_t max_size);
 int decompress_stream_lz4(int fdf, int fdt, off_t max_size);
+int decompress_stream_zstd(int fdf, int fdt, off_t max_size);
 
-#ifdef HAVE_LZ4
+#if defined(HAVE_ZSTD)
+#  define compress_stream compress_stream_zstd
+#  define COMPRESSED_EXT ".zst"
+#elif defined(HAVE_LZ4)
 #  define compress_stream compress_stream_lz4
 #  define COMPRESSED_EXT ".lz4"
 #else
@@ -0,0 +1,524 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#include "util.h"
+#include "hashmap.h"
+#include "siphash24.h"
+#include "compress.h"
+#include "coredump-copy.h"
+
+/* The coredump is read in blocks of this size. Each block of the
+ * compressed copy is a frame of its own, so that blocks can be
+ * compressed in parallel, and identical blocks can share the
+ * compressed data. */
+#define BLOCK_SIZE (1024U*1024U)
+
+#define THREADS_MAX 8U
+#define BLOCKS_PER_THREAD 2U
+
+/* Remembered for every distinct block, to find identical ones */
+typedef struct BlockRecord {
+        uint64_t hash;
+        uint64_t offset;
+        size_t size;
+        uint64_t compressed_offset;
+        size_t compressed_size;
+        bool written;
+} BlockRecord;
+
+typedef struct Block {
+        void *data;
+        size_t size;
+
+        void *out;
+        size_t out_allocated;
+        size_t out_size;
+
+        BlockRecord *record;
+        bool duplicate;
+
+        int r;
+        bool done;
+} Block;
+
+typedef struct Copy {
+        int fdt;
+        int fdt_compressed;
+
+        Block *blocks;
+        unsigned n_blocks;
+
+        /* Blocks are read and written in this order */
+        uint64_t n_read;
+        uint64_t n_written;
+
+        /* The blocks that need to be compressed, in the same order */
+        Block **queue;
+        uint64_t n_queued;
+        uint64_t n_taken;
+        uint64_t compressed_offset;
+
+        Hashmap *records;
+
+        pthread_t *threads;
+        unsigned n_threads;
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        bool quit;
+
+        CoredumpCopyStats stats;
+} Copy;
+
+static const uint8_t hash_key[16] = {
+        0x7c, 0x2a, 0x5b, 0x8e, 0x13, 0x4f, 0xd1, 0x66,
+        0x0b, 0xe9, 0x35, 0xa2, 0x48, 0xc7, 0x91, 0xf0,
+};
+
+static bool page_is_zero(const uint8_t *p, size_t n) {
+        assert(n > 0);
+
+        return p[0] == 0 && memcmp(p, p + 1, n - 1) == 0;
+}
+
+static int pwrite_all(int fd, const uint8_t *p, size_t n, uint64_t offset) {
+        while (n > 0) {
+                ssize_t k;
+
+                k = pwrite(fd, p, n, offset);
+                if (k < 0)
+                        return -errno;
+                if (k == 0)
+                        return -EIO;
+
+                p += k;
+                n -= k;
+                offset += k;
+        }
+
+        return 0;
+}
+
+static int pread_exact(int fd, uint8_t *p, size_t n, uint64_t offset) {
+        while (n > 0) {
+                ssize_t k;
+
+                k = pread(fd, p, n, offset);
+                if (k < 0)
+                        return -errno;
+                if (k == 0)
+                        return -EIO;
+
+                p += k;
+                n -= k;
+                offset += k;
+        }
+
+        return 0;
+}
+
+/* Writes the block, but leaves holes where pages are all zero. Cores
+ * of processes with large, sparsely used heaps are mostly zeros. */
+static int write_sparse(Copy *c, const uint8_t *p, size_t n, uint64_t offset) {
+        size_t ps = page_size(), i, start = 0;
+        int r;
+
+        for (i = 0; i < n; i += ps) {
+                size_t l = MIN(ps, n - i);
+
+                if (!page_is_zero(p + i, l))
+                        continue;
+
+                if (i > start) {
+                        r = pwrite_all(c->fdt, p + start, i - start, offset + start);
+                        if (r < 0)
+                                return r;
+                }
+
+                c->stats.sparse += l;
+                start = i + l;
+        }
+
+        if (n > start)
+                return pwrite_all(c->fdt, p + start, n - start, offset + start);
+
+        return 0;
+}
+
+/* Looks for an earlier block with the same contents. The hash only
+ * finds candidates, the contents are compared with what we already
+ * wrote to the uncompressed copy. Blocks that merely collide with an
+ * earlier one are neither deduplicated nor remembered. */
+static int find_duplicate(Copy *c, Block *b, uint64_t offset) {
+        _cleanup_free_ uint8_t *buf = NULL;
+        BlockRecord *record;
+        uint8_t h[8];
+        uint64_t hash;
+        int r;
+
+        siphash24(h, b->data, b->size, hash_key);
+        memcpy(&hash, h, sizeof(hash));
+
+        record = hashmap_get(c->records, &hash);
+        if (record) {
+                if (record->size != b->size)
+                        return 0;
+
+                buf = malloc(b->size);
+                if (!buf)
+                        return -ENOMEM;
+
+                r = pread_exact(c->fdt, buf, b->size, record->offset);
+                if (r < 0)
+                        return r;
+
+                if (memcmp(buf, b->data, b->size) != 0)
+                        return 0;
+
+                b->record = record;
+                b->duplicate = true;
+                return 1;
+        }
+
+        record = new0(BlockRecord, 1);
+        if (!record)
+                return -ENOMEM;
+
+        record->hash = hash;
+        record->offset = offset;
+        record->size = b->size;
+
+        r = hashmap_put(c->records, &record->hash, record);
+        if (r < 0) {
+                free(record);
+                return r;
+        }
+
+        b->record = record;
+        return 0;
+}
+
+static void *compress_thread(void *userdata) {
+        Copy *c = userdata;
+        sigset_t fullset;
+
+        /* No signals in this thread please */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, NULL) == 0);
+
+        prctl(PR_SET_NAME, (unsigned long) "coredump-compress");
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+        for (;;) {
+                Block *b;
+
+                while (!c->quit && c->n_taken >= c->n_queued)
+                        assert_se(pthread_cond_wait(&c->work_cond, &c->mutex) == 0);
+
+                if (c->quit)
+                        break;
+
+                b = c->queue[c->n_taken % c->n_blocks];
+                c->n_taken++;
+
+                assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+                b->r = compress_frame_zstd(b->data, b->size, &b->out, &b->out_allocated, &b->out_size);
+
+                assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+                b->done = true;
+                assert_se(pthread_cond_broadcast(&c->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return NULL;
+}
+
+/* Appends the oldest block to the compressed copy, waiting for it
+ * to be compressed if necessary */
+static int write_compressed(Copy *c) {
+        Block *b;
+        int r;
+
+        assert(c->n_written < c->n_read);
+
+        b = c->blocks + c->n_written % c->n_blocks;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        while (!b->done)
+                assert_se(pthread_cond_wait(&c->done_cond, &c->mutex) == 0);
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        if (b->r < 0)
+                return b->r;
+
+        if (b->duplicate) {
+                /* The block it duplicates came earlier, hence is
+                 * already written out. Copy its frame. */
+                assert(b->record->written);
+
+                if (!greedy_realloc(&b->out, &b->out_allocated, b->record->compressed_size, 1))
+                        return -ENOMEM;
+
+                r = pread_exact(c->fdt_compressed, b->out, b->record->compressed_size, b->record->compressed_offset);
+                if (r < 0)
+                        return r;
+
+                b->out_size = b->record->compressed_size;
+                c->stats.deduplicated += b->size;
+        } else if (b->record) {
+                b->record->compressed_offset = c->compressed_offset;
+                b->record->compressed_size = b->out_size;
+                b->record->written = true;
+        }
+
+        r = pwrite_all(c->fdt_compressed, b->out, b->out_size, c->compressed_offset);
+        if (r < 0)
+                return r;
+
+        c->compressed_offset += b->out_size;
+        c->n_written++;
+
+        return 0;
+}
+
+static bool head_done(Copy *c) {
+        bool done;
+
+        if (c->n_written >= c->n_read)
+                return false;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        done = c->blocks[c->n_written % c->n_blocks].done;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return done;
+}
+
+static int start_threads(Copy *c, unsigned n_threads) {
+        sigset_t fullset, saved;
+        int r = 0;
+
+        c->threads = new0(pthread_t, n_threads);
+        if (!c->threads)
+                return -ENOMEM;
+
+        /* Start the threads with all signals blocked, so that they
+         * don't steal them from the main thread */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+        for (; c->n_threads < n_threads; c->n_threads++) {
+                r = -pthread_create(c->threads + c->n_threads, NULL, compress_thread, c);
+                if (r < 0)
+                        break;
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+        /* We can make do with fewer threads, as long as there is one */
+        if (c->n_threads > 0)
+                return 0;
+
+        return r;
+}
+
+static void stop_threads(Copy *c) {
+        unsigned i;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        c->quit = true;
+        assert_se(pthread_cond_broadcast(&c->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        for (i = 0; i < c->n_threads; i++)
+                assert_se(pthread_join(c->threads[i], NULL) == 0);
+
+        c->n_threads = 0;
+}
+
+static int copy_loop(Copy *c, int fdf, off_t max_bytes) {
+        bool compress = c->fdt_compressed >= 0;
+        int r;
+
+        for (;;) {
+                Block *b;
+                ssize_t n;
+
+                if (compress) {
+                        /* Write out what is done already, and make
+                         * room for the next block if necessary */
+                        while (head_done(c) || c->n_read - c->n_written >= c->n_blocks) {
+                                r = write_compressed(c);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
+
+                b = c->blocks + c->n_read % c->n_blocks;
+
+                if (!b->data) {
+                        b->data = malloc(BLOCK_SIZE);
+                        if (!b->data)
+                                return -ENOMEM;
+                }
+
+                n = loop_read(fdf, b->data, BLOCK_SIZE, false);
+                if (n < 0)
+                        return (int) n;
+                if (n == 0)
+                        break;
+
+                if (max_bytes != -1 && c->stats.size + n > (uint64_t) max_bytes)
+                        return -EFBIG;
+
+                r = write_sparse(c, b->data, n, c->stats.size);
+                if (r < 0)
+                        return r;
+
+                b->size = n;
+
+                if (compress) {
+                        b->record = NULL;
+                        b->duplicate = false;
+                        b->r = 0;
+
+                        r = find_duplicate(c, b, c->stats.size);
+                        if (r < 0)
+                                return r;
+
+                        /* Duplicates are done as soon as they are
+                         * read, everything else is queued for the
+                         * compression threads */
+                        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+                        b->done = b->duplicate;
+                        if (!b->duplicate) {
+                                c->queue[c->n_queued++ % c->n_blocks] = b;
+                                assert_se(pthread_cond_signal(&c->work_cond) == 0);
+                        }
+                        c->n_read++;
+                        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+                }
+
+                c->stats.size += n;
+        }
+
+        while (c->n_written < c->n_read) {
+                r = write_compressed(c);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Make sure the file has its full size, even if it ends in
+         * a hole */
+        if (ftruncate(c->fdt, c->stats.size) < 0)
+                return -errno;
+
+        if (compress && ftruncate(c->fdt_compressed, c->compressed_offset) < 0)
+                return -errno;
+
+        c->stats.compressed_size = c->compressed_offset;
+
+        return 0;
+}
+
+int coredump_copy(int fdf, int fdt, int fdt_compressed, off_t max_bytes, unsigned n_threads, CoredumpCopyStats *ret_stats) {
+        Copy c = {
+                .fdt = fdt,
+                .fdt_compressed = fdt_compressed,
+                .n_blocks = 1,
+        };
+        BlockRecord *record;
+        unsigned i;
+        int r;
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        /* Copies the coredump from fdf to fdt in a single pass, and
+         * if fdt_compressed is valid, compresses it into that on
+         * n_threads threads at the same time. */
+
+        if (fdt_compressed >= 0) {
+                if (n_threads <= 0) {
+                        long k;
+
+                        k = sysconf(_SC_NPROCESSORS_ONLN);
+                        n_threads = k > 0 ? (unsigned) k : 1;
+                }
+
+                n_threads = MIN(n_threads, THREADS_MAX);
+                c.n_blocks = n_threads * BLOCKS_PER_THREAD;
+
+                c.records = hashmap_new(&uint64_hash_ops);
+                if (!c.records)
+                        return -ENOMEM;
+        }
+
+        assert_se(pthread_mutex_init(&c.mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&c.work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&c.done_cond, NULL) == 0);
+
+        c.blocks = new0(Block, c.n_blocks);
+        c.queue = new0(Block*, c.n_blocks);
+        if (!c.blocks || !c.queue) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        if (fdt_compressed >= 0) {
+                r = start_threads(&c, n_threads);
+                if (r < 0)
+                        goto finish;
+        }
+
+        r = copy_loop(&c, fdf, max_bytes);
+
+finish:
+        stop_threads(&c);
+
+        for (i = 0; c.blocks && i < c.n_blocks; i++) {
+                free(c.blocks[i].data);
+                free(c.blocks[i].out);
+        }
+        free(c.blocks);
+        free(c.queue);
+        free(c.threads);
+
+        while ((record = hashmap_steal_first(c.records)))
+                free(record);
+        hashmap_free(c.records);
+
+        pthread_cond_destroy(&c.done_cond);
+        pthread_cond_destroy(&c.work_cond);
+        pthread_mutex_destroy(&c.mutex);
+
+        if (r >= 0 && ret_stats)
+                *ret_stats = c.stats;
+
+        return r;
+}
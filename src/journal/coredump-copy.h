@@ -0,0 +1,32 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+typedef struct CoredumpCopyStats {
+        uint64_t size;             /* bytes read */
+        uint64_t sparse;           /* bytes of all-zero pages not written */
+        uint64_t deduplicated;     /* bytes not compressed a second time */
+        uint64_t compressed_size;  /* bytes written to the compressed copy */
+} CoredumpCopyStats;
+
+int coredump_copy(int fdf, int fdt, int fdt_compressed, off_t max_bytes, unsigned n_threads, CoredumpCopyStats *ret_stats);
@@ -48,6 +48,7 @@
 #include "capability.h"
 #include "journald-native.h"
 #include "coredump-vacuum.h"
+#include "coredump-copy.h"
 #include "process-util.h"
 
 /* The maximum size up to which we process coredumps */
@@ -289,8 +290,14 @@ static int save_external_coredump(
 
         _cleanup_free_ char *fn = NULL, *tmp = NULL;
         _cleanup_close_ int fd = -1;
+        CoredumpCopyStats stats = {};
+        char a[FORMAT_BYTES_MAX], b[FORMAT_BYTES_MAX], c[FORMAT_BYTES_MAX];
         struct stat st;
         int r;
+#ifdef HAVE_ZSTD
+        _cleanup_free_ char *fn_compressed = NULL, *tmp_compressed = NULL;
+        _cleanup_close_ int fd_compressed = -1;
+#endif
 
         assert(info);
         assert(ret_filename);
@@ -311,7 +318,32 @@ static int save_external_coredump(
         if (fd < 0)
                 return log_error_errno(errno, "Failed to create coredump file %s: %m", tmp);
 
-        r = copy_bytes(STDIN_FILENO, fd, arg_process_size_max, false);
+#ifdef HAVE_ZSTD
+        /* If we will remove the coredump anyway, do not
+         * compress. We don't know the size yet, and check it again
+         * below. Compression happens while we read the coredump,
+         * instead of reading it a second time afterwards. */
+        if (maybe_remove_external_coredump(NULL, 0) == 0 && arg_compress) {
+
+                fn_compressed = strappend(fn, COMPRESSED_EXT);
+                if (!fn_compressed)
+                        log_oom();
+                else {
+                        r = tempfn_random(fn_compressed, &tmp_compressed);
+                        if (r < 0)
+                                log_error_errno(r, "Failed to determine temporary file name for %s: %m", fn_compressed);
+                        else {
+                                fd_compressed = open(tmp_compressed, O_CREAT|O_EXCL|O_RDWR|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, 0640);
+                                if (fd_compressed < 0)
+                                        log_error_errno(errno, "Failed to create file %s: %m", tmp_compressed);
+                        }
+                }
+        }
+
+        r = coredump_copy(STDIN_FILENO, fd, fd_compressed, arg_process_size_max, 0, &stats);
+#else
+        r = coredump_copy(STDIN_FILENO, fd, -1, arg_process_size_max, 0, &stats);
+#endif
         if (r == -EFBIG) {
                 log_error("Coredump of %s (%s) is larger than configured processing limit, refusing.", info[INFO_PID], info[INFO_COMM]);
                 goto fail;
@@ -323,17 +355,43 @@ static int save_external_coredump(
                 goto fail;
         }
 
+        log_debug("Coredump of %s bytes, %s of them in holes, %s deduplicated.",
+                  format_bytes(a, sizeof(a), stats.size),
+                  format_bytes(b, sizeof(b), stats.sparse),
+                  format_bytes(c, sizeof(c), stats.deduplicated));
+
         if (fstat(fd, &st) < 0) {
                 log_error_errno(errno, "Failed to fstat coredump %s: %m", tmp);
                 goto fail;
         }
 
-        if (lseek(fd, 0, SEEK_SET) == (off_t) -1) {
-                log_error_errno(errno, "Failed to seek on %s: %m", tmp);
-                goto fail;
+#ifdef HAVE_ZSTD
+        if (fd_compressed >= 0) {
+
+                if (maybe_remove_external_coredump(NULL, st.st_size) > 0)
+                        goto fail_compressed;
+
+                r = fix_permissions(fd_compressed, tmp_compressed, fn_compressed, info, uid);
+                if (r < 0)
+                        goto fail_compressed;
+
+                /* OK, this worked, we can get rid of the uncompressed version now */
+                unlink_noerrno(tmp);
+
+                *ret_filename = fn_compressed;    /* compressed */
+                *ret_fd = fd;                     /* uncompressed */
+                *ret_size = st.st_size;           /* uncompressed */
+
+                fn_compressed = NULL;
+                fd = -1;
+
+                return 0;
+
+        fail_compressed:
+                unlink_noerrno(tmp_compressed);
         }
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#elif defined(HAVE_XZ) || defined(HAVE_LZ4)
         /* If we will remove the coredump anyway, do not compress. */
         if (maybe_remove_external_coredump(NULL, st.st_size) == 0
             && arg_compress) {
@@ -341,6 +399,11 @@ static int save_external_coredump(
                 _cleanup_free_ char *fn_compressed = NULL, *tmp_compressed = NULL;
                 _cleanup_close_ int fd_compressed = -1;
 
+                if (lseek(fd, 0, SEEK_SET) == (off_t) -1) {
+                        log_error_errno(errno, "Failed to seek on %s: %m", tmp);
+                        goto uncompressed;
+                }
+
                 fn_compressed = strappend(fn, COMPRESSED_EXT);
                 if (!fn_compressed) {
                         log_oom();
@@ -401,6 +464,10 @@ uncompressed:
         return 0;
 
 fail:
+#ifdef HAVE_ZSTD
+        if (fd_compressed >= 0)
+                unlink_noerrno(tmp_compressed);
+#endif
         unlink_noerrno(tmp);
         return r;
 }
@@ -591,7 +591,7 @@ static int save_core(sd_journal *j, int fd, char **path, bool *unlink_temp) {
                 filename = NULL;
         }
 
-        if (filename && !endswith(filename, ".xz") && !endswith(filename, ".lz4")) {
+        if (filename && !endswith(filename, ".xz") && !endswith(filename, ".lz4") && !endswith(filename, ".zst")) {
                 if (path) {
                         *path = filename;
                         filename = NULL;
@@ -635,7 +635,7 @@ static int save_core(sd_journal *j, int fd, char **path, bool *unlink_temp) {
                                 goto error;
                         }
                 } else if (filename) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         _cleanup_close_ int fdf;
 
                         fdf = open(filename, O_RDONLY | O_CLOEXEC);
@@ -282,6 +282,21 @@ int journal_file_hmac_put_object(JournalFile *f, ObjectType type, Object *o, uin
                 gcry_md_write(f->hmac, &o->tag.seqnum, sizeof(o->tag.seqnum));
                 gcry_md_write(f->hmac, &o->tag.epoch, sizeof(o->tag.epoch));
                 break;
+
+        case OBJECT_ENTRY_INDEX:
+                /* All, it is never changed after creation */
+                gcry_md_write(f->hmac, &o->entry_index.n_entries, le64toh(o->object.size) - offsetof(EntryIndexObject, n_entries));
+                break;
+
+        case OBJECT_DICTIONARY:
+                /* Likewise */
+                gcry_md_write(f->hmac, o->dictionary.payload, le64toh(o->object.size) - offsetof(DictionaryObject, payload));
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                /* Likewise */
+                gcry_md_write(f->hmac, &o->bloom_filter.n_data, le64toh(o->object.size) - offsetof(BloomFilterObject, n_data));
+                break;
         default:
                 return -EINVAL;
         }
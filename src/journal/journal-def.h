@@ -45,9 +45,13 @@ typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
 typedef struct TagObject TagObject;
+typedef struct EntryIndexObject EntryIndexObject;
+typedef struct DictionaryObject DictionaryObject;
+typedef struct BloomFilterObject BloomFilterObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
+typedef struct EntryIndexItem EntryIndexItem;
 
 typedef struct FSSHeader FSSHeader;
 
@@ -61,6 +65,9 @@ typedef enum ObjectType {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_ENTRY_INDEX,
+        OBJECT_DICTIONARY,
+        OBJECT_BLOOM_FILTER,
         _OBJECT_TYPE_MAX
 } ObjectType;
 
@@ -68,10 +75,11 @@ typedef enum ObjectType {
 enum {
         OBJECT_COMPRESSED_XZ = 1 << 0,
         OBJECT_COMPRESSED_LZ4 = 1 << 1,
+        OBJECT_COMPRESSED_ZSTD = 1 << 2,
         _OBJECT_COMPRESSED_MAX
 };
 
-#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4)
+#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4 | OBJECT_COMPRESSED_ZSTD)
 
 struct ObjectHeader {
         uint8_t type;
@@ -128,7 +136,10 @@ struct HashTableObject {
 struct EntryArrayObject {
         ObjectHeader object;
         le64_t next_entry_array_offset;
-        le64_t items[];
+        union {
+                le64_t regular[0];
+                le32_t compact[0]; /* in files with HEADER_INCOMPATIBLE_COMPACT */
+        } items;
 } _packed_;
 
 #define TAG_LENGTH (256/8)
@@ -140,6 +151,43 @@ struct TagObject {
         uint8_t tag[TAG_LENGTH]; /* SHA-256 HMAC */
 } _packed_;
 
+/* Sparse index over the main entry array, written when a file is
+ * archived: one item for every stride-th entry, recording its
+ * timestamps and the entry array it is stored in. */
+struct EntryIndexItem {
+        le64_t seqnum;
+        le64_t realtime;
+        le64_t entry_array_offset;
+        le64_t entry_array_begin; /* number of entries in the arrays before it */
+} _packed_;
+
+struct EntryIndexObject {
+        ObjectHeader object;
+        le64_t n_entries;
+        le64_t stride;
+        EntryIndexItem items[];
+} _packed_;
+
+/* Compression dictionary, trained from the first small data objects
+ * of a file. ZSTD frames of later data objects refer to it by the ID
+ * embedded in the payload. */
+struct DictionaryObject {
+        ObjectHeader object;
+        uint8_t payload[];
+} _packed_;
+
+/* Bloom filter over the hashes of all data objects, written when a
+ * file is archived. Every hash selects one block of the filter, and
+ * sets n_hashes bits within it. */
+#define BLOOM_FILTER_BLOCK_SIZE 64
+
+struct BloomFilterObject {
+        ObjectHeader object;
+        le64_t n_data;
+        le64_t n_hashes;
+        uint8_t bits[];
+} _packed_;
+
 union Object {
         ObjectHeader object;
         DataObject data;
@@ -148,6 +196,9 @@ union Object {
         HashTableObject hash_table;
         EntryArrayObject entry_array;
         TagObject tag;
+        EntryIndexObject entry_index;
+        DictionaryObject dictionary;
+        BloomFilterObject bloom_filter;
 };
 
 enum {
@@ -161,20 +212,40 @@ enum {
 enum {
         HEADER_INCOMPATIBLE_COMPRESSED_XZ = 1 << 0,
         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 = 1 << 1,
+        HEADER_INCOMPATIBLE_COMPACT = 1 << 2,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD = 1 << 3,
 };
 
-#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4)
+#define HEADER_INCOMPATIBLE_ANY \
+        (HEADER_INCOMPATIBLE_COMPRESSED_XZ |    \
+         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |   \
+         HEADER_INCOMPATIBLE_COMPACT |          \
+         HEADER_INCOMPATIBLE_COMPRESSED_ZSTD)
+
+#ifdef HAVE_XZ
+#  define HEADER_INCOMPATIBLE_SUPPORTED_XZ HEADER_INCOMPATIBLE_COMPRESSED_XZ
+#else
+#  define HEADER_INCOMPATIBLE_SUPPORTED_XZ 0
+#endif
+
+#ifdef HAVE_LZ4
+#  define HEADER_INCOMPATIBLE_SUPPORTED_LZ4 HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#else
+#  define HEADER_INCOMPATIBLE_SUPPORTED_LZ4 0
+#endif
 
-#if defined(HAVE_XZ) && defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
-#elif defined(HAVE_XZ)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_XZ
-#elif defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#ifdef HAVE_ZSTD
+#  define HEADER_INCOMPATIBLE_SUPPORTED_ZSTD HEADER_INCOMPATIBLE_COMPRESSED_ZSTD
 #else
-#  define HEADER_INCOMPATIBLE_SUPPORTED 0
+#  define HEADER_INCOMPATIBLE_SUPPORTED_ZSTD 0
 #endif
 
+#define HEADER_INCOMPATIBLE_SUPPORTED \
+        (HEADER_INCOMPATIBLE_SUPPORTED_XZ |     \
+         HEADER_INCOMPATIBLE_SUPPORTED_LZ4 |    \
+         HEADER_INCOMPATIBLE_COMPACT |          \
+         HEADER_INCOMPATIBLE_SUPPORTED_ZSTD)
+
 enum {
         HEADER_COMPATIBLE_SEALED = 1
 };
@@ -219,8 +290,12 @@ struct Header {
         /* Added in 189 */
         le64_t n_tags;
         le64_t n_entry_arrays;
+        /* Added in 221 */
+        le64_t entry_index_offset;
+        le64_t dictionary_offset;
+        le64_t bloom_filter_offset;
 
-        /* Size: 240 */
+        /* Size: 264 */
 } _packed_;
 
 #define FSS_HEADER_SIGNATURE ((char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
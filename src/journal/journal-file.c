@@ -35,6 +35,8 @@
 #include "lookup3.h"
 #include "compress.h"
 #include "random-util.h"
+#include "event-util.h"
+#include "prioq.h"
 
 #define DEFAULT_DATA_HASH_TABLE_SIZE (2047ULL*sizeof(HashItem))
 #define DEFAULT_FIELD_HASH_TABLE_SIZE (333ULL*sizeof(HashItem))
@@ -66,12 +68,33 @@
 /* How many entries to keep in the entry array chain cache at max */
 #define CHAIN_CACHE_MAX 20
 
+/* How many chains to remember the last entry array of when appending */
+#define APPEND_CACHE_MAX 1024
+
 /* How much to increase the journal file size at once each time we allocate something new. */
 #define FILE_SIZE_INCREASE (8ULL*1024ULL*1024ULL)              /* 8MB */
 
 /* Reread fstat() of the file for detecting deletions at least this often */
 #define LAST_STAT_REFRESH_USEC (5*USEC_PER_SEC)
 
+/* Record every n-th entry in the sparse entry index of archived files */
+#define ENTRY_INDEX_STRIDE 512
+
+/* Size the bloom filter of archived files for this many bits per data
+ * object, and set this many bits per object: about 1% false positives */
+#define BLOOM_FILTER_BITS_PER_DATA 10
+#define BLOOM_FILTER_N_HASHES 7
+
+/* Train the compression dictionary once this many bytes of small
+ * data objects have been collected */
+#define DICT_SAMPLES_MAX (128U*1024U)
+
+/* Upper bound for the size of the compression dictionary */
+#define DICT_SIZE_MAX (16U*1024U)
+
+/* Smaller data objects are neither sampled nor compressed */
+#define DICT_PAYLOAD_MIN 16U
+
 /* The mmap context to use for the header we pick as one above the last defined typed */
 #define CONTEXT_HEADER _OBJECT_TYPE_MAX
 
@@ -137,6 +160,19 @@ void journal_file_close(JournalFile *f) {
                 journal_file_append_tag(f);
 #endif
 
+        if (f->post_change_timer) {
+                int enabled;
+
+                /* Flush out a change notification that is still
+                 * pending on the timer before we go away. */
+                if (sd_event_source_get_enabled(f->post_change_timer, &enabled) >= 0 &&
+                    enabled == SD_EVENT_ONESHOT)
+                        journal_file_post_change(f);
+
+                sd_event_source_set_enabled(f->post_change_timer, SD_EVENT_OFF);
+                sd_event_source_unref(f->post_change_timer);
+        }
+
         journal_file_set_offline(f);
 
         if (f->mmap && f->fd >= 0)
@@ -161,11 +197,22 @@ void journal_file_close(JournalFile *f) {
                 mmap_cache_unref(f->mmap);
 
         ordered_hashmap_free_free(f->chain_cache);
+        ordered_hashmap_free_free(f->append_cache);
+        free(f->boots);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         free(f->compress_buffer);
 #endif
 
+#ifdef HAVE_ZSTD
+        /* The dictionary would be of no use anymore */
+        sd_event_source_unref(f->dict_training_event);
+
+        compress_dict_free(f->compress_dict);
+        free(f->dict_samples);
+        free(f->dict_sample_sizes);
+#endif
+
 #ifdef HAVE_GCRYPT
         if (f->fss_file)
                 munmap(f->fss_file, PAGE_ALIGN(f->fss_file_size));
@@ -193,7 +240,9 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
 
         h.incompatible_flags |= htole32(
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
-                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4);
+                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
+                f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
+                f->compact * HEADER_INCOMPATIBLE_COMPACT);
 
         h.compatible_flags = htole32(
                 f->seal * HEADER_COMPATIBLE_SEALED);
@@ -330,6 +379,8 @@ static int journal_file_verify_header(JournalFile *f) {
 
         f->compress_xz = JOURNAL_HEADER_COMPRESSED_XZ(f->header);
         f->compress_lz4 = JOURNAL_HEADER_COMPRESSED_LZ4(f->header);
+        f->compress_zstd = JOURNAL_HEADER_COMPRESSED_ZSTD(f->header);
+        f->compact = JOURNAL_HEADER_COMPACT(f->header);
 
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
@@ -392,6 +443,9 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
         if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
                 return -E2BIG;
 
+        if (f->compact && new_size > JOURNAL_COMPACT_SIZE_MAX)
+                return -E2BIG;
+
         if (new_size > f->metrics.min_size && f->metrics.keep_free > 0) {
                 struct statvfs svfs;
 
@@ -414,6 +468,8 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
         new_size = ((new_size+FILE_SIZE_INCREASE-1) / FILE_SIZE_INCREASE) * FILE_SIZE_INCREASE;
         if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
                 new_size = f->metrics.max_size;
+        if (f->compact && new_size > JOURNAL_COMPACT_SIZE_MAX)
+                new_size = JOURNAL_COMPACT_SIZE_MAX;
 
         /* Note that the glibc fallocate() fallback is very
            inefficient, hence we try to minimize the allocation area
@@ -469,6 +525,9 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_ENTRY_INDEX] = sizeof(EntryIndexObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
+                [OBJECT_BLOOM_FILTER] = sizeof(BloomFilterObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -521,6 +580,18 @@ int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset
         return 0;
 }
 
+int journal_file_pin_object(JournalFile *f, ObjectType type, MMapWindow **ret) {
+        assert(f);
+        assert(ret);
+
+        /* Pins the memory map that the object of this type most
+         * recently returned by journal_file_move_to_object() is
+         * located in, so that it stays valid until it is unpinned
+         * again, regardless of any further accesses to the file */
+
+        return mmap_cache_pin(f->mmap, type_to_context(type), ret);
+}
+
 static uint64_t journal_file_entry_seqnum(JournalFile *f, uint64_t *seqnum) {
         uint64_t r;
 
@@ -886,7 +957,7 @@ int journal_file_find_data_object_with_hash(
                         goto next;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         uint64_t l;
                         size_t rsize = 0;
 
@@ -897,7 +968,8 @@ int journal_file_find_data_object_with_hash(
                         l -= offsetof(Object, data.payload);
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0,
+                                            journal_file_compress_dict(f));
                         if (r < 0)
                                 return r;
 
@@ -934,6 +1006,71 @@ int journal_file_find_data_object_with_hash(
         return 0;
 }
 
+static bool bloom_filter_apply(uint8_t *bits, uint64_t n_blocks, uint64_t n_hashes, uint64_t hash, bool set) {
+        uint64_t x, i;
+        uint32_t a, b;
+        uint8_t *block;
+
+        assert(bits);
+        assert(n_blocks > 0);
+
+        /* The data hash selects the block, and the bits within it are
+         * derived from a remixed hash by double hashing. Returns
+         * whether all bits were set before. */
+
+        block = bits + (hash % n_blocks) * BLOOM_FILTER_BLOCK_SIZE;
+
+        x = hash ^ (hash >> 33);
+        x *= UINT64_C(0xff51afd7ed558ccd);
+        x ^= x >> 33;
+
+        a = (uint32_t) x;
+        b = (uint32_t) (x >> 32) | 1;
+
+        for (i = 0; i < n_hashes; i++) {
+                unsigned k = (a + i * b) % (BLOOM_FILTER_BLOCK_SIZE * 8);
+
+                if (set)
+                        block[k / 8] |= 1U << (k % 8);
+                else if (!(block[k / 8] & (1U << (k % 8))))
+                        return false;
+        }
+
+        return true;
+}
+
+bool journal_file_bloom_filter_test(JournalFile *f, uint64_t hash) {
+        uint64_t p, n_hashes, n_blocks;
+        Object *o;
+
+        assert(f);
+
+        /* Returns false if the file definitely contains no data
+         * object with the specified hash. Without a usable filter
+         * we can't tell, and have to assume it does. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset))
+                return true;
+
+        p = le64toh(f->header->bloom_filter_offset);
+        if (p <= 0)
+                return true;
+
+        if (journal_file_move_to_object(f, OBJECT_BLOOM_FILTER, p, &o) < 0)
+                return true;
+
+        /* The filter is only good for the exact set of data objects
+         * it was generated for */
+        n_hashes = le64toh(o->bloom_filter.n_hashes);
+        n_blocks = journal_file_bloom_filter_n_blocks(o);
+        if (le64toh(o->bloom_filter.n_data) != le64toh(f->header->n_data) ||
+            n_hashes <= 0 || n_hashes > BLOOM_FILTER_BLOCK_SIZE * 8 ||
+            n_blocks <= 0)
+                return true;
+
+        return bloom_filter_apply(o->bloom_filter.bits, n_blocks, n_hashes, hash, false);
+}
+
 int journal_file_find_data_object(
                 JournalFile *f,
                 const void *data, uint64_t size,
@@ -1013,6 +1150,168 @@ static int journal_file_append_field(
         return 0;
 }
 
+CompressDict* journal_file_compress_dict(JournalFile *f) {
+#ifdef HAVE_ZSTD
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        if (f->compress_dict)
+                return f->compress_dict;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return NULL;
+
+        p = le64toh(f->header->dictionary_offset);
+        if (p == 0)
+                return NULL;
+
+        r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to read compression dictionary of %s: %m", f->path);
+                return NULL;
+        }
+
+        r = compress_dict_new(o->dictionary.payload, le64toh(o->object.size) - offsetof(Object, dictionary.payload), &f->compress_dict);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to load compression dictionary of %s: %m", f->path);
+                return NULL;
+        }
+
+        return f->compress_dict;
+#else
+        return NULL;
+#endif
+}
+
+static void journal_file_dict_add_sample(JournalFile *f, const void *data, uint64_t size) {
+#ifdef HAVE_ZSTD
+        assert(f);
+        assert(data);
+
+        if (!f->compress_zstd || f->dict_training_done)
+                return;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return;
+
+        /* Enough collected, training is pending */
+        if (f->dict_samples_size >= DICT_SAMPLES_MAX)
+                return;
+
+        if (!GREEDY_REALLOC(f->dict_samples, f->dict_samples_allocated, f->dict_samples_size + size) ||
+            !GREEDY_REALLOC(f->dict_sample_sizes, f->n_dict_samples_allocated, f->n_dict_samples + 1))
+                return;
+
+        memcpy((uint8_t*) f->dict_samples + f->dict_samples_size, data, size);
+        f->dict_samples_size += size;
+        f->dict_sample_sizes[f->n_dict_samples++] = size;
+#endif
+}
+
+#ifdef HAVE_ZSTD
+static int journal_file_append_dictionary(JournalFile *f) {
+        _cleanup_free_ void *dict = NULL;
+        size_t dict_size;
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        /* Trains a dictionary from the collected samples and stores
+         * it in the file. This is attempted only once per file, the
+         * samples are released either way. */
+
+        f->dict_training_done = true;
+
+        r = compress_dict_train(f->dict_samples, f->dict_sample_sizes, f->n_dict_samples,
+                                DICT_SIZE_MAX, &dict, &dict_size);
+
+        free(f->dict_samples);
+        free(f->dict_sample_sizes);
+        f->dict_samples = NULL;
+        f->dict_sample_sizes = NULL;
+        f->dict_samples_size = f->dict_samples_allocated = 0;
+        f->n_dict_samples = f->n_dict_samples_allocated = 0;
+
+        if (r < 0)
+                return r;
+
+        r = journal_file_append_object(f, OBJECT_DICTIONARY, offsetof(Object, dictionary.payload) + dict_size, &o, &p);
+        if (r < 0)
+                return r;
+
+        memcpy(o->dictionary.payload, dict, dict_size);
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, o, p);
+        if (r < 0)
+                return r;
+#endif
+
+        /* The dictionary is picked up from here for the following
+         * data objects, see journal_file_compress_dict() */
+        f->header->dictionary_offset = htole64(p);
+
+        log_debug("Trained %zu byte compression dictionary for %s.", dict_size, f->path);
+
+        return 0;
+}
+
+static void journal_file_train_dictionary(JournalFile *f) {
+        int r;
+
+        assert(f);
+
+        r = journal_file_append_dictionary(f);
+        if (r < 0)
+                log_debug_errno(r, "Failed to append compression dictionary to %s, ignoring: %m", f->path);
+}
+
+static int dictionary_training_thunk(sd_event_source *s, void *userdata) {
+        JournalFile *f = userdata;
+
+        assert(f);
+
+        f->dict_training_event = sd_event_source_unref(f->dict_training_event);
+        journal_file_train_dictionary(f);
+
+        return 1;
+}
+
+static void schedule_dictionary_training(JournalFile *f) {
+        int r;
+
+        assert(f);
+
+        if (f->dict_training_event)
+                return;
+
+        /* Training takes a while. If the file is hooked up to an
+         * event loop, do it when there is nothing else to do, not
+         * while a client waits for its entry to be written. */
+        if (f->post_change_timer) {
+                _cleanup_event_source_unref_ sd_event_source *s = NULL;
+
+                r = sd_event_add_defer(sd_event_source_get_event(f->post_change_timer), &s, dictionary_training_thunk, f);
+                if (r >= 0)
+                        r = sd_event_source_set_priority(s, SD_EVENT_PRIORITY_IDLE);
+                if (r >= 0) {
+                        f->dict_training_event = s;
+                        s = NULL;
+                        return;
+                }
+
+                log_debug_errno(r, "Failed to schedule dictionary training for %s, training right away: %m", f->path);
+        }
+
+        journal_file_train_dictionary(f);
+}
+#endif
+
 static int journal_file_append_data(
                 JournalFile *f,
                 const void *data, uint64_t size,
@@ -1050,19 +1349,35 @@ static int journal_file_append_data(
 
         o->data.hash = htole64(hash);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
-        if (f->compress_xz &&
-            size >= COMPRESSION_SIZE_THRESHOLD) {
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        if (JOURNAL_FILE_COMPRESS(f) && size >= DICT_PAYLOAD_MIN) {
+                CompressDict *dict;
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, &rsize);
+                /* Small objects only shrink when compressed against
+                 * the file's dictionary. Until there is one, collect
+                 * them for training it. Use whatever the file was
+                 * created with, not necessarily our preferred
+                 * algorithm */
+                dict = journal_file_compress_dict(f);
+                if (dict)
+                        compression = compress_blob_zstd_dict(data, size, o->data.payload, &rsize, dict) == 0 ? OBJECT_COMPRESSED_ZSTD : 0;
+                else if (size < COMPRESSION_SIZE_THRESHOLD)
+                        journal_file_dict_add_sample(f, data, size);
+                else if (f->compress_zstd)
+                        compression = compress_blob_zstd(data, size, o->data.payload, &rsize) == 0 ? OBJECT_COMPRESSED_ZSTD : 0;
+                else if (f->compress_lz4)
+                        compression = compress_blob_lz4(data, size, o->data.payload, &rsize) == 0 ? OBJECT_COMPRESSED_LZ4 : 0;
+                else
+                        compression = compress_blob_xz(data, size, o->data.payload, &rsize) == 0 ? OBJECT_COMPRESSED_XZ : 0;
 
                 if (compression) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
                         o->object.flags |= compression;
 
-                        log_debug("Compressed data object %"PRIu64" -> %zu using %s",
-                                  size, rsize, object_compressed_to_string(compression));
+                        log_debug("Compressed data object %"PRIu64" -> %zu using %s%s",
+                                  size, rsize, object_compressed_to_string(compression),
+                                  dict ? " with dictionary" : "");
                 }
         }
 #endif
@@ -1122,13 +1437,50 @@ uint64_t journal_file_entry_n_items(Object *o) {
         return (le64toh(o->object.size) - offsetof(Object, entry.items)) / sizeof(EntryItem);
 }
 
-uint64_t journal_file_entry_array_n_items(Object *o) {
+static uint64_t journal_file_entry_array_item_size(JournalFile *f) {
+        assert(f);
+
+        return f->compact ? sizeof(le32_t) : sizeof(le64_t);
+}
+
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) {
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY_ARRAY)
                 return 0;
 
-        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / sizeof(uint64_t);
+        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / journal_file_entry_array_item_size(f);
+}
+
+static void write_entry_array_item(JournalFile *f, Object *o, uint64_t i, uint64_t p) {
+        assert(f);
+        assert(o);
+
+        if (f->compact) {
+                /* Compact files never grow beyond 4G, see journal_file_allocate() */
+                assert(p <= UINT32_MAX);
+                o->entry_array.items.compact[i] = htole32(p);
+        } else
+                o->entry_array.items.regular[i] = htole64(p);
+}
+
+uint64_t journal_file_entry_index_n_items(Object *o) {
+        assert(o);
+
+        if (o->object.type != OBJECT_ENTRY_INDEX)
+                return 0;
+
+        return (le64toh(o->object.size) - offsetof(Object, entry_index.items)) / sizeof(EntryIndexItem);
+}
+
+uint64_t journal_file_bloom_filter_n_blocks(Object *o) {
+        assert(o);
+
+        if (o->object.type != OBJECT_BLOOM_FILTER)
+                return 0;
+
+        return (le64toh(o->object.size) - offsetof(Object, bloom_filter.bits)) / BLOOM_FILTER_BLOCK_SIZE;
 }
 
 uint64_t journal_file_hash_table_n_items(Object *o) {
@@ -1141,12 +1493,55 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
         return (le64toh(o->object.size) - offsetof(Object, hash_table.items)) / sizeof(HashItem);
 }
 
+typedef struct AppendCacheItem {
+        uint64_t first; /* the array at the beginning of the chain */
+        uint64_t array; /* the last array in the chain */
+        uint64_t total; /* the total number of items in all arrays before it */
+} AppendCacheItem;
+
+static void append_cache_put(JournalFile *f, AppendCacheItem *ai, uint64_t first, uint64_t array, uint64_t total) {
+        assert(f);
+
+        if (!ai) {
+                /* Walking a chain of one array is cheap enough */
+                if (array == first)
+                        return;
+
+                if (!f->append_cache) {
+                        f->append_cache = ordered_hashmap_new(&uint64_hash_ops);
+                        if (!f->append_cache)
+                                return;
+                }
+
+                if (ordered_hashmap_size(f->append_cache) >= APPEND_CACHE_MAX) {
+                        ai = ordered_hashmap_steal_first(f->append_cache);
+                        assert(ai);
+                } else {
+                        ai = new(AppendCacheItem, 1);
+                        if (!ai)
+                                return;
+                }
+
+                ai->first = first;
+
+                if (ordered_hashmap_put(f->append_cache, &ai->first, ai) < 0) {
+                        free(ai);
+                        return;
+                }
+        } else
+                assert(ai->first == first);
+
+        ai->array = array;
+        ai->total = total;
+}
+
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
                                  uint64_t p) {
         int r;
-        uint64_t n = 0, ap = 0, q, i, a, hidx;
+        uint64_t n = 0, ap = 0, q, i, a, hidx, t = 0;
+        AppendCacheItem *ai;
         Object *o;
 
         assert(f);
@@ -1156,20 +1551,33 @@ static int link_entry_into_array(JournalFile *f,
 
         a = le64toh(*first);
         i = hidx = le64toh(*idx);
+
+        /* We always append at the end of the chain, hence skip
+         * ahead to the array we appended to the last time */
+        ai = a > 0 ? ordered_hashmap_get(f->append_cache, &a) : NULL;
+        if (ai && hidx >= ai->total) {
+                a = ai->array;
+                i -= ai->total;
+                t = ai->total;
+        }
+
         while (a > 0) {
 
                 r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
                 if (r < 0)
                         return r;
 
-                n = journal_file_entry_array_n_items(o);
+                n = journal_file_entry_array_n_items(f, o);
                 if (i < n) {
-                        o->entry_array.items[i] = htole64(p);
+                        write_entry_array_item(f, o, i, p);
                         *idx = htole64(hidx + 1);
+
+                        append_cache_put(f, ai, le64toh(*first), a, t);
                         return 0;
                 }
 
                 i -= n;
+                t += n;
                 ap = a;
                 a = le64toh(o->entry_array.next_entry_array_offset);
         }
@@ -1183,7 +1591,7 @@ static int link_entry_into_array(JournalFile *f,
                 n = 4;
 
         r = journal_file_append_object(f, OBJECT_ENTRY_ARRAY,
-                                       offsetof(Object, entry_array.items) + n * sizeof(uint64_t),
+                                       offsetof(Object, entry_array.items) + n * journal_file_entry_array_item_size(f),
                                        &o, &q);
         if (r < 0)
                 return r;
@@ -1194,7 +1602,7 @@ static int link_entry_into_array(JournalFile *f,
                 return r;
 #endif
 
-        o->entry_array.items[i] = htole64(p);
+        write_entry_array_item(f, o, i, p);
 
         if (ap == 0)
                 *first = htole64(q);
@@ -1211,6 +1619,8 @@ static int link_entry_into_array(JournalFile *f,
 
         *idx = htole64(hidx + 1);
 
+        append_cache_put(f, ai, le64toh(*first), q, t);
+
         return 0;
 }
 
@@ -1369,6 +1779,88 @@ void journal_file_post_change(JournalFile *f) {
                 log_error_errno(errno, "Failed to truncate file to its own size: %m");
 }
 
+static int post_change_thunk(sd_event_source *timer, uint64_t usec, void *userdata) {
+        assert(userdata);
+
+        journal_file_post_change(userdata);
+
+        return 1;
+}
+
+static void schedule_post_change(JournalFile *f) {
+        sd_event_source *timer;
+        int enabled, r;
+        uint64_t now;
+
+        assert(f);
+        assert(f->post_change_timer);
+
+        timer = f->post_change_timer;
+
+        r = sd_event_source_get_enabled(timer, &enabled);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to get ftruncate timer state: %m");
+                goto fail;
+        }
+
+        /* A notification is already pending, it will cover this
+         * change too. */
+        if (enabled == SD_EVENT_ONESHOT)
+                return;
+
+        r = sd_event_now(sd_event_source_get_event(timer), CLOCK_MONOTONIC, &now);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to get clock's now for scheduling ftruncate: %m");
+                goto fail;
+        }
+
+        r = sd_event_source_set_time(timer, now + f->post_change_timer_period);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to set time for scheduling ftruncate: %m");
+                goto fail;
+        }
+
+        r = sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to enable scheduled ftruncate: %m");
+                goto fail;
+        }
+
+        return;
+
+fail:
+        /* On failure, let's simply post the change immediately. */
+        journal_file_post_change(f);
+}
+
+/* Enable coalesced change posting in a timer on the provided sd_event
+ * instance. Instead of truncating the file after every single entry
+ * we append, we do so at most once per period t, so that bursts of
+ * messages result in a single IN_MODIFY event and syscall. */
+int journal_file_enable_post_change_timer(JournalFile *f, sd_event *e, usec_t t) {
+        _cleanup_event_source_unref_ sd_event_source *timer = NULL;
+        int r;
+
+        assert(f);
+        assert_return(!f->post_change_timer, -EINVAL);
+        assert(e);
+        assert(t);
+
+        r = sd_event_add_time(e, &timer, CLOCK_MONOTONIC, 0, 0, post_change_thunk, f);
+        if (r < 0)
+                return r;
+
+        r = sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+        if (r < 0)
+                return r;
+
+        f->post_change_timer = timer;
+        timer = NULL;
+        f->post_change_timer_period = t;
+
+        return r;
+}
+
 static int entry_item_cmp(const void *_a, const void *_b) {
         const EntryItem *a = _a, *b = _b;
 
@@ -1426,6 +1918,13 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
 
         r = journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
 
+#ifdef HAVE_ZSTD
+        /* Train the dictionary only now, as appending it moves
+         * the objects we were working with around */
+        if (r >= 0 && f->dict_samples_size >= DICT_SAMPLES_MAX)
+                schedule_dictionary_training(f);
+#endif
+
         /* If the memory mapping triggered a SIGBUS then we return an
          * IO error and ignore the error code passed down to us, since
          * it is very likely just an effect of a nullified replacement
@@ -1434,7 +1933,10 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
         if (mmap_cache_got_sigbus(f->mmap, f->fd))
                 r = -EIO;
 
-        journal_file_post_change(f);
+        if (f->post_change_timer)
+                schedule_post_change(f);
+        else
+                journal_file_post_change(f);
 
         return r;
 }
@@ -1516,9 +2018,9 @@ static int generic_array_get(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(o);
+                k = journal_file_entry_array_n_items(f, o);
                 if (i < k) {
-                        p = le64toh(o->entry_array.items[i]);
+                        p = journal_file_entry_array_item(f, o, i);
                         goto found;
                 }
 
@@ -1531,7 +2033,7 @@ static int generic_array_get(
 
 found:
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(o->entry_array.items[0]), t, i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, o, 0), t, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -1637,13 +2139,13 @@ static int generic_array_bisect(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(array);
+                k = journal_file_entry_array_n_items(f, array);
                 right = MIN(k, n);
                 if (right <= 0)
                         return 0;
 
                 i = right - 1;
-                lp = p = le64toh(array->entry_array.items[i]);
+                lp = p = journal_file_entry_array_item(f, array, i);
                 if (p <= 0)
                         return -EBADMSG;
 
@@ -1671,7 +2173,7 @@ static int generic_array_bisect(
                                 if (last_index > 0) {
                                         uint64_t x = last_index - 1;
 
-                                        p = le64toh(array->entry_array.items[x]);
+                                        p = journal_file_entry_array_item(f, array, x);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -1691,7 +2193,7 @@ static int generic_array_bisect(
                                 if (last_index < right) {
                                         uint64_t y = last_index + 1;
 
-                                        p = le64toh(array->entry_array.items[y]);
+                                        p = journal_file_entry_array_item(f, array, y);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -1721,7 +2223,7 @@ static int generic_array_bisect(
                                 assert(left < right);
                                 i = (left + right) / 2;
 
-                                p = le64toh(array->entry_array.items[i]);
+                                p = journal_file_entry_array_item(f, array, i);
                                 if (p <= 0)
                                         return -EBADMSG;
 
@@ -1764,14 +2266,14 @@ found:
                 return 0;
 
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(array->entry_array.items[0]), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, array, 0), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
 
         if (subtract_one && i == 0)
                 p = last_p;
         else if (subtract_one)
-                p = le64toh(array->entry_array.items[i-1]);
+                p = journal_file_entry_array_item(f, array, i-1);
         else
-                p = le64toh(array->entry_array.items[i]);
+                p = journal_file_entry_array_item(f, array, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -1874,42 +2376,228 @@ _pure_ static int test_object_offset(JournalFile *f, uint64_t p, uint64_t needle
                 return TEST_RIGHT;
 }
 
-static int test_object_seqnum(JournalFile *f, uint64_t p, uint64_t needle) {
+static bool journal_file_get_entry_index(JournalFile *f, Object **ret) {
         Object *o;
-        int r;
+        uint64_t p, n, stride;
 
         assert(f);
-        assert(p > 0);
+        assert(ret);
 
-        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
-        if (r < 0)
-                return r;
+        if (!JOURNAL_HEADER_CONTAINS(f->header, entry_index_offset))
+                return false;
 
-        if (le64toh(o->entry.seqnum) == needle)
-                return TEST_FOUND;
-        else if (le64toh(o->entry.seqnum) < needle)
-                return TEST_LEFT;
-        else
-                return TEST_RIGHT;
-}
+        p = le64toh(f->header->entry_index_offset);
+        if (p <= 0)
+                return false;
 
-int journal_file_move_to_entry_by_seqnum(
-                JournalFile *f,
-                uint64_t seqnum,
-                direction_t direction,
-                Object **ret,
-                uint64_t *offset) {
+        /* A broken index shouldn't break seeking, we can always fall
+         * back to bisecting the entry array chain */
+        if (journal_file_move_to_object(f, OBJECT_ENTRY_INDEX, p, &o) < 0)
+                return false;
 
-        return generic_array_bisect(f,
-                                    le64toh(f->header->entry_array_offset),
-                                    le64toh(f->header->n_entries),
-                                    seqnum,
-                                    test_object_seqnum,
-                                    direction,
-                                    ret, offset, NULL);
+        /* The index is only good for the exact set of entries it
+         * was generated for */
+        n = le64toh(o->entry_index.n_entries);
+        stride = le64toh(o->entry_index.stride);
+        if (n != le64toh(f->header->n_entries) ||
+            stride <= 0 ||
+            journal_file_entry_index_n_items(o) != DIV_ROUND_UP(n, stride))
+                return false;
+
+        *ret = o;
+        return true;
 }
 
-static int test_object_realtime(JournalFile *f, uint64_t p, uint64_t needle) {
+static int entry_index_get(
+                JournalFile *f,
+                const EntryIndexItem *item,
+                uint64_t i,
+                bool cache,
+                uint64_t *ret) {
+
+        uint64_t first, a, t;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(item);
+        assert(ret);
+
+        /* Look up the i-th entry of the main entry array, starting
+         * with the array the index item points to instead of the
+         * beginning of the chain. */
+
+        first = le64toh(f->header->entry_array_offset);
+        a = le64toh(item->entry_array_offset);
+        t = le64toh(item->entry_array_begin);
+
+        if (i < t)
+                return -EBADMSG;
+
+        while (a > 0) {
+                uint64_t k, p;
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
+                if (r < 0)
+                        return r;
+
+                k = journal_file_entry_array_n_items(f, o);
+                if (i - t < k) {
+                        p = journal_file_entry_array_item(f, o, i - t);
+                        if (p <= 0)
+                                return -EBADMSG;
+
+                        /* Let the next bisection or iteration
+                         * step in this chain skip ahead, too */
+                        if (cache)
+                                chain_cache_put(f->chain_cache, ordered_hashmap_get(f->chain_cache, &first),
+                                                first, a, journal_file_entry_array_item(f, o, 0), t, i - t);
+
+                        *ret = p;
+                        return 0;
+                }
+
+                t += k;
+                a = le64toh(o->entry_array.next_entry_array_offset);
+        }
+
+        return -EBADMSG;
+}
+
+static int entry_index_bisect(
+                JournalFile *f,
+                Object *ix,
+                uint64_t needle,
+                bool realtime,
+                int (*test_object)(JournalFile *f, uint64_t p, uint64_t needle),
+                direction_t direction,
+                Object **ret,
+                uint64_t *offset) {
+
+        const EntryIndexItem *item;
+        uint64_t n, m, stride, left, right, p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(ix);
+        assert(test_object);
+
+        n = le64toh(ix->entry_index.n_entries);
+        stride = le64toh(ix->entry_index.stride);
+        m = journal_file_entry_index_n_items(ix);
+
+        /* We are looking for the first entry right of the needle
+         * (or on it, if we go down). First, narrow the range down
+         * to the entries between two index items, without touching
+         * a single entry object. */
+        left = 0;
+        right = m;
+        while (left < right) {
+                uint64_t i, v;
+
+                i = (left + right) / 2;
+                v = realtime ? le64toh(ix->entry_index.items[i].realtime) : le64toh(ix->entry_index.items[i].seqnum);
+
+                if (v > needle || (v == needle && direction == DIRECTION_DOWN))
+                        right = i;
+                else
+                        left = i + 1;
+        }
+
+        item = &ix->entry_index.items[left > 0 ? left - 1 : 0];
+        right = left < m ? left * stride : n;
+        left = left > 0 ? (left - 1) * stride + 1 : 0;
+
+        /* Then bisect the remaining few entries */
+        while (left < right) {
+                uint64_t i;
+
+                i = (left + right) / 2;
+
+                r = entry_index_get(f, item, i, false, &p);
+                if (r < 0)
+                        return r;
+
+                r = test_object(f, p, needle);
+                if (r < 0)
+                        return r;
+
+                if (r == TEST_FOUND)
+                        r = direction == DIRECTION_DOWN ? TEST_RIGHT : TEST_LEFT;
+
+                if (r == TEST_RIGHT)
+                        right = i;
+                else
+                        left = i + 1;
+        }
+
+        if (direction == DIRECTION_UP) {
+                if (left <= 0)
+                        return 0;
+
+                left--;
+        } else if (left >= n)
+                return 0;
+
+        r = entry_index_get(f, item, left, true, &p);
+        if (r < 0)
+                return r;
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
+        if (r < 0)
+                return r;
+
+        if (ret)
+                *ret = o;
+
+        if (offset)
+                *offset = p;
+
+        return 1;
+}
+
+static int test_object_seqnum(JournalFile *f, uint64_t p, uint64_t needle) {
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(p > 0);
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
+        if (r < 0)
+                return r;
+
+        if (le64toh(o->entry.seqnum) == needle)
+                return TEST_FOUND;
+        else if (le64toh(o->entry.seqnum) < needle)
+                return TEST_LEFT;
+        else
+                return TEST_RIGHT;
+}
+
+int journal_file_move_to_entry_by_seqnum(
+                JournalFile *f,
+                uint64_t seqnum,
+                direction_t direction,
+                Object **ret,
+                uint64_t *offset) {
+
+        Object *ix;
+
+        if (journal_file_get_entry_index(f, &ix))
+                return entry_index_bisect(f, ix, seqnum, false, test_object_seqnum, direction, ret, offset);
+
+        return generic_array_bisect(f,
+                                    le64toh(f->header->entry_array_offset),
+                                    le64toh(f->header->n_entries),
+                                    seqnum,
+                                    test_object_seqnum,
+                                    direction,
+                                    ret, offset, NULL);
+}
+
+static int test_object_realtime(JournalFile *f, uint64_t p, uint64_t needle) {
         Object *o;
         int r;
 
@@ -1935,6 +2623,11 @@ int journal_file_move_to_entry_by_realtime(
                 Object **ret,
                 uint64_t *offset) {
 
+        Object *ix;
+
+        if (journal_file_get_entry_index(f, &ix))
+                return entry_index_bisect(f, ix, realtime, true, test_object_realtime, direction, ret, offset);
+
         return generic_array_bisect(f,
                                     le64toh(f->header->entry_array_offset),
                                     le64toh(f->header->n_entries),
@@ -2027,8 +2720,8 @@ void journal_file_save_location(JournalFile *f, Object *o, uint64_t offset) {
 int journal_file_compare_locations(JournalFile *af, JournalFile *bf) {
         assert(af);
         assert(bf);
-        assert(af->location_type == LOCATION_SEEK);
-        assert(bf->location_type == LOCATION_SEEK);
+        assert(IN_SET(af->location_type, LOCATION_SEEK, LOCATION_DISCRETE));
+        assert(IN_SET(bf->location_type, LOCATION_SEEK, LOCATION_DISCRETE));
 
         /* If contents and timestamps match, these entries are
          * identical, even if the seqnum does not match */
@@ -2201,6 +2894,121 @@ int journal_file_next_entry_for_data(
                                           ret, offset);
 }
 
+static int boot_add(JournalBoot **boots, size_t *n, size_t *allocated, sd_id128_t id, uint64_t first, uint64_t last) {
+        size_t i;
+
+        /* Entries of the same boot are usually next to each other,
+         * hence look at the most recently added boots first */
+        for (i = *n; i > 0; i--) {
+                JournalBoot *b = *boots + i - 1;
+
+                if (sd_id128_equal(b->id, id)) {
+                        b->first = MIN(b->first, first);
+                        b->last = MAX(b->last, last);
+                        return 0;
+                }
+        }
+
+        if (!GREEDY_REALLOC(*boots, *allocated, *n + 1))
+                return -ENOMEM;
+
+        (*boots)[(*n)++] = (JournalBoot) {
+                .id = id,
+                .first = first,
+                .last = last,
+        };
+
+        return 0;
+}
+
+int journal_file_get_boots(JournalFile *f, const JournalBoot **ret, size_t *n) {
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n_boots = 0, allocated = 0;
+        uint64_t n_entries, p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(ret);
+        assert(n);
+
+        n_entries = le64toh(f->header->n_entries);
+        if (f->boots_n_entries == n_entries)
+                goto finish;
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, n_fields)) {
+
+                /* Every _BOOT_ID= data object knows the first and
+                 * last entry that references it, so we only need to
+                 * follow the field's chain of data objects. */
+                r = journal_file_find_field_object(f, "_BOOT_ID", strlen("_BOOT_ID"), &o, NULL);
+                if (r < 0)
+                        return r;
+
+                p = r > 0 ? le64toh(o->field.head_data_offset) : 0;
+                while (p > 0) {
+                        uint64_t next, first;
+                        sd_id128_t id;
+
+                        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        next = le64toh(o->data.next_field_offset);
+
+                        r = journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL);
+                        if (r < 0)
+                                return r;
+                        if (r > 0) {
+                                id = o->entry.boot_id;
+                                first = le64toh(o->entry.realtime);
+
+                                r = journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_UP, &o, NULL);
+                                if (r <= 0)
+                                        return r < 0 ? r : -EBADMSG;
+
+                                r = boot_add(&boots, &n_boots, &allocated, id, first, le64toh(o->entry.realtime));
+                                if (r < 0)
+                                        return r;
+                        }
+
+                        p = next;
+                }
+        } else {
+
+                /* Files without a field hash table need to be
+                 * looked at entry by entry. */
+                p = 0;
+                for (;;) {
+                        uint64_t realtime;
+
+                        r = journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                break;
+
+                        realtime = le64toh(o->entry.realtime);
+
+                        r = boot_add(&boots, &n_boots, &allocated, o->entry.boot_id, realtime, realtime);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        free(f->boots);
+        f->boots = boots;
+        f->n_boots = n_boots;
+        f->boots_n_entries = n_entries;
+        boots = NULL;
+
+finish:
+        *ret = f->boots;
+        *n = f->n_boots;
+
+        return 0;
+}
+
 int journal_file_move_to_entry_by_offset_for_data(
                 JournalFile *f,
                 uint64_t data_offset,
@@ -2416,6 +3224,24 @@ void journal_file_dump(JournalFile *f) {
                                le64toh(o->tag.epoch));
                         break;
 
+                case OBJECT_ENTRY_INDEX:
+                        printf("Type: OBJECT_ENTRY_INDEX n_entries=%"PRIu64" stride=%"PRIu64"\n",
+                               le64toh(o->entry_index.n_entries),
+                               le64toh(o->entry_index.stride));
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY size=%"PRIu64"\n",
+                               le64toh(o->object.size) - offsetof(Object, dictionary.payload));
+                        break;
+
+                case OBJECT_BLOOM_FILTER:
+                        printf("Type: OBJECT_BLOOM_FILTER n_data=%"PRIu64" n_hashes=%"PRIu64" n_blocks=%"PRIu64"\n",
+                               le64toh(o->bloom_filter.n_data),
+                               le64toh(o->bloom_filter.n_hashes),
+                               journal_file_bloom_filter_n_blocks(o));
+                        break;
+
                 default:
                         printf("Type: unknown (%i)\n", o->object.type);
                         break;
@@ -2460,7 +3286,7 @@ void journal_file_print_header(JournalFile *f) {
                "Sequential Number ID: %s\n"
                "State: %s\n"
                "Compatible Flags:%s%s\n"
-               "Incompatible Flags:%s%s%s\n"
+               "Incompatible Flags:%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data Hash Table Size: %"PRIu64"\n"
@@ -2485,6 +3311,8 @@ void journal_file_print_header(JournalFile *f) {
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
+               JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
+               JOURNAL_HEADER_COMPACT(f->header) ? " COMPACT" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
@@ -2517,6 +3345,15 @@ void journal_file_print_header(JournalFile *f) {
         if (JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays))
                 printf("Entry Array Objects: %"PRIu64"\n",
                        le64toh(f->header->n_entry_arrays));
+        if (JOURNAL_HEADER_CONTAINS(f->header, entry_index_offset))
+                printf("Entry Index: %s\n",
+                       yes_no(f->header->entry_index_offset != 0));
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                printf("Compression Dictionary: %s\n",
+                       yes_no(f->header->dictionary_offset != 0));
+        if (JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset))
+                printf("Bloom Filter: %s\n",
+                       yes_no(f->header->bloom_filter_offset != 0));
 
         if (fstat(f->fd, &st) >= 0)
                 printf("Disk usage: %s\n", format_bytes(bytes, sizeof(bytes), (off_t) st.st_blocks * 512ULL));
@@ -2557,6 +3394,26 @@ static int journal_file_warn_btrfs(JournalFile *f) {
         return 1;
 }
 
+static bool journal_file_compact_enabled(void) {
+        const char *e;
+        int r;
+
+        /* Compact entry arrays can't be read by older versions, hence
+         * allow turning them off for files that need to be shared
+         * with those. */
+        e = secure_getenv("SYSTEMD_JOURNAL_COMPACT");
+        if (!e)
+                return true;
+
+        r = parse_boolean(e);
+        if (r < 0) {
+                log_debug("Failed to parse $SYSTEMD_JOURNAL_COMPACT, ignoring: %s", e);
+                return true;
+        }
+
+        return r;
+}
+
 int journal_file_open(
                 const char *fname,
                 int flags,
@@ -2589,12 +3446,15 @@ int journal_file_open(
                 return -ENOMEM;
 
         f->fd = -1;
+        f->location_prioq_idx = PRIOQ_IDX_NULL;
         f->mode = mode;
 
         f->flags = flags;
         f->prot = prot_from_flags(flags);
         f->writable = (flags & O_ACCMODE) != O_RDONLY;
-#if defined(HAVE_LZ4)
+#if defined(HAVE_ZSTD)
+        f->compress_zstd = compress;
+#elif defined(HAVE_LZ4)
         f->compress_lz4 = compress;
 #elif defined(HAVE_XZ)
         f->compress_xz = compress;
@@ -2602,6 +3462,7 @@ int journal_file_open(
 #ifdef HAVE_GCRYPT
         f->seal = seal;
 #endif
+        f->compact = journal_file_compact_enabled();
 
         if (mmap_cache)
                 f->mmap = mmap_cache_ref(mmap_cache);
@@ -2707,6 +3568,15 @@ int journal_file_open(
                 r = journal_file_refresh_header(f);
                 if (r < 0)
                         goto fail;
+
+                if (template && template->post_change_timer) {
+                        r = journal_file_enable_post_change_timer(
+                                        f,
+                                        sd_event_source_get_event(template->post_change_timer),
+                                        template->post_change_timer_period);
+                        if (r < 0)
+                                goto fail;
+                }
         }
 
 #ifdef HAVE_GCRYPT
@@ -2756,6 +3626,155 @@ fail:
         return r;
 }
 
+static int journal_file_append_entry_index(JournalFile *f) {
+        _cleanup_free_ EntryIndexItem *items = NULL;
+        uint64_t n, m, a, t = 0, i = 0, q;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        /* Writes a sparse index of the main entry array, so that
+         * seeking by time or sequence number in the archived file
+         * can skip most of the bisection through the entry array
+         * chain. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, entry_index_offset))
+                return 0;
+
+        if (f->header->entry_index_offset != 0)
+                return 0;
+
+        /* Small files can be bisected quickly enough without */
+        n = le64toh(f->header->n_entries);
+        if (n <= ENTRY_INDEX_STRIDE)
+                return 0;
+
+        m = DIV_ROUND_UP(n, ENTRY_INDEX_STRIDE);
+        items = new(EntryIndexItem, m);
+        if (!items)
+                return -ENOMEM;
+
+        a = le64toh(f->header->entry_array_offset);
+        while (a > 0 && i < m) {
+                uint64_t k;
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
+                if (r < 0)
+                        return r;
+
+                k = journal_file_entry_array_n_items(f, o);
+                for (; i < m && i * ENTRY_INDEX_STRIDE < t + k; i++) {
+                        Object *e;
+
+                        r = journal_file_move_to_object(f, OBJECT_ENTRY, journal_file_entry_array_item(f, o, i * ENTRY_INDEX_STRIDE - t), &e);
+                        if (r < 0)
+                                return r;
+
+                        items[i].seqnum = e->entry.seqnum;
+                        items[i].realtime = e->entry.realtime;
+                        items[i].entry_array_offset = htole64(a);
+                        items[i].entry_array_begin = htole64(t);
+                }
+
+                t += k;
+                a = le64toh(o->entry_array.next_entry_array_offset);
+        }
+
+        if (i < m)
+                return -EBADMSG;
+
+        r = journal_file_append_object(f, OBJECT_ENTRY_INDEX,
+                                       offsetof(Object, entry_index.items) + m * sizeof(EntryIndexItem),
+                                       &o, &q);
+        if (r < 0)
+                return r;
+
+        o->entry_index.n_entries = htole64(n);
+        o->entry_index.stride = htole64(ENTRY_INDEX_STRIDE);
+        memcpy(o->entry_index.items, items, m * sizeof(EntryIndexItem));
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_ENTRY_INDEX, o, q);
+        if (r < 0)
+                return r;
+#endif
+
+        f->header->entry_index_offset = htole64(q);
+
+        return 0;
+}
+
+static int journal_file_append_bloom_filter(JournalFile *f) {
+        _cleanup_free_ uint8_t *bits = NULL;
+        uint64_t n, n_blocks, m, h, k = 0, q;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        /* Writes a bloom filter of all data objects, so that readers
+         * can skip the archived file entirely if it can't contain the
+         * data they are matching for. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset))
+                return 0;
+
+        if (f->header->bloom_filter_offset != 0)
+                return 0;
+
+        n = le64toh(f->header->n_data);
+        if (n <= 0)
+                return 0;
+
+        n_blocks = DIV_ROUND_UP(n * BLOOM_FILTER_BITS_PER_DATA, BLOOM_FILTER_BLOCK_SIZE * 8);
+        bits = malloc0(n_blocks * BLOOM_FILTER_BLOCK_SIZE);
+        if (!bits)
+                return -ENOMEM;
+
+        m = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+        for (h = 0; h < m; h++) {
+                uint64_t p;
+
+                p = le64toh(f->data_hash_table[h].head_hash_offset);
+                while (p > 0) {
+                        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        bloom_filter_apply(bits, n_blocks, BLOOM_FILTER_N_HASHES, le64toh(o->data.hash), true);
+
+                        if (++k > n)
+                                return -EBADMSG;
+
+                        p = le64toh(o->data.next_hash_offset);
+                }
+        }
+
+        if (k != n)
+                return -EBADMSG;
+
+        r = journal_file_append_object(f, OBJECT_BLOOM_FILTER,
+                                       offsetof(Object, bloom_filter.bits) + n_blocks * BLOOM_FILTER_BLOCK_SIZE,
+                                       &o, &q);
+        if (r < 0)
+                return r;
+
+        o->bloom_filter.n_data = htole64(n);
+        o->bloom_filter.n_hashes = htole64(BLOOM_FILTER_N_HASHES);
+        memcpy(o->bloom_filter.bits, bits, n_blocks * BLOOM_FILTER_BLOCK_SIZE);
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_BLOOM_FILTER, o, q);
+        if (r < 0)
+                return r;
+#endif
+
+        f->header->bloom_filter_offset = htole64(q);
+
+        return 0;
+}
+
 int journal_file_rotate(JournalFile **f, bool compress, bool seal) {
         _cleanup_free_ char *p = NULL;
         size_t l;
@@ -2789,6 +3808,17 @@ int journal_file_rotate(JournalFile **f, bool compress, bool seal) {
         if (r < 0 && errno != ENOENT)
                 return -errno;
 
+        /* The file won't change anymore, so now is the time to
+         * index it. This is merely an optimization, hence don't
+         * fail if it doesn't work out. */
+        r = journal_file_append_entry_index(old_file);
+        if (r < 0)
+                log_debug_errno(r, "Failed to write entry index to %s, ignoring: %m", old_file->path);
+
+        r = journal_file_append_bloom_filter(old_file);
+        if (r < 0)
+                log_debug_errno(r, "Failed to write bloom filter to %s, ignoring: %m", old_file->path);
+
         old_file->header->state = STATE_ARCHIVED;
 
         /* Currently, btrfs is not very good with out write patterns
@@ -2865,7 +3895,89 @@ int journal_file_open_reliably(
                                  metrics, mmap_cache, template, ret);
 }
 
+/* Copying entries between two files references the same few data
+ * objects (boot ID, host name, unit, ...) over and over again. Remember
+ * where in the target each data object of the source went, so that
+ * repeated ones neither need to be decompressed nor hashed nor looked
+ * up in the target's hash table again. */
+
+#define COPY_CACHE_MAX 16384U
+
+typedef struct CopiedData {
+        uint64_t from;
+        uint64_t to;
+        le64_t hash;
+} CopiedData;
+
+struct JournalCopyCache {
+        sd_id128_t from_id, to_id;
+        Hashmap *data;
+};
+
+JournalCopyCache* journal_copy_cache_new(void) {
+        JournalCopyCache *c;
+
+        c = new0(JournalCopyCache, 1);
+        if (!c)
+                return NULL;
+
+        c->data = hashmap_new(&uint64_hash_ops);
+        if (!c->data) {
+                free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+JournalCopyCache* journal_copy_cache_free(JournalCopyCache *c) {
+        if (!c)
+                return NULL;
+
+        hashmap_free_free(c->data);
+        free(c);
+
+        return NULL;
+}
+
+static void copy_cache_validate(JournalCopyCache *c, JournalFile *from, JournalFile *to) {
+        assert(c);
+
+        /* Offsets are only meaningful between the very same two
+         * files, forget everything if either of them changed */
+
+        if (sd_id128_equal(c->from_id, from->header->file_id) &&
+            sd_id128_equal(c->to_id, to->header->file_id) &&
+            hashmap_size(c->data) < COPY_CACHE_MAX)
+                return;
+
+        hashmap_clear_free(c->data);
+        c->from_id = from->header->file_id;
+        c->to_id = to->header->file_id;
+}
+
+static void copy_cache_add(JournalCopyCache *c, uint64_t from, uint64_t to, le64_t hash) {
+        CopiedData *d;
+
+        assert(c);
+
+        d = new(CopiedData, 1);
+        if (!d)
+                return;
+
+        d->from = from;
+        d->to = to;
+        d->hash = hash;
+
+        if (hashmap_put(c->data, &d->from, d) <= 0)
+                free(d);
+}
+
 int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint64_t p, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+        return journal_file_copy_entry_cached(from, to, o, p, NULL, seqnum, ret, offset);
+}
+
+int journal_file_copy_entry_cached(JournalFile *from, JournalFile *to, Object *o, uint64_t p, JournalCopyCache *cache, uint64_t *seqnum, Object **ret, uint64_t *offset) {
         uint64_t i, n;
         uint64_t q, xor_hash = 0;
         int r;
@@ -2880,6 +3992,9 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
         if (!to->writable)
                 return -EPERM;
 
+        if (cache)
+                copy_cache_validate(cache, from, to);
+
         ts.monotonic = le64toh(o->entry.monotonic);
         ts.realtime = le64toh(o->entry.realtime);
 
@@ -2897,6 +4012,18 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 q = le64toh(o->entry.items[i].object_offset);
                 le_hash = o->entry.items[i].hash;
 
+                if (cache) {
+                        CopiedData *d;
+
+                        d = hashmap_get(cache->data, &q);
+                        if (d) {
+                                xor_hash ^= le64toh(d->hash);
+                                items[i].object_offset = htole64(d->to);
+                                items[i].hash = d->hash;
+                                continue;
+                        }
+                }
+
                 r = journal_file_move_to_object(from, OBJECT_DATA, q, &o);
                 if (r < 0)
                         return r;
@@ -2912,11 +4039,12 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                         return -E2BIG;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         size_t rsize = 0;
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0,
+                                            journal_file_compress_dict(from));
                         if (r < 0)
                                 return r;
 
@@ -2936,6 +4064,9 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 items[i].object_offset = htole64(h);
                 items[i].hash = u->data.hash;
 
+                if (cache)
+                        copy_cache_add(cache, q, h, u->data.hash);
+
                 r = journal_file_move_to_object(from, OBJECT_ENTRY, p, &o);
                 if (r < 0)
                         return r;
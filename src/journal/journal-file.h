@@ -28,11 +28,13 @@
 #endif
 
 #include "sd-id128.h"
+#include "sd-event.h"
 
 #include "sparse-endian.h"
 #include "journal-def.h"
 #include "macro.h"
 #include "mmap-cache.h"
+#include "compress.h"
 #include "hashmap.h"
 
 typedef struct JournalMetrics {
@@ -62,6 +64,12 @@ typedef enum LocationType {
         LOCATION_SEEK
 } LocationType;
 
+typedef struct JournalBoot {
+        sd_id128_t id;
+        uint64_t first;
+        uint64_t last;
+} JournalBoot;
+
 typedef struct JournalFile {
         int fd;
 
@@ -72,6 +80,8 @@ typedef struct JournalFile {
         bool writable:1;
         bool compress_xz:1;
         bool compress_lz4:1;
+        bool compress_zstd:1;
+        bool compact:1;
         bool seal:1;
         bool defrag_on_close:1;
 
@@ -80,6 +90,7 @@ typedef struct JournalFile {
         direction_t last_direction;
         LocationType location_type;
         uint64_t last_n_entries;
+        unsigned location_prioq_idx;
 
         char *path;
         struct stat last_stat;
@@ -100,12 +111,37 @@ typedef struct JournalFile {
         MMapCache *mmap;
 
         OrderedHashmap *chain_cache;
+        OrderedHashmap *append_cache;
+
+        /* Boots with entries in this file, as determined by
+         * journal_file_get_boots(), and the number of entries the
+         * file had back then */
+        JournalBoot *boots;
+        size_t n_boots;
+        uint64_t boots_n_entries;
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+        sd_event_source *post_change_timer;
+        usec_t post_change_timer_period;
+
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         void *compress_buffer;
         size_t compress_buffer_size;
 #endif
 
+#ifdef HAVE_ZSTD
+        CompressDict *compress_dict;
+
+        /* Small data objects collected for training the dictionary */
+        void *dict_samples;
+        size_t dict_samples_size;
+        size_t dict_samples_allocated;
+        size_t *dict_sample_sizes;
+        size_t n_dict_samples;
+        size_t n_dict_samples_allocated;
+        bool dict_training_done;
+        sd_event_source *dict_training_event;
+#endif
+
 #ifdef HAVE_GCRYPT
         gcry_md_hd_t hmac;
         bool hmac_running;
@@ -183,17 +219,39 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_COMPRESSED_LZ4(h) \
         (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
 
+#define JOURNAL_HEADER_COMPRESSED_ZSTD(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+
+#define JOURNAL_FILE_COMPRESS(f) \
+        ((f)->compress_xz || (f)->compress_lz4 || (f)->compress_zstd)
+
+#define JOURNAL_HEADER_COMPACT(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPACT))
+
+/* Files with compact entry arrays store 32bit offsets, hence must not grow beyond 4G */
+#define JOURNAL_COMPACT_SIZE_MAX ((uint64_t) UINT32_MAX)
+
 int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset, Object **ret);
+int journal_file_pin_object(JournalFile *f, ObjectType type, MMapWindow **ret);
 
 uint64_t journal_file_entry_n_items(Object *o) _pure_;
-uint64_t journal_file_entry_array_n_items(Object *o) _pure_;
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) _pure_;
 uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
+uint64_t journal_file_entry_index_n_items(Object *o) _pure_;
+uint64_t journal_file_bloom_filter_n_blocks(Object *o) _pure_;
+
+static inline uint64_t journal_file_entry_array_item(JournalFile *f, Object *o, uint64_t i) {
+        return f->compact ? le32toh(o->entry_array.items.compact[i]) : le64toh(o->entry_array.items.regular[i]);
+}
 
 int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqno, Object **ret, uint64_t *offset);
 
+CompressDict* journal_file_compress_dict(JournalFile *f);
+
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
+bool journal_file_bloom_filter_test(JournalFile *f, uint64_t hash);
 
 int journal_file_find_field_object(JournalFile *f, const void *field, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_field_object_with_hash(JournalFile *f, const void *field, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
@@ -205,6 +263,8 @@ int journal_file_next_entry(JournalFile *f, uint64_t p, direction_t direction, O
 
 int journal_file_next_entry_for_data(JournalFile *f, Object *o, uint64_t p, uint64_t data_offset, direction_t direction, Object **ret, uint64_t *offset);
 
+int journal_file_get_boots(JournalFile *f, const JournalBoot **ret, size_t *n);
+
 int journal_file_move_to_entry_by_seqnum(JournalFile *f, uint64_t seqnum, direction_t direction, Object **ret, uint64_t *offset);
 int journal_file_move_to_entry_by_realtime(JournalFile *f, uint64_t realtime, direction_t direction, Object **ret, uint64_t *offset);
 int journal_file_move_to_entry_by_monotonic(JournalFile *f, sd_id128_t boot_id, uint64_t monotonic, direction_t direction, Object **ret, uint64_t *offset);
@@ -214,7 +274,13 @@ int journal_file_move_to_entry_by_seqnum_for_data(JournalFile *f, uint64_t data_
 int journal_file_move_to_entry_by_realtime_for_data(JournalFile *f, uint64_t data_offset, uint64_t realtime, direction_t direction, Object **ret, uint64_t *offset);
 int journal_file_move_to_entry_by_monotonic_for_data(JournalFile *f, uint64_t data_offset, sd_id128_t boot_id, uint64_t monotonic, direction_t direction, Object **ret, uint64_t *offset);
 
+typedef struct JournalCopyCache JournalCopyCache;
+
+JournalCopyCache* journal_copy_cache_new(void);
+JournalCopyCache* journal_copy_cache_free(JournalCopyCache *c);
+
 int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint64_t p, uint64_t *seqnum, Object **ret, uint64_t *offset);
+int journal_file_copy_entry_cached(JournalFile *from, JournalFile *to, Object *o, uint64_t p, JournalCopyCache *cache, uint64_t *seqnum, Object **ret, uint64_t *offset);
 
 void journal_file_dump(JournalFile *f);
 void journal_file_print_header(JournalFile *f);
@@ -222,6 +288,7 @@ void journal_file_print_header(JournalFile *f);
 int journal_file_rotate(JournalFile **f, bool compress, bool seal);
 
 void journal_file_post_change(JournalFile *f);
+int journal_file_enable_post_change_timer(JournalFile *f, sd_event *e, usec_t t);
 
 void journal_default_metrics(JournalMetrics *m, int fd);
 
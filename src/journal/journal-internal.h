@@ -31,12 +31,15 @@
 #include "list.h"
 #include "hashmap.h"
 #include "set.h"
+#include "prioq.h"
 #include "journal-file.h"
+#include "catalog.h"
 #include "sd-journal.h"
 
 typedef struct Match Match;
 typedef struct Location Location;
 typedef struct Directory Directory;
+typedef struct JournalData JournalData;
 
 typedef enum MatchType {
         MATCH_DISCRETE,
@@ -90,6 +93,14 @@ struct sd_journal {
         OrderedHashmap *files;
         MMapCache *mmap;
 
+        /* Files with a candidate entry for the next iteration step,
+         * ordered by the location of that entry */
+        Prioq *files_by_location;
+        direction_t files_by_location_direction;
+
+        /* Files that hit their end, but might still grow */
+        Set *files_at_tail;
+
         Location current_location;
 
         JournalFile *current_file;
@@ -106,6 +117,8 @@ struct sd_journal {
         char *unique_field;
         JournalFile *unique_file;
         uint64_t unique_offset;
+        Set *unique_values; /* Values sd_j_enumerate_unique
+                               already returned */
 
         int flags;
 
@@ -122,12 +135,42 @@ struct sd_journal {
         Hashmap *directories_by_wd;
 
         Set *errors;
+
+        /* Mapped once for sd_journal_get_catalog(), and checked for
+         * replacement at most every CATALOG_CHECK_USEC */
+        Catalog *catalog;
+        usec_t catalog_checked;
 };
 
+/* A reference to the payload of a data object that stays valid
+ * independently of any further calls on the journal object, and even
+ * after it is closed. Uncompressed data is referenced in place, by
+ * pinning the memory map it is located in, compressed data is
+ * decompressed into a buffer of its own. */
+struct JournalData {
+        unsigned n_ref;
+
+        const void *data;
+        size_t size;
+
+        MMapCache *mmap;
+        MMapWindow *window;
+        void *buffer;
+};
+
+JournalData* journal_data_ref(JournalData *d);
+JournalData* journal_data_unref(JournalData *d);
+
+int journal_get_data_ref(sd_journal *j, const char *field, JournalData **ret);
+int journal_enumerate_data_ref(sd_journal *j, JournalData **ret);
+
 char *journal_make_match_string(sd_journal *j);
 void journal_print_header(sd_journal *j);
+int journal_seek_entry(sd_journal *j, JournalFile *f, uint64_t offset);
+int journal_get_boots(sd_journal *j, JournalBoot **ret);
 
 DEFINE_TRIVIAL_CLEANUP_FUNC(sd_journal*, sd_journal_close);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalData*, journal_data_unref);
 #define _cleanup_journal_close_ _cleanup_(sd_journal_closep)
 
 #define JOURNAL_FOREACH_DATA_RETVAL(j, data, l, retval)                     \
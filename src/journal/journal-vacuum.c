@@ -27,6 +27,7 @@
 #include "journal-file.h"
 #include "journal-vacuum.h"
 #include "sd-id128.h"
+#include "hashmap.h"
 #include "util.h"
 
 struct vacuum_info {
@@ -38,13 +39,31 @@ struct vacuum_info {
         uint64_t seqnum;
 
         bool have_seqnum;
+        bool empty;
+
+        unsigned generation;
+};
+
+struct JournalInventory {
+        char *directory;
+
+        /* All archived and corrupted files of the directory we know
+         * of, indexed by file name */
+        Hashmap *files;
+        unsigned generation;
+
+        /* The directory as of the last time we read it, if nothing
+         * can have changed since without touching its mtime */
+        ino_t inode;
+        struct timespec mtime;
+        bool mtime_valid;
 };
 
 static int vacuum_compare(const void *_a, const void *_b) {
         const struct vacuum_info *a, *b;
 
-        a = _a;
-        b = _b;
+        a = *(struct vacuum_info* const*) _a;
+        b = *(struct vacuum_info* const*) _b;
 
         if (a->have_seqnum && b->have_seqnum &&
             sd_id128_equal(a->seqnum_id, b->seqnum_id)) {
@@ -141,189 +160,345 @@ static int journal_file_empty(int dir_fd, const char *name) {
         return le64toh(n_entries) <= 0;
 }
 
-int journal_directory_vacuum(
-                const char *directory,
-                uint64_t max_use,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec,
-                bool verbose) {
+static struct vacuum_info* vacuum_info_free(struct vacuum_info *info) {
+        if (!info)
+                return NULL;
 
-        _cleanup_closedir_ DIR *d = NULL;
-        int r = 0;
-        struct vacuum_info *list = NULL;
-        unsigned n_list = 0, i;
-        size_t n_allocated = 0;
-        uint64_t sum = 0, freed = 0;
-        usec_t retention_limit = 0;
-        char sbytes[FORMAT_BYTES_MAX];
+        free(info->filename);
+        free(info);
+
+        return NULL;
+}
+
+static int vacuum_info_new(int dir_fd, const char *directory, const char *fn, struct vacuum_info **ret) {
+        _cleanup_free_ char *p = NULL;
+        _cleanup_free_ struct vacuum_info *info = NULL;
+        unsigned long long seqnum = 0, realtime;
+        sd_id128_t seqnum_id = {};
+        bool have_seqnum;
+        struct stat st;
+        size_t q;
 
+        assert(dir_fd >= 0);
         assert(directory);
+        assert(fn);
+        assert(ret);
 
-        if (max_use <= 0 && max_retention_usec <= 0)
+        /* Returns 0 if the file is not one we would ever vacuum */
+
+        q = strlen(fn);
+
+        if (endswith(fn, ".journal")) {
+
+                /* Vacuum archived files */
+
+                if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
+                        return 0;
+
+                if (fn[q-8-16-1] != '-' ||
+                    fn[q-8-16-1-16-1] != '-' ||
+                    fn[q-8-16-1-16-1-32-1] != '@')
+                        return 0;
+
+                p = strndup(fn + q-8-16-1-16-1-32, 32);
+                if (!p)
+                        return -ENOMEM;
+
+                if (sd_id128_from_string(p, &seqnum_id) < 0)
+                        return 0;
+
+                if (sscanf(fn + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2)
+                        return 0;
+
+                have_seqnum = true;
+
+        } else if (endswith(fn, ".journal~")) {
+                unsigned long long tmp;
+
+                /* Vacuum corrupted files */
+
+                if (q < 1 + 16 + 1 + 16 + 8 + 1)
+                        return 0;
+
+                if (fn[q-1-8-16-1] != '-' ||
+                    fn[q-1-8-16-1-16-1] != '@')
+                        return 0;
+
+                if (sscanf(fn + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                        return 0;
+
+                have_seqnum = false;
+        } else
+                /* We do not vacuum active files or unknown files! */
                 return 0;
 
-        if (max_retention_usec > 0) {
-                retention_limit = now(CLOCK_REALTIME);
-                if (retention_limit > max_retention_usec)
-                        retention_limit -= max_retention_usec;
-                else
-                        max_retention_usec = retention_limit = 0;
-        }
+        if (fstatat(dir_fd, fn, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return 0;
 
-        d = opendir(directory);
-        if (!d)
+        if (!S_ISREG(st.st_mode))
+                return 0;
+
+        info = new0(struct vacuum_info, 1);
+        if (!info)
+                return -ENOMEM;
+
+        info->filename = strdup(fn);
+        if (!info->filename)
+                return -ENOMEM;
+
+        /* Empty files are always vacuumed, hence there's no need to
+         * figure out how old they are */
+        info->empty = journal_file_empty(dir_fd, fn) != 0;
+        if (!info->empty)
+                patch_realtime(directory, fn, &st, &realtime);
+
+        info->usage = 512UL * (uint64_t) st.st_blocks;
+        info->seqnum = seqnum;
+        info->realtime = realtime;
+        info->seqnum_id = seqnum_id;
+        info->have_seqnum = have_seqnum;
+
+        *ret = info;
+        info = NULL;
+
+        return 1;
+}
+
+JournalInventory* journal_inventory_new(const char *directory) {
+        JournalInventory *inv;
+
+        assert(directory);
+
+        inv = new0(JournalInventory, 1);
+        if (!inv)
+                return NULL;
+
+        inv->directory = strdup(directory);
+        if (!inv->directory)
+                return journal_inventory_free(inv);
+
+        inv->files = hashmap_new(&string_hash_ops);
+        if (!inv->files)
+                return journal_inventory_free(inv);
+
+        return inv;
+}
+
+JournalInventory* journal_inventory_free(JournalInventory *inv) {
+        struct vacuum_info *info;
+
+        if (!inv)
+                return NULL;
+
+        while ((info = hashmap_steal_first(inv->files)))
+                vacuum_info_free(info);
+
+        hashmap_free(inv->files);
+        free(inv->directory);
+        free(inv);
+
+        return NULL;
+}
+
+static void inventory_remove(JournalInventory *inv, struct vacuum_info *info) {
+        assert_se(hashmap_remove(inv->files, info->filename) == info);
+        vacuum_info_free(info);
+
+        /* We just modified the directory ourselves */
+        inv->mtime_valid = false;
+}
+
+static int inventory_refresh(JournalInventory *inv, DIR *d) {
+        struct vacuum_info *info;
+        struct stat st;
+        Iterator i;
+        int r;
+
+        assert(inv);
+        assert(d);
+
+        /* Brings the list of files up-to-date with the directory. Only
+         * files we haven't seen before are looked at in detail, the
+         * ones we know about already are archived and don't change
+         * anymore. */
+
+        if (fstat(dirfd(d), &st) < 0)
                 return -errno;
 
+        if (inv->mtime_valid &&
+            inv->inode == st.st_ino &&
+            inv->mtime.tv_sec == st.st_mtim.tv_sec &&
+            inv->mtime.tv_nsec == st.st_mtim.tv_nsec)
+                return 0;
+
+        inv->generation++;
+
         for (;;) {
                 struct dirent *de;
-                size_t q;
-                struct stat st;
-                char *p;
-                unsigned long long seqnum = 0, realtime;
-                sd_id128_t seqnum_id;
-                bool have_seqnum;
 
                 errno = 0;
                 de = readdir(d);
-                if (!de && errno != 0) {
-                        r = -errno;
-                        goto finish;
-                }
+                if (!de && errno != 0)
+                        return -errno;
 
                 if (!de)
                         break;
 
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
-                        continue;
+                info = hashmap_get(inv->files, de->d_name);
+                if (!info) {
+                        r = vacuum_info_new(dirfd(d), inv->directory, de->d_name, &info);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                continue;
 
-                if (!S_ISREG(st.st_mode))
-                        continue;
+                        r = hashmap_put(inv->files, info->filename, info);
+                        if (r < 0) {
+                                vacuum_info_free(info);
+                                return r;
+                        }
+                }
 
-                q = strlen(de->d_name);
+                info->generation = inv->generation;
+        }
 
-                if (endswith(de->d_name, ".journal")) {
+        /* Forget about everything that has been removed behind our back */
+        HASHMAP_FOREACH(info, inv->files, i)
+                if (info->generation != inv->generation) {
+                        hashmap_remove(inv->files, info->filename);
+                        vacuum_info_free(info);
+                }
 
-                        /* Vacuum archived files */
+        /* If the directory was modified within the last second, further
+         * changes might not result in a different timestamp, hence
+         * only trust it if it is older than that. */
+        inv->inode = st.st_ino;
+        inv->mtime = st.st_mtim;
+        inv->mtime_valid = timespec_load(&st.st_mtim) + USEC_PER_SEC < now(CLOCK_REALTIME);
 
-                        if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
-                                continue;
+        return 0;
+}
 
-                        if (de->d_name[q-8-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1-32-1] != '@')
-                                continue;
+int journal_inventory_vacuum(
+                JournalInventory *inv,
+                uint64_t max_use,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                uint64_t *ret_freed,
+                bool verbose) {
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+        _cleanup_closedir_ DIR *d = NULL;
+        _cleanup_free_ struct vacuum_info **list = NULL;
+        struct vacuum_info *info;
+        unsigned n_list = 0, i;
+        uint64_t sum = 0, freed = 0;
+        usec_t retention_limit = 0;
+        char sbytes[FORMAT_BYTES_MAX];
+        Iterator j;
+        int r;
 
-                        de->d_name[q-8-16-1-16-1] = 0;
-                        if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                free(p);
-                                continue;
-                        }
+        assert(inv);
 
-                        if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                free(p);
-                                continue;
-                        }
+        if (max_use <= 0 && max_retention_usec <= 0)
+                return 0;
 
-                        have_seqnum = true;
+        if (max_retention_usec > 0) {
+                retention_limit = now(CLOCK_REALTIME);
+                if (retention_limit > max_retention_usec)
+                        retention_limit -= max_retention_usec;
+                else
+                        max_retention_usec = retention_limit = 0;
+        }
 
-                } else if (endswith(de->d_name, ".journal~")) {
-                        unsigned long long tmp;
+        d = opendir(inv->directory);
+        if (!d)
+                return -errno;
 
-                        /* Vacuum corrupted files */
+        r = inventory_refresh(inv, d);
+        if (r < 0)
+                goto finish;
 
-                        if (q < 1 + 16 + 1 + 16 + 8 + 1)
-                                continue;
+        list = new(struct vacuum_info*, hashmap_size(inv->files));
+        if (!list) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
-                        if (de->d_name[q-1-8-16-1] != '-' ||
-                            de->d_name[q-1-8-16-1-16-1] != '@')
-                                continue;
+        HASHMAP_FOREACH(info, inv->files, j) {
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                if (info->empty) {
+                        /* Always vacuum empty non-online files. */
 
-                        if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                free(p);
+                        if (unlinkat(dirfd(d), info->filename, 0) >= 0) {
+                                log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted empty archived journal %s/%s (%s).", inv->directory, info->filename, format_bytes(sbytes, sizeof(sbytes), info->usage));
+                                freed += info->usage;
+                        } else if (errno != ENOENT) {
+                                log_warning_errno(errno, "Failed to delete empty archived journal %s/%s: %m", inv->directory, info->filename);
                                 continue;
                         }
 
-                        have_seqnum = false;
-                } else
-                        /* We do not vacuum active files or unknown files! */
-                        continue;
-
-                if (journal_file_empty(dirfd(d), p)) {
-                        /* Always vacuum empty non-online files. */
-
-                        uint64_t size = 512UL * (uint64_t) st.st_blocks;
-
-                        if (unlinkat(dirfd(d), p, 0) >= 0) {
-                                log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted empty archived journal %s/%s (%s).", directory, p, format_bytes(sbytes, sizeof(sbytes), size));
-                                freed += size;
-                        } else if (errno != ENOENT)
-                                log_warning_errno(errno, "Failed to delete empty archived journal %s/%s: %m", directory, p);
-
-                        free(p);
+                        inventory_remove(inv, info);
                         continue;
                 }
 
-                patch_realtime(directory, p, &st, &realtime);
-
-                if (!GREEDY_REALLOC(list, n_allocated, n_list + 1)) {
-                        free(p);
-                        r = -ENOMEM;
-                        goto finish;
-                }
-
-                list[n_list].filename = p;
-                list[n_list].usage = 512UL * (uint64_t) st.st_blocks;
-                list[n_list].seqnum = seqnum;
-                list[n_list].realtime = realtime;
-                list[n_list].seqnum_id = seqnum_id;
-                list[n_list].have_seqnum = have_seqnum;
-
-                sum += list[n_list].usage;
-
-                n_list ++;
+                list[n_list++] = info;
+                sum += info->usage;
         }
 
-        qsort_safe(list, n_list, sizeof(struct vacuum_info), vacuum_compare);
+        qsort_safe(list, n_list, sizeof(struct vacuum_info*), vacuum_compare);
 
         for (i = 0; i < n_list; i++) {
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
+                if ((max_retention_usec <= 0 || list[i]->realtime >= retention_limit) &&
                     (max_use <= 0 || sum <= max_use))
                         break;
 
-                if (unlinkat(dirfd(d), list[i].filename, 0) >= 0) {
-                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", directory, list[i].filename, format_bytes(sbytes, sizeof(sbytes), list[i].usage));
-                        freed += list[i].usage;
+                if (unlinkat(dirfd(d), list[i]->filename, 0) >= 0) {
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", inv->directory, list[i]->filename, format_bytes(sbytes, sizeof(sbytes), list[i]->usage));
+                        freed += list[i]->usage;
 
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
+                        if (list[i]->usage < sum)
+                                sum -= list[i]->usage;
                         else
                                 sum = 0;
 
-                } else if (errno != ENOENT)
-                        log_warning_errno(errno, "Failed to delete archived journal %s/%s: %m", directory, list[i].filename);
+                } else if (errno != ENOENT) {
+                        log_warning_errno(errno, "Failed to delete archived journal %s/%s: %m", inv->directory, list[i]->filename);
+                        continue;
+                }
+
+                inventory_remove(inv, list[i]);
+                list[i] = NULL;
         }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i]->realtime < *oldest_usec))
+                *oldest_usec = list[i]->realtime;
 
 finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        if (ret_freed)
+                *ret_freed += freed;
 
         log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals on disk.", format_bytes(sbytes, sizeof(sbytes), freed));
 
         return r;
 }
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_(journal_inventory_freep) JournalInventory *inv = NULL;
+
+        assert(directory);
+
+        if (max_use <= 0 && max_retention_usec <= 0)
+                return 0;
+
+        inv = journal_inventory_new(directory);
+        if (!inv)
+                return -ENOMEM;
+
+        return journal_inventory_vacuum(inv, max_use, max_retention_usec, oldest_usec, NULL, verbose);
+}
@@ -22,4 +22,18 @@
 ***/
 
 
+#include "macro.h"
+#include "time-util.h"
+
+typedef struct JournalInventory JournalInventory;
+
+/* Remembers the archived files of a directory between vacuuming
+ * runs, so that only files that showed up since need to be looked
+ * at again */
+JournalInventory* journal_inventory_new(const char *directory);
+JournalInventory* journal_inventory_free(JournalInventory *inv);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalInventory*, journal_inventory_free);
+
+int journal_inventory_vacuum(JournalInventory *inv, uint64_t max_use, usec_t max_retention_usec, usec_t *oldest_usec, uint64_t *freed, bool verbose);
+
 int journal_directory_vacuum(const char *directory, uint64_t max_use, usec_t max_retention_usec, usec_t *oldest_usec, bool vacuum);
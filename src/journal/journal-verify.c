@@ -23,6 +23,8 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "util.h"
 #include "macro.h"
@@ -34,11 +36,15 @@
 #include "compress.h"
 #include "terminal-util.h"
 
+/* Set on the threads helping with the verification, only the one
+ * which started it draws the progress bar */
+static thread_local bool progress_hidden = false;
+
 static void draw_progress(uint64_t p, usec_t *last_usec) {
         unsigned n, i, j, k;
         usec_t z, x;
 
-        if (!on_tty())
+        if (progress_hidden || !on_tty())
                 return;
 
         z = now(CLOCK_MONOTONIC);
@@ -72,7 +78,7 @@ static void draw_progress(uint64_t p, usec_t *last_usec) {
 static void flush_progress(void) {
         unsigned n, i;
 
-        if (!on_tty())
+        if (progress_hidden || !on_tty())
                 return;
 
         n = (3 * columns()) / 4;
@@ -101,6 +107,45 @@ static void flush_progress(void) {
                 log_error(OFSfmt": " _fmt, (uint64_t)_offset, ##__VA_ARGS__); \
         } while(0)
 
+typedef struct VerifyProgress {
+        bool show;
+        usec_t last_usec;
+
+        /* The second pass is split in two halves, which might run on
+         * separate threads. Each records how far it got here, out of
+         * 0x3FFF, but only the main thread draws. Both this and the
+         * abort flag are only accessed atomically. */
+        unsigned second_pass[2];
+
+        /* Set when one of the halves failed, so that the other one
+         * doesn't need to continue */
+        bool abort;
+} VerifyProgress;
+
+static void progress_set_second_pass(VerifyProgress *progress, unsigned half, uint64_t i, uint64_t n) {
+        __atomic_store_n(&progress->second_pass[half], (unsigned) (0x3FFF * i / n), __ATOMIC_RELAXED);
+}
+
+static void progress_abort(VerifyProgress *progress) {
+        __atomic_store_n(&progress->abort, true, __ATOMIC_RELAXED);
+}
+
+static bool progress_aborted(VerifyProgress *progress) {
+        return __atomic_load_n(&progress->abort, __ATOMIC_RELAXED);
+}
+
+static void draw_second_pass(VerifyProgress *progress) {
+        unsigned a, b;
+
+        if (!progress->show)
+                return;
+
+        a = __atomic_load_n(&progress->second_pass[0], __ATOMIC_RELAXED);
+        b = __atomic_load_n(&progress->second_pass[1], __ATOMIC_RELAXED);
+
+        draw_progress(0x8000 + a + b, &progress->last_usec);
+}
+
 static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o) {
         uint64_t i;
 
@@ -112,7 +157,7 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
          * possible field values. It does not follow any references to
          * other objects. */
 
-        if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
+        if ((o->object.flags & OBJECT_COMPRESSION_MASK) &&
             o->object.type != OBJECT_DATA)
                 return -EBADMSG;
 
@@ -147,7 +192,8 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         r = decompress_blob(compression,
                                             o->data.payload,
                                             le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &alloc, &b_size, 0);
+                                            &b, &alloc, &b_size, 0,
+                                            journal_file_compress_dict(f));
                         if (r < 0) {
                                 error(offset, "%s decompression failed: %s",
                                       object_compressed_to_string(compression), strerror(-r));
@@ -293,8 +339,8 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 break;
 
         case OBJECT_ENTRY_ARRAY:
-                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % sizeof(le64_t) != 0 ||
-                    (le64toh(o->object.size) - offsetof(EntryArrayObject, items)) / sizeof(le64_t) <= 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % (f->compact ? sizeof(le32_t) : sizeof(le64_t)) != 0 ||
+                    journal_file_entry_array_n_items(f, o) <= 0) {
                         error(offset,
                               "invalid object entry array size: %"PRIu64,
                               le64toh(o->object.size));
@@ -308,13 +354,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_array_n_items(o); i++)
-                        if (le64toh(o->entry_array.items[i]) != 0 &&
-                            !VALID64(le64toh(o->entry_array.items[i]))) {
+                for (i = 0; i < journal_file_entry_array_n_items(f, o); i++)
+                        if (journal_file_entry_array_item(f, o, i) != 0 &&
+                            !VALID64(journal_file_entry_array_item(f, o, i))) {
                                 error(offset,
                                       "invalid object entry array item (%"PRIu64"/%"PRIu64"): "OFSfmt,
-                                      i, journal_file_entry_array_n_items(o),
-                                      le64toh(o->entry_array.items[i]));
+                                      i, journal_file_entry_array_n_items(f, o),
+                                      journal_file_entry_array_item(f, o, i));
                                 return -EBADMSG;
                         }
 
@@ -335,62 +381,240 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_ENTRY_INDEX:
+                if ((le64toh(o->object.size) - offsetof(EntryIndexObject, items)) % sizeof(EntryIndexItem) != 0 ||
+                    (le64toh(o->object.size) - offsetof(EntryIndexObject, items)) / sizeof(EntryIndexItem) <= 0) {
+                        error(offset,
+                              "invalid object entry index size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                if (le64toh(o->entry_index.stride) <= 0 ||
+                    journal_file_entry_index_n_items(o) != DIV_ROUND_UP(le64toh(o->entry_index.n_entries), le64toh(o->entry_index.stride))) {
+                        error(offset,
+                              "invalid object entry index stride: %"PRIu64,
+                              le64toh(o->entry_index.stride));
+                        return -EBADMSG;
+                }
+
+                for (i = 0; i < journal_file_entry_index_n_items(o); i++)
+                        if (!VALID64(le64toh(o->entry_index.items[i].entry_array_offset)) ||
+                            le64toh(o->entry_index.items[i].entry_array_offset) == 0 ||
+                            !VALID_REALTIME(le64toh(o->entry_index.items[i].realtime))) {
+                                error(offset,
+                                      "invalid object entry index item (%"PRIu64"/%"PRIu64"): "OFSfmt,
+                                      i, journal_file_entry_index_n_items(o),
+                                      le64toh(o->entry_index.items[i].entry_array_offset));
+                                return -EBADMSG;
+                        }
+
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "bad dictionary size (<= %zu): %"PRIu64,
+                              offsetof(DictionaryObject, payload),
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                if (!JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                        error(offset, "dictionary in file without ZSTD compression");
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                if ((le64toh(o->object.size) - offsetof(BloomFilterObject, bits)) % BLOOM_FILTER_BLOCK_SIZE != 0 ||
+                    journal_file_bloom_filter_n_blocks(o) <= 0) {
+                        error(offset,
+                              "invalid object bloom filter size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                if (le64toh(o->bloom_filter.n_hashes) <= 0 ||
+                    le64toh(o->bloom_filter.n_hashes) > BLOOM_FILTER_BLOCK_SIZE * 8) {
+                        error(offset,
+                              "invalid object bloom filter hash count: %"PRIu64,
+                              le64toh(o->bloom_filter.n_hashes));
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
         return 0;
 }
 
-static int write_uint64(int fd, uint64_t p) {
-        ssize_t k;
+/* How many offsets we buffer before writing them out, once an index
+ * has been moved to a temporary file */
+#define OFFSET_INDEX_BUFFER 8192
+
+/* The offsets of all objects of one type, as found by the first pass
+ * over the file, hence sorted. The second pass looks references up
+ * in them. An index is kept in memory, unless it grows too large, in
+ * which case it is moved to a temporary file, and mapped into memory
+ * again once complete. */
+typedef struct OffsetIndex {
+        uint64_t *items;
+        uint64_t n_items;
+        size_t n_allocated;
+        uint64_t memory_max;
+
+        int fd;
+        size_t n_buffered;
+        bool mapped;
+} OffsetIndex;
+
+static void offset_index_init(OffsetIndex *x) {
+        assert(x);
+
+        zero(*x);
+        x->fd = -1;
+
+        /* Three of these are used per file, and several files might
+         * be verified at the same time */
+        x->memory_max = physical_memory() / 64;
+}
+
+static void offset_index_done(OffsetIndex *x) {
+        assert(x);
 
-        k = write(fd, &p, sizeof(p));
-        if (k < 0)
-                return -errno;
-        if (k != sizeof(p))
-                return -EIO;
+        if (x->mapped)
+                munmap(x->items, x->n_items * sizeof(uint64_t));
+        else
+                free(x->items);
+
+        safe_close(x->fd);
+        offset_index_init(x);
+}
 
+static int offset_index_flush(OffsetIndex *x) {
+        int r;
+
+        assert(x);
+        assert(x->fd >= 0);
+
+        r = loop_write(x->fd, x->items, x->n_buffered * sizeof(uint64_t), false);
+        if (r < 0)
+                return r;
+
+        x->n_buffered = 0;
         return 0;
 }
 
-static int contains_uint64(MMapCache *m, int fd, uint64_t n, uint64_t p) {
-        uint64_t a, b;
+static int offset_index_spill(OffsetIndex *x) {
         int r;
 
-        assert(m);
-        assert(fd >= 0);
+        assert(x);
+        assert(x->fd < 0);
 
-        /* Bisection ... */
+        x->fd = open_tmpfile("/var/tmp", O_RDWR|O_CLOEXEC);
+        if (x->fd < 0)
+                return log_error_errno(x->fd, "Failed to create index file: %m");
 
-        a = 0; b = n;
-        while (a < b) {
-                uint64_t c, *z;
+        x->n_buffered = x->n_items;
+        r = offset_index_flush(x);
+        if (r < 0)
+                return r;
 
-                c = (a + b) / 2;
+        free(x->items);
+        x->items = new(uint64_t, OFFSET_INDEX_BUFFER);
+        if (!x->items)
+                return -ENOMEM;
 
-                r = mmap_cache_get(m, fd, PROT_READ|PROT_WRITE, 0, false, c * sizeof(uint64_t), sizeof(uint64_t), NULL, (void **) &z);
+        return 0;
+}
+
+static int offset_index_add(OffsetIndex *x, uint64_t p) {
+        int r;
+
+        assert(x);
+
+        if (x->fd < 0) {
+                if ((x->n_items + 1) * sizeof(uint64_t) <= x->memory_max &&
+                    GREEDY_REALLOC(x->items, x->n_allocated, x->n_items + 1)) {
+                        x->items[x->n_items++] = p;
+                        return 0;
+                }
+
+                r = offset_index_spill(x);
                 if (r < 0)
                         return r;
+        }
 
-                if (*z == p)
-                        return 1;
+        if (x->n_buffered >= OFFSET_INDEX_BUFFER) {
+                r = offset_index_flush(x);
+                if (r < 0)
+                        return r;
+        }
 
-                if (a + 1 >= b)
-                        return 0;
+        x->items[x->n_buffered++] = p;
+        x->n_items++;
+
+        return 0;
+}
+
+static int offset_index_seal(OffsetIndex *x) {
+        void *m;
+        int r;
+
+        assert(x);
+
+        if (x->fd < 0)
+                return 0;
+
+        r = offset_index_flush(x);
+        if (r < 0)
+                return r;
+
+        free(x->items);
+        x->items = NULL;
+
+        m = mmap(NULL, x->n_items * sizeof(uint64_t), PROT_READ, MAP_SHARED, x->fd, 0);
+        if (m == MAP_FAILED)
+                return log_error_errno(errno, "Failed to map index file: %m");
+
+        x->items = m;
+        x->mapped = true;
+
+        return 0;
+}
+
+static bool offset_index_contains(const OffsetIndex *x, uint64_t p) {
+        uint64_t a, b;
 
-                if (p < *z)
+        assert(x);
+
+        /* Bisection ... */
+
+        a = 0; b = x->n_items;
+        while (a < b) {
+                uint64_t c;
+
+                c = (a + b) / 2;
+
+                if (x->items[c] == p)
+                        return true;
+
+                if (p < x->items[c])
                         b = c;
                 else
-                        a = c;
+                        a = c + 1;
         }
 
-        return 0;
+        return false;
 }
 
 static int entry_points_to_data(
                 JournalFile *f,
-                int entry_fd,
-                uint64_t n_entries,
+                const OffsetIndex *entries,
                 uint64_t entry_p,
                 uint64_t data_p) {
 
@@ -400,9 +624,9 @@ static int entry_points_to_data(
         bool found = false;
 
         assert(f);
-        assert(entry_fd >= 0);
+        assert(entries);
 
-        if (!contains_uint64(f->mmap, entry_fd, n_entries, entry_p)) {
+        if (!offset_index_contains(entries, entry_p)) {
                 error(data_p,
                       "data object references invalid entry at "OFSfmt, entry_p);
                 return -EBADMSG;
@@ -440,10 +664,10 @@ static int entry_points_to_data(
                 if (r < 0)
                         return r;
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 u = MIN(n - i, m);
 
-                if (entry_p <= le64toh(o->entry_array.items[u-1])) {
+                if (entry_p <= journal_file_entry_array_item(f, o, u-1)) {
                         uint64_t x, y, z;
 
                         x = 0;
@@ -452,13 +676,13 @@ static int entry_points_to_data(
                         while (x < y) {
                                 z = (x + y) / 2;
 
-                                if (le64toh(o->entry_array.items[z]) == entry_p)
+                                if (journal_file_entry_array_item(f, o, z) == entry_p)
                                         return 0;
 
                                 if (x + 1 >= y)
                                         break;
 
-                                if (entry_p < le64toh(o->entry_array.items[z]))
+                                if (entry_p < journal_file_entry_array_item(f, o, z))
                                         y = z;
                                 else
                                         x = z;
@@ -478,16 +702,16 @@ static int entry_points_to_data(
 static int verify_data(
                 JournalFile *f,
                 Object *o, uint64_t p,
-                int entry_fd, uint64_t n_entries,
-                int entry_array_fd, uint64_t n_entry_arrays) {
+                const OffsetIndex *entries,
+                const OffsetIndex *entry_arrays) {
 
         uint64_t i, n, a, last, q;
         int r;
 
         assert(f);
         assert(o);
-        assert(entry_fd >= 0);
-        assert(entry_array_fd >= 0);
+        assert(entries);
+        assert(entry_arrays);
 
         n = le64toh(o->data.n_entries);
         a = le64toh(o->data.entry_array_offset);
@@ -507,7 +731,7 @@ static int verify_data(
         assert(o->data.entry_offset);
 
         last = q = le64toh(o->data.entry_offset);
-        r = entry_points_to_data(f, entry_fd, n_entries, q, p);
+        r = entry_points_to_data(f, entries, q, p);
         if (r < 0)
                 return r;
 
@@ -520,7 +744,7 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_index_contains(entry_arrays, a)) {
                         error(p, "invalid array offset "OFSfmt, a);
                         return -EBADMSG;
                 }
@@ -536,17 +760,17 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
 
-                        q = le64toh(o->entry_array.items[j]);
+                        q = journal_file_entry_array_item(f, o, j);
                         if (q <= last) {
                                 error(p, "data object's entry array not sorted");
                                 return -EBADMSG;
                         }
                         last = q;
 
-                        r = entry_points_to_data(f, entry_fd, n_entries, q, p);
+                        r = entry_points_to_data(f, entries, q, p);
                         if (r < 0)
                                 return r;
 
@@ -564,34 +788,38 @@ static int verify_data(
 
 static int verify_hash_table(
                 JournalFile *f,
-                int data_fd, uint64_t n_data,
-                int entry_fd, uint64_t n_entries,
-                int entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
+                const OffsetIndex *data,
+                const OffsetIndex *entries,
+                const OffsetIndex *entry_arrays,
+                VerifyProgress *progress,
+                bool draw) {
 
         uint64_t i, n;
         int r;
 
         assert(f);
-        assert(data_fd >= 0);
-        assert(entry_fd >= 0);
-        assert(entry_array_fd >= 0);
-        assert(last_usec);
+        assert(data);
+        assert(entries);
+        assert(entry_arrays);
+        assert(progress);
 
         n = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
         for (i = 0; i < n; i++) {
                 uint64_t last = 0, p;
 
-                if (show_progress)
-                        draw_progress(0xC000 + (0x3FFF * i / n), last_usec);
+                if (progress_aborted(progress))
+                        return -ECANCELED;
+
+                progress_set_second_pass(progress, 1, i, n);
+                if (draw)
+                        draw_second_pass(progress);
 
                 p = le64toh(f->data_hash_table[i].head_hash_offset);
                 while (p != 0) {
                         Object *o;
                         uint64_t next;
 
-                        if (!contains_uint64(f->mmap, data_fd, n_data, p)) {
+                        if (!offset_index_contains(data, p)) {
                                 error(p, "invalid data object at hash entry %"PRIu64" of %"PRIu64,
                                       i, n);
                                 return -EBADMSG;
@@ -614,7 +842,7 @@ static int verify_hash_table(
                                 return -EBADMSG;
                         }
 
-                        r = verify_data(f, o, p, entry_fd, n_entries, entry_array_fd, n_entry_arrays);
+                        r = verify_data(f, o, p, entries, entry_arrays);
                         if (r < 0)
                                 return r;
 
@@ -659,14 +887,14 @@ static int data_object_in_hash_table(JournalFile *f, uint64_t hash, uint64_t p)
 static int verify_entry(
                 JournalFile *f,
                 Object *o, uint64_t p,
-                int data_fd, uint64_t n_data) {
+                const OffsetIndex *data) {
 
         uint64_t i, n;
         int r;
 
         assert(f);
         assert(o);
-        assert(data_fd >= 0);
+        assert(data);
 
         n = journal_file_entry_n_items(o);
         for (i = 0; i < n; i++) {
@@ -676,10 +904,10 @@ static int verify_entry(
                 q = le64toh(o->entry.items[i].object_offset);
                 h = le64toh(o->entry.items[i].hash);
 
-                if (!contains_uint64(f->mmap, data_fd, n_data, q)) {
+                if (!offset_index_contains(data, q)) {
                         error(p, "invalid data object of entry");
-                                return -EBADMSG;
-                        }
+                        return -EBADMSG;
+                }
 
                 r = journal_file_move_to_object(f, OBJECT_DATA, q, &u);
                 if (r < 0)
@@ -704,20 +932,20 @@ static int verify_entry(
 
 static int verify_entry_array(
                 JournalFile *f,
-                int data_fd, uint64_t n_data,
-                int entry_fd, uint64_t n_entries,
-                int entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
+                const OffsetIndex *data,
+                const OffsetIndex *entries,
+                const OffsetIndex *entry_arrays,
+                VerifyProgress *progress,
+                bool draw) {
 
         uint64_t i = 0, a, n, last = 0;
         int r;
 
         assert(f);
-        assert(data_fd >= 0);
-        assert(entry_fd >= 0);
-        assert(entry_array_fd >= 0);
-        assert(last_usec);
+        assert(data);
+        assert(entries);
+        assert(entry_arrays);
+        assert(progress);
 
         n = le64toh(f->header->n_entries);
         a = le64toh(f->header->entry_array_offset);
@@ -725,15 +953,19 @@ static int verify_entry_array(
                 uint64_t next, m, j;
                 Object *o;
 
-                if (show_progress)
-                        draw_progress(0x8000 + (0x3FFF * i / n), last_usec);
+                if (progress_aborted(progress))
+                        return -ECANCELED;
+
+                progress_set_second_pass(progress, 0, i, n);
+                if (draw)
+                        draw_second_pass(progress);
 
                 if (a == 0) {
                         error(a, "array chain too short at %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_index_contains(entry_arrays, a)) {
                         error(a, "invalid array %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
@@ -750,11 +982,11 @@ static int verify_entry_array(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
                         uint64_t p;
 
-                        p = le64toh(o->entry_array.items[j]);
+                        p = journal_file_entry_array_item(f, o, j);
                         if (p <= last) {
                                 error(a, "entry array not sorted at %"PRIu64" of %"PRIu64,
                                       i, n);
@@ -762,7 +994,7 @@ static int verify_entry_array(
                         }
                         last = p;
 
-                        if (!contains_uint64(f->mmap, entry_fd, n_entries, p)) {
+                        if (!offset_index_contains(entries, p)) {
                                 error(a, "invalid array entry at %"PRIu64" of %"PRIu64,
                                       i, n);
                                 return -EBADMSG;
@@ -772,7 +1004,7 @@ static int verify_entry_array(
                         if (r < 0)
                                 return r;
 
-                        r = verify_entry(f, o, p, data_fd, n_data);
+                        r = verify_entry(f, o, p, data);
                         if (r < 0)
                                 return r;
 
@@ -788,6 +1020,187 @@ static int verify_entry_array(
         return 0;
 }
 
+static int verify_entry_index(
+                JournalFile *f,
+                const OffsetIndex *entries,
+                const OffsetIndex *entry_arrays) {
+
+        uint64_t p, stride, i, m;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(entries);
+        assert(entry_arrays);
+
+        p = le64toh(f->header->entry_index_offset);
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY_INDEX, p, &o);
+        if (r < 0)
+                return r;
+
+        if (le64toh(o->entry_index.n_entries) != le64toh(f->header->n_entries)) {
+                error(p, "entry index covers %"PRIu64" entries, but file has %"PRIu64,
+                      le64toh(o->entry_index.n_entries), le64toh(f->header->n_entries));
+                return -EBADMSG;
+        }
+
+        stride = le64toh(o->entry_index.stride);
+        m = journal_file_entry_index_n_items(o);
+
+        for (i = 0; i < m; i++) {
+                uint64_t a, begin, q, seqnum, realtime;
+                Object *e;
+
+                a = le64toh(o->entry_index.items[i].entry_array_offset);
+                begin = le64toh(o->entry_index.items[i].entry_array_begin);
+                seqnum = le64toh(o->entry_index.items[i].seqnum);
+                realtime = le64toh(o->entry_index.items[i].realtime);
+
+                if (!offset_index_contains(entry_arrays, a)) {
+                        error(p, "invalid entry index array at %"PRIu64" of %"PRIu64, i, m);
+                        return -EBADMSG;
+                }
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &e);
+                if (r < 0)
+                        return r;
+
+                if (i * stride < begin ||
+                    i * stride - begin >= journal_file_entry_array_n_items(f, e)) {
+                        error(p, "entry index item %"PRIu64" of %"PRIu64" outside of its array", i, m);
+                        return -EBADMSG;
+                }
+
+                q = journal_file_entry_array_item(f, e, i * stride - begin);
+                if (!offset_index_contains(entries, q)) {
+                        error(p, "invalid entry index entry at %"PRIu64" of %"PRIu64, i, m);
+                        return -EBADMSG;
+                }
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY, q, &e);
+                if (r < 0)
+                        return r;
+
+                if (le64toh(e->entry.seqnum) != seqnum ||
+                    le64toh(e->entry.realtime) != realtime) {
+                        error(p, "entry index item %"PRIu64" of %"PRIu64" doesn't match entry "OFSfmt, i, m, q);
+                        return -EBADMSG;
+                }
+
+                /* Pointer might have moved, reposition */
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_INDEX, p, &o);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+typedef struct HashTableVerify {
+        JournalFile *f;
+        const OffsetIndex *data;
+        const OffsetIndex *entries;
+        const OffsetIndex *entry_arrays;
+        VerifyProgress *progress;
+        int r;
+} HashTableVerify;
+
+static void *verify_hash_table_thread(void *userdata) {
+        HashTableVerify *v = userdata;
+
+        progress_hidden = true;
+
+        v->r = verify_hash_table(v->f, v->data, v->entries, v->entry_arrays, v->progress, false);
+        if (v->r < 0)
+                progress_abort(v->progress);
+
+        return NULL;
+}
+
+static int verify_references(
+                JournalFile *f,
+                const OffsetIndex *data,
+                const OffsetIndex *entries,
+                const OffsetIndex *entry_arrays,
+                VerifyProgress *progress) {
+
+        HashTableVerify v = {
+                .data = data,
+                .entries = entries,
+                .entry_arrays = entry_arrays,
+                .progress = progress,
+        };
+        sigset_t fullset, saved;
+        pthread_t thread;
+        int r;
+
+        /* Everything referenced from the entry array and from the
+         * data hash table can be checked independently. The hash
+         * table is followed on a thread of its own, through a second
+         * instance of the file, since neither JournalFile objects nor
+         * their mmap caches may be used by two threads at once. */
+
+        r = journal_file_open(f->path, O_RDONLY, 0, false, false, NULL, NULL, NULL, &v.f);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to open %s a second time, not verifying in parallel: %m", f->path);
+                goto sequential;
+        }
+
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+        r = -pthread_create(&thread, NULL, verify_hash_table_thread, &v);
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+        if (r < 0) {
+                log_debug_errno(r, "Failed to start thread, not verifying in parallel: %m");
+                journal_file_close(v.f);
+                goto sequential;
+        }
+
+        r = verify_entry_array(f, data, entries, entry_arrays, progress, true);
+        if (r < 0)
+                progress_abort(progress);
+
+        /* Keep the progress bar going while we wait for the other
+         * half, unless it failed and is telling us why */
+        for (;;) {
+                struct timespec ts;
+                int k;
+
+                if (!progress->show || progress_aborted(progress)) {
+                        assert_se(pthread_join(thread, NULL) == 0);
+                        break;
+                }
+
+                timespec_store(&ts, now(CLOCK_REALTIME) + 40 * USEC_PER_MSEC);
+                k = pthread_timedjoin_np(thread, NULL, &ts);
+                if (k != ETIMEDOUT) {
+                        assert_se(k == 0);
+                        break;
+                }
+
+                draw_second_pass(progress);
+        }
+
+        journal_file_close(v.f);
+
+        /* If we have been told to stop, the other half has the error */
+        if (r < 0 && r != -ECANCELED)
+                return r;
+
+        return v.r;
+
+sequential:
+        r = verify_entry_array(f, data, entries, entry_arrays, progress, true);
+        if (r < 0)
+                return r;
+
+        return verify_hash_table(f, data, entries, entry_arrays, progress, true);
+}
+
 int journal_file_verify(
                 JournalFile *f,
                 const char *key,
@@ -799,10 +1212,12 @@ int journal_file_verify(
 
         uint64_t entry_seqnum = 0, entry_monotonic = 0, entry_realtime = 0;
         sd_id128_t entry_boot_id;
-        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
+        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false, found_entry_index = false, found_dictionary = false, found_bloom_filter = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
-        usec_t last_usec = 0;
-        int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
+        VerifyProgress progress = {
+                .show = show_progress,
+        };
+        OffsetIndex data, entries, entry_arrays;
         unsigned i;
         bool found_last = false;
 #ifdef HAVE_GCRYPT
@@ -810,6 +1225,10 @@ int journal_file_verify(
 #endif
         assert(f);
 
+        offset_index_init(&data);
+        offset_index_init(&entries);
+        offset_index_init(&entry_arrays);
+
         if (key) {
 #ifdef HAVE_GCRYPT
                 r = journal_file_parse_verification_key(f, key);
@@ -823,27 +1242,6 @@ int journal_file_verify(
         } else if (f->seal)
                 return -ENOKEY;
 
-        data_fd = open_tmpfile("/var/tmp", O_RDWR | O_CLOEXEC);
-        if (data_fd < 0) {
-                log_error_errno(errno, "Failed to create data file: %m");
-                r = -errno;
-                goto fail;
-        }
-
-        entry_fd = open_tmpfile("/var/tmp", O_RDWR | O_CLOEXEC);
-        if (entry_fd < 0) {
-                log_error_errno(errno, "Failed to create entry file: %m");
-                r = -errno;
-                goto fail;
-        }
-
-        entry_array_fd = open_tmpfile("/var/tmp", O_RDWR | O_CLOEXEC);
-        if (entry_array_fd < 0) {
-                log_error_errno(errno, "Failed to create entry array file: %m");
-                r = -errno;
-                goto fail;
-        }
-
         if (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED) {
                 log_error("Cannot verify file with unknown extensions.");
                 r = -EOPNOTSUPP;
@@ -863,7 +1261,7 @@ int journal_file_verify(
         p = le64toh(f->header->header_size);
         while (p != 0) {
                 if (show_progress)
-                        draw_progress(0x7FFF * p / le64toh(f->header->tail_object_offset), &last_usec);
+                        draw_progress(0x7FFF * p / le64toh(f->header->tail_object_offset), &progress.last_usec);
 
                 r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
                 if (r < 0) {
@@ -907,13 +1305,25 @@ int journal_file_verify(
                         goto fail;
                 }
 
+                if ((o->object.flags & OBJECT_COMPRESSED_ZSTD) && !JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                        error(p, "ZSTD compressed object in file without ZSTD compression");
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
                 switch (o->object.type) {
 
                 case OBJECT_DATA:
-                        r = write_uint64(data_fd, p);
+                        r = offset_index_add(&data, p);
                         if (r < 0)
                                 goto fail;
 
+                        if (!journal_file_bloom_filter_test(f, le64toh(o->data.hash))) {
+                                error(p, "data object missing from bloom filter");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
                         n_data++;
                         break;
 
@@ -928,7 +1338,7 @@ int journal_file_verify(
                                 goto fail;
                         }
 
-                        r = write_uint64(entry_fd, p);
+                        r = offset_index_add(&entries, p);
                         if (r < 0)
                                 goto fail;
 
@@ -1015,7 +1425,7 @@ int journal_file_verify(
                         break;
 
                 case OBJECT_ENTRY_ARRAY:
-                        r = write_uint64(entry_array_fd, p);
+                        r = offset_index_add(&entry_arrays, p);
                         if (r < 0)
                                 goto fail;
 
@@ -1120,6 +1530,46 @@ int journal_file_verify(
                         n_tags ++;
                         break;
 
+                case OBJECT_ENTRY_INDEX:
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, entry_index_offset) ||
+                            p != le64toh(f->header->entry_index_offset)) {
+                                error(p, "entry index not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_entry_index = true;
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+                            p != le64toh(f->header->dictionary_offset)) {
+                                error(p, "dictionary not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_dictionary = true;
+                        break;
+
+                case OBJECT_BLOOM_FILTER:
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) ||
+                            p != le64toh(f->header->bloom_filter_offset)) {
+                                error(p, "bloom filter not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (le64toh(o->bloom_filter.n_data) != le64toh(f->header->n_data)) {
+                                error(p, "bloom filter covers %"PRIu64" data objects, but file has %"PRIu64,
+                                      le64toh(o->bloom_filter.n_data), le64toh(f->header->n_data));
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_bloom_filter = true;
+                        break;
+
                 default:
                         n_weird ++;
                 }
@@ -1194,6 +1644,30 @@ int journal_file_verify(
                 goto fail;
         }
 
+        if (JOURNAL_HEADER_CONTAINS(f->header, entry_index_offset) &&
+            f->header->entry_index_offset != 0 &&
+            !found_entry_index) {
+                error(offsetof(Header, entry_index_offset), "entry index pointer dead");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            f->header->dictionary_offset != 0 &&
+            !found_dictionary) {
+                error(offsetof(Header, dictionary_offset), "dictionary pointer dead");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) &&
+            f->header->bloom_filter_offset != 0 &&
+            !found_bloom_filter) {
+                error(offsetof(Header, bloom_filter_offset), "bloom filter pointer dead");
+                r = -EBADMSG;
+                goto fail;
+        }
+
         if (entry_seqnum_set &&
             entry_seqnum != le64toh(f->header->tail_entry_seqnum)) {
                 error(offsetof(Header, tail_entry_seqnum), "invalid tail seqnum");
@@ -1223,34 +1697,34 @@ int journal_file_verify(
          * unreferenced objects. We only care that everything that is
          * referenced is consistent. */
 
-        r = verify_entry_array(f,
-                               data_fd, n_data,
-                               entry_fd, n_entries,
-                               entry_array_fd, n_entry_arrays,
-                               &last_usec,
-                               show_progress);
+        r = offset_index_seal(&data);
         if (r < 0)
                 goto fail;
 
-        r = verify_hash_table(f,
-                              data_fd, n_data,
-                              entry_fd, n_entries,
-                              entry_array_fd, n_entry_arrays,
-                              &last_usec,
-                              show_progress);
+        r = offset_index_seal(&entries);
         if (r < 0)
                 goto fail;
 
+        r = offset_index_seal(&entry_arrays);
+        if (r < 0)
+                goto fail;
+
+        r = verify_references(f, &data, &entries, &entry_arrays, &progress);
+        if (r < 0)
+                goto fail;
+
+        if (found_entry_index) {
+                r = verify_entry_index(f, &entries, &entry_arrays);
+                if (r < 0)
+                        goto fail;
+        }
+
         if (show_progress)
                 flush_progress();
 
-        mmap_cache_close_fd(f->mmap, data_fd);
-        mmap_cache_close_fd(f->mmap, entry_fd);
-        mmap_cache_close_fd(f->mmap, entry_array_fd);
-
-        safe_close(data_fd);
-        safe_close(entry_fd);
-        safe_close(entry_array_fd);
+        offset_index_done(&data);
+        offset_index_done(&entries);
+        offset_index_done(&entry_arrays);
 
         if (first_contained)
                 *first_contained = le64toh(f->header->head_entry_realtime);
@@ -1271,20 +1745,9 @@ fail:
                   (unsigned long long) f->last_stat.st_size,
                   100 * p / f->last_stat.st_size);
 
-        if (data_fd >= 0) {
-                mmap_cache_close_fd(f->mmap, data_fd);
-                safe_close(data_fd);
-        }
-
-        if (entry_fd >= 0) {
-                mmap_cache_close_fd(f->mmap, entry_fd);
-                safe_close(entry_fd);
-        }
-
-        if (entry_array_fd >= 0) {
-                mmap_cache_close_fd(f->mmap, entry_array_fd);
-                safe_close(entry_array_fd);
-        }
+        offset_index_done(&data);
+        offset_index_done(&entries);
+        offset_index_done(&entry_arrays);
 
         return r;
 }
@@ -31,6 +31,7 @@
 #include <getopt.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
 #include <linux/fs.h>
@@ -39,6 +40,7 @@
 #include "sd-bus.h"
 #include "log.h"
 #include "logs-show.h"
+#include "logs-pipeline.h"
 #include "util.h"
 #include "acl-util.h"
 #include "path-util.h"
@@ -71,6 +73,7 @@ enum {
 };
 
 static OutputMode arg_output = OUTPUT_SHORT;
+static unsigned arg_threads = 1;
 static bool arg_utc = false;
 static bool arg_pager_end = false;
 static bool arg_follow = false;
@@ -125,13 +128,6 @@ static enum {
         ACTION_VACUUM,
 } arg_action = ACTION_SHOW;
 
-typedef struct BootId {
-        sd_id128_t id;
-        uint64_t first;
-        uint64_t last;
-        LIST_FIELDS(struct BootId, boot_list);
-} BootId;
-
 static void pager_open_if_enabled(void) {
 
         if (arg_no_pager)
@@ -214,6 +210,7 @@ static void help(void) {
                "                                   short-precise, short-monotonic, verbose,\n"
                "                                   export, json, json-pretty, json-sse, cat)\n"
                "     --utc                 Express time in Coordinated Universal Time (UTC)\n"
+               "     --threads=N           Format entries or verify files on N threads\n"
                "  -x --catalog             Add message explanations where available\n"
                "     --no-full             Ellipsize fields\n"
                "  -a --all                 Show all fields, including long and unprintable\n"
@@ -280,6 +277,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_FLUSH,
                 ARG_VACUUM_SIZE,
                 ARG_VACUUM_TIME,
+                ARG_THREADS,
         };
 
         static const struct option options[] = {
@@ -333,6 +331,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "flush",          no_argument,       NULL, ARG_FLUSH          },
                 { "vacuum-size",    required_argument, NULL, ARG_VACUUM_SIZE    },
                 { "vacuum-time",    required_argument, NULL, ARG_VACUUM_TIME    },
+                { "threads",        required_argument, NULL, ARG_THREADS        },
                 {}
         };
 
@@ -699,6 +698,14 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_action = ACTION_FLUSH;
                         break;
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0 || arg_threads <= 0) {
+                                log_error("Failed to parse thread count: %s", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -729,6 +736,11 @@ static int parse_argv(int argc, char *argv[]) {
                 return -EINVAL;
         }
 
+        if (arg_follow && arg_threads > 1) {
+                log_error("--threads= is not supported in combination with --follow.");
+                return -EINVAL;
+        }
+
         if (arg_action != ACTION_SHOW && optind < argc) {
                 log_error("Extraneous arguments starting with '%s'", argv[optind]);
                 return -EINVAL;
@@ -852,205 +864,51 @@ static int add_matches(sd_journal *j, char **args) {
         return 0;
 }
 
-static void boot_id_free_all(BootId *l) {
-
-        while (l) {
-                BootId *i = l;
-                LIST_REMOVE(boot_list, l, i);
-                free(i);
-        }
-}
-
-static int discover_next_boot(
+static int get_boot_id(
                 sd_journal *j,
-                BootId **boot,
-                bool advance_older,
-                bool read_realtime) {
-
-        int r;
-        char match[9+32+1] = "_BOOT_ID=";
-        _cleanup_free_ BootId *next_boot = NULL;
-
-        assert(j);
-        assert(boot);
-
-        /* We expect the journal to be on the last position of a boot
-         * (in relation to the direction we are going), so that the next
-         * invocation of sd_journal_next/previous will be from a different
-         * boot. We then collect any information we desire and then jump
-         * to the last location of the new boot by using a _BOOT_ID match
-         * coming from the other journal direction. */
-
-        /* Make sure we aren't restricted by any _BOOT_ID matches, so that
-         * we can actually advance to a *different* boot. */
-        sd_journal_flush_matches(j);
-
-        if (advance_older)
-                r = sd_journal_previous(j);
-        else
-                r = sd_journal_next(j);
-        if (r < 0)
-                return r;
-        else if (r == 0)
-                return 0; /* End of journal, yay. */
-
-        next_boot = new0(BootId, 1);
-        if (!next_boot)
-                return -ENOMEM;
-
-        r = sd_journal_get_monotonic_usec(j, NULL, &next_boot->id);
-        if (r < 0)
-                return r;
-
-        if (read_realtime) {
-                r = sd_journal_get_realtime_usec(j, &next_boot->first);
-                if (r < 0)
-                        return r;
-        }
-
-        /* Now seek to the last occurrence of this boot ID. */
-        sd_id128_to_string(next_boot->id, match + 9);
-        r = sd_journal_add_match(j, match, sizeof(match) - 1);
-        if (r < 0)
-                return r;
-
-        if (advance_older)
-                r = sd_journal_seek_head(j);
-        else
-                r = sd_journal_seek_tail(j);
-        if (r < 0)
-                return r;
-
-        if (advance_older)
-                r = sd_journal_next(j);
-        else
-                r = sd_journal_previous(j);
-        if (r < 0)
-                return r;
-        else if (r == 0)
-                return -ENODATA; /* This shouldn't happen. We just came from this very boot ID. */
-
-        if (read_realtime) {
-                r = sd_journal_get_realtime_usec(j, &next_boot->last);
-                if (r < 0)
-                        return r;
-        }
-
-        *boot = next_boot;
-        next_boot = NULL;
-
-        return 0;
-}
-
-static int get_boots(
-                sd_journal *j,
-                BootId **boots,
-                BootId *query_ref_boot,
+                sd_id128_t *boot_id,
                 int ref_boot_offset) {
 
-        bool skip_once;
-        int r, count = 0;
-        BootId *head = NULL, *tail = NULL;
-        const bool advance_older = query_ref_boot && ref_boot_offset <= 0;
+        _cleanup_free_ JournalBoot *boots = NULL;
+        int n, i;
 
         assert(j);
+        assert(boot_id);
 
-        /* Adjust for the asymmetry that offset 0 is
-         * the last (and current) boot, while 1 is considered the
-         * (chronological) first boot in the journal. */
-        skip_once = query_ref_boot && sd_id128_is_null(query_ref_boot->id) && ref_boot_offset < 0;
-
-        /* Advance to the earliest/latest occurrence of our reference
-         * boot ID (taking our lookup direction into account), so that
-         * discover_next_boot() can do its job.
-         * If no reference is given, the journal head/tail will do,
-         * they're "virtual" boots after all. */
-        if (query_ref_boot && !sd_id128_is_null(query_ref_boot->id)) {
-                char match[9+32+1] = "_BOOT_ID=";
-
-                sd_journal_flush_matches(j);
-
-                sd_id128_to_string(query_ref_boot->id, match + 9);
-                r = sd_journal_add_match(j, match, sizeof(match) - 1);
-                if (r < 0)
-                        return r;
-
-                if (advance_older)
-                        r = sd_journal_seek_head(j);
-                else
-                        r = sd_journal_seek_tail(j);
-                if (r < 0)
-                        return r;
+        n = journal_get_boots(j, &boots);
+        if (n <= 0)
+                return n;
 
-                if (advance_older)
-                        r = sd_journal_next(j);
-                else
-                        r = sd_journal_previous(j);
-                if (r < 0)
-                        return r;
-                else if (r == 0)
-                        goto finish;
-                else if (ref_boot_offset == 0) {
-                        count = 1;
-                        goto finish;
-                }
+        if (sd_id128_is_null(*boot_id)) {
+                /* Adjust for the asymmetry that offset 0 is
+                 * the last (and current) boot, while 1 is considered the
+                 * (chronological) first boot in the journal. */
+                i = ref_boot_offset <= 0 ? n - 1 + ref_boot_offset : ref_boot_offset - 1;
         } else {
-                if (advance_older)
-                        r = sd_journal_seek_tail(j);
-                else
-                        r = sd_journal_seek_head(j);
-                if (r < 0)
-                        return r;
-
-                /* No sd_journal_next/previous here. */
-        }
-
-        for (;;) {
-                _cleanup_free_ BootId *current = NULL;
-
-                r = discover_next_boot(j, &current, advance_older, !query_ref_boot);
-                if (r < 0) {
-                        boot_id_free_all(head);
-                        return r;
-                }
-
-                if (!current)
-                        break;
+                for (i = 0; i < n; i++)
+                        if (sd_id128_equal(boots[i].id, *boot_id))
+                                break;
 
-                if (query_ref_boot) {
-                        if (!skip_once)
-                                ref_boot_offset += advance_older ? 1 : -1;
-                        skip_once = false;
+                if (i >= n)
+                        return 0;
 
-                        if (ref_boot_offset == 0) {
-                                count = 1;
-                                query_ref_boot->id = current->id;
-                                break;
-                        }
-                } else {
-                        LIST_INSERT_AFTER(boot_list, head, tail, current);
-                        tail = current;
-                        current = NULL;
-                        count++;
-                }
+                i += ref_boot_offset;
         }
 
-finish:
-        if (boots)
-                *boots = head;
-
-        sd_journal_flush_matches(j);
+        if (i < 0 || i >= n)
+                return 0;
 
-        return count;
+        *boot_id = boots[i].id;
+        return 1;
 }
 
 static int list_boots(sd_journal *j) {
+        _cleanup_free_ JournalBoot *boots = NULL;
         int w, i, count;
-        BootId *id, *all_ids;
 
         assert(j);
 
-        count = get_boots(j, &all_ids, NULL, 0);
+        count = journal_get_boots(j, &boots);
         if (count < 0)
                 return log_error_errno(count, "Failed to determine boots: %m");
         if (count == 0)
@@ -1061,27 +919,23 @@ static int list_boots(sd_journal *j) {
         /* numbers are one less, but we need an extra char for the sign */
         w = DECIMAL_STR_WIDTH(count - 1) + 1;
 
-        i = 0;
-        LIST_FOREACH(boot_list, id, all_ids) {
+        for (i = 0; i < count; i++) {
                 char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX];
 
                 printf("% *i " SD_ID128_FORMAT_STR " %s—%s\n",
                        w, i - count + 1,
-                       SD_ID128_FORMAT_VAL(id->id),
-                       format_timestamp_maybe_utc(a, sizeof(a), id->first),
-                       format_timestamp_maybe_utc(b, sizeof(b), id->last));
-                i++;
+                       SD_ID128_FORMAT_VAL(boots[i].id),
+                       format_timestamp_maybe_utc(a, sizeof(a), boots[i].first),
+                       format_timestamp_maybe_utc(b, sizeof(b), boots[i].last));
         }
 
-        boot_id_free_all(all_ids);
-
         return 0;
 }
 
 static int add_boot(sd_journal *j) {
         char match[9+32+1] = "_BOOT_ID=";
+        sd_id128_t boot_id;
         int r;
-        BootId ref_boot_id = {};
 
         assert(j);
 
@@ -1091,9 +945,8 @@ static int add_boot(sd_journal *j) {
         if (arg_boot_offset == 0 && sd_id128_equal(arg_boot_id, SD_ID128_NULL))
                 return add_match_this_boot(j, arg_machine);
 
-        ref_boot_id.id = arg_boot_id;
-        r = get_boots(j, NULL, &ref_boot_id, arg_boot_offset);
-        assert(r <= 1);
+        boot_id = arg_boot_id;
+        r = get_boot_id(j, &boot_id, arg_boot_offset);
         if (r <= 0) {
                 const char *reason = (r == 0) ? "No such boot ID in journal" : strerror(-r);
 
@@ -1106,7 +959,7 @@ static int add_boot(sd_journal *j) {
                 return r == 0 ? -ENODATA : r;
         }
 
-        sd_id128_to_string(ref_boot_id.id, match + 9);
+        sd_id128_to_string(boot_id, match + 9);
 
         r = sd_journal_add_match(j, match, sizeof(match) - 1);
         if (r < 0)
@@ -1561,48 +1414,187 @@ finish:
 #endif
 }
 
+typedef struct VerifyJob {
+        JournalFile *f;
+        int r;
+        usec_t first, validated, last;
+        bool done;
+} VerifyJob;
+
+typedef struct VerifyQueue {
+        VerifyJob *jobs;
+        unsigned n_jobs;
+        unsigned next;
+        bool quit;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t done_cond;
+} VerifyQueue;
+
+static void *verify_thread(void *userdata) {
+        VerifyQueue *q = userdata;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        while (!q->quit && q->next < q->n_jobs) {
+                VerifyJob *job = q->jobs + q->next++;
+                JournalFile *f;
+                int r;
+
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                /* All files of the sd_journal object share one mmap
+                 * cache, hence we open the file again for this thread */
+                r = journal_file_open(job->f->path, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f);
+                if (r >= 0) {
+                        r = journal_file_verify(f, arg_verify_key, &job->first, &job->validated, &job->last, false);
+                        journal_file_close(f);
+                }
+
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+                job->r = r;
+                job->done = true;
+                assert_se(pthread_cond_broadcast(&q->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return NULL;
+}
+
+static void verify_report(VerifyJob *job) {
+        char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
+
+        if (job->r < 0) {
+                log_warning("FAIL: %s (%s)", job->f->path, strerror(-job->r));
+                return;
+        }
+
+        log_info("PASS: %s", job->f->path);
+
+        if (arg_verify_key && JOURNAL_HEADER_SEALED(job->f->header)) {
+                if (job->validated > 0) {
+                        log_info("=> Validated from %s to %s, final %s entries not sealed.",
+                                 format_timestamp_maybe_utc(a, sizeof(a), job->first),
+                                 format_timestamp_maybe_utc(b, sizeof(b), job->validated),
+                                 format_timespan(c, sizeof(c), job->last > job->validated ? job->last - job->validated : 0, 0));
+                } else if (job->last > 0)
+                        log_info("=> No sealing yet, %s of entries not sealed.",
+                                 format_timespan(c, sizeof(c), job->last - job->first, 0));
+                else
+                        log_info("=> No sealing yet, no entries in file.");
+        }
+}
+
 static int verify(sd_journal *j) {
-        int r = 0;
+        _cleanup_free_ VerifyJob *jobs = NULL;
+        _cleanup_free_ pthread_t *threads = NULL;
+        VerifyQueue q = {
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .done_cond = PTHREAD_COND_INITIALIZER,
+        };
+        unsigned n_jobs = 0, n_threads = 0, k;
+        uint64_t bytes = 0;
+        usec_t start, elapsed;
         Iterator i;
         JournalFile *f;
+        int r = 0;
 
         assert(j);
 
         log_show_color(true);
 
-        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                int k;
-                usec_t first = 0, validated = 0, last = 0;
+        jobs = new0(VerifyJob, ordered_hashmap_size(j->files));
+        if (!jobs)
+                return log_oom();
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i)
+                jobs[n_jobs++].f = f;
+
+        start = now(CLOCK_MONOTONIC);
+
+        /* With more than one thread, files are verified in parallel,
+         * but still reported in order */
+        if (arg_threads > 1 && n_jobs > 1) {
+                sigset_t fullset, saved;
+
+                threads = new(pthread_t, MIN(arg_threads, n_jobs));
+                if (!threads)
+                        return log_oom();
+
+                q.jobs = jobs;
+                q.n_jobs = n_jobs;
+
+                assert_se(sigfillset(&fullset) == 0);
+                assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+                for (k = 0; k < MIN(arg_threads, n_jobs); k++) {
+                        r = -pthread_create(threads + k, NULL, verify_thread, &q);
+                        if (r < 0) {
+                                log_warning_errno(r, "Failed to start verification thread: %m");
+                                break;
+                        }
+
+                        n_threads++;
+                }
+
+                assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+                r = 0;
+        }
+
+        for (k = 0; k < n_jobs; k++) {
+                VerifyJob *job = jobs + k;
 
 #ifdef HAVE_GCRYPT
-                if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
-                        log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
+                if (!arg_verify_key && JOURNAL_HEADER_SEALED(job->f->header))
+                        log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", job->f->path);
 #endif
 
-                k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
-                if (k == -EINVAL) {
+                if (n_threads > 0) {
+                        assert_se(pthread_mutex_lock(&q.mutex) == 0);
+                        while (!job->done)
+                                assert_se(pthread_cond_wait(&q.done_cond, &q.mutex) == 0);
+                        assert_se(pthread_mutex_unlock(&q.mutex) == 0);
+                } else
+                        job->r = journal_file_verify(job->f, arg_verify_key, &job->first, &job->validated, &job->last, true);
+
+                if (job->r == -EINVAL) {
                         /* If the key was invalid give up right-away. */
-                        return k;
-                } else if (k < 0) {
-                        log_warning("FAIL: %s (%s)", f->path, strerror(-k));
-                        r = k;
-                } else {
-                        char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
-                        log_info("PASS: %s", f->path);
-
-                        if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
-                                if (validated > 0) {
-                                        log_info("=> Validated from %s to %s, final %s entries not sealed.",
-                                                 format_timestamp_maybe_utc(a, sizeof(a), first),
-                                                 format_timestamp_maybe_utc(b, sizeof(b), validated),
-                                                 format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
-                                } else if (last > 0)
-                                        log_info("=> No sealing yet, %s of entries not sealed.",
-                                                 format_timespan(c, sizeof(c), last - first, 0));
-                                else
-                                        log_info("=> No sealing yet, no entries in file.");
-                        }
+                        r = job->r;
+                        break;
                 }
+
+                verify_report(job);
+                if (job->r < 0)
+                        r = job->r;
+
+                bytes += job->f->last_stat.st_size;
+        }
+
+        if (n_threads > 0) {
+                assert_se(pthread_mutex_lock(&q.mutex) == 0);
+                q.quit = true;
+                assert_se(pthread_mutex_unlock(&q.mutex) == 0);
+
+                for (k = 0; k < n_threads; k++)
+                        assert_se(pthread_join(threads[k], NULL) == 0);
+        }
+
+        if (r == -EINVAL)
+                return r;
+
+        elapsed = now(CLOCK_MONOTONIC) - start;
+
+        if (n_jobs > 0) {
+                char a[FORMAT_BYTES_MAX], b[FORMAT_TIMESPAN_MAX], c[FORMAT_BYTES_MAX];
+
+                log_info("Verified %u files, %s in %s (%s/s).",
+                         n_jobs,
+                         format_bytes(a, sizeof(a), bytes),
+                         format_timespan(b, sizeof(b), elapsed, USEC_PER_MSEC),
+                         format_bytes(c, sizeof(c), bytes * USEC_PER_SEC / MAX(elapsed, 1u)));
         }
 
         return r;
@@ -1779,6 +1771,8 @@ static int flush_to_var(void) {
 int main(int argc, char *argv[]) {
         int r;
         _cleanup_journal_close_ sd_journal *j = NULL;
+        _cleanup_(output_pipeline_freep) OutputPipeline *pipeline = NULL;
+        _cleanup_free_ char *reboot_marker = NULL;
         bool need_seek = false;
         sd_id128_t previous_boot_id;
         bool previous_boot_id_valid = false, first_line = true;
@@ -2091,8 +2085,32 @@ int main(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_threads > 1) {
+                int flags;
+
+                flags =
+                        arg_all * OUTPUT_SHOW_ALL |
+                        arg_full * OUTPUT_FULL_WIDTH |
+                        on_tty() * OUTPUT_COLOR |
+                        arg_catalog * OUTPUT_CATALOG |
+                        arg_utc * OUTPUT_UTC;
+
+                r = output_pipeline_new(j, stdout, arg_output, 0, flags, arg_threads, &pipeline);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to set up output threads: %m");
+                        goto finish;
+                }
+
+                reboot_marker = strjoin(ansi_highlight(), "-- Reboot --", ansi_highlight_off(), "\n", NULL);
+                if (!reboot_marker) {
+                        r = log_oom();
+                        goto finish;
+                }
+        }
+
         for (;;) {
                 while (arg_lines < 0 || n_shown < arg_lines || (arg_follow && !first_line)) {
+                        bool reboot = false;
                         int flags;
 
                         if (need_seek) {
@@ -2137,16 +2155,31 @@ int main(int argc, char *argv[]) {
 
                                 r = sd_journal_get_monotonic_usec(j, NULL, &boot_id);
                                 if (r >= 0) {
-                                        if (previous_boot_id_valid &&
-                                            !sd_id128_equal(boot_id, previous_boot_id))
-                                                printf("%s-- Reboot --%s\n",
-                                                       ansi_highlight(), ansi_highlight_off());
+                                        reboot = previous_boot_id_valid &&
+                                                !sd_id128_equal(boot_id, previous_boot_id);
 
                                         previous_boot_id = boot_id;
                                         previous_boot_id_valid = true;
                                 }
                         }
 
+                        if (pipeline) {
+                                /* The entry is formatted on one of
+                                 * the worker threads, and written out
+                                 * in order once it is done */
+                                r = output_pipeline_add(pipeline, reboot ? reboot_marker : NULL);
+                                need_seek = true;
+                                if (r < 0)
+                                        goto finish;
+
+                                n_shown++;
+                                continue;
+                        }
+
+                        if (reboot)
+                                printf("%s-- Reboot --%s\n",
+                                       ansi_highlight(), ansi_highlight_off());
+
                         flags =
                                 arg_all * OUTPUT_SHOW_ALL |
                                 arg_full * OUTPUT_FULL_WIDTH |
@@ -2165,6 +2198,12 @@ int main(int argc, char *argv[]) {
                 }
 
                 if (!arg_follow) {
+                        if (pipeline) {
+                                r = output_pipeline_flush(pipeline);
+                                if (r < 0)
+                                        goto finish;
+                        }
+
                         if (arg_show_cursor) {
                                 _cleanup_free_ char *cursor = NULL;
 
@@ -2188,6 +2227,14 @@ int main(int argc, char *argv[]) {
         }
 
 finish:
+        if (pipeline) {
+                int k;
+
+                k = output_pipeline_flush(pipeline);
+                if (k < 0 && r >= 0)
+                        r = k;
+        }
+
         pager_close();
 
         strv_free(arg_file);
@@ -56,9 +56,9 @@ void server_forward_console(
         struct timespec ts;
         char tbuf[sizeof("[] ")-1 + DECIMAL_STR_MAX(ts.tv_sec) + DECIMAL_STR_MAX(ts.tv_nsec)-3 + 1];
         char header_pid[sizeof("[]: ")-1 + DECIMAL_STR_MAX(pid_t)];
-        int n = 0, fd;
         _cleanup_free_ char *ident_buf = NULL;
-        const char *tty;
+        int n = 0, i;
+        size_t l;
 
         assert(s);
         assert(message);
@@ -97,16 +97,44 @@ void server_forward_console(
         IOVEC_SET_STRING(iovec[n++], message);
         IOVEC_SET_STRING(iovec[n++], "\n");
 
+        /* Queue the line up, the terminal is opened and written to
+         * only once per event loop iteration, see
+         * server_flush_console() */
+        l = IOVEC_TOTAL_SIZE(iovec, n);
+        if (!GREEDY_REALLOC(s->console_batch, s->console_batch_allocated, s->console_batch_size + l)) {
+                log_oom();
+                return;
+        }
+
+        for (i = 0; i < n; i++) {
+                memcpy(s->console_batch + s->console_batch_size, iovec[i].iov_base, iovec[i].iov_len);
+                s->console_batch_size += iovec[i].iov_len;
+        }
+
+        if (s->console_batch_size >= CONSOLE_BATCH_MAX)
+                server_flush_console(s);
+}
+
+void server_flush_console(Server *s) {
+        _cleanup_close_ int fd = -1;
+        const char *tty;
+        int r;
+
+        assert(s);
+
+        if (s->console_batch_size <= 0)
+                return;
+
         tty = s->tty_path ? s->tty_path : "/dev/console";
 
         fd = open_terminal(tty, O_WRONLY|O_NOCTTY|O_CLOEXEC);
-        if (fd < 0) {
-                log_debug_errno(errno, "Failed to open %s for logging: %m", tty);
-                return;
+        if (fd < 0)
+                log_debug_errno(fd, "Failed to open %s for logging: %m", tty);
+        else {
+                r = loop_write(fd, s->console_batch, s->console_batch_size, false);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to write to %s for logging: %m", tty);
         }
 
-        if (writev(fd, iovec, n) < 0)
-                log_debug_errno(errno, "Failed to write to %s for logging: %m", tty);
-
-        safe_close(fd);
+        s->console_batch_size = 0;
 }
@@ -24,3 +24,4 @@
 #include "journald-server.h"
 
 void server_forward_console(Server *s, int priority, const char *identifier, const char *message, const struct ucred *ucred);
+void server_flush_console(Server *s);
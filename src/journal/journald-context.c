@@ -0,0 +1,467 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/stat.h>
+
+#ifdef HAVE_SELINUX
+#include <selinux/selinux.h>
+#endif
+
+#include "journald-context.h"
+#include "hashmap.h"
+#include "process-util.h"
+#include "cgroup-util.h"
+#include "audit.h"
+#include "selinux-util.h"
+#include "formats-util.h"
+#include "fileio.h"
+
+/* The size of the comm field of a process, including the trailing NUL */
+#ifndef TASK_COMM_LEN
+#define TASK_COMM_LEN 16
+#endif
+
+/* After this time we reread all metadata of a client, even if it
+ * still appears to be the same process. This catches changes that
+ * leave the PID, start time, comm and executable alone, such as a
+ * process re-executing itself or cgroup migration. */
+#define CONTEXT_REFRESH_USEC (5*USEC_PER_SEC)
+
+struct ClientContextCache {
+        Hashmap *contexts;
+        ClientContext *lru, *lru_tail;
+        unsigned n_contexts;
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+};
+
+ClientContextCache *client_context_cache_new(void) {
+        ClientContextCache *c;
+
+        c = new0(ClientContextCache, 1);
+        if (!c)
+                return NULL;
+
+        c->contexts = hashmap_new(NULL);
+        if (!c->contexts) {
+                free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+static void field_free(char **field) {
+        assert(field);
+
+        free(*field);
+        *field = NULL;
+}
+
+static void client_context_reset(ClientContext *x) {
+        assert(x);
+
+        field_free(&x->comm);
+        field_free(&x->exe);
+        field_free(&x->cmdline);
+        field_free(&x->capeff);
+
+        field_free(&x->audit_session);
+        field_free(&x->audit_loginuid);
+
+        field_free(&x->cgroup);
+        field_free(&x->session);
+        field_free(&x->owner_uid);
+        field_free(&x->unit);
+        field_free(&x->user_unit);
+        field_free(&x->slice);
+
+        field_free(&x->label);
+
+        x->owner = UID_INVALID;
+        x->cgroup_valid = false;
+        x->owner_valid = false;
+        x->label_read = false;
+}
+
+static void client_context_free(ClientContext *x) {
+        assert(x);
+
+        if (x->parent) {
+                assert(x->parent->n_contexts > 0);
+
+                if (x->parent->lru_tail == x)
+                        x->parent->lru_tail = x->lru_prev;
+
+                LIST_REMOVE(lru, x->parent->lru, x);
+                hashmap_remove(x->parent->contexts, UINT32_TO_PTR(x->pid));
+
+                x->parent->n_contexts --;
+        }
+
+        client_context_reset(x);
+        free(x);
+}
+
+void client_context_cache_flush(ClientContextCache *c) {
+        assert(c);
+
+        while (c->lru)
+                client_context_free(c->lru);
+}
+
+void client_context_cache_free(ClientContextCache *c) {
+        if (!c)
+                return;
+
+        client_context_cache_flush(c);
+        hashmap_free(c->contexts);
+        free(c);
+}
+
+static int get_process_stat(pid_t pid, unsigned long long *ret_starttime, char ret_comm[static TASK_COMM_LEN]) {
+        _cleanup_free_ char *line = NULL;
+        const char *p, *b;
+        int r;
+
+        assert(pid > 0);
+        assert(ret_starttime);
+        assert(ret_comm);
+
+        p = procfs_file_alloca(pid, "stat");
+        r = read_one_line_file(p, &line);
+        if (r == -ENOENT)
+                return -ESRCH;
+        if (r < 0)
+                return r;
+
+        /* The comm field might contain spaces and parentheses, hence
+         * it ends at the last closing parenthesis. After it, pick the
+         * 22nd field (starttime). */
+        b = strchr(line, '(');
+        p = strrchr(line, ')');
+        if (!b || !p || p < b)
+                return -EIO;
+
+        if (sscanf(p + 1,
+                   " %*c "                          /* state */
+                   "%*d %*d %*d %*d %*d "           /* ppid … tpgid */
+                   "%*u %*u %*u %*u %*u %*u %*u "   /* flags … stime */
+                   "%*d %*d %*d %*d %*d %*d "       /* cutime … itrealvalue */
+                   "%llu",                          /* starttime */
+                   ret_starttime) != 1)
+                return -EIO;
+
+        b++;
+        strncpy(ret_comm, b, MIN((size_t) (p - b), (size_t) TASK_COMM_LEN - 1));
+        ret_comm[MIN((size_t) (p - b), (size_t) TASK_COMM_LEN - 1)] = 0;
+
+        return 0;
+}
+
+static void get_process_exe_id(pid_t pid, dev_t *ret_dev, ino_t *ret_ino) {
+        struct stat st;
+        const char *p;
+
+        assert(pid > 0);
+        assert(ret_dev);
+        assert(ret_ino);
+
+        /* Identifies the binary a process is running, so that we
+         * notice execve(). Kernel threads and processes that are
+         * gone have none, and are identified as 0. */
+
+        p = procfs_file_alloca(pid, "exe");
+        if (stat(p, &st) < 0) {
+                *ret_dev = 0;
+                *ret_ino = 0;
+                return;
+        }
+
+        *ret_dev = st.st_dev;
+        *ret_ino = st.st_ino;
+}
+
+static bool client_context_same_image(ClientContext *x, const char *comm, dev_t exe_dev, ino_t exe_ino) {
+        assert(x);
+        assert(comm);
+
+        /* execve() changes the comm to the name of the new binary,
+         * and /proc/$PID/exe to point to it */
+
+        if (x->comm && !streq(x->comm + strlen("_COMM="), comm))
+                return false;
+
+        return x->exe_dev == exe_dev && x->exe_ino == exe_ino;
+}
+
+static int field_strdup(char **field, const char *name, const char *value) {
+        char *x;
+
+        assert(field);
+        assert(name);
+        assert(value);
+
+        x = strappend(name, value);
+        if (!x)
+                return -ENOMEM;
+
+        free(*field);
+        *field = x;
+        return 0;
+}
+
+static int field_take(char **field, const char *name, char *value) {
+        int r;
+
+        /* Like field_strdup(), but frees the value passed in */
+        r = field_strdup(field, name, value);
+        free(value);
+        return r;
+}
+
+static int client_context_read(ClientContext *x, const char *cgroup_root, bool need_label) {
+        char *t, *c = NULL;
+        int r;
+
+        assert(x);
+
+        client_context_reset(x);
+
+        if (get_process_comm(x->pid, &t) >= 0) {
+                r = field_take(&x->comm, "_COMM=", t);
+                if (r < 0)
+                        return r;
+        }
+
+        if (get_process_exe(x->pid, &t) >= 0) {
+                r = field_take(&x->exe, "_EXE=", t);
+                if (r < 0)
+                        return r;
+        }
+
+        if (get_process_cmdline(x->pid, 0, false, &t) >= 0) {
+                r = field_take(&x->cmdline, "_CMDLINE=", t);
+                if (r < 0)
+                        return r;
+        }
+
+        if (get_process_capeff(x->pid, &t) >= 0) {
+                r = field_take(&x->capeff, "_CAP_EFFECTIVE=", t);
+                if (r < 0)
+                        return r;
+        }
+
+#ifdef HAVE_AUDIT
+        {
+                uint32_t audit;
+                uid_t loginuid;
+
+                if (audit_session_from_pid(x->pid, &audit) >= 0)
+                        if (asprintf(&x->audit_session, "_AUDIT_SESSION=%"PRIu32, audit) < 0)
+                                return -ENOMEM;
+
+                if (audit_loginuid_from_pid(x->pid, &loginuid) >= 0)
+                        if (asprintf(&x->audit_loginuid, "_AUDIT_LOGINUID="UID_FMT, loginuid) < 0)
+                                return -ENOMEM;
+        }
+#endif
+
+        if (cg_pid_get_path_shifted(x->pid, cgroup_root, &c) >= 0) {
+                x->cgroup_valid = true;
+
+                r = field_strdup(&x->cgroup, "_SYSTEMD_CGROUP=", c);
+                if (r < 0)
+                        goto finish;
+
+                if (cg_path_get_session(c, &t) >= 0) {
+                        r = field_take(&x->session, "_SYSTEMD_SESSION=", t);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                if (cg_path_get_owner_uid(c, &x->owner) >= 0) {
+                        x->owner_valid = true;
+
+                        if (asprintf(&x->owner_uid, "_SYSTEMD_OWNER_UID="UID_FMT, x->owner) < 0) {
+                                r = -ENOMEM;
+                                goto finish;
+                        }
+                }
+
+                if (cg_path_get_unit(c, &t) >= 0) {
+                        r = field_take(&x->unit, "_SYSTEMD_UNIT=", t);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                if (cg_path_get_user_unit(c, &t) >= 0) {
+                        r = field_take(&x->user_unit, "_SYSTEMD_USER_UNIT=", t);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                if (cg_path_get_slice(c, &t) >= 0) {
+                        r = field_take(&x->slice, "_SYSTEMD_SLICE=", t);
+                        if (r < 0)
+                                goto finish;
+                }
+        }
+
+        x->label_read = need_label;
+
+#ifdef HAVE_SELINUX
+        if (need_label && mac_selinux_use()) {
+                security_context_t con;
+
+                if (getpidcon(x->pid, &con) >= 0) {
+                        r = field_strdup(&x->label, "_SELINUX_CONTEXT=", con);
+                        freecon(con);
+                        if (r < 0)
+                                goto finish;
+                }
+        }
+#endif
+
+        r = 0;
+
+finish:
+        free(c);
+        return r;
+}
+
+static void client_context_touch(ClientContext *x) {
+        ClientContextCache *c;
+
+        assert(x);
+        assert(x->parent);
+
+        c = x->parent;
+
+        if (c->lru == x)
+                return;
+
+        if (c->lru_tail == x)
+                c->lru_tail = x->lru_prev;
+
+        LIST_REMOVE(lru, c->lru, x);
+        LIST_PREPEND(lru, c->lru, x);
+}
+
+int client_context_get(ClientContextCache *c, pid_t pid, const char *cgroup_root, bool need_label, ClientContext **ret) {
+        unsigned long long starttime;
+        char comm[TASK_COMM_LEN];
+        ClientContext *x;
+        dev_t exe_dev;
+        ino_t exe_ino;
+        usec_t ts;
+        int r;
+
+        assert(c);
+        assert(pid > 0);
+        assert(ret);
+
+        /* Looks up the metadata of a client. If we already know the
+         * process and it is still the same one (i.e. the PID hasn't
+         * been recycled in the meantime, as indicated by the start
+         * time), and it didn't execute another binary, we reuse what
+         * we read before and save ourselves a dozen or so reads from
+         * /proc. */
+
+        r = get_process_stat(pid, &starttime, comm);
+        if (r < 0)
+                starttime = 0;
+
+        get_process_exe_id(pid, &exe_dev, &exe_ino);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        x = hashmap_get(c->contexts, UINT32_TO_PTR(pid));
+        if (x) {
+                if (starttime != 0 &&
+                    x->starttime == starttime &&
+                    client_context_same_image(x, comm, exe_dev, exe_ino) &&
+                    x->timestamp + CONTEXT_REFRESH_USEC > ts &&
+                    (!need_label || x->label_read)) {
+                        c->n_hits ++;
+                        client_context_touch(x);
+                        *ret = x;
+                        return 0;
+                }
+
+                /* Stale, reuse the object but reread everything */
+                client_context_touch(x);
+        } else {
+                while (c->n_contexts >= CLIENT_CONTEXTS_MAX)
+                        client_context_free(c->lru_tail);
+
+                x = new0(ClientContext, 1);
+                if (!x)
+                        return -ENOMEM;
+
+                x->pid = pid;
+
+                r = hashmap_put(c->contexts, UINT32_TO_PTR(pid), x);
+                if (r < 0) {
+                        free(x);
+                        return r;
+                }
+
+                LIST_PREPEND(lru, c->lru, x);
+                if (!x->lru_next)
+                        c->lru_tail = x;
+                c->n_contexts ++;
+
+                x->parent = c;
+        }
+
+        c->n_misses ++;
+
+        x->starttime = starttime;
+        x->exe_dev = exe_dev;
+        x->exe_ino = exe_ino;
+        x->timestamp = ts;
+
+        r = client_context_read(x, cgroup_root, need_label);
+        if (r < 0) {
+                client_context_free(x);
+                return r;
+        }
+
+        /* If we couldn't determine the start time the process is
+         * probably gone already. Don't keep anything around then,
+         * the next lookup for this PID will reread things. */
+        if (starttime == 0)
+                x->timestamp = 0;
+
+        *ret = x;
+        return 0;
+}
+
+void client_context_cache_get_stats(ClientContextCache *c, uint64_t *hits, uint64_t *misses, unsigned *n_contexts) {
+        assert(c);
+
+        if (hits)
+                *hits = c->n_hits;
+        if (misses)
+                *misses = c->n_misses;
+        if (n_contexts)
+                *n_contexts = c->n_contexts;
+}
@@ -0,0 +1,75 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/types.h>
+
+#include "util.h"
+#include "list.h"
+
+/* The number of clients we keep metadata for at max */
+#define CLIENT_CONTEXTS_MAX 1024
+
+typedef struct ClientContext ClientContext;
+typedef struct ClientContextCache ClientContextCache;
+
+struct ClientContext {
+        ClientContextCache *parent;
+
+        pid_t pid;
+        unsigned long long starttime;
+        dev_t exe_dev;
+        ino_t exe_ino;
+        usec_t timestamp;
+
+        /* All of these are complete "FIELD=value" strings, ready to
+         * be referenced from an iovec, or NULL if not known */
+        char *comm;
+        char *exe;
+        char *cmdline;
+        char *capeff;
+
+        char *audit_session;
+        char *audit_loginuid;
+
+        char *cgroup;
+        char *session;
+        char *owner_uid;
+        char *unit;
+        char *user_unit;
+        char *slice;
+
+        char *label;
+
+        uid_t owner;
+        bool cgroup_valid:1;
+        bool owner_valid:1;
+        bool label_read:1;
+
+        LIST_FIELDS(ClientContext, lru);
+};
+
+ClientContextCache *client_context_cache_new(void);
+void client_context_cache_free(ClientContextCache *c);
+
+int client_context_get(ClientContextCache *c, pid_t pid, const char *cgroup_root, bool need_label, ClientContext **ret);
+void client_context_cache_flush(ClientContextCache *c);
+
+void client_context_cache_get_stats(ClientContextCache *c, uint64_t *hits, uint64_t *misses, unsigned *n_contexts);
@@ -26,12 +26,16 @@
 #include "list.h"
 #include "util.h"
 #include "hashmap.h"
-#include "random-util.h"
+#include "path-util.h"
+#include "special.h"
 
 #define POOLS_MAX 5
-#define BUCKETS_MAX 127
 #define GROUPS_MAX 2047
 
+/* The deepest cgroup path we rate limit by has three components,
+ * hence there are at most this many groups for one message */
+#define DEPTH_MAX 4
+
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
         [LOG_ALERT]   = 0,
@@ -46,20 +50,37 @@ static const int priority_map[] = {
 typedef struct JournalRateLimitPool JournalRateLimitPool;
 typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
+/* Every pool is a token bucket that holds up to burst messages and
+ * is refilled at burst messages per interval. Instead of the tokens
+ * we store the time at which the bucket would be full again, which
+ * is all we need to know. */
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
+        usec_t full;
+
+        /* Suppressed messages are reported along with a message that
+         * is let through, but no earlier than report, so that a
+         * flood doesn't turn into a flood of reports */
         unsigned suppressed;
+        usec_t report;
 };
 
 struct JournalRateLimitGroup {
         JournalRateLimit *parent;
 
+        /* The closest enclosing cgroup that has a budget of its
+         * own. A message is only let through if all groups up the
+         * tree have room for it. */
+        JournalRateLimitGroup *ancestor;
+        unsigned n_children;
+
         char *id;
+        unsigned burst;
         JournalRateLimitPool pools[POOLS_MAX];
-        unsigned long hash;
 
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
+        /* Messages dropped from this group or any group below it,
+         * for as long as we remember the group */
+        uint64_t dropped;
+
         LIST_FIELDS(JournalRateLimitGroup, lru);
 };
 
@@ -67,12 +88,15 @@ struct JournalRateLimit {
         usec_t interval;
         unsigned burst;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
+        /* Unit name → burst + 1 */
+        Hashmap *bursts;
+
+        Hashmap *groups;
         JournalRateLimitGroup *lru, *lru_tail;
 
         unsigned n_groups;
 
-        uint8_t hash_key[16];
+        uint64_t dropped;
 };
 
 JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
@@ -87,7 +111,11 @@ JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
         r->interval = interval;
         r->burst = burst;
 
-        random_bytes(r->hash_key, sizeof(r->hash_key));
+        r->groups = hashmap_new(&string_hash_ops);
+        if (!r->groups) {
+                free(r);
+                return NULL;
+        }
 
         return r;
 }
@@ -102,31 +130,98 @@ static void journal_rate_limit_group_free(JournalRateLimitGroup *g) {
                         g->parent->lru_tail = g->lru_prev;
 
                 LIST_REMOVE(lru, g->parent->lru, g);
-                LIST_REMOVE(bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
+                hashmap_remove(g->parent->groups, g->id);
 
                 g->parent->n_groups --;
         }
 
+        if (g->ancestor) {
+                assert(g->ancestor->n_children > 0);
+                g->ancestor->n_children --;
+        }
+
         free(g->id);
         free(g);
 }
 
 void journal_rate_limit_free(JournalRateLimit *r) {
+        char *k;
+
         assert(r);
 
-        while (r->lru)
-                journal_rate_limit_group_free(r->lru);
+        /* Children before their ancestors */
+        while (r->lru_tail)
+                journal_rate_limit_group_free(r->lru_tail);
 
+        while ((k = hashmap_steal_first_key(r->bursts)))
+                free(k);
+
+        hashmap_free(r->bursts);
+        hashmap_free(r->groups);
         free(r);
 }
 
+int journal_rate_limit_set_burst(JournalRateLimit *r, const char *unit, unsigned burst) {
+        _cleanup_free_ char *k = NULL;
+        int q;
+
+        assert(r);
+        assert(unit);
+
+        /* Only affects groups created after this call, hence should
+         * be called right after journal_rate_limit_new() */
+
+        q = hashmap_ensure_allocated(&r->bursts, &string_hash_ops);
+        if (q < 0)
+                return q;
+
+        k = strdup(unit);
+        if (!k)
+                return -ENOMEM;
+
+        q = hashmap_replace(r->bursts, k, UINT_TO_PTR(burst + 1));
+        if (q < 0)
+                return q;
+
+        k = NULL;
+        return 0;
+}
+
+static bool journal_rate_limit_get_burst(JournalRateLimit *r, const char *id, unsigned *burst) {
+        const char *unit;
+        void *p;
+
+        assert(r);
+        assert(id);
+        assert(burst);
+
+        /* The cgroup of a unit is named after the unit, except for
+         * the root slice */
+        if (path_equal(id, "/"))
+                unit = SPECIAL_ROOT_SLICE;
+        else {
+                unit = strrchr(id, '/');
+                unit = unit ? unit + 1 : id;
+        }
+
+        p = hashmap_get(r->bursts, unit);
+        if (!p)
+                return false;
+
+        *burst = PTR_TO_UINT(p) - 1;
+        return true;
+}
+
 _pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
         unsigned i;
 
         assert(g);
 
+        if (g->n_children > 0)
+                return false;
+
         for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->parent->interval >= ts)
+                if (g->pools[i].full > ts)
                         return false;
 
         return true;
@@ -135,20 +230,65 @@ _pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, us
 static void journal_rate_limit_vacuum(JournalRateLimit *r, usec_t ts) {
         assert(r);
 
-        /* Makes room for at least one new item, but drop all
-         * expored items too. */
+        /* Makes room for a new group and all its ancestors, but drop
+         * all expired items too. Groups are always used before their
+         * ancestors, so the least recently used group never has
+         * children of its own. */
 
-        while (r->n_groups >= GROUPS_MAX ||
+        while (r->n_groups > GROUPS_MAX - DEPTH_MAX ||
                (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts)))
                 journal_rate_limit_group_free(r->lru_tail);
 }
 
-static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, usec_t ts) {
-        JournalRateLimitGroup *g;
+static void journal_rate_limit_group_touch(JournalRateLimitGroup *g) {
+        JournalRateLimit *r;
+
+        assert(g);
+
+        r = g->parent;
+
+        if (r->lru == g)
+                return;
+
+        if (r->lru_tail == g)
+                r->lru_tail = g->lru_prev;
+
+        LIST_REMOVE(lru, r->lru, g);
+        LIST_PREPEND(lru, r->lru, g);
+}
+
+static JournalRateLimitGroup* journal_rate_limit_group_get(JournalRateLimit *r, const char *id, unsigned burst) {
+        JournalRateLimitGroup *g, *a = NULL;
+        char *p, *e;
+        unsigned b;
 
         assert(r);
         assert(id);
 
+        g = hashmap_get(r->groups, id);
+        if (g)
+                return g;
+
+        /* Find the closest enclosing cgroup with a budget */
+        p = strdupa(id);
+        while (!path_equal(p, "/")) {
+                e = strrchr(p, '/');
+                if (!e)
+                        break;
+
+                if (e == p)
+                        e[1] = 0;
+                else
+                        *e = 0;
+
+                if (journal_rate_limit_get_burst(r, p, &b)) {
+                        a = journal_rate_limit_group_get(r, p, b);
+                        if (!a)
+                                return NULL;
+                        break;
+                }
+        }
+
         g = new0(JournalRateLimitGroup, 1);
         if (!g)
                 return NULL;
@@ -157,21 +297,28 @@ static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r,
         if (!g->id)
                 goto fail;
 
-        g->hash = string_hash_func(g->id, r->hash_key);
+        if (hashmap_put(r->groups, g->id, g) < 0)
+                goto fail;
 
-        journal_rate_limit_vacuum(r, ts);
+        g->burst = burst;
 
-        LIST_PREPEND(bucket, r->buckets[g->hash % BUCKETS_MAX], g);
         LIST_PREPEND(lru, r->lru, g);
         if (!g->lru_next)
                 r->lru_tail = g;
         r->n_groups ++;
 
         g->parent = r;
+
+        if (a) {
+                g->ancestor = a;
+                a->n_children ++;
+        }
+
         return g;
 
 fail:
-        journal_rate_limit_group_free(g);
+        free(g->id);
+        free(g);
         return NULL;
 }
 
@@ -203,12 +350,27 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available) {
-        unsigned long h;
-        JournalRateLimitGroup *g;
+static usec_t journal_rate_limit_pool_test(JournalRateLimitPool *p, usec_t interval, unsigned burst, usec_t ts) {
+        usec_t cost, full;
+
+        /* Returns when the bucket would be full again if the message
+         * was let through, or 0 if there's no room for it */
+
+        cost = MAX(interval / MAX(burst, 1u), 1u);
+        full = MAX(p->full, ts);
+
+        if (full + cost > ts + interval)
+                return 0;
+
+        return full + cost;
+}
+
+int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available, usec_t ts) {
+        JournalRateLimitGroup *leaf, *g, *path[DEPTH_MAX];
         JournalRateLimitPool *p;
-        unsigned burst;
-        usec_t ts;
+        usec_t full[DEPTH_MAX];
+        unsigned burst, n = 0, i, s;
+        int k;
 
         assert(id);
 
@@ -218,48 +380,105 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
         if (r->interval == 0 || r->burst == 0)
                 return 1;
 
-        burst = burst_modulate(r->burst, available);
-
-        ts = now(CLOCK_MONOTONIC);
+        k = priority_map[priority];
 
-        h = string_hash_func(id, r->hash_key);
-        g = r->buckets[h % BUCKETS_MAX];
+        leaf = hashmap_get(r->groups, id);
+        if (!leaf) {
+                journal_rate_limit_vacuum(r, ts);
 
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
+                if (!journal_rate_limit_get_burst(r, id, &burst))
+                        burst = r->burst;
 
-        if (!g) {
-                g = journal_rate_limit_group_new(r, id, ts);
-                if (!g)
+                leaf = journal_rate_limit_group_get(r, id, burst);
+                if (!leaf)
                         return -ENOMEM;
         }
 
-        p = &g->pools[priority_map[priority]];
+        for (g = leaf; g && n < DEPTH_MAX; g = g->ancestor)
+                path[n++] = g;
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
-                return 1;
-        }
+        /* Ancestors last, so that they stay more recently used than
+         * their children */
+        for (i = 0; i < n; i++)
+                journal_rate_limit_group_touch(path[i]);
 
-        if (p->begin + r->interval < ts) {
-                unsigned s;
+        /* Check all the way up first, and only take from the buckets
+         * if the message is let through */
+        for (i = 0; i < n; i++) {
+                g = path[i];
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+                if (g->burst == 0) {
+                        full[i] = 0;
+                        continue;
+                }
 
-                return 1 + s;
+                burst = burst_modulate(g->burst, available);
+
+                full[i] = journal_rate_limit_pool_test(g->pools + k, r->interval, burst, ts);
+                if (full[i] == 0) {
+                        leaf->pools[k].suppressed++;
+                        r->dropped++;
+
+                        for (i = 0; i < n; i++)
+                                path[i]->dropped++;
+
+                        return 0;
+                }
         }
 
-        if (p->num <= burst) {
-                p->num++;
+        for (i = 0; i < n; i++)
+                if (full[i] > 0)
+                        path[i]->pools[k].full = full[i];
+
+        p = leaf->pools + k;
+        if (p->suppressed == 0 || p->report > ts)
                 return 1;
+
+        s = p->suppressed;
+        p->suppressed = 0;
+        p->report = ts + r->interval;
+
+        return 1 + s;
+}
+
+void journal_rate_limit_get_stats(JournalRateLimit *r, uint64_t *dropped, unsigned *n_groups) {
+        assert(r);
+
+        if (dropped)
+                *dropped = r->dropped;
+        if (n_groups)
+                *n_groups = r->n_groups;
+}
+
+unsigned journal_rate_limit_get_top(JournalRateLimit *r, JournalRateLimitTop *top, unsigned n_top) {
+        JournalRateLimitGroup *g;
+        unsigned n = 0, i;
+        Iterator it;
+
+        assert(r);
+        assert(top || n_top == 0);
+
+        /* Finds the groups that dropped the most messages, most first */
+
+        HASHMAP_FOREACH(g, r->groups, it) {
+                if (g->dropped == 0)
+                        continue;
+
+                for (i = n; i > 0 && top[i - 1].dropped < g->dropped; i--)
+                        if (i < n_top)
+                                top[i] = top[i - 1];
+
+                if (i >= n_top)
+                        continue;
+
+                top[i] = (JournalRateLimitTop) {
+                        .id = g->id,
+                        .dropped = g->dropped,
+                };
+
+                if (n < n_top)
+                        n++;
         }
 
-        p->suppressed++;
-        return 0;
+        return n;
 }
@@ -25,6 +25,16 @@
 
 typedef struct JournalRateLimit JournalRateLimit;
 
+typedef struct JournalRateLimitTop {
+        const char *id;
+        uint64_t dropped;
+} JournalRateLimitTop;
+
 JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst);
 void journal_rate_limit_free(JournalRateLimit *r);
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available);
+int journal_rate_limit_set_burst(JournalRateLimit *r, const char *unit, unsigned burst);
+int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available, usec_t ts);
+void journal_rate_limit_get_stats(JournalRateLimit *r, uint64_t *dropped, unsigned *n_groups);
+
+/* The ids are only valid until the next call to journal_rate_limit_test() */
+unsigned journal_rate_limit_get_top(JournalRateLimit *r, JournalRateLimitTop *top, unsigned n_top);
@@ -36,6 +36,7 @@
 #include "sd-daemon.h"
 #include "mkdir.h"
 #include "rm-rf.h"
+#include "fileio.h"
 #include "hashmap.h"
 #include "journal-file.h"
 #include "socket-util.h"
@@ -48,15 +49,20 @@
 #include "process-util.h"
 #include "hostname-util.h"
 #include "signal-util.h"
+#include "strv.h"
+#include "unit-name.h"
 #include "journal-internal.h"
 #include "journal-vacuum.h"
 #include "journal-authenticate.h"
 #include "journald-rate-limit.h"
 #include "journald-kmsg.h"
 #include "journald-syslog.h"
+#include "journald-console.h"
 #include "journald-stream.h"
 #include "journald-native.h"
 #include "journald-audit.h"
+#include "journald-context.h"
+#include "journald-vacuum.h"
 #include "journald-server.h"
 
 #define USER_JOURNALS_MAX 1024
@@ -68,6 +74,22 @@
 
 #define RECHECK_AVAILABLE_SPACE_USEC (30*USEC_PER_SEC)
 
+/* How long to coalesce change notifications (i.e. the ftruncate()
+ * that triggers IN_MODIFY for readers) of our journal files */
+#define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
+
+/* How often to refresh the statistics in our service status string */
+#define STATUS_UPDATE_USEC (30*USEC_PER_SEC)
+
+/* How much of the runtime journal to copy to /var at a time, before
+ * we go back to process incoming messages */
+#define FLUSH_CHUNK_ENTRIES 1024U
+#define FLUSH_CHUNK_USEC (10*USEC_PER_MSEC)
+
+/* Where we remember how far the flush to /var got, so that it can
+ * be resumed if we are restarted in the middle of it */
+#define FLUSH_CURSOR_FILE "/run/systemd/journal/flush-cursor"
+
 static const char* const storage_table[_STORAGE_MAX] = {
         [STORAGE_AUTO] = "auto",
         [STORAGE_VOLATILE] = "volatile",
@@ -240,6 +262,38 @@ finish:
 #endif
 }
 
+static int open_journal(
+                Server *s,
+                bool reliably,
+                const char *fname,
+                int flags,
+                bool seal,
+                JournalMetrics *metrics,
+                JournalFile **ret) {
+        int r;
+        JournalFile *f;
+
+        assert(s);
+        assert(fname);
+        assert(ret);
+
+        if (reliably)
+                r = journal_file_open_reliably(fname, flags, 0640, s->compress, seal, metrics, s->mmap, NULL, &f);
+        else
+                r = journal_file_open(fname, flags, 0640, s->compress, seal, metrics, s->mmap, NULL, &f);
+        if (r < 0)
+                return r;
+
+        r = journal_file_enable_post_change_timer(f, s->event, POST_CHANGE_TIMER_INTERVAL_USEC);
+        if (r < 0) {
+                journal_file_close(f);
+                return r;
+        }
+
+        *ret = f;
+        return r;
+}
+
 static JournalFile* find_journal(Server *s, uid_t uid) {
         _cleanup_free_ char *p = NULL;
         int r;
@@ -278,7 +332,7 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
                 journal_file_close(f);
         }
 
-        r = journal_file_open_reliably(p, O_RDWR|O_CREAT, 0640, s->compress, s->seal, &s->system_metrics, s->mmap, NULL, &f);
+        r = open_journal(s, true, p, O_RDWR|O_CREAT, s->seal, &s->system_metrics, &f);
         if (r < 0)
                 return s->system_journal;
 
@@ -380,12 +434,12 @@ static void do_vacuum(
                 return;
 
         p = strjoina(path, id);
-        r = journal_directory_vacuum(p, metrics->max_use, s->max_retention_usec, &s->oldest_file_usec, false);
-        if (r < 0 && r != -ENOENT)
-                log_error_errno(r, "Failed to vacuum %s: %m", p);
+        r = journal_vacuumer_queue(s->vacuumer, p, metrics->max_use, s->max_retention_usec);
+        if (r < 0)
+                log_error_errno(r, "Failed to queue vacuuming of %s: %m", p);
 }
 
-void server_vacuum(Server *s) {
+void server_vacuum(Server *s, bool wait) {
         char ids[33];
         sd_id128_t machine;
         int r;
@@ -402,9 +456,39 @@ void server_vacuum(Server *s) {
         sd_id128_to_string(machine, ids);
 
         do_vacuum(s, ids, s->system_journal, "/var/log/journal/", &s->system_metrics);
-        do_vacuum(s, ids, s->runtime_journal, "/run/log/journal/", &s->runtime_metrics);
 
+        /* Don't remove runtime files we haven't flushed yet */
+        if (!s->flush_journal)
+                do_vacuum(s, ids, s->runtime_journal, "/run/log/journal/", &s->runtime_metrics);
+
+        /* The actual work is done in the background, unless the
+         * caller needs the space right away */
+        r = journal_vacuumer_start(s->vacuumer);
+        if (r < 0) {
+                log_error_errno(r, "Failed to start vacuuming: %m");
+                return;
+        }
+
+        if (wait)
+                journal_vacuumer_wait(s->vacuumer);
+}
+
+static void server_vacuum_done(JournalVacuumer *v, const VacuumResult *result, void *userdata) {
+        Server *s = userdata;
+        char fb[FORMAT_BYTES_MAX], ft[FORMAT_TIMESPAN_MAX];
+
+        assert(s);
+        assert(result);
+
+        s->oldest_file_usec = result->oldest_usec;
         s->cached_available_space_timestamp = 0;
+
+        s->n_vacuum_runs++;
+        s->vacuum_usec += result->duration;
+
+        log_debug("Vacuuming freed %s in %s.",
+                  format_bytes(fb, sizeof(fb), result->freed),
+                  format_timespan(ft, sizeof(ft), result->duration, USEC_PER_MSEC));
 }
 
 static void server_cache_machine_id(Server *s) {
@@ -502,7 +586,7 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned
         if (journal_file_rotate_suggested(f, s->max_file_usec)) {
                 log_debug("%s: Journal header limits reached or header out-of-date, rotating.", f->path);
                 server_rotate(s);
-                server_vacuum(s);
+                server_vacuum(s, false);
                 vacuumed = true;
 
                 f = find_journal(s, uid);
@@ -522,7 +606,7 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned
         }
 
         server_rotate(s);
-        server_vacuum(s);
+        server_vacuum(s, true);
 
         f = find_journal(s, uid);
         if (!f)
@@ -540,6 +624,7 @@ static void dispatch_message_real(
                 Server *s,
                 struct iovec *iovec, unsigned n, unsigned m,
                 const struct ucred *ucred,
+                ClientContext *cc,
                 const struct timeval *tv,
                 const char *label, size_t label_len,
                 const char *unit_id,
@@ -549,7 +634,6 @@ static void dispatch_message_real(
         char    pid[sizeof("_PID=") + DECIMAL_STR_MAX(pid_t)],
                 uid[sizeof("_UID=") + DECIMAL_STR_MAX(uid_t)],
                 gid[sizeof("_GID=") + DECIMAL_STR_MAX(gid_t)],
-                owner_uid[sizeof("_SYSTEMD_OWNER_UID=") + DECIMAL_STR_MAX(uid_t)],
                 source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)],
                 o_uid[sizeof("OBJECT_UID=") + DECIMAL_STR_MAX(uid_t)],
                 o_gid[sizeof("OBJECT_GID=") + DECIMAL_STR_MAX(gid_t)],
@@ -562,9 +646,7 @@ static void dispatch_message_real(
         uid_t realuid = 0, owner = 0, journal_uid;
         bool owner_valid = false;
 #ifdef HAVE_AUDIT
-        char    audit_session[sizeof("_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
-                audit_loginuid[sizeof("_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)],
-                o_audit_session[sizeof("OBJECT_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
+        char    o_audit_session[sizeof("OBJECT_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
                 o_audit_loginuid[sizeof("OBJECT_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)];
 
         uint32_t audit;
@@ -588,94 +670,51 @@ static void dispatch_message_real(
                 sprintf(gid, "_GID="GID_FMT, ucred->gid);
                 IOVEC_SET_STRING(iovec[n++], gid);
 
-                r = get_process_comm(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_COMM=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
-                }
-
-                r = get_process_exe(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_EXE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
-                }
-
-                r = get_process_cmdline(ucred->pid, 0, false, &t);
-                if (r >= 0) {
-                        x = strjoina("_CMDLINE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
-                }
-
-                r = get_process_capeff(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_CAP_EFFECTIVE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
+                if (cc) {
+                        if (cc->comm)
+                                IOVEC_SET_STRING(iovec[n++], cc->comm);
+                        if (cc->exe)
+                                IOVEC_SET_STRING(iovec[n++], cc->exe);
+                        if (cc->cmdline)
+                                IOVEC_SET_STRING(iovec[n++], cc->cmdline);
+                        if (cc->capeff)
+                                IOVEC_SET_STRING(iovec[n++], cc->capeff);
+
+                        if (cc->audit_session)
+                                IOVEC_SET_STRING(iovec[n++], cc->audit_session);
+                        if (cc->audit_loginuid)
+                                IOVEC_SET_STRING(iovec[n++], cc->audit_loginuid);
                 }
 
-#ifdef HAVE_AUDIT
-                r = audit_session_from_pid(ucred->pid, &audit);
-                if (r >= 0) {
-                        sprintf(audit_session, "_AUDIT_SESSION=%"PRIu32, audit);
-                        IOVEC_SET_STRING(iovec[n++], audit_session);
-                }
+                if (cc && cc->cgroup_valid) {
+                        IOVEC_SET_STRING(iovec[n++], cc->cgroup);
 
-                r = audit_loginuid_from_pid(ucred->pid, &loginuid);
-                if (r >= 0) {
-                        sprintf(audit_loginuid, "_AUDIT_LOGINUID="UID_FMT, loginuid);
-                        IOVEC_SET_STRING(iovec[n++], audit_loginuid);
-                }
-#endif
-
-                r = cg_pid_get_path_shifted(ucred->pid, s->cgroup_root, &c);
-                if (r >= 0) {
-                        char *session = NULL;
-
-                        x = strjoina("_SYSTEMD_CGROUP=", c);
-                        IOVEC_SET_STRING(iovec[n++], x);
-
-                        r = cg_path_get_session(c, &t);
-                        if (r >= 0) {
-                                session = strjoina("_SYSTEMD_SESSION=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], session);
-                        }
+                        if (cc->session)
+                                IOVEC_SET_STRING(iovec[n++], cc->session);
 
-                        if (cg_path_get_owner_uid(c, &owner) >= 0) {
+                        if (cc->owner_valid) {
                                 owner_valid = true;
+                                owner = cc->owner;
 
-                                sprintf(owner_uid, "_SYSTEMD_OWNER_UID="UID_FMT, owner);
-                                IOVEC_SET_STRING(iovec[n++], owner_uid);
+                                IOVEC_SET_STRING(iovec[n++], cc->owner_uid);
                         }
 
-                        if (cg_path_get_unit(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_UNIT=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], x);
-                        } else if (unit_id && !session) {
+                        if (cc->unit)
+                                IOVEC_SET_STRING(iovec[n++], cc->unit);
+                        else if (unit_id && !cc->session) {
                                 x = strjoina("_SYSTEMD_UNIT=", unit_id);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_user_unit(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_USER_UNIT=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], x);
-                        } else if (unit_id && session) {
+                        if (cc->user_unit)
+                                IOVEC_SET_STRING(iovec[n++], cc->user_unit);
+                        else if (unit_id && cc->session) {
                                 x = strjoina("_SYSTEMD_USER_UNIT=", unit_id);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_slice(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_SLICE=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], x);
-                        }
-
-                        free(c);
+                        if (cc->slice)
+                                IOVEC_SET_STRING(iovec[n++], cc->slice);
                 } else if (unit_id) {
                         x = strjoina("_SYSTEMD_UNIT=", unit_id);
                         IOVEC_SET_STRING(iovec[n++], x);
@@ -688,16 +727,8 @@ static void dispatch_message_real(
 
                                 *((char*) mempcpy(stpcpy(x, "_SELINUX_CONTEXT="), label, label_len)) = 0;
                                 IOVEC_SET_STRING(iovec[n++], x);
-                        } else {
-                                security_context_t con;
-
-                                if (getpidcon(ucred->pid, &con) >= 0) {
-                                        x = strjoina("_SELINUX_CONTEXT=", con);
-
-                                        freecon(con);
-                                        IOVEC_SET_STRING(iovec[n++], x);
-                                }
-                        }
+                        } else if (cc && cc->label)
+                                IOVEC_SET_STRING(iovec[n++], cc->label);
                 }
 #endif
         }
@@ -820,6 +851,48 @@ static void dispatch_message_real(
         write_to_journal(s, journal_uid, iovec, n, priority);
 }
 
+void server_maybe_update_status(Server *s) {
+        char ft[FORMAT_TIMESPAN_MAX];
+        JournalRateLimitTop top[3];
+        _cleanup_free_ char *noisy = NULL;
+        uint64_t hits, misses, dropped;
+        unsigned n, n_top, i;
+        usec_t ts;
+
+        assert(s);
+
+        ts = now(CLOCK_MONOTONIC);
+        if (s->last_status_update + STATUS_UPDATE_USEC > ts)
+                return;
+
+        client_context_cache_get_stats(s->client_contexts, &hits, &misses, &n);
+        journal_rate_limit_get_stats(s->rate_limit, &dropped, NULL);
+
+        /* Name those that log too much */
+        n_top = journal_rate_limit_get_top(s->rate_limit, top, ELEMENTSOF(top));
+        for (i = 0; i < n_top; i++) {
+                char *t;
+
+                if (asprintf(&t, "%s%s%s: %"PRIu64,
+                             strempty(noisy), i > 0 ? ", " : "",
+                             top[i].id, top[i].dropped) < 0)
+                        break;
+
+                free(noisy);
+                noisy = t;
+        }
+
+        sd_notifyf(false,
+                   "STATUS=Processing requests (client metadata cache: %u clients, %"PRIu64" hits, %"PRIu64" misses; "
+                   "%"PRIu64" messages dropped by rate limiting%s%s%s; "
+                   "vacuumed %u times in %s)...",
+                   n, hits, misses,
+                   dropped, noisy ? " (" : "", strempty(noisy), noisy ? ")" : "",
+                   s->n_vacuum_runs, format_timespan(ft, sizeof(ft), s->vacuum_usec, USEC_PER_MSEC));
+
+        s->last_status_update = ts;
+}
+
 void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) {
         char mid[11 + 32 + 1];
         char buffer[16 + LINE_MAX + 1];
@@ -849,7 +922,38 @@ void server_driver_message(Server *s, sd_id128_t message_id, const char *format,
         ucred.uid = getuid();
         ucred.gid = getgid();
 
-        dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, NULL, NULL, 0, NULL, LOG_INFO, 0);
+        dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, server_get_client_context(s, &ucred, true), NULL, NULL, 0, NULL, LOG_INFO, 0);
+}
+
+static bool shall_store(Server *s, unsigned n, int priority) {
+        if (n == 0)
+                return false;
+
+        if (LOG_PRI(priority) > s->max_level_store)
+                return false;
+
+        /* Stop early in case the information will not be stored
+         * in a journal. */
+        if (s->storage == STORAGE_NONE)
+                return false;
+
+        return true;
+}
+
+ClientContext *server_get_client_context(Server *s, const struct ucred *ucred, bool need_label) {
+        ClientContext *cc = NULL;
+        int r;
+
+        assert(s);
+
+        if (!ucred)
+                return NULL;
+
+        r = client_context_get(s->client_contexts, ucred->pid, s->cgroup_root, need_label, &cc);
+        if (r < 0)
+                log_debug_errno(r, "Failed to retrieve metadata of client "PID_FMT", ignoring: %m", ucred->pid);
+
+        return cc;
 }
 
 void server_dispatch_message(
@@ -862,30 +966,51 @@ void server_dispatch_message(
                 int priority,
                 pid_t object_pid) {
 
+        assert(s);
+        assert(iovec || n == 0);
+
+        if (!shall_store(s, n, priority))
+                return;
+
+        server_dispatch_message_with_context(s, iovec, n, m, ucred, server_get_client_context(s, ucred, !label),
+                                             tv, label, label_len, unit_id, priority, object_pid);
+}
+
+void server_dispatch_message_with_context(
+                Server *s,
+                struct iovec *iovec, unsigned n, unsigned m,
+                const struct ucred *ucred,
+                ClientContext *cc,
+                const struct timeval *tv,
+                const char *label, size_t label_len,
+                const char *unit_id,
+                int priority,
+                pid_t object_pid) {
+
         int rl, r;
         _cleanup_free_ char *path = NULL;
+        usec_t ts;
         char *c;
 
         assert(s);
         assert(iovec || n == 0);
 
-        if (n == 0)
-                return;
-
-        if (LOG_PRI(priority) > s->max_level_store)
-                return;
-
-        /* Stop early in case the information will not be stored
-         * in a journal. */
-        if (s->storage == STORAGE_NONE)
+        if (!shall_store(s, n, priority))
                 return;
 
         if (!ucred)
                 goto finish;
 
-        r = cg_pid_get_path_shifted(ucred->pid, s->cgroup_root, &path);
-        if (r < 0)
-                goto finish;
+        /* The client context usually knows the cgroup already */
+        if (cc && cc->cgroup_valid) {
+                path = strdup(cc->cgroup + strlen("_SYSTEMD_CGROUP="));
+                if (!path)
+                        goto finish;
+        } else {
+                r = cg_pid_get_path_shifted(ucred->pid, s->cgroup_root, &path);
+                if (r < 0)
+                        goto finish;
+        }
 
         /* example: /user/lennart/3/foobar
          *          /system/dbus.service/foobar
@@ -903,8 +1028,13 @@ void server_dispatch_message(
                 }
         }
 
+        /* Everything that arrives in one event loop iteration counts
+         * as arriving at the same time, that's good enough here */
+        if (sd_event_now(s->event, CLOCK_MONOTONIC, &ts) < 0)
+                ts = now(CLOCK_MONOTONIC);
+
         rl = journal_rate_limit_test(s->rate_limit, path,
-                                     priority & LOG_PRIMASK, available_space(s, false));
+                                     priority & LOG_PRIMASK, available_space(s, false), ts);
 
         if (rl == 0)
                 return;
@@ -915,7 +1045,7 @@ void server_dispatch_message(
                                       "Suppressed %u messages from %s", rl - 1, path);
 
 finish:
-        dispatch_message_real(s, iovec, n, m, ucred, tv, label, label_len, unit_id, priority, object_pid);
+        dispatch_message_real(s, iovec, n, m, ucred, cc, tv, label, label_len, unit_id, priority, object_pid);
 }
 
 
@@ -949,7 +1079,7 @@ static int system_journal_open(Server *s, bool flush_requested) {
                 (void) mkdir(fn, 0755);
 
                 fn = strjoina(fn, "/system.journal");
-                r = journal_file_open_reliably(fn, O_RDWR|O_CREAT, 0640, s->compress, s->seal, &s->system_metrics, s->mmap, NULL, &s->system_journal);
+                r = open_journal(s, true, fn, O_RDWR|O_CREAT, s->seal, &s->system_metrics, &s->system_journal);
 
                 if (r >= 0)
                         server_fix_perms(s, s->system_journal, 0);
@@ -974,7 +1104,7 @@ static int system_journal_open(Server *s, bool flush_requested) {
                          * if it already exists, so that we can flush
                          * it into the system journal */
 
-                        r = journal_file_open(fn, O_RDWR, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
+                        r = open_journal(s, false, fn, O_RDWR, false, &s->runtime_metrics, &s->runtime_journal);
                         free(fn);
 
                         if (r < 0) {
@@ -993,7 +1123,7 @@ static int system_journal_open(Server *s, bool flush_requested) {
                         (void) mkdir("/run/log/journal", 0755);
                         (void) mkdir_parents(fn, 0750);
 
-                        r = journal_file_open_reliably(fn, O_RDWR|O_CREAT, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
+                        r = open_journal(s, true, fn, O_RDWR|O_CREAT, false, &s->runtime_metrics, &s->runtime_journal);
                         free(fn);
 
                         if (r < 0)
@@ -1009,97 +1139,251 @@ static int system_journal_open(Server *s, bool flush_requested) {
         return r;
 }
 
-int server_flush_to_var(Server *s) {
-        sd_id128_t machine;
-        sd_journal *j = NULL;
+static void server_finish_flush(Server *s, int r) {
         char ts[FORMAT_TIMESPAN_MAX];
-        usec_t start;
-        unsigned n = 0;
-        int r;
 
         assert(s);
+        assert(s->flush_journal);
 
-        if (s->storage != STORAGE_AUTO &&
-            s->storage != STORAGE_PERSISTENT)
-                return 0;
+        if (s->system_journal)
+                journal_file_post_change(s->system_journal);
 
-        if (!s->runtime_journal)
-                return 0;
+        journal_file_close(s->runtime_journal);
+        s->runtime_journal = NULL;
 
-        system_journal_open(s, true);
+        if (r >= 0) {
+                (void) rm_rf("/run/log/journal", REMOVE_ROOT);
+                (void) unlink(FLUSH_CURSOR_FILE);
+        }
 
-        if (!s->system_journal)
+        s->flush_event_source = sd_event_source_unref(s->flush_event_source);
+        s->flush_cache = journal_copy_cache_free(s->flush_cache);
+        sd_journal_close(s->flush_journal);
+        s->flush_journal = NULL;
+
+        server_driver_message(s, SD_ID128_NULL, "Time spent on flushing to /var is %s for %u entries.", format_timespan(ts, sizeof(ts), now(CLOCK_MONOTONIC) - s->flush_start, 0), s->n_flushed);
+
+        if (s->flush_requested) {
+                touch("/run/systemd/journal/flushed");
+                s->flush_requested = false;
+        }
+}
+
+static int flush_entry(Server *s) {
+        sd_journal *j = s->flush_journal;
+        Object *o = NULL;
+        JournalFile *f;
+        int r;
+
+        f = j->current_file;
+        assert(f && f->current_offset > 0);
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
+        if (r < 0)
+                return log_error_errno(r, "Can't read entry: %m");
+
+        r = journal_file_copy_entry_cached(f, s->system_journal, o, f->current_offset, s->flush_cache, NULL, NULL, NULL);
+        if (r >= 0)
                 return 0;
 
-        log_debug("Flushing to /var...");
+        if (!shall_try_append_again(s->system_journal, r))
+                return log_error_errno(r, "Can't write entry: %m");
 
-        start = now(CLOCK_MONOTONIC);
+        server_rotate(s);
+        server_vacuum(s, true);
 
-        r = sd_id128_get_machine(&machine);
+        if (!s->system_journal) {
+                log_notice("Didn't flush runtime journal since rotation of system journal wasn't successful.");
+                return -EIO;
+        }
+
+        log_debug("Retrying write.");
+
+        /* Rotation might have moved the window the entry was in */
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
         if (r < 0)
-                return r;
+                return log_error_errno(r, "Can't read entry: %m");
 
-        r = sd_journal_open(&j, SD_JOURNAL_RUNTIME_ONLY);
+        r = journal_file_copy_entry_cached(f, s->system_journal, o, f->current_offset, s->flush_cache, NULL, NULL, NULL);
         if (r < 0)
-                return log_error_errno(r, "Failed to read runtime journal: %m");
+                return log_error_errno(r, "Can't write entry: %m");
 
-        sd_journal_set_data_threshold(j, 0);
+        return 0;
+}
+
+static int dispatch_flush(sd_event_source *es, void *userdata) {
+        _cleanup_free_ char *cursor = NULL;
+        Server *s = userdata;
+        unsigned n = 0;
+        usec_t start;
+        int r;
 
-        SD_JOURNAL_FOREACH(j) {
-                Object *o = NULL;
-                JournalFile *f;
+        assert(s);
+        assert(s->flush_journal);
 
-                f = j->current_file;
-                assert(f && f->current_offset > 0);
+        start = now(CLOCK_MONOTONIC);
 
-                n++;
+        /* Pick up runtime journal files that got rotated while we
+         * were processing messages in between */
+        (void) sd_journal_process(s->flush_journal);
 
-                r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
+        for (;;) {
+                r = sd_journal_next(s->flush_journal);
                 if (r < 0) {
-                        log_error_errno(r, "Can't read entry: %m");
-                        goto finish;
+                        log_error_errno(r, "Failed to iterate runtime journal: %m");
+                        break;
+                }
+                if (r == 0) {
+                        /* We caught up with the runtime journal, and
+                         * since we are the only writer nothing can be
+                         * added to it before we close it. */
+                        break;
                 }
 
-                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
-                if (r >= 0)
-                        continue;
+                r = flush_entry(s);
+                if (r < 0)
+                        break;
 
-                if (!shall_try_append_again(s->system_journal, r)) {
-                        log_error_errno(r, "Can't write entry: %m");
-                        goto finish;
-                }
+                n++;
 
-                server_rotate(s);
-                server_vacuum(s);
+                if (n >= FLUSH_CHUNK_ENTRIES ||
+                    (n % 64 == 0 && now(CLOCK_MONOTONIC) >= start + FLUSH_CHUNK_USEC)) {
+                        s->n_flushed += n;
 
-                if (!s->system_journal) {
-                        log_notice("Didn't flush runtime journal since rotation of system journal wasn't successful.");
-                        r = -EIO;
-                        goto finish;
-                }
+                        /* Entries copied after the last saved
+                         * cursor are copied a second time if we
+                         * are interrupted, but none are lost */
+                        journal_file_post_change(s->system_journal);
 
-                log_debug("Retrying write.");
-                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
-                if (r < 0) {
-                        log_error_errno(r, "Can't write entry: %m");
-                        goto finish;
+                        r = sd_journal_get_cursor(s->flush_journal, &cursor);
+                        if (r >= 0)
+                                r = write_string_file_atomic(FLUSH_CURSOR_FILE, cursor);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to save flush position, ignoring: %m");
+
+                        return 0;
                 }
         }
 
-finish:
-        journal_file_post_change(s->system_journal);
+        s->n_flushed += n;
+        server_finish_flush(s, r);
 
-        journal_file_close(s->runtime_journal);
-        s->runtime_journal = NULL;
+        return 0;
+}
 
-        if (r >= 0)
-                (void) rm_rf("/run/log/journal", REMOVE_ROOT);
+int server_seek_flush_cursor(sd_journal *j, const char *fn) {
+        _cleanup_free_ char *cursor = NULL;
+        int r;
 
-        sd_journal_close(j);
+        assert(j);
+        assert(fn);
 
-        server_driver_message(s, SD_ID128_NULL, "Time spent on flushing to /var is %s for %u entries.", format_timespan(ts, sizeof(ts), now(CLOCK_MONOTONIC) - start, 0), n);
+        r = read_one_line_file(fn, &cursor);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return log_warning_errno(r, "Failed to read %s, flushing everything: %m", fn);
 
-        return r;
+        r = sd_journal_seek_cursor(j, cursor);
+        if (r < 0)
+                return log_warning_errno(r, "Failed to seek to flush position %s, flushing everything: %m", cursor);
+
+        /* Skip the entry the cursor refers to, it was copied
+         * already. If it is gone, start with the one after it. */
+        r = sd_journal_next(j);
+        if (r > 0 && sd_journal_test_cursor(j, cursor) <= 0)
+                r = sd_journal_seek_cursor(j, cursor);
+        if (r < 0)
+                return log_warning_errno(r, "Failed to seek to flush position %s: %m", cursor);
+
+        return 1;
+}
+
+static int flush_seek_cursor(Server *s) {
+        int r;
+
+        assert(s);
+
+        r = server_seek_flush_cursor(s->flush_journal, FLUSH_CURSOR_FILE);
+        if (r <= 0)
+                return r;
+
+        log_info("Resuming interrupted flush to /var.");
+
+        /* The request that started the flush might still wait for
+         * us to finish it */
+        s->flush_requested = true;
+
+        return 1;
+}
+
+int server_flush_to_var(Server *s) {
+        sd_journal *j = NULL;
+        int r;
+
+        assert(s);
+
+        /* Copies the runtime journal to /var in chunks, interleaved
+         * with the processing of incoming messages. Until it is done
+         * new messages keep going to the runtime journal, so that
+         * their order is retained. */
+
+        if (s->storage != STORAGE_AUTO &&
+            s->storage != STORAGE_PERSISTENT)
+                return 0;
+
+        if (!s->runtime_journal)
+                return 0;
+
+        if (s->flush_journal)
+                return 0;
+
+        system_journal_open(s, true);
+
+        if (!s->system_journal)
+                return 0;
+
+        log_debug("Flushing to /var...");
+
+        r = sd_journal_open(&j, SD_JOURNAL_RUNTIME_ONLY);
+        if (r < 0)
+                return log_error_errno(r, "Failed to read runtime journal: %m");
+
+        sd_journal_set_data_threshold(j, 0);
+
+        /* Set up inotify, so that rotated runtime files are noticed */
+        r = sd_journal_get_fd(j);
+        if (r < 0) {
+                sd_journal_close(j);
+                return log_error_errno(r, "Failed to watch runtime journal: %m");
+        }
+
+        s->flush_cache = journal_copy_cache_new();
+        if (!s->flush_cache) {
+                sd_journal_close(j);
+                return log_oom();
+        }
+
+        s->flush_journal = j;
+        s->flush_start = now(CLOCK_MONOTONIC);
+        s->n_flushed = 0;
+
+        (void) flush_seek_cursor(s);
+
+        /* Datagram sockets take precedence, streams take turns with
+         * us */
+        r = sd_event_add_defer(s->event, &s->flush_event_source, dispatch_flush, s);
+        if (r >= 0)
+                r = sd_event_source_set_priority(s->flush_event_source, SD_EVENT_PRIORITY_NORMAL+5);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(s->flush_event_source, SD_EVENT_ON);
+        if (r < 0) {
+                log_error_errno(r, "Failed to schedule flushing to /var: %m");
+                server_finish_flush(s, r);
+                return r;
+        }
+
+        return 0;
 }
 
 int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
@@ -1235,11 +1519,17 @@ static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *
 
         log_info("Received request to flush runtime journal from PID %"PRIu32, si->ssi_pid);
 
+        /* The flushed file is created once the flush is complete */
+        s->flush_requested = true;
+
         server_flush_to_var(s);
         server_sync(s);
-        server_vacuum(s);
+        server_vacuum(s, false);
 
-        touch("/run/systemd/journal/flushed");
+        if (!s->flush_journal) {
+                touch("/run/systemd/journal/flushed");
+                s->flush_requested = false;
+        }
 
         return 0;
 }
@@ -1251,7 +1541,7 @@ static int dispatch_sigusr2(sd_event_source *es, const struct signalfd_siginfo *
 
         log_info("Received request to rotate journal from PID %"PRIu32, si->ssi_pid);
         server_rotate(s);
-        server_vacuum(s);
+        server_vacuum(s, false);
 
         return 0;
 }
@@ -1347,6 +1637,46 @@ static int server_parse_proc_cmdline(Server *s) {
         return 0;
 }
 
+static int server_setup_rate_limit(Server *s) {
+        char **i;
+        int r;
+
+        assert(s);
+
+        s->rate_limit = journal_rate_limit_new(s->rate_limit_interval, s->rate_limit_burst);
+        if (!s->rate_limit)
+                return -ENOMEM;
+
+        /* Entries are of the form UNIT:BURST, the unit usually being
+         * a slice whose budget is shared by everything in it */
+        STRV_FOREACH(i, s->rate_limit_unit_burst) {
+                _cleanup_free_ char *unit = NULL;
+                unsigned burst;
+                const char *e;
+
+                e = strrchr(*i, ':');
+                if (!e || safe_atou(e + 1, &burst) < 0) {
+                        log_warning("Failed to parse rate limit burst '%s', ignoring.", *i);
+                        continue;
+                }
+
+                unit = strndup(*i, e - *i);
+                if (!unit)
+                        return log_oom();
+
+                if (!unit_name_is_valid(unit, UNIT_NAME_PLAIN|UNIT_NAME_INSTANCE)) {
+                        log_warning("Invalid unit name in rate limit burst '%s', ignoring.", *i);
+                        continue;
+                }
+
+                r = journal_rate_limit_set_burst(s->rate_limit, unit, burst);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
 static int server_parse_config_file(Server *s) {
         assert(s);
 
@@ -1455,6 +1785,44 @@ static int server_open_hostname(Server *s) {
         return 0;
 }
 
+static int dispatch_forward(sd_event_source *es, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        server_flush_forward(s);
+        return 0;
+}
+
+static int server_setup_forward(Server *s) {
+        int r;
+
+        assert(s);
+
+        /* Messages forwarded to syslog and the console are queued up
+         * while we process incoming messages, and are written out
+         * in one go before the event loop goes back to sleep. This
+         * is needed even if forwarding is off globally, since stream
+         * clients may turn it on for themselves. */
+
+        r = sd_event_add_post(s->event, &s->forward_event_source, dispatch_forward, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add forwarding event source: %m");
+
+        r = sd_event_source_set_priority(s->forward_event_source, SD_EVENT_PRIORITY_IDLE);
+        if (r < 0)
+                return log_error_errno(r, "Failed to adjust priority of forwarding event source: %m");
+
+        return 0;
+}
+
+void server_flush_forward(Server *s) {
+        assert(s);
+
+        server_flush_syslog(s);
+        server_flush_console(s);
+}
+
 int server_init(Server *s) {
         _cleanup_fdset_free_ FDSet *fds = NULL;
         int n, r, fd;
@@ -1603,14 +1971,26 @@ int server_init(Server *s) {
         if (r < 0)
                 return r;
 
+        r = server_setup_forward(s);
+        if (r < 0)
+                return r;
+
         s->udev = udev_new();
         if (!s->udev)
                 return -ENOMEM;
 
-        s->rate_limit = journal_rate_limit_new(s->rate_limit_interval, s->rate_limit_burst);
-        if (!s->rate_limit)
+        r = server_setup_rate_limit(s);
+        if (r < 0)
+                return r;
+
+        s->client_contexts = client_context_cache_new();
+        if (!s->client_contexts)
                 return -ENOMEM;
 
+        r = journal_vacuumer_new(s->event, server_vacuum_done, s, &s->vacuumer);
+        if (r < 0)
+                return r;
+
         r = cg_get_root_path(&s->cgroup_root);
         if (r < 0)
                 return r;
@@ -1649,6 +2029,12 @@ void server_done(Server *s) {
         while (s->stdout_streams)
                 stdout_stream_free(s->stdout_streams);
 
+        server_flush_forward(s);
+
+        /* An unfinished flush is resumed on the next start */
+        journal_copy_cache_free(s->flush_cache);
+        sd_journal_close(s->flush_journal);
+
         if (s->system_journal)
                 journal_file_close(s->system_journal);
 
@@ -1660,6 +2046,9 @@ void server_done(Server *s) {
 
         ordered_hashmap_free(s->user_journals);
 
+        /* Waits for a vacuuming run in progress */
+        journal_vacuumer_free(s->vacuumer);
+
         sd_event_source_unref(s->syslog_event_source);
         sd_event_source_unref(s->native_event_source);
         sd_event_source_unref(s->stdout_event_source);
@@ -1671,6 +2060,8 @@ void server_done(Server *s) {
         sd_event_source_unref(s->sigterm_event_source);
         sd_event_source_unref(s->sigint_event_source);
         sd_event_source_unref(s->hostname_event_source);
+        sd_event_source_unref(s->forward_event_source);
+        sd_event_source_unref(s->flush_event_source);
         sd_event_unref(s->event);
 
         safe_close(s->syslog_fd);
@@ -1683,11 +2074,16 @@ void server_done(Server *s) {
         if (s->rate_limit)
                 journal_rate_limit_free(s->rate_limit);
 
+        client_context_cache_free(s->client_contexts);
+
         if (s->kernel_seqnum)
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
         free(s->buffer);
+        free(s->syslog_batch);
+        free(s->console_batch);
         free(s->tty_path);
+        strv_free(s->rate_limit_unit_burst);
         free(s->cgroup_root);
         free(s->hostname_field);
 
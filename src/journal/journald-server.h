@@ -23,12 +23,16 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
 #include "sd-event.h"
+#include "sd-journal.h"
 #include "journal-file.h"
 #include "hashmap.h"
 #include "audit.h"
 #include "journald-rate-limit.h"
+#include "journald-context.h"
+#include "journald-vacuum.h"
 #include "list.h"
 
 typedef enum Storage {
@@ -50,6 +54,18 @@ typedef enum SplitMode {
 
 typedef struct StdoutStream StdoutStream;
 
+/* Syslog messages are forwarded in batches of at most this many,
+ * console output once this many bytes are queued up */
+#define SYSLOG_BATCH_MAX 64
+#define CONSOLE_BATCH_MAX (64U*1024U)
+
+typedef struct SyslogMessage {
+        size_t offset;
+        size_t length;
+        struct ucred ucred;
+        bool have_ucred;
+} SyslogMessage;
+
 typedef struct Server {
         int syslog_fd;
         int native_fd;
@@ -71,6 +87,8 @@ typedef struct Server {
         sd_event_source *sigterm_event_source;
         sd_event_source *sigint_event_source;
         sd_event_source *hostname_event_source;
+        sd_event_source *forward_event_source;
+        sd_event_source *flush_event_source;
 
         JournalFile *runtime_journal;
         JournalFile *system_journal;
@@ -82,9 +100,11 @@ typedef struct Server {
         size_t buffer_size;
 
         JournalRateLimit *rate_limit;
+        ClientContextCache *client_contexts;
         usec_t sync_interval_usec;
         usec_t rate_limit_interval;
         unsigned rate_limit_burst;
+        char **rate_limit_unit_burst;
 
         JournalMetrics runtime_metrics;
         JournalMetrics system_metrics;
@@ -100,6 +120,14 @@ typedef struct Server {
         unsigned n_forward_syslog_missed;
         usec_t last_warn_forward_syslog_missed;
 
+        char *syslog_batch;
+        size_t syslog_batch_size, syslog_batch_allocated;
+        SyslogMessage syslog_messages[SYSLOG_BATCH_MAX];
+        unsigned n_syslog_messages;
+
+        char *console_batch;
+        size_t console_batch_size, console_batch_allocated;
+
         uint64_t cached_available_space;
         usec_t cached_available_space_timestamp;
 
@@ -109,6 +137,16 @@ typedef struct Server {
         usec_t max_file_usec;
         usec_t oldest_file_usec;
 
+        sd_journal *flush_journal;
+        JournalCopyCache *flush_cache;
+        usec_t flush_start;
+        unsigned n_flushed;
+        bool flush_requested;
+
+        JournalVacuumer *vacuumer;
+        unsigned n_vacuum_runs;
+        usec_t vacuum_usec;
+
         LIST_HEAD(StdoutStream, stdout_streams);
         unsigned n_stdout_streams;
 
@@ -139,6 +177,8 @@ typedef struct Server {
 
         /* Cached cgroup root, so that we don't have to query that all the time */
         char *cgroup_root;
+
+        usec_t last_status_update;
 } Server;
 
 #define N_IOVEC_META_FIELDS 20
@@ -147,6 +187,12 @@ typedef struct Server {
 #define N_IOVEC_OBJECT_FIELDS 11
 
 void server_dispatch_message(Server *s, struct iovec *iovec, unsigned n, unsigned m, const struct ucred *ucred, const struct timeval *tv, const char *label, size_t label_len, const char *unit_id, int priority, pid_t object_pid);
+
+/* For callers dispatching many messages of the same client in a row:
+ * look up its metadata once, and pass it along with each message. The
+ * context is only valid until control returns to the event loop. */
+ClientContext *server_get_client_context(Server *s, const struct ucred *ucred, bool need_label);
+void server_dispatch_message_with_context(Server *s, struct iovec *iovec, unsigned n, unsigned m, const struct ucred *ucred, ClientContext *cc, const struct timeval *tv, const char *label, size_t label_len, const char *unit_id, int priority, pid_t object_pid);
 void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) _printf_(3,4);
 
 /* gperf lookup function */
@@ -166,9 +212,12 @@ void server_fix_perms(Server *s, JournalFile *f, uid_t uid);
 int server_init(Server *s);
 void server_done(Server *s);
 void server_sync(Server *s);
-void server_vacuum(Server *s);
+void server_vacuum(Server *s, bool wait);
 void server_rotate(Server *s);
+void server_flush_forward(Server *s);
 int server_schedule_sync(Server *s, int priority);
 int server_flush_to_var(Server *s);
+int server_seek_flush_cursor(sd_journal *j, const char *fn);
 void server_maybe_append_tags(Server *s);
+void server_maybe_update_status(Server *s);
 int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata);
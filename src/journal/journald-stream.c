@@ -73,8 +73,21 @@ struct StdoutStream {
 
         bool fdstore:1;
 
-        char buffer[LINE_MAX+1];
-        size_t length;
+        /* The fields that are the same for each message of the
+         * stream, prepared when the first message is logged */
+        bool fields_ready:1;
+        char *identifier_field;
+        char priority_field[sizeof("PRIORITY=") + 1];
+        char facility_field[sizeof("SYSLOG_FACILITY=")-1 + DECIMAL_STR_MAX(int) + 1];
+        struct iovec fields[4];
+        unsigned n_fields;
+
+        /* The metadata of the peer, looked up once for all lines
+         * read in one go */
+        ClientContext *context;
+        bool context_valid:1;
+
+        StdoutStreamBuffer buffer;
 
         sd_event_source *event_source;
 
@@ -108,6 +121,8 @@ void stdout_stream_free(StdoutStream *s) {
         free(s->identifier);
         free(s->unit_id);
         free(s->state_file);
+        free(s->identifier_field);
+        stdout_stream_buffer_done(&s->buffer);
 
         free(s);
 }
@@ -218,15 +233,57 @@ finish:
         return r;
 }
 
+static void stdout_stream_format_priority(
+                int priority,
+                char priority_field[sizeof("PRIORITY=") + 1],
+                char facility_field[sizeof("SYSLOG_FACILITY=")-1 + DECIMAL_STR_MAX(int) + 1],
+                struct iovec *iovec, unsigned *n) {
+
+        memcpy(priority_field, "PRIORITY=", strlen("PRIORITY="));
+        priority_field[strlen("PRIORITY=")] = '0' + LOG_PRI(priority);
+        priority_field[strlen("PRIORITY=") + 1] = 0;
+        IOVEC_SET_STRING(iovec[(*n)++], priority_field);
+
+        if (priority & LOG_FACMASK) {
+                sprintf(facility_field, "SYSLOG_FACILITY=%i", LOG_FAC(priority));
+                IOVEC_SET_STRING(iovec[(*n)++], facility_field);
+        }
+}
+
+static int stdout_stream_setup_fields(StdoutStream *s) {
+        assert(s);
+
+        s->n_fields = 0;
+
+        IOVEC_SET_STRING(s->fields[s->n_fields++], "_TRANSPORT=stdout");
+
+        stdout_stream_format_priority(s->priority, s->priority_field, s->facility_field, s->fields, &s->n_fields);
+
+        if (s->identifier) {
+                free(s->identifier_field);
+                s->identifier_field = strappend("SYSLOG_IDENTIFIER=", s->identifier);
+                if (!s->identifier_field)
+                        return log_oom();
+
+                IOVEC_SET_STRING(s->fields[s->n_fields++], s->identifier_field);
+        }
+
+        assert(s->n_fields <= ELEMENTSOF(s->fields));
+
+        s->fields_ready = true;
+        return 0;
+}
+
 static int stdout_stream_log(StdoutStream *s, const char *p) {
         struct iovec iovec[N_IOVEC_META_FIELDS + 5];
         int priority;
-        char syslog_priority[] = "PRIORITY=\0";
+        char syslog_priority[sizeof("PRIORITY=") + 1];
         char syslog_facility[sizeof("SYSLOG_FACILITY=")-1 + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
+        char message[sizeof("MESSAGE=") + LINE_MAX];
         unsigned n = 0;
         char *label = NULL;
         size_t label_len = 0;
+        int r;
 
         assert(s);
         assert(p);
@@ -234,6 +291,12 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
         if (isempty(p))
                 return 0;
 
+        if (!s->fields_ready) {
+                r = stdout_stream_setup_fields(s);
+                if (r < 0)
+                        return r;
+        }
+
         priority = s->priority;
 
         if (s->level_prefix)
@@ -251,25 +314,21 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
         if (s->server->forward_to_wall)
                 server_forward_wall(s->server, priority, s->identifier, p, &s->ucred);
 
-        IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=stdout");
+        if (priority == s->priority) {
+                memcpy(iovec, s->fields, s->n_fields * sizeof(struct iovec));
+                n = s->n_fields;
+        } else {
+                IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=stdout");
 
-        syslog_priority[strlen("PRIORITY=")] = '0' + LOG_PRI(priority);
-        IOVEC_SET_STRING(iovec[n++], syslog_priority);
+                stdout_stream_format_priority(priority, syslog_priority, syslog_facility, iovec, &n);
 
-        if (priority & LOG_FACMASK) {
-                xsprintf(syslog_facility, "SYSLOG_FACILITY=%i", LOG_FAC(priority));
-                IOVEC_SET_STRING(iovec[n++], syslog_facility);
+                if (s->identifier_field)
+                        IOVEC_SET_STRING(iovec[n++], s->identifier_field);
         }
 
-        if (s->identifier) {
-                syslog_identifier = strappend("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        IOVEC_SET_STRING(iovec[n++], syslog_identifier);
-        }
-
-        message = strappend("MESSAGE=", p);
-        if (message)
-                IOVEC_SET_STRING(iovec[n++], message);
+        /* Lines are at most LINE_MAX long, see stdout_stream_buffer_scan() */
+        *((char*) mempcpy(stpcpy(message, "MESSAGE="), p, strnlen(p, LINE_MAX))) = 0;
+        IOVEC_SET_STRING(iovec[n++], message);
 
 #ifdef HAVE_SELINUX
         if (s->security_context) {
@@ -278,7 +337,12 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
         }
 #endif
 
-        server_dispatch_message(s->server, iovec, n, ELEMENTSOF(iovec), &s->ucred, NULL, label, label_len, s->unit_id, priority, 0);
+        if (!s->context_valid) {
+                s->context = server_get_client_context(s->server, &s->ucred, !label);
+                s->context_valid = true;
+        }
+
+        server_dispatch_message_with_context(s->server, iovec, n, ELEMENTSOF(iovec), &s->ucred, s->context, NULL, label, label_len, s->unit_id, priority, 0);
         return 0;
 }
 
@@ -382,41 +446,68 @@ static int stdout_stream_line(StdoutStream *s, char *p) {
         assert_not_reached("Unknown stream state");
 }
 
-static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
+int stdout_stream_buffer_init(StdoutStreamBuffer *b) {
+        assert(b);
+
+        b->data = new(char, STDOUT_STREAM_BUFFER_MIN);
+        if (!b->data)
+                return -ENOMEM;
+
+        b->length = 0;
+        b->allocated = STDOUT_STREAM_BUFFER_MIN;
+
+        return 0;
+}
+
+void stdout_stream_buffer_done(StdoutStreamBuffer *b) {
+        assert(b);
+
+        free(b->data);
+        b->data = NULL;
+        b->length = b->allocated = 0;
+}
+
+static int stdout_stream_buffer_scan(StdoutStreamBuffer *b, bool force_flush, stdout_stream_line_handler_t handler, void *userdata) {
         char *p;
         size_t remaining;
         int r;
 
-        assert(s);
+        assert(b);
+        assert(handler);
 
-        p = s->buffer;
-        remaining = s->length;
+        p = b->data;
+        remaining = b->length;
         for (;;) {
                 char *end;
                 size_t skip;
+                char c;
 
-                end = memchr(p, '\n', remaining);
+                end = memchr(p, '\n', MIN(remaining, (size_t) LINE_MAX));
                 if (end)
                         skip = end - p + 1;
-                else if (remaining >= sizeof(s->buffer) - 1) {
-                        end = p + sizeof(s->buffer) - 1;
-                        skip = remaining;
+                else if (remaining >= LINE_MAX) {
+                        /* Overly long lines are split at LINE_MAX */
+                        end = p + LINE_MAX;
+                        skip = LINE_MAX;
                 } else
                         break;
 
+                c = *end;
                 *end = 0;
 
-                r = stdout_stream_line(s, p);
+                r = handler(p, userdata);
                 if (r < 0)
                         return r;
 
+                *end = c;
+
                 remaining -= skip;
                 p += skip;
         }
 
         if (force_flush && remaining > 0) {
                 p[remaining] = 0;
-                r = stdout_stream_line(s, p);
+                r = handler(p, userdata);
                 if (r < 0)
                         return r;
 
@@ -424,44 +515,103 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 remaining = 0;
         }
 
-        if (p > s->buffer) {
-                memmove(s->buffer, p, remaining);
-                s->length = remaining;
+        if (p > b->data) {
+                memmove(b->data, p, remaining);
+                b->length = remaining;
         }
 
         return 0;
 }
 
-static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
-        StdoutStream *s = userdata;
+static void stdout_stream_buffer_resize(StdoutStreamBuffer *b, bool filled, size_t l) {
+        size_t n;
+        char *d;
+
+        assert(b);
+
+        /* Grow the buffer if a read filled it up completely, shrink
+         * it again when reads get small */
+        if (filled && b->allocated < STDOUT_STREAM_BUFFER_MAX)
+                n = MIN(b->allocated * 2, STDOUT_STREAM_BUFFER_MAX);
+        else if (!filled && l < b->allocated / 8 && b->length < STDOUT_STREAM_BUFFER_MIN - 1 && b->allocated > STDOUT_STREAM_BUFFER_MIN)
+                n = MAX(b->allocated / 2, STDOUT_STREAM_BUFFER_MIN);
+        else
+                return;
+
+        d = realloc(b->data, n);
+        if (!d)
+                return;
+
+        b->data = d;
+        b->allocated = n;
+}
+
+/* Reads what is available from fd, and passes each complete line to
+ * handler, all of them before the next read. Returns 0 once the other
+ * side is done, after the incomplete line at the end was passed on
+ * too, and -EAGAIN if there was nothing to read. */
+int stdout_stream_buffer_read(StdoutStreamBuffer *b, int fd, stdout_stream_line_handler_t handler, void *userdata) {
+        size_t available;
         ssize_t l;
         int r;
 
-        assert(s);
+        assert(b);
+        assert(fd >= 0);
+        assert(handler);
 
-        if ((revents|EPOLLIN|EPOLLHUP) != (EPOLLIN|EPOLLHUP)) {
-                log_error("Got invalid event from epoll for stdout stream: %"PRIx32, revents);
-                goto terminate;
-        }
+        /* Leave room for the trailing NUL */
+        available = b->allocated - 1 - b->length;
 
-        l = read(s->fd, s->buffer+s->length, sizeof(s->buffer)-1-s->length);
+        l = read(fd, b->data + b->length, available);
         if (l < 0) {
-
                 if (errno == EAGAIN)
-                        return 0;
+                        return -EAGAIN;
 
-                log_warning_errno(errno, "Failed to read from stream: %m");
-                goto terminate;
+                return log_warning_errno(errno, "Failed to read from stream: %m");
         }
 
         if (l == 0) {
-                stdout_stream_scan(s, true);
-                goto terminate;
+                r = stdout_stream_buffer_scan(b, true, handler, userdata);
+                return r < 0 ? r : 0;
         }
 
-        s->length += l;
-        r = stdout_stream_scan(s, false);
+        b->length += l;
+        r = stdout_stream_buffer_scan(b, false, handler, userdata);
         if (r < 0)
+                return r;
+
+        stdout_stream_buffer_resize(b, (size_t) l == available, l);
+
+        return 1;
+}
+
+static int stdout_stream_line_handler(char *line, void *userdata) {
+        return stdout_stream_line(userdata, line);
+}
+
+static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        StdoutStream *s = userdata;
+        int r;
+
+        assert(s);
+
+        if ((revents|EPOLLIN|EPOLLHUP) != (EPOLLIN|EPOLLHUP)) {
+                log_error("Got invalid event from epoll for stdout stream: %"PRIx32, revents);
+                goto terminate;
+        }
+
+        /* All lines of one read are dispatched as a batch, for which
+         * the peer's metadata is looked up only once */
+        s->context_valid = false;
+
+        r = stdout_stream_buffer_read(&s->buffer, s->fd, stdout_stream_line_handler, s);
+
+        s->context = NULL;
+        s->context_valid = false;
+
+        if (r == -EAGAIN)
+                return 0;
+        if (r <= 0)
                 goto terminate;
 
         return 1;
@@ -485,6 +635,10 @@ static int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
         stream->fd = -1;
         stream->priority = LOG_INFO;
 
+        r = stdout_stream_buffer_init(&stream->buffer);
+        if (r < 0)
+                return log_oom();
+
         r = getpeercred(fd, &stream->ucred);
         if (r < 0)
                 return log_error_errno(r, "Failed to determine peer credentials: %m");
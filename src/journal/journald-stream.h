@@ -24,6 +24,22 @@
 #include "fdset.h"
 #include "journald-server.h"
 
+/* Streams start out with room for one line, and get more room for
+ * reading many lines at once while they keep filling it up */
+#define STDOUT_STREAM_BUFFER_MIN (LINE_MAX+1)
+#define STDOUT_STREAM_BUFFER_MAX (64U*1024U)
+
+typedef struct StdoutStreamBuffer {
+        char *data;
+        size_t length, allocated;
+} StdoutStreamBuffer;
+
+typedef int (*stdout_stream_line_handler_t)(char *line, void *userdata);
+
+int stdout_stream_buffer_init(StdoutStreamBuffer *b);
+void stdout_stream_buffer_done(StdoutStreamBuffer *b);
+int stdout_stream_buffer_read(StdoutStreamBuffer *b, int fd, stdout_stream_line_handler_t handler, void *userdata);
+
 int server_open_stdout_socket(Server *s, FDSet *fds);
 
 void stdout_stream_free(StdoutStream *s);
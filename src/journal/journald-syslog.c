@@ -38,77 +38,137 @@
 #define WARN_FORWARD_SYSLOG_MISSED_USEC (30 * USEC_PER_SEC)
 
 static void forward_syslog_iovec(Server *s, const struct iovec *iovec, unsigned n_iovec, const struct ucred *ucred, const struct timeval *tv) {
+        SyslogMessage *m;
+        size_t l, k;
+        unsigned i;
+
+        assert(s);
+        assert(iovec);
+        assert(n_iovec > 0);
+
+        /* Forward the syslog message we received via /dev/log to
+         * /run/systemd/syslog. Unfortunately we currently can't set
+         * the SO_TIMESTAMP auxiliary data, and hence we don't.
+         *
+         * The messages are queued up and sent off with a single
+         * sendmmsg() once we have a batch together or the event loop
+         * has nothing else to do. */
+
+        if (s->n_syslog_messages >= SYSLOG_BATCH_MAX)
+                server_flush_syslog(s);
+
+        l = IOVEC_TOTAL_SIZE(iovec, n_iovec);
+
+        if (!GREEDY_REALLOC(s->syslog_batch, s->syslog_batch_allocated, s->syslog_batch_size + l)) {
+                log_oom();
+                return;
+        }
+
+        m = s->syslog_messages + s->n_syslog_messages++;
+        m->offset = s->syslog_batch_size;
+        m->length = l;
+        m->have_ucred = !!ucred;
+        if (ucred)
+                m->ucred = *ucred;
+
+        for (i = 0, k = m->offset; i < n_iovec; k += iovec[i].iov_len, i++)
+                memcpy(s->syslog_batch + k, iovec[i].iov_base, iovec[i].iov_len);
+
+        s->syslog_batch_size += l;
+}
+
+void server_flush_syslog(Server *s) {
 
         static const union sockaddr_union sa = {
                 .un.sun_family = AF_UNIX,
                 .un.sun_path = "/run/systemd/journal/syslog",
         };
-        struct msghdr msghdr = {
-                .msg_iov = (struct iovec *) iovec,
-                .msg_iovlen = n_iovec,
-                .msg_name = (struct sockaddr*) &sa.sa,
-                .msg_namelen = offsetof(union sockaddr_union, un.sun_path)
-                               + strlen("/run/systemd/journal/syslog"),
-        };
-        struct cmsghdr *cmsg;
+        struct mmsghdr mmsghdr[SYSLOG_BATCH_MAX] = {};
+        struct iovec iovec[SYSLOG_BATCH_MAX];
         union {
                 struct cmsghdr cmsghdr;
                 uint8_t buf[CMSG_SPACE(sizeof(struct ucred))];
-        } control;
+        } control[SYSLOG_BATCH_MAX];
+        unsigned i, n, retried = (unsigned) -1;
+        int r;
 
         assert(s);
-        assert(iovec);
-        assert(n_iovec > 0);
 
-        if (ucred) {
-                zero(control);
-                msghdr.msg_control = &control;
-                msghdr.msg_controllen = sizeof(control);
-
-                cmsg = CMSG_FIRSTHDR(&msghdr);
-                cmsg->cmsg_level = SOL_SOCKET;
-                cmsg->cmsg_type = SCM_CREDENTIALS;
-                cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
-                memcpy(CMSG_DATA(cmsg), ucred, sizeof(struct ucred));
-                msghdr.msg_controllen = cmsg->cmsg_len;
-        }
+        n = s->n_syslog_messages;
+        if (n <= 0)
+                return;
 
-        /* Forward the syslog message we received via /dev/log to
-         * /run/systemd/syslog. Unfortunately we currently can't set
-         * the SO_TIMESTAMP auxiliary data, and hence we don't. */
+        for (i = 0; i < n; i++) {
+                struct msghdr *msghdr = &mmsghdr[i].msg_hdr;
+                SyslogMessage *m = s->syslog_messages + i;
 
-        if (sendmsg(s->syslog_fd, &msghdr, MSG_NOSIGNAL) >= 0)
-                return;
+                iovec[i].iov_base = s->syslog_batch + m->offset;
+                iovec[i].iov_len = m->length;
 
-        /* The socket is full? I guess the syslog implementation is
-         * too slow, and we shouldn't wait for that... */
-        if (errno == EAGAIN) {
-                s->n_forward_syslog_missed++;
-                return;
-        }
+                msghdr->msg_iov = iovec + i;
+                msghdr->msg_iovlen = 1;
+                msghdr->msg_name = (struct sockaddr*) &sa.sa;
+                msghdr->msg_namelen = offsetof(union sockaddr_union, un.sun_path)
+                                      + strlen("/run/systemd/journal/syslog");
 
-        if (ucred && (errno == ESRCH || errno == EPERM)) {
-                struct ucred u;
+                if (m->have_ucred) {
+                        struct cmsghdr *cmsg;
 
-                /* Hmm, presumably the sender process vanished
-                 * by now, or we don't have CAP_SYS_AMDIN, so
-                 * let's fix it as good as we can, and retry */
+                        zero(control[i]);
+                        msghdr->msg_control = control + i;
+                        msghdr->msg_controllen = sizeof(control[i]);
 
-                u = *ucred;
-                u.pid = getpid();
-                memcpy(CMSG_DATA(cmsg), &u, sizeof(struct ucred));
+                        cmsg = CMSG_FIRSTHDR(msghdr);
+                        cmsg->cmsg_level = SOL_SOCKET;
+                        cmsg->cmsg_type = SCM_CREDENTIALS;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+                        memcpy(CMSG_DATA(cmsg), &m->ucred, sizeof(struct ucred));
+                        msghdr->msg_controllen = cmsg->cmsg_len;
+                }
+        }
 
-                if (sendmsg(s->syslog_fd, &msghdr, MSG_NOSIGNAL) >= 0)
-                        return;
+        s->n_syslog_messages = 0;
+        s->syslog_batch_size = 0;
+
+        i = 0;
+        while (i < n) {
+                r = sendmmsg(s->syslog_fd, mmsghdr + i, n - i, MSG_NOSIGNAL);
+                if (r > 0) {
+                        i += r;
+                        continue;
+                }
 
+                /* The socket is full? I guess the syslog implementation is
+                 * too slow, and we shouldn't wait for that... */
                 if (errno == EAGAIN) {
-                        s->n_forward_syslog_missed++;
+                        s->n_forward_syslog_missed += n - i;
                         return;
                 }
-        }
 
-        if (errno != ENOENT)
+                /* Nobody listening, don't bother with the rest */
+                if (errno == ENOENT)
+                        return;
+
+                if (s->syslog_messages[i].have_ucred && (errno == ESRCH || errno == EPERM) && retried != i) {
+                        struct cmsghdr *cmsg;
+                        struct ucred u;
+
+                        /* Hmm, presumably the sender process vanished
+                         * by now, or we don't have CAP_SYS_AMDIN, so
+                         * let's fix it as good as we can, and retry */
+
+                        cmsg = CMSG_FIRSTHDR(&mmsghdr[i].msg_hdr);
+                        u = s->syslog_messages[i].ucred;
+                        u.pid = getpid();
+                        memcpy(CMSG_DATA(cmsg), &u, sizeof(struct ucred));
+
+                        retried = i;
+                        continue;
+                }
+
                 log_debug_errno(errno, "Failed to forward syslog message: %m");
+                i++;
+        }
 }
 
 static void forward_syslog_raw(Server *s, int priority, const char *buffer, const struct ucred *ucred, const struct timeval *tv) {
@@ -124,13 +184,37 @@ static void forward_syslog_raw(Server *s, int priority, const char *buffer, cons
         forward_syslog_iovec(s, &iovec, 1, ucred, tv);
 }
 
+static bool format_syslog_time(time_t t, char *buf, size_t size) {
+        static time_t cached_t = (time_t) -1;
+        static char cached[64];
+        struct tm *tm;
+
+        /* localtime() checks /etc/localtime every time it is called,
+         * hence do this only once a second */
+
+        if (t != cached_t) {
+                tm = localtime(&t);
+                if (!tm)
+                        return false;
+                if (strftime(cached, sizeof(cached), "%h %e %T ", tm) <= 0)
+                        return false;
+
+                cached_t = t;
+        }
+
+        if (strlen(cached) >= size)
+                return false;
+
+        strcpy(buf, cached);
+        return true;
+}
+
 void server_forward_syslog(Server *s, int priority, const char *identifier, const char *message, const struct ucred *ucred, const struct timeval *tv) {
         struct iovec iovec[5];
         char header_priority[DECIMAL_STR_MAX(priority) + 3], header_time[64],
              header_pid[sizeof("[]: ")-1 + DECIMAL_STR_MAX(pid_t) + 1];
         int n = 0;
         time_t t;
-        struct tm *tm;
         char *ident_buf = NULL;
 
         assert(s);
@@ -147,10 +231,7 @@ void server_forward_syslog(Server *s, int priority, const char *identifier, cons
 
         /* Second: timestamp */
         t = tv ? tv->tv_sec : ((time_t) (now(CLOCK_REALTIME) / USEC_PER_SEC));
-        tm = localtime(&t);
-        if (!tm)
-                return;
-        if (strftime(header_time, sizeof(header_time), "%h %e %T ", tm) <= 0)
+        if (!format_syslog_time(t, header_time, sizeof(header_time)))
                 return;
         IOVEC_SET_STRING(iovec[n++], header_time);
 
@@ -0,0 +1,412 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "journald-vacuum.h"
+#include "journal-vacuum.h"
+#include "hashmap.h"
+#include "log.h"
+#include "util.h"
+
+typedef struct VacuumDirectory {
+        char *path;
+        uint64_t max_use;
+} VacuumDirectory;
+
+typedef struct VacuumRun {
+        VacuumDirectory *directories;
+        unsigned n_directories;
+        size_t n_allocated;
+
+        usec_t max_retention_usec;
+} VacuumRun;
+
+struct JournalVacuumer {
+        sd_event_source *event_source;
+        int fd;
+
+        vacuum_done_handler_t done;
+        void *userdata;
+
+        /* Collected by the main thread until the run is started */
+        VacuumRun queued;
+
+        pthread_t thread;
+        bool thread_running;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+
+        /* Protected by the mutex */
+        VacuumRun pending;
+        bool have_pending;
+        bool running;
+        bool quit;
+
+        VacuumResult result;
+        bool have_result;
+
+        /* Only used by whoever is vacuuming, i.e. the thread if
+         * there is one, indexed by directory path */
+        Hashmap *inventories;
+};
+
+static void vacuum_run_done(VacuumRun *run) {
+        unsigned i;
+
+        assert(run);
+
+        for (i = 0; i < run->n_directories; i++)
+                free(run->directories[i].path);
+
+        free(run->directories);
+        zero(*run);
+}
+
+static void vacuumer_execute(JournalVacuumer *v, const VacuumRun *run, VacuumResult *result) {
+        usec_t start;
+        unsigned i;
+        int r;
+
+        assert(v);
+        assert(run);
+        assert(result);
+
+        start = now(CLOCK_MONOTONIC);
+
+        zero(*result);
+
+        for (i = 0; i < run->n_directories; i++) {
+                const VacuumDirectory *d = run->directories + i;
+                JournalInventory *inv;
+
+                inv = hashmap_get(v->inventories, d->path);
+                if (!inv) {
+                        _cleanup_free_ char *key = NULL;
+
+                        key = strdup(d->path);
+                        if (!key) {
+                                log_oom();
+                                continue;
+                        }
+
+                        inv = journal_inventory_new(d->path);
+                        if (!inv) {
+                                log_oom();
+                                continue;
+                        }
+
+                        r = hashmap_put(v->inventories, key, inv);
+                        if (r < 0) {
+                                journal_inventory_free(inv);
+                                log_oom();
+                                continue;
+                        }
+
+                        key = NULL;
+                }
+
+                r = journal_inventory_vacuum(inv, d->max_use, run->max_retention_usec, &result->oldest_usec, &result->freed, false);
+                if (r < 0 && r != -ENOENT)
+                        log_error_errno(r, "Failed to vacuum %s: %m", d->path);
+        }
+
+        result->duration = now(CLOCK_MONOTONIC) - start;
+}
+
+static void vacuumer_add_result(JournalVacuumer *v, const VacuumResult *result) {
+        assert(v);
+        assert(result);
+
+        /* If runs finish before the main thread gets around to look
+         * at them, the oldest file of the last run is what counts */
+        v->result.oldest_usec = result->oldest_usec;
+        v->result.freed += result->freed;
+        v->result.duration += result->duration;
+        v->have_result = true;
+}
+
+static void *vacuumer_thread(void *userdata) {
+        JournalVacuumer *v = userdata;
+        sigset_t fullset;
+
+        /* No signals in this thread please */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, NULL) == 0);
+
+        prctl(PR_SET_NAME, (unsigned long) "journal-vacuum");
+
+        assert_se(pthread_mutex_lock(&v->mutex) == 0);
+
+        for (;;) {
+                VacuumResult result;
+                VacuumRun run;
+
+                while (!v->quit && !v->have_pending)
+                        assert_se(pthread_cond_wait(&v->work_cond, &v->mutex) == 0);
+
+                if (v->quit)
+                        break;
+
+                run = v->pending;
+                zero(v->pending);
+                v->have_pending = false;
+                v->running = true;
+
+                assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+                vacuumer_execute(v, &run, &result);
+                vacuum_run_done(&run);
+
+                assert_se(pthread_mutex_lock(&v->mutex) == 0);
+
+                v->running = false;
+                vacuumer_add_result(v, &result);
+                assert_se(pthread_cond_broadcast(&v->done_cond) == 0);
+
+                (void) eventfd_write(v->fd, 1);
+        }
+
+        assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+        return NULL;
+}
+
+static void vacuumer_dispatch(JournalVacuumer *v) {
+        VacuumResult result;
+        eventfd_t x;
+        bool have_result;
+
+        assert(v);
+
+        (void) eventfd_read(v->fd, &x);
+
+        assert_se(pthread_mutex_lock(&v->mutex) == 0);
+
+        result = v->result;
+        have_result = v->have_result;
+
+        zero(v->result);
+        v->have_result = false;
+
+        assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+        if (have_result && v->done)
+                v->done(v, &result, v->userdata);
+}
+
+static int dispatch_vacuum_done(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        JournalVacuumer *v = userdata;
+
+        assert(v);
+
+        vacuumer_dispatch(v);
+
+        return 0;
+}
+
+int journal_vacuumer_new(sd_event *e, vacuum_done_handler_t done, void *userdata, JournalVacuumer **ret) {
+        JournalVacuumer *v;
+        int r;
+
+        assert(e);
+        assert(ret);
+
+        v = new0(JournalVacuumer, 1);
+        if (!v)
+                return -ENOMEM;
+
+        v->fd = -1;
+        v->done = done;
+        v->userdata = userdata;
+
+        assert_se(pthread_mutex_init(&v->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&v->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&v->done_cond, NULL) == 0);
+
+        v->inventories = hashmap_new(&string_hash_ops);
+        if (!v->inventories) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        v->fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (v->fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = sd_event_add_io(e, &v->event_source, v->fd, EPOLLIN, dispatch_vacuum_done, v);
+        if (r < 0)
+                goto fail;
+
+        *ret = v;
+        return 0;
+
+fail:
+        journal_vacuumer_free(v);
+        return r;
+}
+
+JournalVacuumer* journal_vacuumer_free(JournalVacuumer *v) {
+        JournalInventory *inv;
+        char *key;
+        Iterator i;
+
+        if (!v)
+                return NULL;
+
+        if (v->thread_running) {
+                assert_se(pthread_mutex_lock(&v->mutex) == 0);
+                v->quit = true;
+                assert_se(pthread_cond_broadcast(&v->work_cond) == 0);
+                assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+                assert_se(pthread_join(v->thread, NULL) == 0);
+        }
+
+        vacuum_run_done(&v->queued);
+        vacuum_run_done(&v->pending);
+
+        HASHMAP_FOREACH_KEY(inv, key, v->inventories, i) {
+                journal_inventory_free(inv);
+                free(key);
+        }
+        hashmap_free(v->inventories);
+
+        sd_event_source_unref(v->event_source);
+        safe_close(v->fd);
+
+        pthread_cond_destroy(&v->work_cond);
+        pthread_cond_destroy(&v->done_cond);
+        pthread_mutex_destroy(&v->mutex);
+
+        free(v);
+
+        return NULL;
+}
+
+int journal_vacuumer_queue(JournalVacuumer *v, const char *directory, uint64_t max_use, usec_t max_retention_usec) {
+        VacuumRun *run;
+        char *p;
+
+        assert(v);
+        assert(directory);
+
+        run = &v->queued;
+
+        p = strdup(directory);
+        if (!p)
+                return -ENOMEM;
+
+        if (!GREEDY_REALLOC(run->directories, run->n_allocated, run->n_directories + 1)) {
+                free(p);
+                return -ENOMEM;
+        }
+
+        run->directories[run->n_directories].path = p;
+        run->directories[run->n_directories].max_use = max_use;
+        run->n_directories++;
+
+        run->max_retention_usec = max_retention_usec;
+
+        return 0;
+}
+
+static int vacuumer_start_thread(JournalVacuumer *v) {
+        sigset_t fullset, saved;
+        int r;
+
+        assert(v);
+
+        if (v->thread_running)
+                return 0;
+
+        /* Start the thread with all signals blocked, so that it
+         * doesn't steal them from the main thread */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+        r = -pthread_create(&v->thread, NULL, vacuumer_thread, v);
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+        if (r < 0)
+                return r;
+
+        v->thread_running = true;
+        return 0;
+}
+
+int journal_vacuumer_start(JournalVacuumer *v) {
+        VacuumResult result;
+        int r;
+
+        assert(v);
+
+        r = vacuumer_start_thread(v);
+        if (r < 0) {
+                /* Without a thread we can still vacuum, just not in
+                 * the background */
+                log_warning_errno(r, "Failed to start vacuuming thread, vacuuming synchronously: %m");
+
+                vacuumer_execute(v, &v->queued, &result);
+                vacuum_run_done(&v->queued);
+
+                v->have_result = true;
+                v->result = result;
+                vacuumer_dispatch(v);
+
+                return 0;
+        }
+
+        assert_se(pthread_mutex_lock(&v->mutex) == 0);
+
+        /* A run that didn't start yet is superseded by the new one */
+        vacuum_run_done(&v->pending);
+        v->pending = v->queued;
+        v->have_pending = true;
+        zero(v->queued);
+
+        assert_se(pthread_cond_signal(&v->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+        return 0;
+}
+
+void journal_vacuumer_wait(JournalVacuumer *v) {
+        assert(v);
+
+        if (!v->thread_running)
+                return;
+
+        assert_se(pthread_mutex_lock(&v->mutex) == 0);
+
+        while (v->have_pending || v->running)
+                assert_se(pthread_cond_wait(&v->done_cond, &v->mutex) == 0);
+
+        assert_se(pthread_mutex_unlock(&v->mutex) == 0);
+
+        vacuumer_dispatch(v);
+}
@@ -0,0 +1,44 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "sd-event.h"
+#include "time-util.h"
+
+/* Vacuums journal directories on a thread of its own, so that
+ * journald can continue to process messages in the meantime. The
+ * handler is called from the event loop when a run finished. */
+
+typedef struct JournalVacuumer JournalVacuumer;
+
+typedef struct VacuumResult {
+        usec_t oldest_usec;
+        uint64_t freed;
+        usec_t duration;
+} VacuumResult;
+
+typedef void (*vacuum_done_handler_t)(JournalVacuumer *v, const VacuumResult *result, void *userdata);
+
+int journal_vacuumer_new(sd_event *e, vacuum_done_handler_t done, void *userdata, JournalVacuumer **ret);
+JournalVacuumer* journal_vacuumer_free(JournalVacuumer *v);
+
+int journal_vacuumer_queue(JournalVacuumer *v, const char *directory, uint64_t max_use, usec_t max_retention_usec);
+int journal_vacuumer_start(JournalVacuumer *v);
+void journal_vacuumer_wait(JournalVacuumer *v);
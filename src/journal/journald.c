@@ -54,7 +54,7 @@ int main(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
-        server_vacuum(&server);
+        server_vacuum(&server, false);
         server_flush_to_var(&server);
         server_flush_dev_kmsg(&server);
 
@@ -82,7 +82,7 @@ int main(int argc, char *argv[]) {
                         if (server.oldest_file_usec + server.max_retention_usec < n) {
                                 log_info("Retention time reached.");
                                 server_rotate(&server);
-                                server_vacuum(&server);
+                                server_vacuum(&server, false);
                                 continue;
                         }
 
@@ -111,6 +111,7 @@ int main(int argc, char *argv[]) {
 
                 server_maybe_append_tags(&server);
                 server_maybe_warn_forward_syslog_missed(&server);
+                server_maybe_update_status(&server);
         }
 
         log_debug("systemd-journald stopped as pid "PID_FMT, getpid());
@@ -20,6 +20,7 @@
 ***/
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 
@@ -41,6 +42,12 @@ struct Window {
         bool invalidated;
         bool keep_always;
         bool in_unused;
+        bool orphaned;
+
+        /* Pinned windows are never reused, and stay mapped even after
+         * their file descriptor is closed, until the last pin is
+         * dropped */
+        unsigned n_pinned;
 
         int prot;
         void *ptr;
@@ -60,6 +67,9 @@ struct Context {
         unsigned id;
         Window *window;
 
+        /* The array of the thread this context belongs to */
+        Context **slots;
+
         LIST_FIELDS(Context, by_window);
 };
 
@@ -74,18 +84,35 @@ struct MMapCache {
         int n_ref;
         unsigned n_windows;
 
-        unsigned n_hit, n_missed;
-
+        unsigned n_context_cache_hit, n_window_list_hit, n_missed;
+        unsigned n_windows_reused;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
 
+        /* In shared mode, all of the state below is protected by
+         * the lock, and each thread gets its own set of contexts,
+         * so that a thread never moves the window another thread's
+         * pointers point into. Maps pthread_t → Context*[] */
+        bool shared;
+        pthread_mutex_t lock;
+        Hashmap *thread_contexts;
+
         LIST_HEAD(Window, unused);
         Window *last_unused;
+
+        /* Pinned windows whose file descriptor is gone already */
+        LIST_HEAD(Window, orphaned);
 };
 
 #define WINDOWS_MIN 64
 
+/* How many additional unused windows to keep around for each file we
+ * have mapped, so that the pool of windows grows with the number of
+ * files that are read in an interleaved fashion, instead of all of
+ * them fighting over the same WINDOWS_MIN windows. */
+#define WINDOWS_PER_FD 4
+
 #ifdef ENABLE_DEBUG_MMAP_CACHE
 /* Tiny windows increase mmap activity and the chance of exposing unsafe use. */
 # define WINDOW_SIZE (page_size())
@@ -104,14 +131,81 @@ MMapCache* mmap_cache_new(void) {
         return m;
 }
 
+MMapCache* mmap_cache_new_shared(void) {
+        MMapCache *m;
+
+        m = mmap_cache_new();
+        if (!m)
+                return NULL;
+
+        if (pthread_mutex_init(&m->lock, NULL) != 0) {
+                free(m);
+                return NULL;
+        }
+
+        m->shared = true;
+        return m;
+}
+
 MMapCache* mmap_cache_ref(MMapCache *m) {
         assert(m);
         assert(m->n_ref > 0);
 
-        m->n_ref ++;
+        /* Pins take references too, possibly from several threads */
+        __sync_add_and_fetch(&m->n_ref, 1);
         return m;
 }
 
+static void mmap_cache_lock(MMapCache *m) {
+        if (m->shared)
+                assert_se(pthread_mutex_lock(&m->lock) == 0);
+}
+
+static void mmap_cache_unlock(MMapCache *m) {
+        if (m->shared)
+                assert_se(pthread_mutex_unlock(&m->lock) == 0);
+}
+
+static Context **contexts_of_thread(MMapCache *m, bool create) {
+        Context **slots;
+        void *key;
+
+        assert(m);
+
+        if (!m->shared)
+                return m->contexts;
+
+        key = (void*) pthread_self();
+
+        slots = hashmap_get(m->thread_contexts, key);
+        if (slots || !create)
+                return slots;
+
+        if (hashmap_ensure_allocated(&m->thread_contexts, NULL) < 0)
+                return NULL;
+
+        slots = new0(Context*, MMAP_CACHE_MAX_CONTEXTS);
+        if (!slots)
+                return NULL;
+
+        if (hashmap_put(m->thread_contexts, key, slots) < 0) {
+                free(slots);
+                return NULL;
+        }
+
+        return slots;
+}
+
+static Context *context_get(MMapCache *m, unsigned id) {
+        Context **slots;
+
+        slots = contexts_of_thread(m, false);
+        if (!slots)
+                return NULL;
+
+        return slots[id];
+}
+
 static void window_unlink(Window *w) {
         Context *c;
 
@@ -122,6 +216,8 @@ static void window_unlink(Window *w) {
 
         if (w->fd)
                 LIST_REMOVE(by_fd, w->fd->windows, w);
+        else if (w->orphaned)
+                LIST_REMOVE(by_fd, w->cache->orphaned, w);
 
         if (w->in_unused) {
                 if (w->cache->last_unused == w)
@@ -172,12 +268,18 @@ _pure_ static bool window_matches(Window *w, int fd, int prot, uint64_t offset,
                 offset + size <= w->offset + w->size;
 }
 
+static unsigned windows_min(MMapCache *m) {
+        assert(m);
+
+        return WINDOWS_MIN + WINDOWS_PER_FD * hashmap_size(m->fds);
+}
+
 static Window *window_add(MMapCache *m) {
         Window *w;
 
         assert(m);
 
-        if (!m->last_unused || m->n_windows <= WINDOWS_MIN) {
+        if (!m->last_unused || m->n_windows <= windows_min(m)) {
 
                 /* Allocate a new window */
                 w = new0(Window, 1);
@@ -186,16 +288,68 @@ static Window *window_add(MMapCache *m) {
                 m->n_windows++;
         } else {
 
-                /* Reuse an existing one */
+                /* Reuse the least recently used one */
                 w = m->last_unused;
                 window_unlink(w);
                 zero(*w);
+                m->n_windows_reused++;
         }
 
         w->cache = m;
         return w;
 }
 
+static void window_release(Window *w) {
+        assert(w);
+
+        if (w->n_pinned > 0)
+                return;
+
+        if (w->orphaned) {
+                window_free(w);
+                return;
+        }
+
+        if (w->contexts || w->keep_always)
+                return;
+
+        /* Not used anymore? */
+#ifdef ENABLE_DEBUG_MMAP_CACHE
+        /* Unmap unused windows immediately to expose use-after-unmap
+         * by SIGSEGV. */
+        window_free(w);
+#else
+        LIST_PREPEND(unused, w->cache->unused, w);
+        if (!w->cache->last_unused)
+                w->cache->last_unused = w;
+
+        w->in_unused = true;
+#endif
+}
+
+static void window_orphan(Window *w) {
+        Context *c;
+
+        assert(w);
+        assert(w->fd);
+        assert(w->n_pinned > 0);
+
+        /* The file descriptor goes away, but somebody still
+         * references the memory, hence keep the mapping around */
+
+        LIST_FOREACH(by_window, c, w->contexts) {
+                assert(c->window == w);
+                c->window = NULL;
+        }
+        w->contexts = NULL;
+
+        LIST_REMOVE(by_fd, w->fd->windows, w);
+        w->fd = NULL;
+
+        LIST_PREPEND(by_fd, w->cache->orphaned, w);
+        w->orphaned = true;
+}
+
 static void context_detach_window(Context *c) {
         Window *w;
 
@@ -208,20 +362,7 @@ static void context_detach_window(Context *c) {
         c->window = NULL;
         LIST_REMOVE(by_window, w->contexts, c);
 
-        if (!w->contexts && !w->keep_always) {
-                /* Not used anymore? */
-#ifdef ENABLE_DEBUG_MMAP_CACHE
-                /* Unmap unused windows immediately to expose use-after-unmap
-                 * by SIGSEGV. */
-                window_free(w);
-#else
-                LIST_PREPEND(unused, c->cache->unused, w);
-                if (!c->cache->last_unused)
-                        c->cache->last_unused = w;
-
-                w->in_unused = true;
-#endif
-        }
+        window_release(w);
 }
 
 static void context_attach_window(Context *c, Window *w) {
@@ -247,11 +388,16 @@ static void context_attach_window(Context *c, Window *w) {
 }
 
 static Context *context_add(MMapCache *m, unsigned id) {
+        Context **slots;
         Context *c;
 
         assert(m);
 
-        c = m->contexts[id];
+        slots = contexts_of_thread(m, true);
+        if (!slots)
+                return NULL;
+
+        c = slots[id];
         if (c)
                 return c;
 
@@ -261,9 +407,9 @@ static Context *context_add(MMapCache *m, unsigned id) {
 
         c->cache = m;
         c->id = id;
+        c->slots = slots;
 
-        assert(!m->contexts[id]);
-        m->contexts[id] = c;
+        slots[id] = c;
 
         return c;
 }
@@ -273,19 +419,33 @@ static void context_free(Context *c) {
 
         context_detach_window(c);
 
-        if (c->cache) {
-                assert(c->cache->contexts[c->id] == c);
-                c->cache->contexts[c->id] = NULL;
+        if (c->slots) {
+                assert(c->slots[c->id] == c);
+                c->slots[c->id] = NULL;
         }
 
         free(c);
 }
 
+static void contexts_free(Context **slots) {
+        unsigned i;
+
+        assert(slots);
+
+        for (i = 0; i < MMAP_CACHE_MAX_CONTEXTS; i++)
+                if (slots[i])
+                        context_free(slots[i]);
+}
+
 static void fd_free(FileDescriptor *f) {
         assert(f);
 
-        while (f->windows)
-                window_free(f->windows);
+        while (f->windows) {
+                if (f->windows->n_pinned > 0)
+                        window_orphan(f->windows);
+                else
+                        window_free(f->windows);
+        }
 
         if (f->cache)
                 assert_se(hashmap_remove(f->cache->fds, INT_TO_PTR(f->fd + 1)));
@@ -326,13 +486,18 @@ static FileDescriptor* fd_add(MMapCache *m, int fd) {
 
 static void mmap_cache_free(MMapCache *m) {
         FileDescriptor *f;
-        int i;
+        Context **slots;
 
         assert(m);
 
-        for (i = 0; i < MMAP_CACHE_MAX_CONTEXTS; i++)
-                if (m->contexts[i])
-                        context_free(m->contexts[i]);
+        contexts_free(m->contexts);
+
+        while ((slots = hashmap_steal_first(m->thread_contexts))) {
+                contexts_free(slots);
+                free(slots);
+        }
+
+        hashmap_free(m->thread_contexts);
 
         while ((f = hashmap_first(m->fds)))
                 fd_free(f);
@@ -342,6 +507,13 @@ static void mmap_cache_free(MMapCache *m) {
         while (m->unused)
                 window_free(m->unused);
 
+        /* Pins keep a reference to the cache, hence there can't be
+         * any left at this point */
+        assert(!m->orphaned);
+
+        if (m->shared)
+                pthread_mutex_destroy(&m->lock);
+
         free(m);
 }
 
@@ -349,13 +521,35 @@ MMapCache* mmap_cache_unref(MMapCache *m) {
         assert(m);
         assert(m->n_ref > 0);
 
-        m->n_ref --;
-        if (m->n_ref == 0)
+        if (__sync_sub_and_fetch(&m->n_ref, 1) == 0)
                 mmap_cache_free(m);
 
         return NULL;
 }
 
+void mmap_cache_forget_thread(MMapCache *m) {
+        Context **slots;
+
+        assert(m);
+
+        if (!m->shared)
+                return;
+
+        /* Drops the contexts of the calling thread, so that the
+         * windows they reference may be reused. Pointers previously
+         * returned to this thread become invalid. */
+
+        mmap_cache_lock(m);
+
+        slots = hashmap_remove(m->thread_contexts, (void*) pthread_self());
+        if (slots) {
+                contexts_free(slots);
+                free(slots);
+        }
+
+        mmap_cache_unlock(m);
+}
+
 static int make_room(MMapCache *m) {
         assert(m);
 
@@ -384,7 +578,7 @@ static int try_context(
         assert(size > 0);
         assert(ret);
 
-        c = m->contexts[context];
+        c = context_get(m, context);
         if (!c)
                 return 0;
 
@@ -448,8 +642,15 @@ static int find_mmap(
         if (!c)
                 return -ENOMEM;
 
+        /* Move the window to the front of the per-fd list, so that
+         * the windows accessed most recently are found first */
+        if (f->windows != w) {
+                LIST_REMOVE(by_fd, f->windows, w);
+                LIST_PREPEND(by_fd, f->windows, w);
+        }
+
         context_attach_window(c, w);
-        w->keep_always += keep_always;
+        w->keep_always |= keep_always;
 
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
         return 1;
@@ -575,36 +776,86 @@ int mmap_cache_get(
         assert(ret);
         assert(context < MMAP_CACHE_MAX_CONTEXTS);
 
+        mmap_cache_lock(m);
+
         /* Check whether the current context is the right one already */
         r = try_context(m, fd, prot, context, keep_always, offset, size, ret);
         if (r != 0) {
-                m->n_hit ++;
-                return r;
+                m->n_context_cache_hit ++;
+                goto finish;
         }
 
         /* Search for a matching mmap */
         r = find_mmap(m, fd, prot, context, keep_always, offset, size, ret);
         if (r != 0) {
-                m->n_hit ++;
-                return r;
+                m->n_window_list_hit ++;
+                goto finish;
         }
 
         m->n_missed++;
 
         /* Create a new mmap */
-        return add_mmap(m, fd, prot, context, keep_always, offset, size, st, ret);
+        r = add_mmap(m, fd, prot, context, keep_always, offset, size, st, ret);
+
+finish:
+        mmap_cache_unlock(m);
+        return r;
 }
 
-unsigned mmap_cache_get_hit(MMapCache *m) {
+void mmap_cache_get_stats(MMapCache *m, MMapCacheStats *ret) {
         assert(m);
+        assert(ret);
+
+        mmap_cache_lock(m);
+
+        ret->n_context_cache_hit = m->n_context_cache_hit;
+        ret->n_window_list_hit = m->n_window_list_hit;
+        ret->n_missed = m->n_missed;
+        ret->n_windows = m->n_windows;
+        ret->n_windows_reused = m->n_windows_reused;
+        ret->n_files = hashmap_size(m->fds);
+        ret->n_threads = hashmap_size(m->thread_contexts);
 
-        return m->n_hit;
+        mmap_cache_unlock(m);
+}
+
+unsigned mmap_cache_get_hit(MMapCache *m) {
+        MMapCacheStats s;
+
+        mmap_cache_get_stats(m, &s);
+        return s.n_context_cache_hit + s.n_window_list_hit;
+}
+
+unsigned mmap_cache_get_context_cache_hit(MMapCache *m) {
+        MMapCacheStats s;
+
+        mmap_cache_get_stats(m, &s);
+        return s.n_context_cache_hit;
+}
+
+unsigned mmap_cache_get_window_list_hit(MMapCache *m) {
+        MMapCacheStats s;
+
+        mmap_cache_get_stats(m, &s);
+        return s.n_window_list_hit;
 }
 
 unsigned mmap_cache_get_missed(MMapCache *m) {
-        assert(m);
+        MMapCacheStats s;
+
+        mmap_cache_get_stats(m, &s);
+        return s.n_missed;
+}
+
+void mmap_cache_stats_log_debug(MMapCache *m) {
+        MMapCacheStats s;
+
+        mmap_cache_get_stats(m, &s);
 
-        return m->n_missed;
+        log_debug("mmap cache statistics: %u context cache hit, %u window list hit, %u miss, "
+                  "%u windows (%u reused), %u files, %u threads",
+                  s.n_context_cache_hit, s.n_window_list_hit, s.n_missed,
+                  s.n_windows, s.n_windows_reused, s.n_files, s.n_threads);
 }
 
 static void mmap_cache_process_sigbus(MMapCache *m) {
@@ -645,6 +896,21 @@ static void mmap_cache_process_sigbus(MMapCache *m) {
                                 break;
                 }
 
+                if (!ours) {
+                        Window *w;
+
+                        /* The file is closed already, but a pinned
+                         * window of it is still around. Make sure it
+                         * cannot trigger again right-away. */
+                        LIST_FOREACH(by_fd, w, m->orphaned)
+                                if ((uint8_t*) addr >= (uint8_t*) w->ptr &&
+                                    (uint8_t*) addr < (uint8_t*) w->ptr + w->size) {
+                                        window_invalidate(w);
+                                        ours = true;
+                                        break;
+                                }
+                }
+
                 /* Didn't find a matching window, give up */
                 if (!ours) {
                         log_error("Unknown SIGBUS page, aborting.");
@@ -672,17 +938,20 @@ static void mmap_cache_process_sigbus(MMapCache *m) {
 
 bool mmap_cache_got_sigbus(MMapCache *m, int fd) {
         FileDescriptor *f;
+        bool r;
 
         assert(m);
         assert(fd >= 0);
 
+        mmap_cache_lock(m);
+
         mmap_cache_process_sigbus(m);
 
         f = hashmap_get(m->fds, INT_TO_PTR(fd + 1));
-        if (!f)
-                return false;
+        r = f && f->sigbus;
 
-        return f->sigbus;
+        mmap_cache_unlock(m);
+        return r;
 }
 
 void mmap_cache_close_fd(MMapCache *m, int fd) {
@@ -695,11 +964,61 @@ void mmap_cache_close_fd(MMapCache *m, int fd) {
          * that we don't end up with a SIGBUS entry we cannot relate
          * to any existing memory map */
 
+        mmap_cache_lock(m);
+
         mmap_cache_process_sigbus(m);
 
         f = hashmap_get(m->fds, INT_TO_PTR(fd + 1));
-        if (!f)
-                return;
+        if (f)
+                fd_free(f);
+
+        mmap_cache_unlock(m);
+}
+
+int mmap_cache_pin(MMapCache *m, unsigned context, MMapWindow **ret) {
+        Context *c;
+        int r;
+
+        assert(m);
+        assert(m->n_ref > 0);
+        assert(context < MMAP_CACHE_MAX_CONTEXTS);
+        assert(ret);
+
+        /* Pins the window the context was last used with, i.e. the
+         * one the pointer returned by the most recent
+         * mmap_cache_get() call for this context points into */
+
+        mmap_cache_lock(m);
+
+        c = context_get(m, context);
+        if (!c || !c->window)
+                r = -EADDRNOTAVAIL;
+        else if (c->window->fd->sigbus)
+                r = -EIO;
+        else {
+                c->window->n_pinned++;
+                mmap_cache_ref(m);
+
+                *ret = c->window;
+                r = 0;
+        }
+
+        mmap_cache_unlock(m);
+        return r;
+}
+
+void mmap_cache_unpin(MMapCache *m, MMapWindow *w) {
+        assert(m);
+        assert(w);
+        assert(w->cache == m);
+        assert(w->n_pinned > 0);
+
+        mmap_cache_lock(m);
+
+        w->n_pinned--;
+        window_release(w);
+
+        mmap_cache_unlock(m);
 
-        fd_free(f);
+        mmap_cache_unref(m);
 }
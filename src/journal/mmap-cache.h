@@ -25,13 +25,30 @@
 #include <sys/stat.h>
 
 /* One context per object type, plus one of the header, plus one "additional" one */
-#define MMAP_CACHE_MAX_CONTEXTS 9
+#define MMAP_CACHE_MAX_CONTEXTS 12
 
 typedef struct MMapCache MMapCache;
+typedef struct Window MMapWindow;
+
+typedef struct MMapCacheStats {
+        unsigned n_context_cache_hit;
+        unsigned n_window_list_hit;
+        unsigned n_missed;
+        unsigned n_windows;
+        unsigned n_windows_reused;
+        unsigned n_files;
+        unsigned n_threads;
+} MMapCacheStats;
 
 MMapCache* mmap_cache_new(void);
+/* A cache that may be used from several threads at once. Contexts are
+ * per thread, i.e. a pointer returned to one thread stays valid until
+ * that same thread uses the context again, regardless of what other
+ * threads do. */
+MMapCache* mmap_cache_new_shared(void);
 MMapCache* mmap_cache_ref(MMapCache *m);
 MMapCache* mmap_cache_unref(MMapCache *m);
+void mmap_cache_forget_thread(MMapCache *m);
 
 int mmap_cache_get(
         MMapCache *m,
@@ -45,7 +62,15 @@ int mmap_cache_get(
         void **ret);
 void mmap_cache_close_fd(MMapCache *m, int fd);
 
+int mmap_cache_pin(MMapCache *m, unsigned context, MMapWindow **ret);
+void mmap_cache_unpin(MMapCache *m, MMapWindow *w);
+
+void mmap_cache_get_stats(MMapCache *m, MMapCacheStats *ret);
 unsigned mmap_cache_get_hit(MMapCache *m);
+unsigned mmap_cache_get_context_cache_hit(MMapCache *m);
+unsigned mmap_cache_get_window_list_hit(MMapCache *m);
 unsigned mmap_cache_get_missed(MMapCache *m);
 
+void mmap_cache_stats_log_debug(MMapCache *m);
+
 bool mmap_cache_got_sigbus(MMapCache *m, int fd);
@@ -32,6 +32,7 @@
 #include "journal-def.h"
 #include "journal-file.h"
 #include "hashmap.h"
+#include "siphash24.h"
 #include "list.h"
 #include "strv.h"
 #include "path-util.h"
@@ -43,6 +44,7 @@
 #include "replace-var.h"
 #include "fileio.h"
 #include "formats-util.h"
+#include "prioq.h"
 
 #define JOURNAL_FILES_MAX 7168
 
@@ -52,6 +54,8 @@
 
 #define DEFAULT_DATA_THRESHOLD (64*1024)
 
+#define CATALOG_CHECK_USEC (1 * USEC_PER_SEC)
+
 static void remove_file_real(sd_journal *j, JournalFile *f);
 
 static bool journal_pid_changed(sd_journal *j) {
@@ -78,6 +82,16 @@ static int set_put_error(sd_journal *j, int r) {
         return set_put(j->errors, INT_TO_PTR(r));
 }
 
+static void invalidate_files_by_location(sd_journal *j) {
+        assert(j);
+
+        /* Forget the order of the files, it is rebuilt from scratch
+         * on the next iteration step */
+
+        j->files_by_location = prioq_free(j->files_by_location);
+        set_clear(j->files_at_tail);
+}
+
 static void detach_location(sd_journal *j) {
         Iterator i;
         JournalFile *f;
@@ -87,6 +101,8 @@ static void detach_location(sd_journal *j) {
         j->current_file = NULL;
         j->current_field = 0;
 
+        invalidate_files_by_location(j);
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i)
                 journal_file_reset_location(f);
 }
@@ -556,6 +572,35 @@ static int next_for_match(
         return 1;
 }
 
+static bool match_may_be_in_file(Match *m, JournalFile *f) {
+        Match *i;
+
+        assert(m);
+        assert(f);
+
+        /* Consults the bloom filter of archived files to check whether
+         * the file could contain any entry matching m at all */
+
+        if (m->type == MATCH_DISCRETE)
+                return journal_file_bloom_filter_test(f, le64toh(m->le_hash));
+
+        if (m->type == MATCH_OR_TERM) {
+                LIST_FOREACH(matches, i, m->matches)
+                        if (match_may_be_in_file(i, f))
+                                return true;
+
+                return false;
+        }
+
+        assert(m->type == MATCH_AND_TERM);
+
+        LIST_FOREACH(matches, i, m->matches)
+                if (!match_may_be_in_file(i, f))
+                        return false;
+
+        return true;
+}
+
 static int find_location_for_match(
                 sd_journal *j,
                 Match *m,
@@ -748,6 +793,11 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         } else {
                 f->last_direction = direction;
 
+                /* Don't bother looking up the matches one by one if
+                 * the file can't contain any of them anyway */
+                if (j->level0 && !match_may_be_in_file(j->level0, f))
+                        return 0;
+
                 r = find_location_with_matches(j, f, direction, &c, &cp);
                 if (r <= 0)
                         return r;
@@ -784,8 +834,97 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         }
 }
 
+static int compare_files_down(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) a, (JournalFile*) b);
+}
+
+static int compare_files_up(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) b, (JournalFile*) a);
+}
+
+static int update_file_location(sd_journal *j, JournalFile *f, direction_t direction) {
+        int r;
+
+        assert(j);
+        assert(f);
+        assert(j->files_by_location);
+
+        /* Moves f on to its next candidate entry, and updates its
+         * position in the priority queue of files accordingly */
+
+        r = next_beyond_location(j, f, direction);
+        if (r < 0) {
+                log_debug_errno(r, "Can't iterate through %s, ignoring: %m", f->path);
+                remove_file_real(j, f);
+                return 0;
+        }
+
+        if (r == 0) {
+                f->location_type = LOCATION_TAIL;
+
+                if (f->location_prioq_idx != PRIOQ_IDX_NULL) {
+                        prioq_remove(j->files_by_location, f, &f->location_prioq_idx);
+                        f->location_prioq_idx = PRIOQ_IDX_NULL;
+                }
+
+                /* Archived files will never grow again, no need to
+                 * check them for new entries later on */
+                if (f->header->state == STATE_ARCHIVED) {
+                        set_remove(j->files_at_tail, f);
+                        return 0;
+                }
+
+                r = set_ensure_allocated(&j->files_at_tail, NULL);
+                if (r < 0)
+                        return r;
+
+                r = set_put(j->files_at_tail, f);
+                if (r < 0)
+                        return r;
+
+                return 0;
+        }
+
+        set_remove(j->files_at_tail, f);
+
+        if (f->location_prioq_idx == PRIOQ_IDX_NULL)
+                return prioq_put(j->files_by_location, f, &f->location_prioq_idx);
+
+        prioq_reshuffle(j->files_by_location, f, &f->location_prioq_idx);
+        return 0;
+}
+
+static int rebuild_files_by_location(sd_journal *j, direction_t direction) {
+        JournalFile *f;
+        Iterator i;
+        int r;
+
+        assert(j);
+
+        invalidate_files_by_location(j);
+
+        j->files_by_location = prioq_new(direction == DIRECTION_DOWN ? compare_files_down : compare_files_up);
+        if (!j->files_by_location)
+                return -ENOMEM;
+
+        j->files_by_location_direction = direction;
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i)
+                f->location_prioq_idx = PRIOQ_IDX_NULL;
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
+                r = update_file_location(j, f, direction);
+                if (r < 0) {
+                        invalidate_files_by_location(j);
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
 static int real_journal_next(sd_journal *j, direction_t direction) {
-        JournalFile *f, *new_file = NULL;
+        JournalFile *f;
         Iterator i;
         Object *o;
         int r;
@@ -793,43 +932,68 @@ static int real_journal_next(sd_journal *j, direction_t direction) {
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
 
-        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                bool found;
+        /* We keep the files ordered by their next candidate entry in
+         * a priority queue, so that each step only needs to move on
+         * the file we picked last time, instead of looking at every
+         * single file again. The queue is rebuilt whenever the
+         * location is reset or the set of files changes. */
 
-                r = next_beyond_location(j, f, direction);
-                if (r < 0) {
-                        log_debug_errno(r, "Can't iterate through %s, ignoring: %m", f->path);
-                        remove_file_real(j, f);
-                        continue;
-                } else if (r == 0) {
-                        f->location_type = LOCATION_TAIL;
-                        continue;
+        if (!j->files_by_location || j->files_by_location_direction != direction) {
+                r = rebuild_files_by_location(j, direction);
+                if (r < 0)
+                        return r;
+        } else {
+                if (j->current_file) {
+                        r = update_file_location(j, j->current_file, direction);
+                        if (r < 0)
+                                goto fail;
                 }
 
-                if (!new_file)
-                        found = true;
-                else {
-                        int k;
-
-                        k = journal_file_compare_locations(f, new_file);
+                /* Check whether any file that hit its end before got
+                 * new entries in the meantime */
+                SET_FOREACH(f, j->files_at_tail, i) {
+                        if (le64toh(f->header->n_entries) == f->last_n_entries)
+                                continue;
 
-                        found = direction == DIRECTION_DOWN ? k < 0 : k > 0;
+                        r = update_file_location(j, f, direction);
+                        if (r < 0)
+                                goto fail;
                 }
-
-                if (found)
-                        new_file = f;
         }
 
-        if (!new_file)
-                return 0;
+        /* Now, skip over the candidates that are identical to the
+         * entry we are currently looking at. This happens for
+         * entries which exist in two (or more) journal files. */
+        for (;;) {
+                int k;
+
+                f = prioq_peek(j->files_by_location);
+                if (!f)
+                        return 0;
+
+                if (j->current_location.type != LOCATION_DISCRETE)
+                        break;
 
-        r = journal_file_move_to_object(new_file, OBJECT_ENTRY, new_file->current_offset, &o);
+                k = compare_with_location(f, &j->current_location);
+                if (direction == DIRECTION_DOWN ? k > 0 : k < 0)
+                        break;
+
+                r = update_file_location(j, f, direction);
+                if (r < 0)
+                        goto fail;
+        }
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
         if (r < 0)
                 return r;
 
-        set_location(j, new_file, o);
+        set_location(j, f, o);
 
         return 1;
+
+fail:
+        invalidate_files_by_location(j);
+        return r;
 }
 
 _public_ int sd_journal_next(sd_journal *j) {
@@ -1225,6 +1389,10 @@ static int add_any_file(sd_journal *j, const char *path) {
 
         check_network(j, f->fd);
 
+        /* Make sure the new file is considered on the next iteration
+         * step */
+        invalidate_files_by_location(j);
+
         j->current_invalidate_counter ++;
 
         return 0;
@@ -1272,6 +1440,69 @@ static int remove_file(sd_journal *j, const char *prefix, const char *filename)
         return 0;
 }
 
+/* Values returned by sd_journal_enumerate_unique() are remembered, so
+ * that we don't have to look for them in all the files traversed
+ * earlier. Only where each of them was found is stored, keyed by the
+ * data object's own hash, which is the same in every file, and the
+ * size. The payloads are only compared when those collide. */
+typedef struct UniqueValue UniqueValue;
+
+struct UniqueValue {
+        uint64_t hash;
+        size_t size;
+
+        /* NULL once the file went away */
+        JournalFile *file;
+        uint64_t offset;
+
+        /* Other values with the same hash and size */
+        LIST_FIELDS(UniqueValue, same);
+};
+
+static unsigned long unique_value_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        const UniqueValue *v = p;
+        uint64_t u;
+
+        siphash24((uint8_t*) &u, &v->hash, sizeof(v->hash), hash_key);
+        return (unsigned long) u;
+}
+
+static int unique_value_compare_func(const void *_a, const void *_b) {
+        const UniqueValue *a = _a, *b = _b;
+
+        if (a->hash != b->hash)
+                return a->hash < b->hash ? -1 : 1;
+        if (a->size != b->size)
+                return a->size < b->size ? -1 : 1;
+
+        return 0;
+}
+
+static const struct hash_ops unique_value_hash_ops = {
+        .hash = unique_value_hash_func,
+        .compare = unique_value_compare_func
+};
+
+static void unique_values_clear(Set *s) {
+        UniqueValue *head, *v;
+
+        while ((head = set_steal_first(s)))
+                while ((v = head)) {
+                        LIST_REMOVE(same, head, v);
+                        free(v);
+                }
+}
+
+static void unique_values_forget_file(Set *s, JournalFile *f) {
+        UniqueValue *head, *v;
+        Iterator i;
+
+        SET_FOREACH(head, s, i)
+                LIST_FOREACH(same, v, head)
+                        if (v->file == f)
+                                v->file = NULL;
+}
+
 static void remove_file_real(sd_journal *j, JournalFile *f) {
         assert(j);
         assert(f);
@@ -1285,6 +1516,10 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
                 j->current_field = 0;
         }
 
+        if (j->files_by_location && f->location_prioq_idx != PRIOQ_IDX_NULL)
+                prioq_remove(j->files_by_location, f, &f->location_prioq_idx);
+        set_remove(j->files_at_tail, f);
+
         if (j->unique_file == f) {
                 /* Jump to the next unique_file or NULL if that one was last */
                 j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
@@ -1293,6 +1528,8 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
                         j->unique_file_lost = true;
         }
 
+        unique_values_forget_file(j->unique_values, f);
+
         journal_file_close(f);
 
         j->current_invalidate_counter ++;
@@ -1765,14 +2002,19 @@ _public_ void sd_journal_close(sd_journal *j) {
         safe_close(j->inotify_fd);
 
         if (j->mmap) {
-                log_debug("mmap cache statistics: %u hit, %u miss", mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap));
+                mmap_cache_stats_log_debug(j->mmap);
                 mmap_cache_unref(j->mmap);
         }
 
         free(j->path);
         free(j->prefix);
         free(j->unique_field);
+        unique_values_clear(j->unique_values);
+        set_free(j->unique_values);
         set_free(j->errors);
+        prioq_free(j->files_by_location);
+        set_free(j->files_at_tail);
+        catalog_close(j->catalog);
         free(j);
 }
 
@@ -1865,19 +2107,17 @@ static bool field_is_valid(const char *field) {
         return true;
 }
 
-_public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **data, size_t *size) {
+static int find_data(sd_journal *j, const char *field, JournalFile **ret_file, Object **ret) {
         JournalFile *f;
         uint64_t i, n;
         size_t field_length;
         int r;
         Object *o;
 
-        assert_return(j, -EINVAL);
-        assert_return(!journal_pid_changed(j), -ECHILD);
-        assert_return(field, -EINVAL);
-        assert_return(data, -EINVAL);
-        assert_return(size, -EINVAL);
-        assert_return(field_is_valid(field), -EINVAL);
+        assert(j);
+        assert(field);
+        assert(ret_file);
+        assert(ret);
 
         f = j->current_file;
         if (!f)
@@ -1896,7 +2136,6 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
         for (i = 0; i < n; i++) {
                 uint64_t p, l;
                 le64_t le_hash;
-                size_t t;
                 int compression;
 
                 p = le64toh(o->entry.items[i].object_offset);
@@ -1912,24 +2151,15 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         if (decompress_startswith(compression,
                                                   o->data.payload, l,
                                                   &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=')) {
-
-                                size_t rsize;
-
-                                r = decompress_blob(compression,
-                                                    o->data.payload, l,
-                                                    &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                    j->data_threshold);
-                                if (r < 0)
-                                        return r;
-
-                                *data = f->compress_buffer;
-                                *size = (size_t) rsize;
+                                                  field, field_length, '=',
+                                                  journal_file_compress_dict(f))) {
 
+                                *ret_file = f;
+                                *ret = o;
                                 return 0;
                         }
 #else
@@ -1939,14 +2169,8 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                            memcmp(o->data.payload, field, field_length) == 0 &&
                            o->data.payload[field_length] == '=') {
 
-                        t = (size_t) l;
-
-                        if ((uint64_t) t != l)
-                                return -E2BIG;
-
-                        *data = o->data.payload;
-                        *size = t;
-
+                        *ret_file = f;
+                        *ret = o;
                         return 0;
                 }
 
@@ -1972,13 +2196,14 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
 
         compression = o->object.flags & OBJECT_COMPRESSION_MASK;
         if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                 size_t rsize;
                 int r;
 
                 r = decompress_blob(compression,
                                     o->data.payload, l, &f->compress_buffer,
-                                    &f->compress_buffer_size, &rsize, j->data_threshold);
+                                    &f->compress_buffer_size, &rsize, j->data_threshold,
+                                    journal_file_compress_dict(f));
                 if (r < 0)
                         return r;
 
@@ -1995,17 +2220,35 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
         return 0;
 }
 
-_public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t *size) {
+_public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **data, size_t *size) {
         JournalFile *f;
-        uint64_t p, n;
-        le64_t le_hash;
-        int r;
         Object *o;
+        int r;
 
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(field, -EINVAL);
         assert_return(data, -EINVAL);
         assert_return(size, -EINVAL);
+        assert_return(field_is_valid(field), -EINVAL);
+
+        r = find_data(j, field, &f, &o);
+        if (r < 0)
+                return r;
+
+        return return_data(j, f, o, data, size);
+}
+
+static int next_data(sd_journal *j, JournalFile **ret_file, Object **ret) {
+        JournalFile *f;
+        uint64_t p, n;
+        le64_t le_hash;
+        int r;
+        Object *o;
+
+        assert(j);
+        assert(ret_file);
+        assert(ret);
 
         f = j->current_file;
         if (!f)
@@ -2031,6 +2274,25 @@ _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t
         if (le_hash != o->data.hash)
                 return -EBADMSG;
 
+        *ret_file = f;
+        *ret = o;
+        return 1;
+}
+
+_public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t *size) {
+        JournalFile *f;
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(data, -EINVAL);
+        assert_return(size, -EINVAL);
+
+        r = next_data(j, &f, &o);
+        if (r <= 0)
+                return r;
+
         r = return_data(j, f, o, data, size);
         if (r < 0)
                 return r;
@@ -2040,6 +2302,134 @@ _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t
         return 1;
 }
 
+JournalData* journal_data_ref(JournalData *d) {
+        if (!d)
+                return NULL;
+
+        assert(d->n_ref > 0);
+        d->n_ref++;
+
+        return d;
+}
+
+JournalData* journal_data_unref(JournalData *d) {
+        if (!d)
+                return NULL;
+
+        assert(d->n_ref > 0);
+        d->n_ref--;
+
+        if (d->n_ref > 0)
+                return NULL;
+
+        if (d->window)
+                mmap_cache_unpin(d->mmap, d->window);
+
+        free(d->buffer);
+        free(d);
+
+        return NULL;
+}
+
+static int data_ref_new(sd_journal *j, JournalFile *f, Object *o, JournalData **ret) {
+        _cleanup_(journal_data_unrefp) JournalData *d = NULL;
+        size_t t;
+        uint64_t l;
+        int compression, r;
+
+        assert(j);
+        assert(f);
+        assert(o);
+        assert(ret);
+
+        l = le64toh(o->object.size) - offsetof(Object, data.payload);
+        t = (size_t) l;
+
+        /* We can't read objects larger than 4G on a 32bit machine */
+        if ((uint64_t) t != l)
+                return -E2BIG;
+
+        d = new0(JournalData, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->n_ref = 1;
+
+        compression = o->object.flags & OBJECT_COMPRESSION_MASK;
+        if (compression) {
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+                size_t allocated = 0, rsize;
+
+                r = decompress_blob(compression,
+                                    o->data.payload, l, &d->buffer,
+                                    &allocated, &rsize, j->data_threshold,
+                                    journal_file_compress_dict(f));
+                if (r < 0)
+                        return r;
+
+                d->data = d->buffer;
+                d->size = rsize;
+#else
+                return -EPROTONOSUPPORT;
+#endif
+        } else {
+                /* The object was the last one looked up in the data
+                 * context, hence pinning it pins the right window */
+                r = journal_file_pin_object(f, OBJECT_DATA, &d->window);
+                if (r < 0)
+                        return r;
+
+                d->mmap = f->mmap;
+                d->data = o->data.payload;
+                d->size = t;
+        }
+
+        *ret = d;
+        d = NULL;
+
+        return 0;
+}
+
+int journal_get_data_ref(sd_journal *j, const char *field, JournalData **ret) {
+        JournalFile *f;
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(field, -EINVAL);
+        assert_return(ret, -EINVAL);
+        assert_return(field_is_valid(field), -EINVAL);
+
+        r = find_data(j, field, &f, &o);
+        if (r < 0)
+                return r;
+
+        return data_ref_new(j, f, o, ret);
+}
+
+int journal_enumerate_data_ref(sd_journal *j, JournalData **ret) {
+        JournalFile *f;
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(ret, -EINVAL);
+
+        r = next_data(j, &f, &o);
+        if (r <= 0)
+                return r;
+
+        r = data_ref_new(j, f, o, ret);
+        if (r < 0)
+                return r;
+
+        j->current_field ++;
+
+        return 1;
+}
+
 _public_ void sd_journal_restart_data(sd_journal *j) {
         if (!j)
                 return;
@@ -2339,6 +2729,98 @@ _public_ int sd_journal_get_cutoff_monotonic_usec(sd_journal *j, sd_id128_t boot
         return found;
 }
 
+int journal_seek_entry(sd_journal *j, JournalFile *f, uint64_t offset) {
+        Object *o;
+        int r;
+
+        assert(j);
+        assert(f);
+
+        /* Makes the entry at the specified offset of f the current
+         * one, without consulting the matches or the other files.
+         * This allows replaying the iteration of another sd_journal
+         * object over the same set of files. */
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, offset, &o);
+        if (r < 0)
+                return r;
+
+        journal_file_save_location(f, o, offset);
+        f->location_type = LOCATION_DISCRETE;
+
+        init_location(&j->current_location, LOCATION_DISCRETE, f, o);
+        j->current_file = f;
+        j->current_field = 0;
+
+        return 0;
+}
+
+static int boot_compare_id(const void *_a, const void *_b) {
+        const JournalBoot *a = _a, *b = _b;
+
+        return memcmp(&a->id, &b->id, sizeof(sd_id128_t));
+}
+
+static int boot_compare_first(const void *_a, const void *_b) {
+        const JournalBoot *a = _a, *b = _b;
+
+        if (a->first != b->first)
+                return a->first < b->first ? -1 : 1;
+
+        return boot_compare_id(a, b);
+}
+
+int journal_get_boots(sd_journal *j, JournalBoot **ret) {
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n = 0, allocated = 0, i, k;
+        JournalFile *f;
+        Iterator it;
+        int r;
+
+        assert(j);
+        assert(ret);
+
+        /* Returns all boots of the journal, ordered by the time of
+         * their first entry. This only looks at the boots the files
+         * cache, and never at individual entries. Matches are not
+         * taken into account. */
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, it) {
+                const JournalBoot *b;
+                size_t m;
+
+                r = journal_file_get_boots(f, &b, &m);
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to determine boots of %s, ignoring: %m", f->path);
+                        continue;
+                }
+
+                if (!GREEDY_REALLOC(boots, allocated, n + m))
+                        return -ENOMEM;
+
+                memcpy(boots + n, b, m * sizeof(JournalBoot));
+                n += m;
+        }
+
+        /* The same boot may show up in several files */
+        qsort_safe(boots, n, sizeof(JournalBoot), boot_compare_id);
+
+        for (i = 0, k = 0; i < n; i++) {
+                if (k > 0 && sd_id128_equal(boots[k-1].id, boots[i].id)) {
+                        boots[k-1].first = MIN(boots[k-1].first, boots[i].first);
+                        boots[k-1].last = MAX(boots[k-1].last, boots[i].last);
+                } else
+                        boots[k++] = boots[i];
+        }
+
+        qsort_safe(boots, k, sizeof(JournalBoot), boot_compare_first);
+
+        *ret = boots;
+        boots = NULL;
+
+        return (int) k;
+}
+
 void journal_print_header(sd_journal *j) {
         Iterator i;
         JournalFile *f;
@@ -2395,10 +2877,78 @@ _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
         j->unique_file = NULL;
         j->unique_offset = 0;
         j->unique_file_lost = false;
+        unique_values_clear(j->unique_values);
 
         return 0;
 }
 
+static int unique_value_equal(sd_journal *j, UniqueValue *v, const void *data, size_t size) {
+        const void *vdata;
+        size_t vl;
+        Object *o;
+        int r;
+
+        if (!v->file)
+                return 0;
+
+        /* Each value is stored only once in a file */
+        if (v->file == j->unique_file)
+                return v->offset == j->unique_offset;
+
+        /* The OBJECT_DATA context, so that the data object we are
+         * looking at stays mapped */
+        r = journal_file_move_to_object(v->file, OBJECT_DATA, v->offset, &o);
+        if (r < 0)
+                return r;
+
+        r = return_data(j, v->file, o, &vdata, &vl);
+        if (r < 0)
+                return r;
+
+        return vl == size && memcmp(vdata, data, size) == 0;
+}
+
+static int unique_value_add(sd_journal *j, uint64_t hash, const void *data, size_t size) {
+        UniqueValue key = {
+                .hash = hash,
+                .size = size,
+        }, *head, *v;
+        int r;
+
+        head = set_get(j->unique_values, &key);
+        LIST_FOREACH(same, v, head) {
+                r = unique_value_equal(j, v, data, size);
+                if (r != 0)
+                        return r < 0 ? r : 0;
+        }
+
+        r = set_ensure_allocated(&j->unique_values, &unique_value_hash_ops);
+        if (r < 0)
+                return r;
+
+        v = new0(UniqueValue, 1);
+        if (!v)
+                return -ENOMEM;
+
+        v->hash = hash;
+        v->size = size;
+        v->file = j->unique_file;
+        v->offset = j->unique_offset;
+
+        if (head) {
+                LIST_INSERT_AFTER(same, head, head, v);
+                return 1;
+        }
+
+        r = set_put(j->unique_values, v);
+        if (r < 0) {
+                free(v);
+                return r;
+        }
+
+        return 1;
+}
+
 _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
         size_t k;
 
@@ -2422,12 +2972,9 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
         }
 
         for (;;) {
-                JournalFile *of;
-                Iterator i;
                 Object *o;
                 const void *odata;
                 size_t ol;
-                bool found;
                 int r;
 
                 /* Proceed to next data object in the field's linked list */
@@ -2489,36 +3036,15 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 }
 
                 /* OK, now let's see if we already returned this data
-                 * object by checking if it exists in the earlier
-                 * traversed files. */
-                found = false;
-                ORDERED_HASHMAP_FOREACH(of, j->files, i) {
-                        Object *oo;
-                        uint64_t op;
-
-                        if (of == j->unique_file)
-                                break;
-
-                        /* Skip this file it didn't have any fields
-                         * indexed */
-                        if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) &&
-                            le64toh(of->header->n_fields) <= 0)
-                                continue;
-
-                        r = journal_file_find_data_object_with_hash(of, odata, ol, le64toh(o->data.hash), &oo, &op);
-                        if (r < 0)
-                                return r;
-
-                        if (r > 0)
-                                found = true;
-                }
-
-                if (found)
-                        continue;
-
-                r = return_data(j, j->unique_file, o, data, l);
+                 * object, as part of an earlier traversed file. */
+                r = unique_value_add(j, le64toh(o->data.hash), odata, ol);
                 if (r < 0)
                         return r;
+                if (r == 0)
+                        continue;
+
+                *data = odata;
+                *l = ol;
 
                 return 1;
         }
@@ -2531,6 +3057,7 @@ _public_ void sd_journal_restart_unique(sd_journal *j) {
         j->unique_file = NULL;
         j->unique_offset = 0;
         j->unique_file_lost = false;
+        unique_values_clear(j->unique_values);
 }
 
 _public_ int sd_journal_reliable_fd(sd_journal *j) {
@@ -2559,11 +3086,40 @@ static char *lookup_field(const char *field, void *userdata) {
         return strndup((const char*) data + d, size - d);
 }
 
+static int journal_open_catalog(sd_journal *j) {
+        usec_t n;
+        int r;
+
+        assert(j);
+
+        n = now(CLOCK_MONOTONIC);
+
+        if (j->catalog) {
+                if (n < j->catalog_checked + CATALOG_CHECK_USEC)
+                        return 0;
+
+                j->catalog_checked = n;
+
+                if (!catalog_changed(j->catalog, CATALOG_DATABASE))
+                        return 0;
+
+                j->catalog = catalog_close(j->catalog);
+        }
+
+        r = catalog_open(CATALOG_DATABASE, &j->catalog);
+        if (r < 0)
+                return r;
+
+        j->catalog_checked = n;
+        return 0;
+}
+
 _public_ int sd_journal_get_catalog(sd_journal *j, char **ret) {
         const void *data;
         size_t size;
         sd_id128_t id;
-        _cleanup_free_ char *text = NULL, *cid = NULL;
+        _cleanup_free_ char *cid = NULL;
+        const char *text;
         char *t;
         int r;
 
@@ -2583,7 +3139,11 @@ _public_ int sd_journal_get_catalog(sd_journal *j, char **ret) {
         if (r < 0)
                 return r;
 
-        r = catalog_get(CATALOG_DATABASE, id, &text);
+        r = journal_open_catalog(j);
+        if (r < 0)
+                return r;
+
+        r = catalog_get_text(j->catalog, id, &text);
         if (r < 0)
                 return r;
 
@@ -122,6 +122,79 @@ static void test_catalog_update(void) {
         assert_se(r >= 0);
 }
 
+static void test_catalog_lookup_all(const char *db, unsigned n, bool de) {
+        _cleanup_(catalog_closep) Catalog *c = NULL;
+        const char *text;
+        unsigned i;
+
+        assert_se(catalog_open(db, &c) >= 0);
+
+        for (i = 0; i < n; i++) {
+                char expected[LINE_MAX];
+                sd_id128_t id = {};
+
+                id.qwords[0] = i;
+                id.qwords[1] = UINT64_C(0x5ca1ab1e);
+
+                xsprintf(expected, "Subject: %s %u\n\nBody.\n", de && i % 2 == 0 ? "de" : "C", i);
+
+                assert_se(catalog_get_text(c, id, &text) >= 0);
+                assert_se(streq(text, expected));
+        }
+
+        /* Misses have to be detected with and without index */
+        assert_se(catalog_get_text(c, SD_ID128_MAKE(ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff,ff), &text) == -ENOENT);
+}
+
+static void test_catalog_index(void) {
+        char dir[] = "/tmp/test-catalog-index.XXXXXX";
+        _cleanup_free_ char *fn = NULL, *db = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        const char *dirs[2] = {};
+        const char *loc;
+        bool de;
+        unsigned i, n = 3000;
+        uint32_t flags = 0;
+        int fd;
+
+        assert_se(mkdtemp(dir));
+        assert_se(fn = strappend(dir, "/index.catalog"));
+        assert_se(db = strappend(dir, "/database"));
+
+        assert_se(f = fopen(fn, "we"));
+        for (i = 0; i < n; i++) {
+                sd_id128_t id = {};
+
+                id.qwords[0] = i;
+                id.qwords[1] = UINT64_C(0x5ca1ab1e);
+
+                fprintf(f, "-- " SD_ID128_FORMAT_STR "\nSubject: C %u\n\nBody.\n\n", SD_ID128_FORMAT_VAL(id), i);
+                if (i % 2 == 0)
+                        fprintf(f, "-- " SD_ID128_FORMAT_STR " de\nSubject: de %u\n\nBody.\n\n", SD_ID128_FORMAT_VAL(id), i);
+        }
+        assert_se(fflush_and_check(f) >= 0);
+
+        dirs[0] = dir;
+        assert_se(catalog_update(db, NULL, dirs) >= 0);
+
+        loc = setlocale(LC_MESSAGES, NULL);
+        de = loc && startswith(loc, "de");
+
+        test_catalog_lookup_all(db, n, de);
+
+        /* Old databases come without index and are searched */
+        fd = open(db, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(pwrite(fd, &flags, sizeof(flags), 8) == sizeof(flags));
+        safe_close(fd);
+
+        test_catalog_lookup_all(db, n, de);
+
+        assert_se(unlink(fn) == 0);
+        assert_se(unlink(db) == 0);
+        assert_se(rmdir(dir) == 0);
+}
+
 static void test_catalog_file_lang(void) {
         _cleanup_free_ char *lang = NULL, *lang2 = NULL, *lang3 = NULL, *lang4 = NULL;
 
@@ -165,6 +238,8 @@ int main(int argc, char *argv[]) {
 
         test_catalog_update();
 
+        test_catalog_index();
+
         r = catalog_list(stdout, database, true);
         assert_se(r >= 0);
 
@@ -27,7 +27,10 @@ typedef int (decompress_t)(const void *src, uint64_t src_size,
 
 #define MAX_SIZE (1024*1024LU)
 
-static char* make_buf(size_t count) {
+/* Stop each run after this long, xz is slow */
+#define MAX_RUN_USEC (10 * USEC_PER_SEC)
+
+static char* make_buf_alphabet(size_t count) {
         char *buf;
         size_t i;
 
@@ -40,27 +43,60 @@ static char* make_buf(size_t count) {
         return buf;
 }
 
-static void test_compress_decompress(const char* label,
+static char* make_buf_json(size_t count) {
+        static const char *const levels[] = { "debug", "info", "notice", "warning", "err" };
+        uint32_t seed = 1;
+        char *buf;
+        size_t i = 0;
+
+        /* Something resembling structured service logs: mostly
+         * repeating keys, with some varying values */
+
+        buf = malloc(count + 256);
+        assert_se(buf);
+
+        while (i < count) {
+                unsigned a, b, c;
+
+                seed = seed * 1103515245 + 12345;
+                a = seed >> 16;
+                seed = seed * 1103515245 + 12345;
+                b = seed >> 16;
+                seed = seed * 1103515245 + 12345;
+                c = seed >> 16;
+
+                i += sprintf(buf + i,
+                             "{\"timestamp\":%"PRIu64",\"level\":\"%s\",\"unit\":\"worker-%u.service\","
+                             "\"message\":\"request %u from 10.0.%u.%u completed in %u ms\"}\n",
+                             UINT64_C(1434000000000000) + i * 37, levels[a % ELEMENTSOF(levels)], a % 16,
+                             b, (c >> 8) & 0xff, c & 0xff, a % 1000);
+        }
+
+        return buf;
+}
+
+static void test_compress_decompress(const char *label, const char *type,
                                      compress_t compress, decompress_t decompress) {
-        usec_t n, n2 = 0;
-        float dt;
+        usec_t n, t_compress = 0, t_decompress = 0;
 
-        _cleanup_free_ char *text, *buf;
+        _cleanup_free_ char *text = NULL, *buf = NULL;
         _cleanup_free_ void *buf2 = NULL;
         size_t buf2_allocated = 0;
         size_t skipped = 0, compressed = 0, total = 0;
 
-        text = make_buf(MAX_SIZE);
+        text = streq(type, "json") ? make_buf_json(MAX_SIZE) : make_buf_alphabet(MAX_SIZE);
         buf = calloc(MAX_SIZE + 1, 1);
         assert_se(text && buf);
 
-        n = now(CLOCK_MONOTONIC);
-
         for (size_t i = 1; i <= MAX_SIZE; i += (i < 2048 ? 1 : 217)) {
                 size_t j = 0, k = 0;
+                usec_t a, b;
                 int r;
 
+                a = now(CLOCK_MONOTONIC);
                 r = compress(text, i, buf, &j);
+                b = now(CLOCK_MONOTONIC);
+
                 /* assume compression must be successful except for small inputs */
                 assert_se(r == 0 || (i < 2048 && r == -ENOBUFS));
                 /* check for overwrites */
@@ -70,44 +106,57 @@ static void test_compress_decompress(const char* label,
                         continue;
                 }
 
+                t_compress += b - a;
+
                 assert_se(j > 0);
                 if (j >= i)
                         log_error("%s \"compressed\" %zu -> %zu", label, i, j);
 
+                a = now(CLOCK_MONOTONIC);
                 r = decompress(buf, j, &buf2, &buf2_allocated, &k, 0);
+                b = now(CLOCK_MONOTONIC);
                 assert_se(r == 0);
                 assert_se(buf2_allocated >= k);
                 assert_se(k == i);
 
+                t_decompress += b - a;
+
                 assert_se(memcmp(text, buf2, i) == 0);
 
                 total += i;
                 compressed += j;
 
-                n2 = now(CLOCK_MONOTONIC);
-                if (n2 - n > 60 * USEC_PER_SEC)
+                n = t_compress + t_decompress;
+                if (n > MAX_RUN_USEC)
                         break;
         }
 
-        dt = (n2-n) / 1e6;
-
-        log_info("%s: compressed & decompressed %zu bytes in %.2fs (%.2fMiB/s), "
-                 "mean compresion %.2f%%, skipped %zu bytes",
-                 label, total, dt,
-                 total / 1024. / 1024 / dt,
+        log_info("%s/%s: %zu bytes, compression %.2fMiB/s, decompression %.2fMiB/s, "
+                 "mean compression %.2f%%, skipped %zu bytes",
+                 label, type, total,
+                 total / 1024. / 1024 / (t_compress / 1e6),
+                 total / 1024. / 1024 / (t_decompress / 1e6),
                  100 - compressed * 100. / total,
                  skipped);
 }
 
 int main(int argc, char *argv[]) {
+        static const char *const types[] = { "alphabet", "json" };
+        unsigned i;
 
         log_set_max_level(LOG_DEBUG);
 
+        for (i = 0; i < ELEMENTSOF(types); i++) {
 #ifdef HAVE_XZ
-        test_compress_decompress("XZ", compress_blob_xz, decompress_blob_xz);
+                test_compress_decompress("XZ", types[i], compress_blob_xz, decompress_blob_xz);
 #endif
 #ifdef HAVE_LZ4
-        test_compress_decompress("LZ4", compress_blob_lz4, decompress_blob_lz4);
+                test_compress_decompress("LZ4", types[i], compress_blob_lz4, decompress_blob_lz4);
+#endif
+#ifdef HAVE_ZSTD
+                test_compress_decompress("ZSTD", types[i], compress_blob_zstd, decompress_blob_zstd);
 #endif
+        }
+
         return 0;
 }
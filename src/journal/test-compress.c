@@ -34,6 +34,12 @@
 # define LZ4_OK -EPROTONOSUPPORT
 #endif
 
+#ifdef HAVE_ZSTD
+# define ZSTD_OK 0
+#else
+# define ZSTD_OK -EPROTONOSUPPORT
+#endif
+
 typedef int (compress_blob_t)(const void *src, uint64_t src_size,
                               void *dst, size_t *dst_size);
 typedef int (decompress_blob_t)(const void *src, uint64_t src_size,
@@ -91,6 +97,50 @@ static void test_compress_decompress(int compression,
         memzero(decompressed, usize);
 }
 
+static void test_decompress_max(int compression,
+                                compress_blob_t compress,
+                                decompress_blob_t decompress) {
+        _cleanup_free_ char *data = NULL, *compressed = NULL, *decompressed = NULL;
+        size_t data_len = 64 * 1024, csize = 0, usize = 0, dsize = 0, i;
+        int r;
+
+        log_info("/* testing %s decompression with a maximum size */",
+                 object_compressed_to_string(compression));
+
+        data = malloc(data_len);
+        compressed = malloc(data_len);
+        assert_se(data && compressed);
+
+        for (i = 0; i < data_len; i++)
+                data[i] = 'a' + i % 7;
+
+        r = compress(data, data_len, compressed, &csize);
+        assert_se(r == 0);
+
+        /* The output stops somewhere after the maximum, and the rest
+         * isn't even allocated */
+        r = decompress(compressed, csize, (void **) &decompressed, &usize, &dsize, 1000);
+        assert_se(r == 0);
+        assert_se(dsize >= 1000);
+        assert_se(dsize < data_len);
+        assert_se(usize < data_len);
+        assert_se(memcmp(decompressed, data, 1000) == 0);
+
+        r = decompress(compressed, csize, (void **) &decompressed, &usize, &dsize, 0);
+        assert_se(r == 0);
+        assert_se(dsize == data_len);
+        assert_se(memcmp(decompressed, data, data_len) == 0);
+
+        r = decompress(compressed, csize, (void **) &decompressed, &usize, &dsize, data_len + 1);
+        assert_se(r == 0);
+        assert_se(dsize == data_len);
+
+        /* Truncated input is an error, even if the maximum is never
+         * reached */
+        r = decompress(compressed, csize / 2, (void **) &decompressed, &usize, &dsize, 0);
+        assert_se(r < 0);
+}
+
 static void test_decompress_startswith(int compression,
                                        compress_blob_t compress,
                                        decompress_sw_t decompress_sw,
@@ -196,6 +246,69 @@ static void test_compress_stream(int compression,
         assert_se(unlink(pattern2) == 0);
 }
 
+#ifdef HAVE_ZSTD
+static void test_compress_dict(void) {
+        _cleanup_free_ char *samples = NULL, *decompressed = NULL;
+        _cleanup_free_ size_t *sizes = NULL;
+        _cleanup_free_ void *dict_data = NULL;
+        CompressDict *dict;
+        const char msg[] = "MESSAGE=Accepted publickey for root from 10.0.3.77 port 51234 ssh2";
+        char compressed[512];
+        size_t csize = 0, usize = 0, dsize = 0, n = 0, l = 0;
+        unsigned i;
+        int r;
+
+        log_info("/* testing ZSTD dictionary compression */");
+
+        samples = malloc(128 * 1024);
+        sizes = new(size_t, 4096);
+        assert_se(samples && sizes);
+
+        for (i = 0; n < 4096 && l + 128 < 128 * 1024; i++) {
+                int k;
+
+                k = snprintf(samples + l, 128,
+                             i % 2 ? "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u ssh2" :
+                                     "_SYSTEMD_UNIT=session-%u.scope%u%u%u",
+                             i * 7 % 113, i % 256, i * 13 % 256, 1024 + i * 31 % 60000);
+                sizes[n++] = k;
+                l += k;
+        }
+
+        r = compress_dict_train(samples, sizes, n, 16 * 1024, &dict_data, &dsize);
+        assert_se(r == 0);
+        assert_se(dsize > 0 && dsize <= 16 * 1024);
+
+        assert_se(compress_dict_new("garbage", 7, &dict) == -EBADMSG);
+        assert_se(compress_dict_new(dict_data, dsize, &dict) == 0);
+
+        /* Without the dictionary this blob is too small to compress */
+        assert_se(compress_blob_zstd_dict(msg, sizeof(msg), compressed, &csize, dict) == 0);
+        log_info("dictionary compressed %zu -> %zu", sizeof(msg), csize);
+        assert_se(csize < sizeof(msg));
+
+        assert_se(decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                  (void **) &decompressed, &usize, &l, 0, dict) == 0);
+        assert_se(l == sizeof(msg));
+        assert_se(memcmp(decompressed, msg, sizeof(msg)) == 0);
+
+        assert_se(decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                  (void **) &decompressed, &usize, &l, 0, NULL) == -ENOKEY);
+
+        assert_se(decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                        (void **) &decompressed, &usize,
+                                        "MESSAGE", 7, '=', dict) > 0);
+        assert_se(decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                        (void **) &decompressed, &usize,
+                                        "MESSAGE", 7, '_', dict) == 0);
+        assert_se(decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                        (void **) &decompressed, &usize,
+                                        "MESSAGE", 7, '=', NULL) == -ENOKEY);
+
+        compress_dict_free(dict);
+}
+#endif
+
 int main(int argc, char *argv[]) {
         const char text[] =
                 "text\0foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF"
@@ -212,6 +325,7 @@ int main(int argc, char *argv[]) {
                                  text, sizeof(text), false);
         test_compress_decompress(OBJECT_COMPRESSED_XZ, compress_blob_xz, decompress_blob_xz,
                                  data, sizeof(data), true);
+        test_decompress_max(OBJECT_COMPRESSED_XZ, compress_blob_xz, decompress_blob_xz);
         test_decompress_startswith(OBJECT_COMPRESSED_XZ,
                                    compress_blob_xz, decompress_startswith_xz,
                                    text, sizeof(text), false);
@@ -229,6 +343,7 @@ int main(int argc, char *argv[]) {
                                  text, sizeof(text), false);
         test_compress_decompress(OBJECT_COMPRESSED_LZ4, compress_blob_lz4, decompress_blob_lz4,
                                  data, sizeof(data), true);
+        test_decompress_max(OBJECT_COMPRESSED_LZ4, compress_blob_lz4, decompress_blob_lz4);
         test_decompress_startswith(OBJECT_COMPRESSED_LZ4,
                                    compress_blob_lz4, decompress_startswith_lz4,
                                    text, sizeof(text), false);
@@ -243,5 +358,24 @@ int main(int argc, char *argv[]) {
         log_info("/* LZ4 test skipped */");
 #endif
 
+#ifdef HAVE_ZSTD
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 text, sizeof(text), false);
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 data, sizeof(data), true);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   text, sizeof(text), false);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   data, sizeof(data), true);
+        test_decompress_max(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd);
+        test_compress_stream(OBJECT_COMPRESSED_ZSTD, "zstdcat",
+                             compress_stream_zstd, decompress_stream_zstd, argv[0]);
+        test_compress_dict();
+#else
+        log_info("/* ZSTD test skipped */");
+#endif
+
         return 0;
 }
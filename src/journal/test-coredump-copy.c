@@ -0,0 +1,169 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "macro.h"
+#include "compress.h"
+#include "coredump-copy.h"
+
+#define MIB (1024U*1024U)
+
+/* 16 MiB: random data, zeros, a repetition of the first two MiB, and
+ * an odd sized tail */
+static void make_core(uint8_t **ret, size_t *ret_size) {
+        size_t size = 13 * MIB + 12345, i;
+        unsigned seed = 4711;
+        uint8_t *p;
+
+        p = malloc0(size);
+        assert_se(p);
+
+        for (i = 0; i < 2 * MIB; i++)
+                p[i] = rand_r(&seed);
+
+        /* 4 MiB of zeros, with a few bytes in between */
+        p[3 * MIB + 100] = 1;
+        p[5 * MIB - 1] = 2;
+
+        memcpy(p + 6 * MIB, p, 2 * MIB);
+
+        for (i = 8 * MIB; i < 10 * MIB; i++)
+                p[i] = i % 251;
+
+        memcpy(p + 10 * MIB, p, 2 * MIB);
+
+        for (i = 12 * MIB; i < size; i++)
+                p[i] = rand_r(&seed) % 4;
+
+        *ret = p;
+        *ret_size = size;
+}
+
+static int make_input(const char *dir, const uint8_t *p, size_t size) {
+        _cleanup_free_ char *fn = NULL;
+        int fd;
+
+        assert_se(fn = strappend(dir, "/input"));
+        fd = open(fn, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, p, size, false) >= 0);
+        assert_se(lseek(fd, 0, SEEK_SET) == 0);
+        assert_se(unlink(fn) == 0);
+
+        return fd;
+}
+
+static void verify(int fd, const uint8_t *p, size_t size) {
+        _cleanup_free_ uint8_t *buf = NULL;
+
+        buf = malloc(size + 1);
+        assert_se(buf);
+
+        assert_se(lseek(fd, 0, SEEK_SET) == 0);
+        assert_se(loop_read(fd, buf, size + 1, false) == (ssize_t) size);
+        assert_se(memcmp(buf, p, size) == 0);
+}
+
+static void test_copy(const char *dir, const uint8_t *p, size_t size, bool compress, unsigned n_threads) {
+        _cleanup_close_ int fdf = -1, fdt = -1, fdc = -1, fdd = -1;
+        CoredumpCopyStats stats;
+        struct stat st;
+
+        log_info("/* %s(compress=%s, n_threads=%u) */", __func__, yes_no(compress), n_threads);
+
+        fdf = make_input(dir, p, size);
+        fdt = open_tmpfile(dir, O_RDWR|O_CLOEXEC);
+        assert_se(fdt >= 0);
+
+        if (compress) {
+                fdc = open_tmpfile(dir, O_RDWR|O_CLOEXEC);
+                assert_se(fdc >= 0);
+        }
+
+        assert_se(coredump_copy(fdf, fdt, fdc, -1, n_threads, &stats) >= 0);
+
+        log_info("%"PRIu64" bytes, %"PRIu64" sparse, %"PRIu64" deduplicated, %"PRIu64" compressed",
+                 stats.size, stats.sparse, stats.deduplicated, stats.compressed_size);
+
+        assert_se(stats.size == size);
+        assert_se(stats.sparse >= 4 * MIB - 2 * page_size());
+
+        /* The zeros end up as holes */
+        assert_se(fstat(fdt, &st) >= 0);
+        assert_se(st.st_size == (off_t) size);
+        assert_se((uint64_t) st.st_blocks * 512 < size - 3 * MIB);
+
+        verify(fdt, p, size);
+
+        if (!compress)
+                return;
+
+        /* The copies of the first two MiB, and all but the first MiB
+         * of zeros without anything in it */
+        assert_se(stats.deduplicated == 4 * MIB + 1 * MIB);
+
+        fdd = open_tmpfile(dir, O_RDWR|O_CLOEXEC);
+        assert_se(fdd >= 0);
+
+        assert_se(lseek(fdc, 0, SEEK_SET) == 0);
+        assert_se(decompress_stream_zstd(fdc, fdd, -1) >= 0);
+
+        verify(fdd, p, size);
+}
+
+static void test_too_big(const char *dir, const uint8_t *p, size_t size) {
+        _cleanup_close_ int fdf = -1, fdt = -1, fdc = -1;
+
+        log_info("/* %s */", __func__);
+
+        fdf = make_input(dir, p, size);
+        fdt = open_tmpfile(dir, O_RDWR|O_CLOEXEC);
+        assert_se(fdt >= 0);
+        fdc = open_tmpfile(dir, O_RDWR|O_CLOEXEC);
+        assert_se(fdc >= 0);
+
+        assert_se(coredump_copy(fdf, fdt, fdc, size - 1, 2, NULL) == -EFBIG);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_free_ uint8_t *p = NULL;
+        char dir[] = "/var/tmp/test-coredump-copy.XXXXXX";
+        size_t size;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(dir));
+
+        make_core(&p, &size);
+
+        test_copy(dir, p, size, false, 0);
+
+#ifdef HAVE_ZSTD
+        test_copy(dir, p, size, true, 1);
+        test_copy(dir, p, size, true, 4);
+        test_too_big(dir, p, size);
+#endif
+
+        assert_se(rmdir(dir) == 0);
+
+        return 0;
+}
@@ -0,0 +1,133 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "event-util.h"
+#include "journal-file.h"
+#include "journal-verify.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define N_ENTRIES_DEFAULT 50000U
+
+/* Look up an entry by seqnum every so often, as journald does when
+ * it flushes, to mix bisection into the chain cache */
+#define SEEK_EVERY 4096U
+
+static void append(JournalFile *f, unsigned i) {
+        static const char *const units[] = { "sshd.service", "cron.service", "nginx.service", "session-4.scope" };
+        char message[LINE_MAX], priority[16], pid[32], unit[64];
+        struct iovec iovec[8];
+        unsigned n = 0;
+        dual_timestamp ts;
+
+        /* What a typical service logs via stdout: a unique message,
+         * a handful of values repeated in every entry, and a few
+         * that vary a bit */
+        xsprintf(message, "MESSAGE=Request %u from 10.0.%u.%u completed with status %u", i, i % 256, i * 7 % 256, 200 + i % 5);
+        xsprintf(priority, "PRIORITY=%u", 3 + i % 4);
+        xsprintf(pid, "_PID=%u", 100 + i % 37);
+        xsprintf(unit, "_SYSTEMD_UNIT=%s", units[i % ELEMENTSOF(units)]);
+
+        IOVEC_SET_STRING(iovec[n++], message);
+        IOVEC_SET_STRING(iovec[n++], priority);
+        IOVEC_SET_STRING(iovec[n++], pid);
+        IOVEC_SET_STRING(iovec[n++], unit);
+        IOVEC_SET_STRING(iovec[n++], "SYSLOG_IDENTIFIER=benchmark");
+        IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=stdout");
+        IOVEC_SET_STRING(iovec[n++], "_HOSTNAME=benchmark-host");
+        IOVEC_SET_STRING(iovec[n++], "_COMM=benchmark");
+
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, iovec, n, NULL, NULL, NULL) == 0);
+}
+
+static void run(const char *directory, unsigned n_entries, bool coalesce) {
+        _cleanup_event_unref_ sd_event *e = NULL;
+        _cleanup_free_ char *path = NULL;
+        JournalMetrics metrics;
+        JournalFile *f;
+        Object *o;
+        unsigned i;
+        usec_t u;
+
+        path = strjoin(directory, coalesce ? "/coalesced.journal" : "/immediate.journal", NULL);
+        assert_se(path);
+
+        /* Size the hash tables like journald does */
+        memset(&metrics, 0xFF, sizeof(metrics));
+        assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, true, false, &metrics, NULL, NULL, &f) == 0);
+
+        /* The event loop is never run, so the only notification
+         * happens when the file is closed */
+        if (coalesce) {
+                assert_se(sd_event_new(&e) >= 0);
+                assert_se(journal_file_enable_post_change_timer(f, e, 250 * USEC_PER_MSEC) >= 0);
+        }
+
+        u = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_entries; i++) {
+                append(f, i);
+
+                if (i % SEEK_EVERY == SEEK_EVERY - 1) {
+                        assert_se(journal_file_move_to_entry_by_seqnum(f, i / 2 + 1, DIRECTION_DOWN, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.seqnum) == i / 2 + 1);
+                }
+        }
+
+        u = now(CLOCK_MONOTONIC) - u;
+
+        log_info("%s post-change notifications: %u entries in %.3fs, %.0f entries/s",
+                 coalesce ? "coalesced" : "immediate",
+                 n_entries, u / 1e6, n_entries / (MAX(u, 1u) / 1e6));
+
+        assert_se(le64toh(f->header->n_entries) == n_entries);
+        journal_file_close(f);
+
+        assert_se(journal_file_open(path, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        journal_file_close(f);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-append-XXXXXX";
+        unsigned n_entries = N_ENTRIES_DEFAULT;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_entries) >= 0);
+
+        assert_se(mkdtemp(t));
+
+        run(t, n_entries, false);
+        run(t, n_entries, true);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
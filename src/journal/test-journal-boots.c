@@ -0,0 +1,166 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sd-journal.h"
+#include "util.h"
+#include "log.h"
+#include "macro.h"
+#include "rm-rf.h"
+#include "journal-file.h"
+#include "journal-internal.h"
+
+#define N_BOOTS 4
+#define N_ENTRIES 100
+
+static sd_id128_t boot_ids[N_BOOTS];
+
+static void append(JournalFile *f, unsigned boot, uint64_t realtime, unsigned n) {
+        char b[9+32+1] = "_BOOT_ID=", m[32];
+        struct iovec iovec[2];
+        dual_timestamp ts;
+
+        f->header->boot_id = boot_ids[boot];
+
+        sd_id128_to_string(boot_ids[boot], b + 9);
+        xsprintf(m, "MESSAGE=%u", n);
+        IOVEC_SET_STRING(iovec[0], b);
+        IOVEC_SET_STRING(iovec[1], m);
+
+        ts.realtime = realtime;
+        ts.monotonic = realtime;
+
+        assert_se(journal_file_append_entry(f, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+}
+
+static void verify_boots(sd_journal *j, unsigned n, const unsigned boots[], const uint64_t first[], const uint64_t last[]) {
+        _cleanup_free_ JournalBoot *b = NULL;
+        unsigned i;
+
+        assert_se(journal_get_boots(j, &b) == (int) n);
+
+        for (i = 0; i < n; i++) {
+                log_info("boot %u: " SD_ID128_FORMAT_STR " "USEC_FMT"-"USEC_FMT,
+                         i, SD_ID128_FORMAT_VAL(b[i].id), b[i].first, b[i].last);
+
+                assert_se(sd_id128_equal(b[i].id, boot_ids[boots[i]]));
+                assert_se(b[i].first == first[i]);
+                assert_se(b[i].last == last[i]);
+        }
+}
+
+static void test_boots(const char *t) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        JournalFile *one, *two;
+        const JournalBoot *b;
+        unsigned i, k = 0;
+        size_t n;
+
+        assert_se(journal_file_open("one.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &one) == 0);
+        assert_se(journal_file_open("two.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &two) == 0);
+
+        /* Boot 1 is spread over both files, boot 0 and 2 only show
+         * up in one of them each */
+        for (i = 0; i < N_ENTRIES; i++)
+                append(one, 0, 1000 + i, k++);
+        for (i = 0; i < N_ENTRIES; i++)
+                append(i % 2 ? one : two, 1, 2000 + i, k++);
+        for (i = 0; i < N_ENTRIES; i++)
+                append(two, 2, 3000 + i, k++);
+
+        assert_se(journal_file_get_boots(one, &b, &n) >= 0);
+        assert_se(n == 2);
+        assert_se(journal_file_get_boots(two, &b, &n) >= 0);
+        assert_se(n == 2);
+
+        journal_file_close(one);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        verify_boots(j, 3,
+                     (const unsigned[]) { 0, 1, 2 },
+                     (const uint64_t[]) { 1000, 2000, 3000 },
+                     (const uint64_t[]) { 1000 + N_ENTRIES - 1, 2000 + N_ENTRIES - 1, 3000 + N_ENTRIES - 1 });
+
+        /* Another boot in a file that is still being written to has
+         * to show up, even though the boots of the file are cached */
+        for (i = 0; i < N_ENTRIES; i++)
+                append(two, 3, 4000 + i, k++);
+        journal_file_close(two);
+
+        verify_boots(j, 4,
+                     (const unsigned[]) { 0, 1, 2, 3 },
+                     (const uint64_t[]) { 1000, 2000, 3000, 4000 },
+                     (const uint64_t[]) { 1000 + N_ENTRIES - 1, 2000 + N_ENTRIES - 1, 3000 + N_ENTRIES - 1, 4000 + N_ENTRIES - 1 });
+}
+
+static void test_unique(const char *t) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        const void *data;
+        unsigned n;
+        size_t l;
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        /* Every value once, no matter in how many files it shows up */
+        assert_se(sd_journal_query_unique(j, "_BOOT_ID") >= 0);
+
+        n = 0;
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
+                n++;
+        assert_se(n == N_BOOTS);
+
+        n = 0;
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
+                n++;
+        assert_se(n == N_BOOTS);
+
+        assert_se(sd_journal_query_unique(j, "MESSAGE") >= 0);
+
+        n = 0;
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
+                n++;
+        assert_se(n == N_BOOTS * N_ENTRIES);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-boots-XXXXXX";
+        unsigned i;
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        log_set_max_level(LOG_DEBUG);
+
+        for (i = 0; i < N_BOOTS; i++)
+                assert_se(sd_id128_randomize(&boot_ids[i]) >= 0);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        test_boots(t);
+        test_unique(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -20,13 +20,119 @@
 ***/
 
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "sd-journal.h"
 #include "macro.h"
+#include "fileio.h"
+#include "rm-rf.h"
 #include "journal-file.h"
 #include "journal-internal.h"
+#include "journald-server.h"
 
-int main(int argc, char *argv[]) {
+static void append_entries(JournalFile *f, unsigned first, unsigned n) {
+        unsigned i;
+
+        for (i = first; i < first + n; i++) {
+                char m[32], p[32];
+                struct iovec iovec[3];
+                dual_timestamp ts;
+
+                xsprintf(m, "MESSAGE=message %u", i);
+                xsprintf(p, "PRIORITY=%u", i % 8);
+                IOVEC_SET_STRING(iovec[0], m);
+                IOVEC_SET_STRING(iovec[1], p);
+                IOVEC_SET_STRING(iovec[2], "_HOSTNAME=host");
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, 3, NULL, NULL, NULL) == 0);
+        }
+}
+
+static void verify_entries(const char *fn, unsigned n) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        const char *paths[] = { fn, NULL };
+        unsigned i = 0;
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                char m[32], p[32];
+                const void *d;
+                size_t l;
+
+                xsprintf(m, "MESSAGE=message %u", i);
+                xsprintf(p, "PRIORITY=%u", i % 8);
+
+                assert_se(sd_journal_get_data(j, "MESSAGE", &d, &l) >= 0);
+                assert_se(l == strlen(m) && memcmp(d, m, l) == 0);
+                assert_se(sd_journal_get_data(j, "PRIORITY", &d, &l) >= 0);
+                assert_se(l == strlen(p) && memcmp(d, p, l) == 0);
+                assert_se(sd_journal_get_data(j, "_HOSTNAME", &d, &l) >= 0);
+                assert_se(l == strlen("_HOSTNAME=host"));
+
+                i++;
+        }
+
+        assert_se(i == n);
+}
+
+static void test_copy_cached(void) {
+        char dn[] = "/var/tmp/test-journal-flush.XXXXXX";
+        _cleanup_free_ char *from_fn = NULL, *to_fn = NULL, *other_fn = NULL;
+        JournalFile *from = NULL, *to = NULL, *other = NULL;
+        JournalCopyCache *cache;
+        uint64_t p;
+        Object *o;
+        unsigned n = 0;
+
+        assert_se(mkdtemp(dn));
+        from_fn = strappend(dn, "/from.journal");
+        to_fn = strappend(dn, "/to.journal");
+        other_fn = strappend(dn, "/other.journal");
+
+        assert_se(journal_file_open(from_fn, O_CREAT|O_RDWR, 0644, true, false, NULL, NULL, NULL, &from) >= 0);
+        assert_se(journal_file_open(to_fn, O_CREAT|O_RDWR, 0644, false, false, NULL, NULL, NULL, &to) >= 0);
+        assert_se(journal_file_open(other_fn, O_CREAT|O_RDWR, 0644, false, false, NULL, NULL, NULL, &other) >= 0);
+
+        append_entries(from, 0, 1000);
+
+        assert_se(cache = journal_copy_cache_new());
+
+        /* Switch the target in the middle, offsets remembered for
+         * the first one must not be used for the second one */
+        p = 0;
+        while (journal_file_next_entry(from, p, DIRECTION_DOWN, &o, &p) > 0) {
+                assert_se(journal_file_copy_entry_cached(from, n < 500 ? to : other, o, p, cache, NULL, NULL, NULL) >= 0);
+                n++;
+        }
+        assert_se(n == 1000);
+
+        /* Everything that repeats is stored only once */
+        assert_se(le64toh(to->header->n_data) == 500 + 8 + 1);
+        assert_se(le64toh(other->header->n_data) == 500 + 8 + 1);
+
+        journal_copy_cache_free(cache);
+
+        journal_file_close(from);
+        journal_file_close(to);
+
+        p = 0;
+        n = 0;
+        while (journal_file_next_entry(other, p, DIRECTION_DOWN, &o, &p) > 0)
+                n++;
+        assert_se(n == 500);
+        journal_file_close(other);
+
+        verify_entries(to_fn, 500);
+
+        unlink(from_fn);
+        unlink(to_fn);
+        unlink(other_fn);
+        assert_se(rmdir(dn) == 0);
+}
+
+static void test_flush(void) {
         _cleanup_free_ char *fn = NULL;
         char dn[] = "/var/tmp/test-journal-flush.XXXXXX";
         JournalFile *new_journal = NULL;
@@ -69,6 +175,113 @@ int main(int argc, char *argv[]) {
 
         unlink(fn);
         assert_se(rmdir(dn) == 0);
+}
+
+static unsigned current_entry(sd_journal *j) {
+        const void *d;
+        size_t l;
+        unsigned i;
+        char *m;
+
+        assert_se(sd_journal_get_data(j, "MESSAGE", &d, &l) >= 0);
+        m = strndupa(d, l);
+        assert_se(startswith(m, "MESSAGE=message "));
+        assert_se(safe_atou(m + strlen("MESSAGE=message "), &i) >= 0);
+
+        return i;
+}
+
+static char *entry_cursor(sd_journal *j, unsigned i) {
+        char *cursor;
+
+        assert_se(sd_journal_seek_head(j) >= 0);
+        assert_se(sd_journal_next_skip(j, i + 1) == (int) i + 1);
+        assert_se(current_entry(j) == i);
+        assert_se(sd_journal_get_cursor(j, &cursor) >= 0);
+
+        return cursor;
+}
+
+/* Opens the runtime journal the way the flush does, seeks to the
+ * saved position, and returns the entry the flush continues with */
+static int resume_flush(const char *dn, const char *cursor_fn, int expect) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        int r;
+
+        assert_se(sd_journal_open_directory(&j, dn, 0) >= 0);
+        assert_se(sd_journal_get_fd(j) >= 0);
+
+        assert_se(server_seek_flush_cursor(j, cursor_fn) == expect);
+
+        r = sd_journal_next(j);
+        assert_se(r >= 0);
+        if (r == 0)
+                return -1;
+
+        return (int) current_entry(j);
+}
+
+static void test_flush_cursor(void) {
+        char dn[] = "/var/tmp/test-journal-flush.XXXXXX";
+        _cleanup_free_ char *one_fn = NULL, *two_fn = NULL, *cursor_fn = NULL, *cursor = NULL, *last = NULL;
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        JournalFile *one = NULL, *two = NULL;
+
+        assert_se(mkdtemp(dn));
+        one_fn = strappend(dn, "/one.journal");
+        two_fn = strappend(dn, "/two.journal");
+        cursor_fn = strappend(dn, "/flush-cursor");
+
+        /* A runtime journal that was rotated once, the entries
+         * continue in the second file */
+        assert_se(journal_file_open(one_fn, O_CREAT|O_RDWR, 0644, false, false, NULL, NULL, NULL, &one) >= 0);
+        append_entries(one, 0, 50);
+        assert_se(journal_file_open(two_fn, O_CREAT|O_RDWR, 0644, false, false, NULL, NULL, one, &two) >= 0);
+        append_entries(two, 50, 50);
+        journal_file_close(one);
+        journal_file_close(two);
+
+        assert_se(sd_journal_open_directory(&j, dn, 0) >= 0);
+        cursor = entry_cursor(j, 41);
+        last = entry_cursor(j, 49);
+        sd_journal_close(j);
+        j = NULL;
+
+        /* No flush was interrupted */
+        assert_se(resume_flush(dn, cursor_fn, 0) == 0);
+
+        /* Continue right after the entry that was copied last */
+        assert_se(write_string_file(cursor_fn, cursor) >= 0);
+        assert_se(resume_flush(dn, cursor_fn, 1) == 42);
+
+        /* Also across files */
+        assert_se(write_string_file(cursor_fn, last) >= 0);
+        assert_se(resume_flush(dn, cursor_fn, 1) == 50);
+
+        /* The file with the entry went away in the meantime, continue
+         * with the first one after it that is still around */
+        assert_se(unlink(one_fn) == 0);
+        assert_se(write_string_file(cursor_fn, cursor) >= 0);
+        assert_se(resume_flush(dn, cursor_fn, 1) == 50);
+        assert_se(write_string_file(cursor_fn, last) >= 0);
+        assert_se(resume_flush(dn, cursor_fn, 1) == 50);
+
+        /* Garbage, copy everything that is left */
+        assert_se(write_string_file(cursor_fn, "garbage") >= 0);
+        assert_se(resume_flush(dn, cursor_fn, -EINVAL) == 50);
+
+        assert_se(rm_rf(dn, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        test_copy_cached();
+        test_flush_cursor();
+        test_flush();
 
         return 0;
 }
@@ -196,6 +196,79 @@ static void test_skip(void (*setup)(void)) {
         puts("------------------------------------------------------------");
 }
 
+#define MANY_FILES 64
+#define MANY_ENTRIES 2000
+
+static void setup_many_interleaved(void) {
+        JournalFile *files[MANY_FILES];
+        unsigned i, seed = 0;
+        uint64_t seqnum = 0;
+
+        for (i = 0; i < MANY_FILES; i++) {
+                char name[DECIMAL_STR_MAX(unsigned) + 9];
+
+                xsprintf(name, "%u.journal", i);
+                assert_ret(journal_file_open(name, O_RDWR|O_CREAT, 0644, true, false, NULL, NULL,
+                                             i > 0 ? files[0] : NULL, files + i));
+        }
+
+        for (i = 1; i <= MANY_ENTRIES; i++)
+                append_number(files[rand_r(&seed) % MANY_FILES], i, &seqnum);
+
+        for (i = 0; i < MANY_FILES; i++)
+                test_close(files[i]);
+}
+
+static void test_many_files(void) {
+        char t[] = "/tmp/journal-many-XXXXXX";
+        sd_journal *j;
+        int i, r;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        setup_many_interleaved();
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+
+        /* Both directions have to return exactly the same sequence */
+        assert_ret(sd_journal_seek_head(j));
+        assert_ret(sd_journal_next(j));
+        test_check_numbers_down(j, MANY_ENTRIES);
+
+        assert_ret(sd_journal_seek_tail(j));
+        assert_ret(sd_journal_previous(j));
+        test_check_numbers_up(j, MANY_ENTRIES);
+
+        /* Turning around in the middle continues from the current
+         * entry, in each of the files */
+        assert_ret(sd_journal_seek_head(j));
+        assert_ret(r = sd_journal_next_skip(j, MANY_ENTRIES / 2));
+        assert_se(r == MANY_ENTRIES / 2);
+        test_check_number(j, MANY_ENTRIES / 2);
+
+        for (i = MANY_ENTRIES / 2 - 1; i > MANY_ENTRIES / 4; i--) {
+                assert_ret(r = sd_journal_previous(j));
+                assert_se(r == 1);
+                test_check_number(j, i);
+        }
+
+        for (i = MANY_ENTRIES / 4 + 2; i <= MANY_ENTRIES / 2 + 10; i++) {
+                assert_ret(r = sd_journal_next(j));
+                assert_se(r == 1);
+                test_check_number(j, i);
+        }
+
+        sd_journal_close(j);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 static void test_sequence_numbers(void) {
 
         char t[] = "/tmp/journal-seq-XXXXXX";
@@ -291,6 +364,8 @@ int main(int argc, char *argv[]) {
         test_skip(setup_sequential);
         test_skip(setup_interleaved);
 
+        test_many_files();
+
         test_sequence_numbers();
 
         return 0;
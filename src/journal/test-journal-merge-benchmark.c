@@ -0,0 +1,134 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+#include "journal-file.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define N_FILES_DEFAULT 400U
+#define N_ENTRIES_DEFAULT 40000U
+
+static void populate(const char *directory, unsigned n_files, unsigned n_entries) {
+        JournalFile **files;
+        unsigned i, seed = 0;
+        uint64_t seqnum = 0;
+
+        files = new0(JournalFile*, n_files);
+        assert_se(files);
+
+        /* Like a directory of rotated system and per-user files,
+         * where all files share the same sequence number space and
+         * the entries are spread over them in no particular order */
+        for (i = 0; i < n_files; i++) {
+                _cleanup_free_ char *path = NULL;
+
+                assert_se(asprintf(&path, "%s/file-%u.journal", directory, i) >= 0);
+                assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, i > 0 ? files[0] : NULL, files + i) == 0);
+        }
+
+        for (i = 0; i < n_entries; i++) {
+                char number[DECIMAL_STR_MAX(unsigned) + 8];
+                struct iovec iovec;
+                dual_timestamp ts;
+
+                xsprintf(number, "NUMBER=%u", i);
+                IOVEC_SET_STRING(iovec, number);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(files[rand_r(&seed) % n_files], &ts, &iovec, 1, &seqnum, NULL, NULL) == 0);
+        }
+
+        for (i = 0; i < n_files; i++)
+                journal_file_close(files[i]);
+
+        free(files);
+}
+
+static unsigned iterate(sd_journal *j, bool forward) {
+        unsigned n = 0;
+        int r;
+
+        if (forward)
+                assert_se(sd_journal_seek_head(j) >= 0);
+        else
+                assert_se(sd_journal_seek_tail(j) >= 0);
+
+        for (;;) {
+                r = forward ? sd_journal_next(j) : sd_journal_previous(j);
+                assert_se(r >= 0);
+                if (r == 0)
+                        break;
+
+                n++;
+        }
+
+        return n;
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-merge-XXXXXX";
+        unsigned n_files = N_FILES_DEFAULT, n_entries = N_ENTRIES_DEFAULT;
+        sd_journal *j;
+        usec_t u;
+        int k;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_files) >= 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &n_entries) >= 0);
+
+        assert_se(n_files > 0);
+        assert_se(mkdtemp(t));
+
+        u = now(CLOCK_MONOTONIC);
+        populate(t, n_files, n_entries);
+        log_info("Wrote %u entries to %u files in %.3fs",
+                 n_entries, n_files, (now(CLOCK_MONOTONIC) - u) / 1e6);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        for (k = 0; k < 2; k++) {
+                bool forward = k == 0;
+
+                u = now(CLOCK_MONOTONIC);
+                assert_se(iterate(j, forward) == n_entries);
+                u = now(CLOCK_MONOTONIC) - u;
+
+                log_info("%s: %u entries from %u files in %.3fs, %.0f entries/s",
+                         forward ? "next" : "previous",
+                         n_entries, n_files, u / 1e6, n_entries / (MAX(u, 1u) / 1e6));
+        }
+
+        sd_journal_close(j);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,204 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+#include "journal-internal.h"
+#include "logs-show.h"
+#include "logs-pipeline.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define N_ENTRIES_DEFAULT 20000U
+
+#define STRING_AND_LENGTH(s) s, sizeof(s) - 1
+
+static void make_journal(const char *path, unsigned n_entries) {
+        static const char *const units[] = { "sshd.service", "cron.service", "nginx.service", "session-4.scope" };
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, true, false, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < n_entries; i++) {
+                static const char binary[] = "BINARY=\x01\x02\xff\xfe\x00" "data";
+                char message[LINE_MAX], priority[16], pid[32], unit[64], source[64];
+                struct iovec iovec[9];
+                unsigned n = 0;
+                dual_timestamp ts;
+
+                /* Every eighth message needs escaping, and every
+                 * 64th entry carries a field that is not UTF-8 */
+                if (i % 8 == 0)
+                        xsprintf(message, "MESSAGE=Request %u for \"/srv/caf\xc3\xa9 \\ men\xc3\xbc\"\tfailed:\nstatus %u",
+                                 i, 400 + i % 5);
+                else
+                        xsprintf(message, "MESSAGE=Request %u from 10.0.%u.%u completed with status %u after %u ms",
+                                 i, i % 256, i * 7 % 256, 200 + i % 5, i * 13 % 1000);
+                xsprintf(priority, "PRIORITY=%u", 3 + i % 4);
+                xsprintf(pid, "_PID=%u", 100 + i % 37);
+                xsprintf(unit, "_SYSTEMD_UNIT=%s", units[i % ELEMENTSOF(units)]);
+                xsprintf(source, "_SOURCE_REALTIME_TIMESTAMP="USEC_FMT, 1434000000000000ULL + i * 1000ULL);
+
+                IOVEC_SET_STRING(iovec[n++], message);
+                IOVEC_SET_STRING(iovec[n++], priority);
+                IOVEC_SET_STRING(iovec[n++], pid);
+                IOVEC_SET_STRING(iovec[n++], unit);
+                IOVEC_SET_STRING(iovec[n++], source);
+                IOVEC_SET_STRING(iovec[n++], "SYSLOG_IDENTIFIER=benchmark");
+                IOVEC_SET_STRING(iovec[n++], "_HOSTNAME=benchmark-host");
+                IOVEC_SET_STRING(iovec[n++], "_COMM=benchmark");
+
+                if (i % 64 == 0) {
+                        iovec[n].iov_base = (char*) binary;
+                        iovec[n++].iov_len = sizeof(binary) - 1;
+                }
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_close(f);
+}
+
+static usec_t run(const char *directory, OutputMode mode, unsigned n_threads, char **ret, size_t *ret_size) {
+        _cleanup_(output_pipeline_freep) OutputPipeline *p = NULL;
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        usec_t a, b;
+        FILE *f;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+
+        f = open_memstream(ret, ret_size);
+        assert_se(f);
+
+        a = now(CLOCK_MONOTONIC);
+
+        if (n_threads > 1)
+                assert_se(output_pipeline_new(j, f, mode, 0, OUTPUT_FULL_WIDTH, n_threads, &p) >= 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                if (p)
+                        assert_se(output_pipeline_add(p, NULL) >= 0);
+                else
+                        assert_se(output_journal(f, j, mode, 0, OUTPUT_FULL_WIDTH, NULL) >= 0);
+        }
+
+        if (p)
+                assert_se(output_pipeline_flush(p) >= 0);
+
+        b = now(CLOCK_MONOTONIC);
+
+        assert_se(fclose(f) == 0);
+
+        return b - a;
+}
+
+static void test_json_escape_one(const char *p, size_t l, OutputFlags flags, const char *expected) {
+        _cleanup_free_ char *buf = NULL;
+        size_t size = 0;
+        FILE *f;
+
+        f = open_memstream(&buf, &size);
+        assert_se(f);
+        json_escape(f, p, l, flags);
+        assert_se(fclose(f) == 0);
+
+        assert_se(streq(buf, expected));
+}
+
+static void test_json_escape(void) {
+        _cleanup_free_ char *long_plain = NULL, *long_escaped = NULL;
+        char *e;
+
+        test_json_escape_one(STRING_AND_LENGTH(""), 0, "\"\"");
+        test_json_escape_one(STRING_AND_LENGTH("plain ascii text"), 0, "\"plain ascii text\"");
+        test_json_escape_one(STRING_AND_LENGTH("a \"quoted\" \\path\\"), 0, "\"a \\\"quoted\\\" \\\\path\\\\\"");
+        test_json_escape_one(STRING_AND_LENGTH("line\nbreak\ttab"), 0, "\"line\\nbreak\\u0009tab\"");
+        test_json_escape_one(STRING_AND_LENGTH("caf\xc3\xa9 \"men\xc3\xbc\""), 0, "\"caf\xc3\xa9 \\\"men\xc3\xbc\\\"\"");
+        test_json_escape_one(STRING_AND_LENGTH("\x01\xff\x00" "a"), 0, "[ 1, 255, 0, 97 ]");
+
+        /* Long enough to go through the word-wise scan, with a
+         * character to escape right at the end */
+        long_plain = strjoin("0123456789abcdefghijklmnopqrstuvwxyz", "\"", NULL);
+        long_escaped = strjoin("\"0123456789abcdefghijklmnopqrstuvwxyz", "\\\"\"", NULL);
+        assert_se(long_plain && long_escaped);
+        test_json_escape_one(long_plain, strlen(long_plain), 0, long_escaped);
+
+        e = newa(char, 5000);
+        memset(e, 'x', 5000);
+        test_json_escape_one(e, 5000, 0, "null");
+}
+
+int main(int argc, char *argv[]) {
+        static const OutputMode modes[] = { OUTPUT_SHORT, OUTPUT_CAT, OUTPUT_VERBOSE, OUTPUT_EXPORT, OUTPUT_JSON, OUTPUT_JSON_PRETTY, OUTPUT_JSON_SSE };
+        static const unsigned threads[] = { 2, 4 };
+        char t[] = "/tmp/journal-output-XXXXXX";
+        unsigned n_entries = N_ENTRIES_DEFAULT, i, k;
+        _cleanup_free_ char *path = NULL;
+
+        log_set_max_level(LOG_INFO);
+
+        test_json_escape();
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_entries) >= 0);
+
+        assert_se(mkdtemp(t));
+        path = strappend(t, "/benchmark.journal");
+        assert_se(path);
+
+        make_journal(path, n_entries);
+
+        for (i = 0; i < ELEMENTSOF(modes); i++) {
+                _cleanup_free_ char *reference = NULL;
+                size_t reference_size = 0;
+                usec_t u;
+
+                u = run(t, modes[i], 1, &reference, &reference_size);
+                log_info("%s, 1 thread: %u entries, %zu bytes, %.2f MiB/s",
+                         output_mode_to_string(modes[i]), n_entries, reference_size,
+                         reference_size / 1024. / 1024 / (MAX(u, 1u) / 1e6));
+
+                for (k = 0; k < ELEMENTSOF(threads); k++) {
+                        _cleanup_free_ char *buf = NULL;
+                        size_t size = 0;
+
+                        u = run(t, modes[i], threads[k], &buf, &size);
+                        log_info("%s, %u threads: %.2f MiB/s",
+                                 output_mode_to_string(modes[i]), threads[k],
+                                 size / 1024. / 1024 / (MAX(u, 1u) / 1e6));
+
+                        /* Threading must not change a single byte of the output */
+                        assert_se(size == reference_size);
+                        assert_se(memcmp(buf, reference, size) == 0);
+                }
+        }
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,200 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "journald-rate-limit.h"
+#include "util.h"
+#include "log.h"
+
+#define INTERVAL (10 * USEC_PER_SEC)
+#define BURST 10
+
+/* Returns how many of n messages were let through */
+static unsigned test_send(JournalRateLimit *r, const char *id, int priority, unsigned n, usec_t ts) {
+        unsigned i, passed = 0;
+
+        for (i = 0; i < n; i++) {
+                int k;
+
+                k = journal_rate_limit_test(r, id, priority, 0, ts);
+                assert_se(k >= 0);
+                if (k > 0)
+                        passed++;
+        }
+
+        return passed;
+}
+
+static void test_bucket(void) {
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        uint64_t dropped;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST));
+
+        /* A full burst at once, nothing more */
+        assert_se(test_send(r, "/system.slice/a.service", LOG_INFO, 2 * BURST, ts) == BURST);
+
+        /* Priorities are accounted separately */
+        assert_se(test_send(r, "/system.slice/a.service", LOG_ERR, 2 * BURST, ts) == BURST);
+
+        /* Room for one more message after a tenth of the interval,
+         * which also reports what was suppressed */
+        ts += INTERVAL / BURST;
+        assert_se(journal_rate_limit_test(r, "/system.slice/a.service", LOG_INFO, 0, ts) == 1 + BURST);
+        assert_se(journal_rate_limit_test(r, "/system.slice/a.service", LOG_INFO, 0, ts) == 0);
+
+        /* All refilled after the interval */
+        ts += INTERVAL;
+        assert_se(test_send(r, "/system.slice/a.service", LOG_INFO, 2 * BURST, ts) == BURST);
+
+        journal_rate_limit_get_stats(r, &dropped, NULL);
+        assert_se(dropped == 3 * BURST + 1);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_report(void) {
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        unsigned i, passed = 0, reported = 0, reports = 0;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST));
+
+        /* A steady flood gets one message through for every token
+         * that is refilled, but what was suppressed is reported at
+         * most once per interval */
+        for (i = 0; i < 4 * BURST * 10; i++) {
+                int k;
+
+                k = journal_rate_limit_test(r, "/system.slice/a.service", LOG_INFO, 0, ts);
+                assert_se(k >= 0);
+                if (k > 0)
+                        passed++;
+                if (k > 1) {
+                        reports++;
+                        reported += k - 1;
+                }
+
+                ts += INTERVAL / BURST / 10;
+        }
+
+        log_info("%u passed, %u reports of %u suppressed messages", passed, reports, reported);
+        assert_se(passed >= 4 * BURST);
+        assert_se(passed <= 5 * BURST);
+        assert_se(reports >= 3);
+        assert_se(reports <= 4);
+
+        /* Nothing gets lost, it is reported with the next message
+         * after the interval */
+        ts += INTERVAL;
+        i = journal_rate_limit_test(r, "/system.slice/a.service", LOG_INFO, 0, ts);
+        assert_se(i > 1);
+        assert_se(passed + reported + i - 1 == 4 * BURST * 10);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_hierarchy(void) {
+        JournalRateLimitTop top[3];
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        unsigned i;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST));
+
+        assert_se(journal_rate_limit_set_burst(r, "system.slice", BURST + BURST / 2) >= 0);
+        assert_se(journal_rate_limit_set_burst(r, "quiet.service", 2) >= 0);
+        assert_se(journal_rate_limit_set_burst(r, "loud.service", 0) >= 0);
+        assert_se(journal_rate_limit_set_burst(r, "-.slice", 10 * BURST) >= 0);
+
+        /* The slice's budget is shared by everything in it */
+        assert_se(test_send(r, "/system.slice/a.service", LOG_INFO, 2 * BURST, ts) == BURST);
+        assert_se(test_send(r, "/system.slice/b.service", LOG_INFO, 2 * BURST, ts) == BURST / 2);
+
+        /* Other slices are not affected */
+        assert_se(test_send(r, "/user.slice/user-1000.slice/session-1.scope", LOG_INFO, 2 * BURST, ts) == BURST);
+
+        /* Units may have budgets of their own */
+        assert_se(test_send(r, "/machine.slice/quiet.service", LOG_INFO, 2 * BURST, ts) == 2);
+        assert_se(test_send(r, "/machine.slice/loud.service", LOG_INFO, 10 * BURST, ts) == 10 * BURST - BURST - BURST / 2 - BURST - 2);
+
+        /* And the root slice caps everything */
+        assert_se(test_send(r, "/machine.slice/c.service", LOG_INFO, BURST, ts) == 0);
+
+        /* Drops are counted for each group, and for all the slices
+         * whose budget they share */
+        assert_se(journal_rate_limit_get_top(r, top, ELEMENTSOF(top)) == ELEMENTSOF(top));
+        for (i = 0; i < ELEMENTSOF(top); i++)
+                log_info("%s: %"PRIu64, top[i].id, top[i].dropped);
+        /* Everything beyond the root slice's budget */
+        assert_se(streq(top[0].id, "/"));
+        assert_se(top[0].dropped == 4 * 2 * BURST + 10 * BURST + BURST - 10 * BURST);
+        assert_se(streq(top[1].id, "/machine.slice/loud.service"));
+        assert_se(top[1].dropped == BURST + BURST / 2 + BURST + 2);
+        assert_se(streq(top[2].id, "/system.slice"));
+        assert_se(top[2].dropped == BURST + BURST + BURST / 2);
+
+        ts += INTERVAL;
+        assert_se(test_send(r, "/system.slice/b.service", LOG_INFO, 2 * BURST, ts) == BURST);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_many(void) {
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        unsigned i, n;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST));
+        assert_se(journal_rate_limit_set_burst(r, "system.slice", 1000000) >= 0);
+
+        /* Old groups are forgotten, but never the slices still in use */
+        for (i = 0; i < 10000; i++) {
+                char id[64];
+
+                xsprintf(id, "/system.slice/unit-%u.service", i);
+                assert_se(test_send(r, id, LOG_INFO, 1, ts) == 1);
+
+                xsprintf(id, "/user.slice/user-%u.slice/session-%u.scope", i % 100, i);
+                assert_se(test_send(r, id, LOG_INFO, 1, ts) == 1);
+        }
+
+        journal_rate_limit_get_stats(r, NULL, &n);
+        log_info("%u groups", n);
+        assert_se(n > 0 && n < 2048);
+
+        /* Expired groups go away when new ones are added */
+        ts += 2 * INTERVAL;
+        assert_se(test_send(r, "/system.slice/new.service", LOG_INFO, 1, ts) == 1);
+        journal_rate_limit_get_stats(r, NULL, &n);
+        assert_se(n == 2);
+
+        journal_rate_limit_free(r);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+
+        test_bucket();
+        test_report();
+        test_hierarchy();
+        test_many();
+
+        return 0;
+}
@@ -72,6 +72,96 @@ static void verify_contents(sd_journal *j, unsigned skip) {
                 assert_se(i == N_ENTRIES);
 }
 
+static void verify_data_refs(sd_journal *j, unsigned n, size_t blob_size) {
+        JournalData **refs;
+        unsigned i = 0, k;
+
+        assert_se(refs = new0(JournalData*, n * 2));
+
+        /* Take references to the fields of all entries, and check
+         * that they remain valid while we keep iterating, and after
+         * the journal is closed */
+        SD_JOURNAL_FOREACH(j) {
+                JournalData *d;
+                int r;
+
+                assert_se(i < n);
+
+                assert_se(journal_get_data_ref(j, "NUMBER", &refs[i*2]) >= 0);
+
+                sd_journal_restart_data(j);
+                while ((r = journal_enumerate_data_ref(j, &d)) > 0) {
+                        if (d->size > 5 && memcmp(d->data, "BLOB=", 5) == 0) {
+                                assert_se(!refs[i*2+1]);
+                                refs[i*2+1] = d;
+                        } else
+                                journal_data_unref(d);
+                }
+                assert_se(r == 0);
+
+                i++;
+        }
+
+        assert_se(i == n);
+
+        sd_journal_close(j);
+
+        for (i = 0; i < n; i++) {
+                char number[DECIMAL_STR_MAX(unsigned) + 8];
+
+                xsprintf(number, "NUMBER=%u", i);
+                assert_se(refs[i*2]->size == strlen(number));
+                assert_se(memcmp(refs[i*2]->data, number, refs[i*2]->size) == 0);
+
+                if (blob_size > 0) {
+                        assert_se(refs[i*2+1]);
+                        assert_se(refs[i*2+1]->size == blob_size);
+                        for (k = 5; k < blob_size; k++)
+                                assert_se(((const char*) refs[i*2+1]->data)[k] == 'a' + i % 26);
+                }
+
+                assert_se(journal_data_ref(refs[i*2]) == refs[i*2]);
+                journal_data_unref(refs[i*2]);
+                journal_data_unref(refs[i*2]);
+                journal_data_unref(refs[i*2+1]);
+        }
+
+        free(refs);
+}
+
+static void test_data_refs(void) {
+        const char *paths[] = { "four.journal", NULL };
+        JournalFile *four;
+        sd_journal *j;
+        unsigned i;
+
+        /* Large fields are stored compressed, if support for that is
+         * compiled in, so this covers both kinds of references */
+        assert_se(journal_file_open("four.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &four) == 0);
+
+        for (i = 0; i < 20; i++) {
+                char number[DECIMAL_STR_MAX(unsigned) + 8], blob[4096];
+                struct iovec iovec[2];
+                dual_timestamp ts;
+
+                xsprintf(number, "NUMBER=%u", i);
+                memcpy(blob, "BLOB=", 5);
+                memset(blob + 5, 'a' + i % 26, sizeof(blob) - 5);
+
+                IOVEC_SET_STRING(iovec[0], number);
+                iovec[1].iov_base = blob;
+                iovec[1].iov_len = sizeof(blob);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(four, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_close(four);
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+        verify_data_refs(j, 20, 4096);
+}
+
 int main(int argc, char *argv[]) {
         JournalFile *one, *two, *three;
         char t[] = "/tmp/journal-stream-XXXXXX";
@@ -180,6 +270,12 @@ int main(int argc, char *argv[]) {
         SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
                 printf("%.*s\n", (int) l, (const char*) data);
 
+        sd_journal_flush_matches(j);
+        verify_data_refs(j, N_ENTRIES, 0);
+        j = NULL;
+
+        test_data_refs();
+
         assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
 
         return 0;
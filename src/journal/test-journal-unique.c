@@ -0,0 +1,165 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sd-journal.h"
+#include "util.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "journal-file.h"
+#include "journal-internal.h"
+
+#define N_FILES 3
+#define N_VALUES 300
+
+/* Every other value is large enough to be compressed */
+static char *value(unsigned v) {
+        char *s;
+
+        if (v % 2 == 0)
+                assert_se(asprintf(&s, "VALUE=%04u", v) >= 0);
+        else
+                assert_se(asprintf(&s, "VALUE=%04u%01024u", v, 0) >= 0);
+
+        return s;
+}
+
+static void populate(const char *directory) {
+        unsigned i, v;
+
+        /* Each value shows up in two of the files */
+        for (i = 0; i < N_FILES; i++) {
+                _cleanup_free_ char *path = NULL;
+                JournalFile *f;
+
+                assert_se(asprintf(&path, "%s/file-%u.journal", directory, i) >= 0);
+                assert_se(journal_file_open(path, O_RDWR|O_CREAT, 0644, true, false, NULL, NULL, NULL, &f) == 0);
+
+                for (v = 0; v < N_VALUES; v++) {
+                        _cleanup_free_ char *s = NULL;
+                        struct iovec iovec;
+                        dual_timestamp ts;
+
+                        if (v % N_FILES == i)
+                                continue;
+
+                        s = value(v);
+                        IOVEC_SET_STRING(iovec, s);
+
+                        dual_timestamp_get(&ts);
+                        assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+                }
+
+                journal_file_close(f);
+        }
+}
+
+static unsigned lookup(const void *data, size_t l) {
+        unsigned v;
+
+        for (v = 0; v < N_VALUES; v++) {
+                _cleanup_free_ char *s = value(v);
+
+                if (l == strlen(s) && memcmp(data, s, l) == 0)
+                        return v;
+        }
+
+        assert_not_reached("Unexpected value");
+}
+
+static void test_unique(const char *directory) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        unsigned seen[N_VALUES], k, v;
+        const void *data;
+        size_t l;
+        int r;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(sd_journal_query_unique(j, "VALUE") >= 0);
+
+        /* Twice, the second time after a restart */
+        for (k = 0; k < 2; k++) {
+                zero(seen);
+
+                while ((r = sd_journal_enumerate_unique(j, &data, &l)) > 0)
+                        seen[lookup(data, l)]++;
+                assert_se(r == 0);
+
+                for (v = 0; v < N_VALUES; v++)
+                        assert_se(seen[v] == 1);
+
+                sd_journal_restart_unique(j);
+        }
+}
+
+static void test_unique_remove(const char *directory) {
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        _cleanup_free_ char *path = NULL;
+        unsigned seen[N_VALUES] = {}, v, n = 0;
+        const void *data;
+        size_t l;
+        int r;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(sd_journal_get_fd(j) >= 0);
+        assert_se(sd_journal_query_unique(j, "VALUE") >= 0);
+
+        /* The first file has two thirds of the values, get into the
+         * second one */
+        while (n < N_VALUES * 5 / 6) {
+                assert_se(sd_journal_enumerate_unique(j, &data, &l) > 0);
+                seen[lookup(data, l)]++;
+                n++;
+        }
+
+        /* Whether it was traversed already or not, the values
+         * remembered from it must not be looked at anymore */
+        assert_se(path = strappend(directory, "/file-0.journal"));
+        assert_se(unlink(path) >= 0);
+        assert_se(sd_journal_process(j) == SD_JOURNAL_INVALIDATE);
+
+        while ((r = sd_journal_enumerate_unique(j, &data, &l)) > 0)
+                seen[lookup(data, l)]++;
+        assert_se(r == 0);
+
+        for (v = 0; v < N_VALUES; v++)
+                assert_se(seen[v] >= 1);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-unique-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        assert_se(mkdtemp(t));
+        populate(t);
+
+        test_unique(t);
+        test_unique_remove(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
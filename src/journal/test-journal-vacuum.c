@@ -0,0 +1,198 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "event-util.h"
+#include "fileio.h"
+#include "journal-def.h"
+#include "journal-vacuum.h"
+#include "journald-vacuum.h"
+#include "rm-rf.h"
+#include "util.h"
+#include "log.h"
+
+#define FILE_SIZE (64U * 1024U)
+
+static sd_id128_t seqnum_id;
+
+static const char *archived_path(const char *dir, unsigned i) {
+        static char p[PATH_MAX];
+
+        xsprintf(p, "%s/system@" SD_ID128_FORMAT_STR "-%016x-%016x.journal",
+                 dir, SD_ID128_FORMAT_VAL(seqnum_id), i, 1000 + i);
+
+        return p;
+}
+
+/* Creates something that looks like an archived journal file to the
+ * vacuuming logic */
+static void make_archived(const char *dir, unsigned i, bool empty) {
+        _cleanup_free_ void *buf = NULL;
+        _cleanup_close_ int fd = -1;
+        le64_t n_entries;
+
+        assert_se(buf = malloc0(FILE_SIZE));
+        n_entries = htole64(empty ? 0 : 1);
+        memcpy((uint8_t*) buf + offsetof(Header, n_entries), &n_entries, sizeof(n_entries));
+
+        fd = open(archived_path(dir, i), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, buf, FILE_SIZE, false) >= 0);
+        assert_se(fsync(fd) >= 0);
+}
+
+static bool have_archived(const char *dir, unsigned i) {
+        return access(archived_path(dir, i), F_OK) >= 0;
+}
+
+static uint64_t usage(const char *dir, unsigned i) {
+        struct stat st;
+
+        assert_se(stat(archived_path(dir, i), &st) >= 0);
+
+        return 512UL * (uint64_t) st.st_blocks;
+}
+
+static void test_inventory(const char *t) {
+        _cleanup_(journal_inventory_freep) JournalInventory *inv = NULL;
+        _cleanup_free_ char *p = NULL;
+        uint64_t freed = 0, u;
+        usec_t oldest = 0;
+        unsigned i;
+
+        for (i = 0; i < 4; i++)
+                make_archived(t, i, false);
+
+        /* Active files are never touched */
+        assert_se(p = strappend(t, "/system.journal"));
+        assert_se(write_string_file(p, "") >= 0);
+
+        u = usage(t, 0);
+
+        assert_se(inv = journal_inventory_new(t));
+
+        /* Everything fits */
+        assert_se(journal_inventory_vacuum(inv, 100 * u, 0, &oldest, &freed, false) >= 0);
+        assert_se(freed == 0);
+        assert_se(oldest == 1000);
+
+        /* Only the two newest files fit */
+        oldest = 0;
+        assert_se(journal_inventory_vacuum(inv, 2 * u, 0, &oldest, &freed, false) >= 0);
+        assert_se(freed == 2 * u);
+        assert_se(oldest == 1002);
+        assert_se(!have_archived(t, 0));
+        assert_se(!have_archived(t, 1));
+        assert_se(have_archived(t, 2));
+        assert_se(have_archived(t, 3));
+
+        /* New files are picked up, empty ones removed right away */
+        make_archived(t, 4, false);
+        make_archived(t, 5, true);
+
+        freed = oldest = 0;
+        assert_se(journal_inventory_vacuum(inv, 100 * u, 0, &oldest, &freed, false) >= 0);
+        assert_se(freed == u);
+        assert_se(oldest == 1002);
+        assert_se(have_archived(t, 4));
+        assert_se(!have_archived(t, 5));
+
+        /* Files removed behind our back are forgotten about */
+        assert_se(unlink(archived_path(t, 4)) >= 0);
+        make_archived(t, 6, false);
+
+        freed = oldest = 0;
+        assert_se(journal_inventory_vacuum(inv, 2 * u, 0, &oldest, &freed, false) >= 0);
+        assert_se(freed == u);
+        assert_se(oldest == 1003);
+        assert_se(!have_archived(t, 2));
+        assert_se(have_archived(t, 3));
+        assert_se(have_archived(t, 6));
+}
+
+static void on_done(JournalVacuumer *v, const VacuumResult *result, void *userdata) {
+        VacuumResult *ret = userdata;
+
+        *ret = *result;
+        ret->duration = MAX(ret->duration, 1u);
+}
+
+static void test_vacuumer(const char *t) {
+        _cleanup_event_unref_ sd_event *e = NULL;
+        JournalVacuumer *v;
+        VacuumResult result = {};
+        uint64_t u;
+        unsigned i;
+
+        for (i = 10; i < 14; i++)
+                make_archived(t, i, false);
+
+        u = usage(t, 10);
+
+        assert_se(sd_event_default(&e) >= 0);
+        assert_se(journal_vacuumer_new(e, on_done, &result, &v) >= 0);
+
+        /* In the background, but blocking until it is done, the
+         * result is delivered directly by the wait */
+        assert_se(journal_vacuumer_queue(v, t, 3 * u, 0) >= 0);
+        assert_se(journal_vacuumer_start(v) >= 0);
+        journal_vacuumer_wait(v);
+
+        assert_se(result.duration > 0);
+        assert_se(result.freed == 3 * u);
+        assert_se(result.oldest_usec == 1011);
+        assert_se(!have_archived(t, 3));
+        assert_se(!have_archived(t, 6));
+        assert_se(!have_archived(t, 10));
+
+        /* In the background without waiting, the result is delivered
+         * via the event loop */
+        zero(result);
+        assert_se(journal_vacuumer_queue(v, t, u, 0) >= 0);
+        assert_se(journal_vacuumer_start(v) >= 0);
+
+        while (result.duration == 0)
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+
+        assert_se(result.freed == 2 * u);
+        assert_se(result.oldest_usec == 1013);
+        assert_se(!have_archived(t, 12));
+        assert_se(have_archived(t, 13));
+
+        journal_vacuumer_free(v);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-vacuum-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(sd_id128_randomize(&seqnum_id) >= 0);
+
+        assert_se(mkdtemp(t));
+
+        test_inventory(t);
+        test_vacuumer(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
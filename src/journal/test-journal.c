@@ -19,14 +19,20 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "systemd/sd-journal.h"
+
+#include "event-util.h"
 #include "log.h"
 #include "rm-rf.h"
+#include "lookup3.h"
 #include "journal-file.h"
 #include "journal-authenticate.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 
 static bool arg_keep = false;
 
@@ -166,6 +172,432 @@ static void test_empty(void) {
         journal_file_close(f4);
 }
 
+#define N_INDEXED 2000
+
+/* Entry i gets sequence number i+1, and every three entries share
+ * one realtime timestamp */
+static uint64_t indexed_realtime(uint64_t i) {
+        return 1000000 + (i / 3) * 10;
+}
+
+static void test_entry_index(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        JournalFile *f;
+        struct iovec iovec;
+        static const char test[] = "TEST1=1";
+        Object *o;
+        uint64_t i, x;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        iovec.iov_base = (void*) test;
+        iovec.iov_len = strlen(test);
+
+        for (i = 0; i < N_INDEXED; i++) {
+                dual_timestamp ts = {
+                        .realtime = indexed_realtime(i),
+                        .monotonic = i + 1,
+                };
+
+                assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_rotate(&f, true, false);
+        journal_file_close(f);
+
+        /* Find the archived file, it should carry an index now */
+        assert_se(d = opendir("."));
+        while ((de = readdir(d)))
+                if (startswith(de->d_name, "test@"))
+                        break;
+        assert_se(de);
+
+        assert_se(journal_file_open(de->d_name, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->header->entry_index_offset != 0);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        for (x = indexed_realtime(0) - 5; x <= indexed_realtime(N_INDEXED - 1) + 5; x += 5) {
+                uint64_t down = 0, up = 0;
+
+                while (down < N_INDEXED && indexed_realtime(down) < x)
+                        down++;
+                while (up < N_INDEXED && indexed_realtime(up) <= x)
+                        up++;
+
+                if (down < N_INDEXED) {
+                        assert_se(journal_file_move_to_entry_by_realtime(f, x, DIRECTION_DOWN, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.seqnum) == down + 1);
+                } else
+                        assert_se(journal_file_move_to_entry_by_realtime(f, x, DIRECTION_DOWN, &o, NULL) == 0);
+
+                if (up > 0) {
+                        assert_se(journal_file_move_to_entry_by_realtime(f, x, DIRECTION_UP, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.seqnum) == up);
+                } else
+                        assert_se(journal_file_move_to_entry_by_realtime(f, x, DIRECTION_UP, &o, NULL) == 0);
+        }
+
+        for (x = 1; x <= N_INDEXED; x++) {
+                assert_se(journal_file_move_to_entry_by_seqnum(f, x, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == x);
+                assert_se(journal_file_move_to_entry_by_seqnum(f, x, DIRECTION_UP, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == x);
+        }
+
+        assert_se(journal_file_move_to_entry_by_seqnum(f, N_INDEXED + 1, DIRECTION_DOWN, &o, NULL) == 0);
+        assert_se(journal_file_move_to_entry_by_seqnum(f, N_INDEXED + 1, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == N_INDEXED);
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_BLOOM 2000
+
+static unsigned count_matching(sd_journal *j, const char *match) {
+        unsigned n = 0;
+
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j)
+                n++;
+
+        return n;
+}
+
+static void test_bloom_filter(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        JournalFile *f;
+        sd_journal *j;
+        char t[] = "/tmp/journal-XXXXXX";
+        char buf[32];
+        struct iovec iovec[2];
+        unsigned i, n = 0;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        iovec[0].iov_base = (char*) "TEST=bloom";
+        iovec[0].iov_len = strlen("TEST=bloom");
+
+        for (i = 0; i < N_BLOOM; i++) {
+                dual_timestamp ts;
+
+                xsprintf(buf, "VALUE=%u", i);
+                iovec[1].iov_base = buf;
+                iovec[1].iov_len = strlen(buf);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_rotate(&f, true, false);
+        journal_file_close(f);
+
+        assert_se(d = opendir("."));
+        while ((de = readdir(d)))
+                if (startswith(de->d_name, "test@"))
+                        break;
+        assert_se(de);
+
+        assert_se(journal_file_open(de->d_name, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->header->bloom_filter_offset != 0);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        /* No false negatives, and not too many false positives */
+        assert_se(journal_file_bloom_filter_test(f, hash64("TEST=bloom", strlen("TEST=bloom"))));
+
+        for (i = 0; i < N_BLOOM; i++) {
+                xsprintf(buf, "VALUE=%u", i);
+                assert_se(journal_file_bloom_filter_test(f, hash64(buf, strlen(buf))));
+
+                xsprintf(buf, "VALUE=%u", N_BLOOM + i);
+                if (journal_file_bloom_filter_test(f, hash64(buf, strlen(buf))))
+                        n++;
+        }
+
+        log_info("%u of %u absent values passed the bloom filter", n, N_BLOOM);
+        assert_se(n < N_BLOOM / 20);
+
+        journal_file_close(f);
+
+        /* Matching across the archived and the (empty) online file
+         * still finds exactly what is there */
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        assert_se(count_matching(j, "TEST=bloom") == N_BLOOM);
+        assert_se(count_matching(j, "VALUE=7") == 1);
+        assert_se(count_matching(j, "VALUE=4711") == 0);
+        assert_se(count_matching(j, "TEST=other") == 0);
+
+        sd_journal_close(j);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_LAYOUT 3000
+
+static void test_layout(bool compact) {
+        JournalFile *f;
+        char t[] = "/tmp/journal-XXXXXX";
+        char buf[32];
+        struct iovec iovec[2];
+        Object *o;
+        uint64_t i, p, q, n_items = 0;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", one_zero(compact), 1) >= 0);
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+
+        assert_se(f->compact == compact);
+        assert_se(JOURNAL_HEADER_COMPACT(f->header) == compact);
+
+        /* Entry i carries VALUE=i%3, hence every data object is
+         * linked into a chain of several entry arrays, as is the
+         * main array */
+        for (i = 0; i < N_LAYOUT; i++) {
+                dual_timestamp ts = {
+                        .realtime = 1000000 + i * 10,
+                        .monotonic = i + 1,
+                };
+
+                iovec[0].iov_base = (char*) "TEST=layout";
+                iovec[0].iov_len = strlen("TEST=layout");
+
+                xsprintf(buf, "VALUE=%"PRIu64, i % 3);
+                iovec[1].iov_base = buf;
+                iovec[1].iov_len = strlen(buf);
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+
+        /* The items of the main array take 4 or 8 bytes each */
+        for (p = le64toh(f->header->entry_array_offset); p > 0; p = le64toh(o->entry_array.next_entry_array_offset)) {
+                assert_se(journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, p, &o) >= 0);
+                assert_se(le64toh(o->object.size) - offsetof(Object, entry_array.items) ==
+                          journal_file_entry_array_n_items(f, o) * (compact ? 4 : 8));
+                n_items += journal_file_entry_array_n_items(f, o);
+        }
+        assert_se(n_items >= N_LAYOUT);
+
+        /* Bisect over the main array */
+        for (i = 1; i <= N_LAYOUT; i++) {
+                assert_se(journal_file_move_to_entry_by_seqnum(f, i, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i);
+                assert_se(journal_file_move_to_entry_by_realtime(f, 1000000 + (i - 1) * 10 + 5, DIRECTION_UP, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i);
+        }
+
+        /* Bisect over the arrays of a data object, every third entry
+         * has VALUE=1 */
+        assert_se(journal_file_find_data_object(f, "VALUE=1", strlen("VALUE=1"), NULL, &q) == 1);
+        for (i = 1; i < N_LAYOUT; i++) {
+                uint64_t expected = i + (3 - (i + 1) % 3) % 3;
+
+                assert_se(journal_file_move_to_entry_by_seqnum_for_data(f, q, i, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == expected);
+        }
+
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, q, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 2);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, q, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == N_LAYOUT - 1);
+
+        journal_file_close(f);
+
+        assert_se(journal_file_open("test.journal", O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->compact == compact);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_size_limit(bool compact) {
+        _cleanup_closedir_ DIR *d = NULL;
+        ObjectHeader fake = {
+                .type = OBJECT_ENTRY_ARRAY,
+        };
+        JournalFile *f;
+        struct dirent *de;
+        char t[] = "/tmp/journal-XXXXXX";
+        struct iovec iovec;
+        dual_timestamp ts;
+        uint64_t p, end;
+        Object *o;
+        int r;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", one_zero(compact), 1) >= 0);
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+
+        IOVEC_SET_STRING(iovec, "TEST=before");
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+
+        /* Writing 4G for real is too slow, hence pretend the file
+         * is full up to 4G: a single object that reaches up to
+         * there, in a sparse file. Without metrics there's no other
+         * size limit. */
+        assert_se(journal_file_move_to_object(f, OBJECT_UNUSED, le64toh(f->header->tail_object_offset), &o) >= 0);
+        p = le64toh(f->header->tail_object_offset) + ALIGN64(le64toh(o->object.size));
+        end = JOURNAL_COMPACT_SIZE_MAX + 1;
+
+        fake.size = htole64(end - p);
+        assert_se(ftruncate(f->fd, end) >= 0);
+        assert_se(pwrite(f->fd, &fake, sizeof(fake), p) == sizeof(fake));
+        f->header->arena_size = htole64(end - le64toh(f->header->header_size));
+        f->header->tail_object_offset = htole64(p);
+
+        IOVEC_SET_STRING(iovec, "TEST=after");
+        dual_timestamp_get(&ts);
+        r = journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL);
+
+        if (compact) {
+                /* Compact files can't grow beyond 4G, journald
+                 * rotates on -E2BIG */
+                assert_se(r == -E2BIG);
+                assert_se(f->header->n_entries == htole64(1));
+
+                assert_se(journal_file_rotate(&f, false, false) >= 0);
+                assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+                assert_se(f->header->n_entries == htole64(1));
+
+                assert_se(d = opendir("."));
+                while ((de = readdir(d)))
+                        if (startswith(de->d_name, "test@"))
+                                break;
+                assert_se(de);
+        } else {
+                /* Regular files just continue, with items pointing
+                 * beyond 4G */
+                assert_se(r == 0);
+                assert_se(journal_file_move_to_entry_by_seqnum(f, 2, DIRECTION_DOWN, &o, &p) == 1);
+                assert_se(p > UINT32_MAX);
+                assert_se(journal_file_next_entry(f, 0, DIRECTION_UP, &o, &p) == 1);
+                assert_se(le64toh(o->entry.seqnum) == 2);
+                assert_se(p > UINT32_MAX);
+        }
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#ifdef HAVE_ZSTD
+static void test_dictionary(bool deferred) {
+        _cleanup_event_unref_ sd_event *e = NULL;
+        JournalFile *f;
+        char t[] = "/tmp/journal-XXXXXX";
+        char buf[128];
+        struct iovec iovec;
+        dual_timestamp ts;
+        Object *o;
+        unsigned i, n;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        /* Files hooked up to an event loop train the dictionary
+         * only once the loop is idle */
+        if (deferred) {
+                assert_se(sd_event_new(&e) >= 0);
+                assert_se(journal_file_enable_post_change_timer(f, e, USEC_PER_SEC) >= 0);
+        }
+
+        /* Log distinct small messages until the dictionary got trained */
+        for (n = 0; n < 100000 && f->header->dictionary_offset == 0 && !f->dict_training_event; n++) {
+                xsprintf(buf, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u",
+                         n % 97, n % 256, n * 7 % 256, 1024 + n);
+                iovec.iov_base = buf;
+                iovec.iov_len = strlen(buf);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        if (deferred) {
+                assert_se(f->dict_training_event);
+                assert_se(f->header->dictionary_offset == 0);
+
+                assert_se(sd_event_run(e, 0) > 0);
+                assert_se(!f->dict_training_event);
+        }
+
+        assert_se(f->header->dictionary_offset != 0);
+
+        for (i = n; i < n + 100; i++) {
+                xsprintf(buf, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u",
+                         i % 97, i % 256, i * 7 % 256, 1024 + i);
+                iovec.iov_base = buf;
+                iovec.iov_len = strlen(buf);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_close(f);
+
+        assert_se(journal_file_open("test.journal", O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        /* The last one should have been compressed with the dictionary */
+        i--;
+        xsprintf(buf, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u",
+                 i % 97, i % 256, i * 7 % 256, 1024 + i);
+        assert_se(journal_file_find_data_object(f, buf, strlen(buf), &o, NULL) == 1);
+        assert_se(o->object.flags & OBJECT_COMPRESSED_ZSTD);
+        assert_se(le64toh(o->object.size) - offsetof(Object, data.payload) < strlen(buf));
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
 int main(int argc, char *argv[]) {
         arg_keep = argc > 1;
 
@@ -175,6 +607,16 @@ int main(int argc, char *argv[]) {
 
         test_non_empty();
         test_empty();
+        test_entry_index();
+        test_bloom_filter();
+        test_layout(false);
+        test_layout(true);
+        test_size_limit(false);
+        test_size_limit(true);
+#ifdef HAVE_ZSTD
+        test_dictionary(false);
+        test_dictionary(true);
+#endif
 
         return 0;
 }
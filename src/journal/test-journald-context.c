@@ -0,0 +1,213 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "journald-context.h"
+#include "process-util.h"
+#include "util.h"
+#include "log.h"
+
+/* PIDs this large can't exist, the kernel caps pid_max way below */
+#define FAKE_PID(i) ((pid_t) (INT32_MAX - (i)))
+
+static void assert_stats(ClientContextCache *c, uint64_t hits, uint64_t misses, unsigned n_contexts) {
+        uint64_t h, m;
+        unsigned n;
+
+        client_context_cache_get_stats(c, &h, &m, &n);
+        log_debug("hits=%"PRIu64" misses=%"PRIu64" contexts=%u", h, m, n);
+
+        assert_se(h == hits);
+        assert_se(m == misses);
+        assert_se(n == n_contexts);
+}
+
+static void test_hit_miss(void) {
+        ClientContextCache *c;
+        ClientContext *x, *y;
+
+        assert_se(c = client_context_cache_new());
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        assert_se(x->pid == getpid());
+        assert_se(x->starttime > 0);
+        assert_se(startswith(x->comm, "_COMM="));
+        assert_se(startswith(x->exe, "_EXE="));
+        assert_stats(c, 0, 1, 1);
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &y) >= 0);
+        assert_se(x == y);
+        assert_stats(c, 1, 1, 1);
+
+        /* Processes that don't exist are never served from the cache */
+        assert_se(client_context_get(c, FAKE_PID(0), NULL, false, &x) >= 0);
+        assert_se(!x->comm);
+        assert_se(client_context_get(c, FAKE_PID(0), NULL, false, &x) >= 0);
+        assert_stats(c, 1, 3, 2);
+
+        client_context_cache_flush(c);
+        assert_stats(c, 1, 3, 0);
+
+        client_context_cache_free(c);
+}
+
+static void test_starttime_change(void) {
+        ClientContextCache *c;
+        ClientContext *x;
+        unsigned long long starttime;
+
+        assert_se(c = client_context_cache_new());
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        starttime = x->starttime;
+
+        /* Pretend the PID was recycled */
+        x->starttime = starttime + 1;
+        free(x->comm);
+        x->comm = strdup("_COMM=recycled");
+        assert_se(x->comm);
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        assert_se(x->starttime == starttime);
+        assert_se(!streq(x->comm, "_COMM=recycled"));
+        assert_stats(c, 0, 2, 1);
+
+        client_context_cache_free(c);
+}
+
+static void test_exec(void) {
+        _cleanup_free_ char *comm = NULL;
+        ClientContextCache *c;
+        ClientContext *x;
+        int fds[2];
+        unsigned i;
+        pid_t pid;
+
+        if (access("/bin/sleep", X_OK) < 0) {
+                log_info("/bin/sleep not available, skipping %s", __func__);
+                return;
+        }
+
+        assert_se(pipe2(fds, O_CLOEXEC) >= 0);
+
+        pid = fork();
+        assert_se(pid >= 0);
+
+        if (pid == 0) {
+                char b;
+
+                safe_close(fds[1]);
+                if (read(fds[0], &b, 1) != 1)
+                        _exit(EXIT_FAILURE);
+
+                execl("/bin/sleep", "sleep", "infinity", NULL);
+                _exit(EXIT_FAILURE);
+        }
+
+        safe_close(fds[0]);
+
+        assert_se(c = client_context_cache_new());
+
+        assert_se(client_context_get(c, pid, NULL, false, &x) >= 0);
+        assert_se(!streq(x->comm, "_COMM=sleep"));
+        assert_se(client_context_get(c, pid, NULL, false, &x) >= 0);
+        assert_stats(c, 1, 1, 1);
+
+        /* Let the child execute sleep, and wait until it did */
+        assert_se(write(fds[1], "x", 1) == 1);
+        safe_close(fds[1]);
+
+        for (i = 0; i < 500; i++) {
+                free(comm);
+                comm = NULL;
+                assert_se(get_process_comm(pid, &comm) >= 0);
+                if (streq(comm, "sleep"))
+                        break;
+
+                usleep(10 * USEC_PER_MSEC);
+        }
+        assert_se(streq(comm, "sleep"));
+
+        /* Well within the refresh period, but the exec has to be
+         * noticed anyway */
+        assert_se(client_context_get(c, pid, NULL, false, &x) >= 0);
+        assert_se(streq(x->comm, "_COMM=sleep"));
+        assert_se(endswith(x->exe, "sleep"));
+        assert_stats(c, 1, 2, 1);
+
+        assert_se(kill(pid, SIGKILL) >= 0);
+        assert_se(waitpid(pid, NULL, 0) == pid);
+
+        client_context_cache_free(c);
+}
+
+static void test_lru(void) {
+        ClientContextCache *c;
+        ClientContext *x;
+        uint64_t misses = 1;
+        unsigned i;
+
+        assert_se(c = client_context_cache_new());
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+
+        /* Fill the cache up */
+        for (i = 1; i < CLIENT_CONTEXTS_MAX; i++)
+                assert_se(client_context_get(c, FAKE_PID(i), NULL, false, &x) >= 0);
+        misses += CLIENT_CONTEXTS_MAX - 1;
+        assert_stats(c, 0, misses, CLIENT_CONTEXTS_MAX);
+
+        /* Using our context keeps it around when the next one is
+         * added, the least recently used one goes instead */
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        assert_se(client_context_get(c, FAKE_PID(CLIENT_CONTEXTS_MAX), NULL, false, &x) >= 0);
+        misses++;
+        assert_stats(c, 1, misses, CLIENT_CONTEXTS_MAX);
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        assert_stats(c, 2, misses, CLIENT_CONTEXTS_MAX);
+
+        /* But it is evicted eventually if it isn't used anymore */
+        for (i = 0; i < CLIENT_CONTEXTS_MAX; i++)
+                assert_se(client_context_get(c, FAKE_PID(CLIENT_CONTEXTS_MAX + 1 + i), NULL, false, &x) >= 0);
+        misses += CLIENT_CONTEXTS_MAX;
+        assert_stats(c, 2, misses, CLIENT_CONTEXTS_MAX);
+
+        assert_se(client_context_get(c, getpid(), NULL, false, &x) >= 0);
+        misses++;
+        assert_stats(c, 2, misses, CLIENT_CONTEXTS_MAX);
+
+        client_context_cache_free(c);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+        log_open();
+
+        test_hit_miss();
+        test_starttime_change();
+        test_exec();
+        test_lru();
+
+        return 0;
+}
@@ -0,0 +1,266 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "journald-stream.h"
+#include "strv.h"
+#include "util.h"
+#include "log.h"
+
+#define N_CHUNK_LINES 4096U
+
+static int collect_line(char *line, void *userdata) {
+        char ***lines = userdata;
+
+        assert_se(strlen(line) <= LINE_MAX);
+        assert_se(strv_extend(lines, line) >= 0);
+
+        return 0;
+}
+
+static int failing_line(char *line, void *userdata) {
+        unsigned *n = userdata;
+
+        (*n)++;
+        return -EINVAL;
+}
+
+static void open_stream(int fds[2], StdoutStreamBuffer *b) {
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert_se(stdout_stream_buffer_init(b) >= 0);
+        assert_se(b->allocated == STDOUT_STREAM_BUFFER_MIN);
+}
+
+static void close_stream(int fds[2], StdoutStreamBuffer *b) {
+        stdout_stream_buffer_done(b);
+        safe_close(fds[0]);
+        safe_close(fds[1]);
+}
+
+static void send_string(int fd, const char *s) {
+        assert_se(loop_write(fd, s, strlen(s), false) >= 0);
+}
+
+/* Reads until there is nothing more, returns the last result */
+static int read_all(StdoutStreamBuffer *b, int fd, char ***lines) {
+        int r;
+
+        while ((r = stdout_stream_buffer_read(b, fd, collect_line, lines)) > 0)
+                ;
+
+        return r;
+}
+
+static void test_partial_lines(void) {
+        _cleanup_strv_free_ char **lines = NULL;
+        StdoutStreamBuffer b;
+        int fds[2];
+
+        open_stream(fds, &b);
+
+        /* Nothing is passed on until the line is complete */
+        send_string(fds[1], "foo");
+        assert_se(stdout_stream_buffer_read(&b, fds[0], collect_line, &lines) > 0);
+        assert_se(strv_isempty(lines));
+        assert_se(stdout_stream_buffer_read(&b, fds[0], collect_line, &lines) == -EAGAIN);
+
+        send_string(fds[1], "bar\nba");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_equal(lines, STRV_MAKE("foobar")));
+
+        send_string(fds[1], "z\n\nqux");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_equal(lines, STRV_MAKE("foobar", "baz", "")));
+
+        /* The rest goes out when the other side is done */
+        assert_se(shutdown(fds[1], SHUT_WR) >= 0);
+        assert_se(read_all(&b, fds[0], &lines) == 0);
+        assert_se(strv_equal(lines, STRV_MAKE("foobar", "baz", "", "qux")));
+        assert_se(b.length == 0);
+
+        close_stream(fds, &b);
+}
+
+static void test_long_lines(void) {
+        _cleanup_strv_free_ char **lines = NULL;
+        char x[2 * LINE_MAX + 6];
+        StdoutStreamBuffer b;
+        int fds[2];
+
+        open_stream(fds, &b);
+
+        /* The longest line that is passed on in one piece */
+        memset(x, 'x', LINE_MAX - 1);
+        x[LINE_MAX - 1] = 0;
+        send_string(fds[1], x);
+        send_string(fds[1], "\n");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_length(lines) == 1);
+        assert_se(streq(lines[0], x));
+        strv_free(lines);
+        lines = NULL;
+
+        /* One more, and the newline ends up on a line of its own */
+        memset(x, 'x', LINE_MAX);
+        x[LINE_MAX] = 0;
+        send_string(fds[1], x);
+        send_string(fds[1], "\n");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_equal(lines, STRV_MAKE(x, "")));
+        strv_free(lines);
+        lines = NULL;
+
+        /* Split at LINE_MAX, however the line arrives */
+        memset(x, 'x', sizeof(x) - 1);
+        x[sizeof(x) - 1] = 0;
+        send_string(fds[1], x);
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_length(lines) == 2);
+        assert_se(strlen(lines[0]) == LINE_MAX);
+        assert_se(strlen(lines[1]) == LINE_MAX);
+
+        send_string(fds[1], "yy\nnext\n");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(strv_length(lines) == 4);
+        assert_se(streq(lines[2], "xxxxxyy"));
+        assert_se(streq(lines[3], "next"));
+
+        close_stream(fds, &b);
+}
+
+static void fill(int fds[2], StdoutStreamBuffer *b, char ***lines) {
+        _cleanup_free_ char *data = NULL;
+        size_t available, i;
+
+        /* Exactly as much as fits into the buffer */
+        available = b->allocated - 1 - b->length;
+        data = new(char, available + 1);
+        assert_se(data);
+
+        for (i = 0; i < available; i++)
+                data[i] = i % 100 == 99 ? '\n' : 'a';
+        data[available] = 0;
+
+        send_string(fds[1], data);
+        assert_se(stdout_stream_buffer_read(b, fds[0], collect_line, lines) > 0);
+}
+
+static void test_resize(void) {
+        _cleanup_strv_free_ char **lines = NULL;
+        StdoutStreamBuffer b;
+        size_t last, peak;
+        unsigned i, k, n = 0;
+        int fds[2], r;
+
+        open_stream(fds, &b);
+
+        /* Each read that fills the buffer makes it grow, up to the
+         * maximum */
+        for (k = 0; b.allocated < STDOUT_STREAM_BUFFER_MAX; k++) {
+                assert_se(k < 16);
+
+                last = b.allocated;
+                fill(fds, &b, &lines);
+                assert_se(b.allocated == MIN(2 * last, STDOUT_STREAM_BUFFER_MAX));
+        }
+
+        fill(fds, &b, &lines);
+        assert_se(b.allocated == STDOUT_STREAM_BUFFER_MAX);
+
+        /* Finish the last line */
+        send_string(fds[1], "\n");
+        assert_se(read_all(&b, fds[0], &lines) == -EAGAIN);
+        assert_se(b.length == 0);
+
+        /* Small reads make it shrink again, step by step */
+        for (k = 0; b.allocated > STDOUT_STREAM_BUFFER_MIN; k++) {
+                strv_free(lines);
+                lines = NULL;
+
+                assert_se(k < 16);
+
+                last = b.allocated;
+                send_string(fds[1], "small\n");
+                assert_se(stdout_stream_buffer_read(&b, fds[0], collect_line, &lines) > 0);
+                assert_se(strv_equal(lines, STRV_MAKE("small")));
+                assert_se(b.allocated == MAX(last / 2, STDOUT_STREAM_BUFFER_MIN));
+        }
+
+        /* No line gets lost or torn apart while the buffer changes
+         * its size back and forth */
+        peak = b.allocated;
+        for (k = 0; k < 4; k++) {
+                _cleanup_free_ char *chunk = NULL;
+                char *p;
+
+                strv_free(lines);
+                lines = NULL;
+
+                p = chunk = new(char, N_CHUNK_LINES * 8 + 1);
+                assert_se(chunk);
+                for (i = 0; i < N_CHUNK_LINES; i++)
+                        p += sprintf(p, "%07u\n", k * N_CHUNK_LINES + i);
+                send_string(fds[1], chunk);
+
+                while ((r = stdout_stream_buffer_read(&b, fds[0], collect_line, &lines)) > 0)
+                        peak = MAX(peak, b.allocated);
+                assert_se(r == -EAGAIN);
+
+                assert_se(strv_length(lines) == N_CHUNK_LINES);
+                for (i = 0; i < N_CHUNK_LINES; i++) {
+                        char expected[8];
+
+                        xsprintf(expected, "%07u", n++);
+                        assert_se(streq(lines[i], expected));
+                }
+        }
+
+        assert_se(peak > STDOUT_STREAM_BUFFER_MIN);
+
+        close_stream(fds, &b);
+}
+
+static void test_handler_error(void) {
+        StdoutStreamBuffer b;
+        unsigned n = 0;
+        int fds[2];
+
+        open_stream(fds, &b);
+
+        /* The first failing line stops processing */
+        send_string(fds[1], "one\ntwo\n");
+        assert_se(stdout_stream_buffer_read(&b, fds[0], failing_line, &n) == -EINVAL);
+        assert_se(n == 1);
+
+        close_stream(fds, &b);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+
+        test_partial_lines();
+        test_long_lines();
+        test_resize();
+        test_handler_error();
+
+        return 0;
+}
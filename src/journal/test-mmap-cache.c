@@ -20,18 +20,21 @@
 ***/
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "macro.h"
 #include "util.h"
+#include "log.h"
 #include "mmap-cache.h"
 
-int main(int argc, char *argv[]) {
+static void test_basic(void) {
         int x, y, z, r;
         char px[] = "/tmp/testmmapXXXXXXX", py[] = "/tmp/testmmapYXXXXXX", pz[] = "/tmp/testmmapZXXXXXX";
         MMapCache *m;
+        MMapWindow *w;
         void *p, *q;
 
         assert_se(m = mmap_cache_new());
@@ -69,11 +72,139 @@ int main(int argc, char *argv[]) {
 
         assert_se((uint8_t*) p + 1 == (uint8_t*) q);
 
+        /* Only the first access and the one at 16MB needed a new
+         * window, everything else was found via the context or the
+         * window list of the fd */
+        assert_se(mmap_cache_get_missed(m) == 2);
+        assert_se(mmap_cache_get_context_cache_hit(m) == 1);
+        assert_se(mmap_cache_get_window_list_hit(m) == 2);
+        assert_se(mmap_cache_get_hit(m) == 3);
+
+        /* A pinned window stays mapped, even when the context moves
+         * on and the file is closed */
+        assert_se(ftruncate(y, page_size()) >= 0);
+        assert_se(pwrite(y, "pinned", 6, 42) == 6);
+
+        r = mmap_cache_get(m, y, PROT_READ, 2, false, 42, 6, NULL, &p);
+        assert_se(r >= 0);
+        assert_se(memcmp(p, "pinned", 6) == 0);
+
+        assert_se(mmap_cache_pin(m, 2, &w) >= 0);
+
+        r = mmap_cache_get(m, x, PROT_READ, 2, false, 1, 2, NULL, &q);
+        assert_se(r >= 0);
+
+        mmap_cache_close_fd(m, y);
+        assert_se(memcmp(p, "pinned", 6) == 0);
+
+        mmap_cache_unpin(m, w);
+
         mmap_cache_unref(m);
 
         safe_close(x);
         safe_close(y);
         safe_close(z);
+}
+
+/* Large enough that the windows for all of it don't fit into the
+ * pool, so that windows are recycled while other threads use them */
+#define SHARED_FILE_SIZE (1024ULL*1024ULL*1024ULL)
+#define SHARED_STEP (1024ULL*1024ULL)
+#define SHARED_THREADS 8
+#define SHARED_ITERATIONS 20000
+
+typedef struct SharedThread {
+        MMapCache *cache;
+        int fd;
+        unsigned seed;
+} SharedThread;
+
+static uint64_t shared_offset(unsigned *seed) {
+        return (rand_r(seed) % (SHARED_FILE_SIZE / SHARED_STEP)) * SHARED_STEP;
+}
+
+static void *shared_thread(void *p) {
+        SharedThread *t = p;
+        uint64_t pinned_offset;
+        void *pinned;
+        unsigned i;
+
+        /* The pointer we get for context 1 must stay valid while
+         * the other threads go through the same context */
+        pinned_offset = shared_offset(&t->seed);
+        assert_se(mmap_cache_get(t->cache, t->fd, PROT_READ, 1, false, pinned_offset, sizeof(uint64_t), NULL, &pinned) > 0);
+
+        for (i = 0; i < SHARED_ITERATIONS; i++) {
+                uint64_t offset;
+                void *q;
+
+                offset = shared_offset(&t->seed);
+                assert_se(mmap_cache_get(t->cache, t->fd, PROT_READ, 0, false, offset, sizeof(uint64_t), NULL, &q) > 0);
+                assert_se(*(uint64_t*) q == offset);
+
+                assert_se(*(uint64_t*) pinned == pinned_offset);
+        }
+
+        mmap_cache_forget_thread(t->cache);
+
+        return NULL;
+}
+
+static void test_shared(void) {
+        char path[] = "/tmp/testmmapSXXXXXX";
+        SharedThread threads[SHARED_THREADS];
+        pthread_t ids[SHARED_THREADS];
+        MMapCacheStats stats;
+        MMapCache *m;
+        uint64_t offset;
+        unsigned i;
+        int fd;
+
+        assert_se(m = mmap_cache_new_shared());
+
+        fd = mkostemp_safe(path, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        unlink(path);
+
+        assert_se(ftruncate(fd, SHARED_FILE_SIZE) >= 0);
+        for (offset = 0; offset < SHARED_FILE_SIZE; offset += SHARED_STEP)
+                assert_se(pwrite(fd, &offset, sizeof(offset), offset) == sizeof(offset));
+
+        for (i = 0; i < SHARED_THREADS; i++) {
+                threads[i] = (SharedThread) {
+                        .cache = m,
+                        .fd = fd,
+                        .seed = i,
+                };
+
+                assert_se(pthread_create(ids + i, NULL, shared_thread, threads + i) == 0);
+        }
+
+        for (i = 0; i < SHARED_THREADS; i++)
+                assert_se(pthread_join(ids[i], NULL) == 0);
+
+        mmap_cache_get_stats(m, &stats);
+        log_info("shared cache: %u context cache hit, %u window list hit, %u miss, %u windows (%u reused)",
+                 stats.n_context_cache_hit, stats.n_window_list_hit, stats.n_missed,
+                 stats.n_windows, stats.n_windows_reused);
+
+        assert_se(stats.n_context_cache_hit + stats.n_window_list_hit + stats.n_missed ==
+                  SHARED_THREADS * (SHARED_ITERATIONS + 1));
+        assert_se(stats.n_windows_reused > 0);
+        assert_se(stats.n_files == 1);
+        assert_se(stats.n_threads == 0);
+
+        mmap_cache_close_fd(m, fd);
+        mmap_cache_unref(m);
+
+        safe_close(fd);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_INFO);
+
+        test_basic();
+        test_shared();
 
         return 0;
 }
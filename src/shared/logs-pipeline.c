@@ -0,0 +1,464 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/prctl.h>
+
+#include "logs-pipeline.h"
+#include "logs-show.h"
+#include "journal-internal.h"
+#include "hashmap.h"
+#include "terminal-util.h"
+#include "log.h"
+#include "util.h"
+
+/* How many entries to hand to a worker at once */
+#define OUTPUT_BATCH_SIZE 256
+
+/* How many batches to keep in flight per worker, this bounds the
+ * amount of formatted output we buffer */
+#define OUTPUT_BATCHES_PER_THREAD 4
+
+typedef struct OutputItem {
+        unsigned file;
+        uint64_t offset;
+        char *prefix;
+} OutputItem;
+
+typedef struct OutputBatch {
+        OutputItem *items;
+        size_t n_items;
+
+        char *buf;
+        size_t size;
+
+        int r;
+        bool done;
+} OutputBatch;
+
+typedef struct OutputWorker {
+        OutputPipeline *pipeline;
+        pthread_t thread;
+        bool running;
+
+        /* Each worker reads the entries through its own journal
+         * object, opened on the same files as the caller's one */
+        sd_journal *journal;
+        JournalFile **files;
+} OutputWorker;
+
+struct OutputPipeline {
+        sd_journal *journal;
+        FILE *f;
+        OutputMode mode;
+        unsigned n_columns;
+        OutputFlags flags;
+
+        /* Maps the JournalFile objects of the caller's journal to
+         * their index in the workers' files arrays */
+        Hashmap *file_index;
+        unsigned n_files;
+
+        OutputWorker *workers;
+        unsigned n_workers;
+
+        OutputBatch *current;
+
+        /* Ring of submitted batches, oldest first. The first
+         * n_taken of them have been picked up by a worker. */
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        OutputBatch **queue;
+        unsigned n_queue_max;
+        unsigned head;
+        unsigned n_queued;
+        unsigned n_taken;
+        bool quit;
+};
+
+static OutputBatch* output_batch_free(OutputBatch *b) {
+        size_t i;
+
+        if (!b)
+                return NULL;
+
+        for (i = 0; i < b->n_items; i++)
+                free(b->items[i].prefix);
+
+        free(b->items);
+        free(b->buf);
+        free(b);
+
+        return NULL;
+}
+
+static void output_batch_format(OutputWorker *w, OutputBatch *b) {
+        OutputPipeline *p = w->pipeline;
+        FILE *f;
+        size_t i;
+        int r = 0;
+
+        f = open_memstream(&b->buf, &b->size);
+        if (!f) {
+                b->r = -ENOMEM;
+                return;
+        }
+
+        for (i = 0; i < b->n_items; i++) {
+                OutputItem *item = b->items + i;
+
+                if (item->prefix)
+                        fputs(item->prefix, f);
+
+                r = journal_seek_entry(w->journal, w->files[item->file], item->offset);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to seek to entry: %m");
+                        break;
+                }
+
+                r = output_journal(f, w->journal, p->mode, p->n_columns, p->flags, NULL);
+                if (r < 0)
+                        break;
+        }
+
+        if (fclose(f) != 0 && r >= 0)
+                r = -ENOMEM;
+
+        b->r = r < 0 ? r : 0;
+}
+
+static void *output_worker_thread(void *userdata) {
+        OutputWorker *w = userdata;
+        OutputPipeline *p = w->pipeline;
+        sigset_t fullset;
+
+        /* No signals in this thread please */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, NULL) == 0);
+
+        prctl(PR_SET_NAME, (unsigned long) "journal-output");
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                OutputBatch *b;
+
+                while (!p->quit && p->n_taken >= p->n_queued)
+                        assert_se(pthread_cond_wait(&p->work_cond, &p->mutex) == 0);
+
+                /* Pending batches are dropped when we are asked to quit */
+                if (p->quit)
+                        break;
+
+                b = p->queue[(p->head + p->n_taken) % p->n_queue_max];
+                p->n_taken++;
+
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                output_batch_format(w, b);
+
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                b->done = true;
+                assert_se(pthread_cond_broadcast(&p->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return NULL;
+}
+
+static int output_worker_open(OutputWorker *w, char **paths) {
+        unsigned i;
+        int r;
+
+        r = sd_journal_open_files(&w->journal, (const char**) paths, 0);
+        if (r < 0)
+                return r;
+
+        w->files = new0(JournalFile*, w->pipeline->n_files);
+        if (!w->files)
+                return -ENOMEM;
+
+        for (i = 0; i < w->pipeline->n_files; i++) {
+                w->files[i] = ordered_hashmap_get(w->journal->files, paths[i]);
+                if (!w->files[i])
+                        return log_error_errno(-ENOENT, "Failed to reopen journal file %s.", paths[i]);
+        }
+
+        return 0;
+}
+
+int output_pipeline_new(
+                sd_journal *j,
+                FILE *f,
+                OutputMode mode,
+                unsigned n_columns,
+                OutputFlags flags,
+                unsigned n_threads,
+                OutputPipeline **ret) {
+
+        _cleanup_(output_pipeline_freep) OutputPipeline *p = NULL;
+        _cleanup_free_ char **paths = NULL;
+        sigset_t fullset, saved;
+        JournalFile *jf;
+        Iterator i;
+        unsigned k;
+        int r;
+
+        assert(j);
+        assert(f);
+        assert(n_threads > 0);
+        assert(ret);
+
+        p = new0(OutputPipeline, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->journal = j;
+        p->f = f;
+        p->mode = mode;
+        p->n_columns = n_columns > 0 ? n_columns : columns();
+        p->flags = flags;
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done_cond, NULL) == 0);
+
+        p->file_index = hashmap_new(NULL);
+        if (!p->file_index)
+                return -ENOMEM;
+
+        paths = new0(char*, ordered_hashmap_size(j->files) + 1);
+        if (!paths)
+                return -ENOMEM;
+
+        ORDERED_HASHMAP_FOREACH(jf, j->files, i) {
+                r = hashmap_put(p->file_index, jf, UINT_TO_PTR(p->n_files + 1));
+                if (r < 0)
+                        return r;
+
+                paths[p->n_files++] = jf->path;
+        }
+
+        p->n_queue_max = n_threads * OUTPUT_BATCHES_PER_THREAD;
+        p->queue = new0(OutputBatch*, p->n_queue_max);
+        if (!p->queue)
+                return -ENOMEM;
+
+        p->workers = new0(OutputWorker, n_threads);
+        if (!p->workers)
+                return -ENOMEM;
+
+        for (k = 0; k < n_threads; k++) {
+                p->workers[k].pipeline = p;
+                p->n_workers++;
+
+                r = output_worker_open(p->workers + k, paths);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Start the threads with all signals blocked, so that they
+         * don't steal them from the main thread */
+        assert_se(sigfillset(&fullset) == 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &fullset, &saved) == 0);
+
+        for (k = 0; k < n_threads; k++) {
+                r = -pthread_create(&p->workers[k].thread, NULL, output_worker_thread, p->workers + k);
+                if (r < 0)
+                        break;
+
+                p->workers[k].running = true;
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+
+        if (r < 0)
+                return r;
+
+        *ret = p;
+        p = NULL;
+
+        return 0;
+}
+
+static int output_pipeline_write_one(OutputPipeline *p) {
+        OutputBatch *b;
+        int r;
+
+        assert(p);
+        assert(p->n_queued > 0);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        b = p->queue[p->head];
+        while (!b->done)
+                assert_se(pthread_cond_wait(&p->done_cond, &p->mutex) == 0);
+
+        p->queue[p->head] = NULL;
+        p->head = (p->head + 1) % p->n_queue_max;
+        p->n_queued--;
+        p->n_taken--;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        if (b->size > 0)
+                fwrite(b->buf, 1, b->size, p->f);
+
+        r = b->r;
+        output_batch_free(b);
+
+        if (r >= 0 && ferror(p->f))
+                r = -EIO;
+
+        return r;
+}
+
+static int output_pipeline_submit(OutputPipeline *p) {
+        OutputBatch *b;
+        int r = 0;
+
+        assert(p);
+
+        b = p->current;
+        if (!b)
+                return 0;
+
+        p->current = NULL;
+
+        /* Make room by writing out the oldest batch, this is where
+         * we wait for the workers to catch up */
+        if (p->n_queued >= p->n_queue_max)
+                r = output_pipeline_write_one(p);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        p->queue[(p->head + p->n_queued) % p->n_queue_max] = b;
+        p->n_queued++;
+
+        assert_se(pthread_cond_signal(&p->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
+
+int output_pipeline_add(OutputPipeline *p, const char *prefix) {
+        OutputItem *item;
+        unsigned k;
+
+        assert(p);
+
+        if (!p->journal->current_file || p->journal->current_file->current_offset <= 0)
+                return -EADDRNOTAVAIL;
+
+        k = PTR_TO_UINT(hashmap_get(p->file_index, p->journal->current_file));
+        if (k == 0)
+                return -ESTALE;
+
+        if (!p->current) {
+                p->current = new0(OutputBatch, 1);
+                if (!p->current)
+                        return -ENOMEM;
+
+                p->current->items = new0(OutputItem, OUTPUT_BATCH_SIZE);
+                if (!p->current->items) {
+                        p->current = output_batch_free(p->current);
+                        return -ENOMEM;
+                }
+        }
+
+        item = p->current->items + p->current->n_items;
+        item->file = k - 1;
+        item->offset = p->journal->current_file->current_offset;
+
+        if (prefix) {
+                item->prefix = strdup(prefix);
+                if (!item->prefix)
+                        return -ENOMEM;
+        }
+
+        p->current->n_items++;
+
+        if (p->current->n_items >= OUTPUT_BATCH_SIZE)
+                return output_pipeline_submit(p);
+
+        return 0;
+}
+
+int output_pipeline_flush(OutputPipeline *p) {
+        int r;
+
+        assert(p);
+
+        r = output_pipeline_submit(p);
+        if (r < 0)
+                return r;
+
+        while (p->n_queued > 0) {
+                r = output_pipeline_write_one(p);
+                if (r < 0)
+                        return r;
+        }
+
+        fflush(p->f);
+
+        return 0;
+}
+
+OutputPipeline* output_pipeline_free(OutputPipeline *p) {
+        unsigned k;
+
+        if (!p)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->quit = true;
+        assert_se(pthread_cond_broadcast(&p->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (k = 0; k < p->n_workers; k++) {
+                OutputWorker *w = p->workers + k;
+
+                if (w->running)
+                        assert_se(pthread_join(w->thread, NULL) == 0);
+
+                free(w->files);
+                sd_journal_close(w->journal);
+        }
+
+        for (k = 0; k < p->n_queued; k++)
+                output_batch_free(p->queue[(p->head + k) % p->n_queue_max]);
+
+        output_batch_free(p->current);
+
+        free(p->workers);
+        free(p->queue);
+        hashmap_free(p->file_index);
+
+        pthread_cond_destroy(&p->work_cond);
+        pthread_cond_destroy(&p->done_cond);
+        pthread_mutex_destroy(&p->mutex);
+
+        free(p);
+
+        return NULL;
+}
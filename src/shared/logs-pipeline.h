@@ -0,0 +1,47 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+
+#include "sd-journal.h"
+
+#include "macro.h"
+#include "output-mode.h"
+
+/* Formats journal entries on a pool of worker threads, while the
+ * caller keeps iterating on its own sd_journal object. Output is
+ * written to the stream in the order the entries were added. */
+typedef struct OutputPipeline OutputPipeline;
+
+int output_pipeline_new(
+                sd_journal *j,
+                FILE *f,
+                OutputMode mode,
+                unsigned n_columns,
+                OutputFlags flags,
+                unsigned n_threads,
+                OutputPipeline **ret);
+OutputPipeline* output_pipeline_free(OutputPipeline *p);
+
+int output_pipeline_add(OutputPipeline *p, const char *prefix);
+int output_pipeline_flush(OutputPipeline *p);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(OutputPipeline*, output_pipeline_free);
@@ -93,6 +93,62 @@ static int parse_field(const void *data, size_t length, const char *field, char
         return 1;
 }
 
+typedef struct ParseFieldVec {
+        const char *field;
+        size_t field_len;
+        char **target;
+        size_t *target_len;
+} ParseFieldVec;
+
+#define PARSE_FIELD_VEC_ENTRY(_field, _target, _target_len)             \
+        { .field = _field, .field_len = strlen(_field), .target = _target, .target_len = _target_len }
+
+/* Like parse_field(), but looks for any of the specified fields at
+ * once: the name of the field in data is located only once, and only
+ * entries with a matching name length are compared at all. */
+static int parse_fieldv(const void *data, size_t length, const ParseFieldVec *fields, unsigned n_fields) {
+        const char *eq;
+        size_t fl;
+        unsigned i;
+
+        assert(data);
+        assert(fields || n_fields == 0);
+
+        eq = memchr(data, '=', length);
+        if (!eq)
+                return 0;
+
+        fl = eq - (const char*) data + 1;
+
+        for (i = 0; i < n_fields; i++) {
+                const ParseFieldVec *v = fields + i;
+                size_t nl;
+                char *buf;
+
+                if (v->field_len != fl)
+                        continue;
+
+                if (memcmp(data, v->field, fl) != 0)
+                        continue;
+
+                nl = length - fl;
+                buf = malloc(nl+1);
+                if (!buf)
+                        return log_oom();
+
+                memcpy(buf, eq + 1, nl);
+                buf[nl] = 0;
+
+                free(*v->target);
+                *v->target = buf;
+                *v->target_len = nl;
+
+                return 1;
+        }
+
+        return 0;
+}
+
 static bool shall_print(const char *p, size_t l, OutputFlags flags) {
         assert(p);
 
@@ -204,6 +260,17 @@ static int output_short(
         size_t hostname_len = 0, identifier_len = 0, comm_len = 0, pid_len = 0, fake_pid_len = 0, message_len = 0, realtime_len = 0, monotonic_len = 0, priority_len = 0;
         int p = LOG_INFO;
         bool ellipsized = false;
+        const ParseFieldVec fields[] = {
+                PARSE_FIELD_VEC_ENTRY("_PID=", &pid, &pid_len),
+                PARSE_FIELD_VEC_ENTRY("_COMM=", &comm, &comm_len),
+                PARSE_FIELD_VEC_ENTRY("MESSAGE=", &message, &message_len),
+                PARSE_FIELD_VEC_ENTRY("PRIORITY=", &priority, &priority_len),
+                PARSE_FIELD_VEC_ENTRY("_HOSTNAME=", &hostname, &hostname_len),
+                PARSE_FIELD_VEC_ENTRY("SYSLOG_PID=", &fake_pid, &fake_pid_len),
+                PARSE_FIELD_VEC_ENTRY("SYSLOG_IDENTIFIER=", &identifier, &identifier_len),
+                PARSE_FIELD_VEC_ENTRY("_SOURCE_REALTIME_TIMESTAMP=", &realtime, &realtime_len),
+                PARSE_FIELD_VEC_ENTRY("_SOURCE_MONOTONIC_TIMESTAMP=", &monotonic, &monotonic_len),
+        };
 
         assert(f);
         assert(j);
@@ -218,55 +285,7 @@ static int output_short(
 
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
 
-                r = parse_field(data, length, "PRIORITY=", &priority, &priority_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "_HOSTNAME=", &hostname, &hostname_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "SYSLOG_IDENTIFIER=", &identifier, &identifier_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "_COMM=", &comm, &comm_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "_PID=", &pid, &pid_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "SYSLOG_PID=", &fake_pid, &fake_pid_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "_SOURCE_REALTIME_TIMESTAMP=", &realtime, &realtime_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "_SOURCE_MONOTONIC_TIMESTAMP=", &monotonic, &monotonic_len);
-                if (r < 0)
-                        return r;
-                else if (r > 0)
-                        continue;
-
-                r = parse_field(data, length, "MESSAGE=", &message, &message_len);
+                r = parse_fieldv(data, length, fields, ELEMENTSOF(fields));
                 if (r < 0)
                         return r;
         }
@@ -563,53 +582,121 @@ static int output_export(
         return 0;
 }
 
+#define WORD_ONES ((unsigned long) -1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/* Non-zero if any byte in w is zero, or less than n (n <= 0x80) */
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+#define WORD_HAS_LESS(w, n) (((w) - WORD_ONES * (n)) & ~(w) & WORD_HIGHS)
+
+static inline bool json_byte_plain(uint8_t c, bool allow_8bit) {
+        if (c == '"' || c == '\\' || c < ' ' || c == 0x7F)
+                return false;
+
+        return allow_8bit || c < 0x80;
+}
+
+/* Returns the number of bytes at the beginning of p that may be
+ * copied into a JSON string verbatim: anything but quotes,
+ * backslashes and control characters, and, unless allow_8bit is set,
+ * non-ASCII bytes. Looks at a word at a time, as most fields consist
+ * of such bytes only. */
+static size_t json_plain_prefix(const char *p, size_t l, bool allow_8bit) {
+        const char *s = p, *e = p + l;
+
+        while ((size_t) (e - s) >= sizeof(unsigned long)) {
+                unsigned long w;
+
+                memcpy(&w, s, sizeof(w));
+
+                if (WORD_HAS_LESS(w, ' ') ||
+                    WORD_HAS_ZERO(w ^ (WORD_ONES * '"')) ||
+                    WORD_HAS_ZERO(w ^ (WORD_ONES * '\\')) ||
+                    WORD_HAS_ZERO(w ^ (WORD_ONES * 0x7F)))
+                        break;
+
+                if (!allow_8bit && (w & WORD_HIGHS))
+                        break;
+
+                s += sizeof(w);
+        }
+
+        while (s < e && json_byte_plain(*s, allow_8bit))
+                s++;
+
+        return s - p;
+}
+
 void json_escape(
                 FILE *f,
                 const char* p,
                 size_t l,
                 OutputFlags flags) {
 
+        size_t n;
+
         assert(f);
         assert(p);
 
-        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD)
-
+        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD) {
                 fputs("null", f);
+                return;
+        }
+
+        /* Printable ASCII without anything to escape needs no UTF-8
+         * validation and goes out in one piece */
+        n = json_plain_prefix(p, l, false);
+        if (n == l) {
+                fputc('\"', f);
+                fwrite(p, 1, l, f);
+                fputc('\"', f);
 
-        else if (!utf8_is_printable(p, l)) {
-                bool not_first = false;
+        } else if (!utf8_is_printable(p, l)) {
+                char buf[LINE_MAX];
+                size_t k = 0;
 
+                /* Format the array into a buffer, and flush it
+                 * whenever another ", 255" might not fit */
                 fputs("[ ", f);
 
-                while (l > 0) {
-                        if (not_first)
-                                fprintf(f, ", %u", (uint8_t) *p);
-                        else {
-                                not_first = true;
-                                fprintf(f, "%u", (uint8_t) *p);
+                for (n = 0; n < l; n++) {
+                        if (k + 6 > sizeof(buf)) {
+                                fwrite(buf, 1, k, f);
+                                k = 0;
                         }
 
-                        p++;
-                        l--;
+                        k += sprintf(buf + k, n > 0 ? ", %u" : "%u", (uint8_t) p[n]);
                 }
 
+                fwrite(buf, 1, k, f);
                 fputs(" ]", f);
         } else {
                 fputc('\"', f);
 
-                while (l > 0) {
+                /* Copy the runs between the characters that need
+                 * escaping as a whole */
+                n += json_plain_prefix(p + n, l - n, true);
+
+                for (;;) {
+                        fwrite(p, 1, n, f);
+                        p += n;
+                        l -= n;
+
+                        if (l == 0)
+                                break;
+
                         if (*p == '"' || *p == '\\') {
                                 fputc('\\', f);
                                 fputc(*p, f);
                         } else if (*p == '\n')
                                 fputs("\\n", f);
-                        else if (*p < ' ')
-                                fprintf(f, "\\u%04x", *p);
                         else
-                                fputc(*p, f);
+                                fprintf(f, "\\u%04x", (uint8_t) *p);
 
                         p++;
                         l--;
+
+                        n = json_plain_prefix(p, l, true);
                 }
 
                 fputc('\"', f);
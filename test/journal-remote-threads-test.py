@@ -0,0 +1,159 @@
+# systemd-journal-remote --threads integration test
+#
+# systemd is free software; you can redistribute it and/or modify it
+# under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+
+# systemd is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with systemd; If not, see <http://www.gnu.org/licenses/>.
+
+import unittest
+import sys
+import os
+import re
+import socket
+import subprocess
+import tempfile
+import shutil
+
+journal_remote = os.path.join(os.environ.get('builddir', '.'), 'systemd-journal-remote')
+
+N_CONNECTIONS = 6
+N_ENTRIES = 500
+
+
+class JournalRemoteThreadsTest(unittest.TestCase):
+    def setUp(self):
+        self.workdir = tempfile.mkdtemp(prefix='journal-remote-test.')
+        self.output = os.path.join(self.workdir, 'output')
+        os.mkdir(self.output)
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(N_CONNECTIONS)
+        self.clients = []
+        self.servers = []
+
+    def tearDown(self):
+        for s in self.clients + self.servers + [self.listener]:
+            s.close()
+        shutil.rmtree(self.workdir)
+
+    def connect(self, n):
+        '''Open n connections.
+
+        Keep the server ends of the connections, which are passed
+        to journal-remote.
+        '''
+        for i in range(n):
+            c = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            c.connect(self.listener.getsockname())
+            self.clients.append(c)
+            self.servers.append(self.listener.accept()[0])
+
+    def run_journal_remote(self, threads):
+        '''Run journal-remote on the connections.
+
+        Pass them via socket activation, so that all of them are handed
+        to the shards right at startup. Return the process.
+        '''
+        fds = [s.fileno() for s in self.servers]
+
+        def pass_fds():
+            # Move them out of the way first, they might be in the
+            # range they are going to
+            high = [os.dup(fd) for fd in fds]
+            for i, fd in enumerate(high):
+                os.dup2(fd, 3 + i)
+                os.close(fd)
+
+        env = os.environ.copy()
+        env['SYSTEMD_LOG_LEVEL'] = 'info'
+        env['SYSTEMD_LOG_TARGET'] = 'console'
+        env['LISTEN_FDS'] = str(len(fds))
+        return subprocess.Popen(
+            ['sh', '-c', 'LISTEN_PID=$$ exec "$0" "$@"', journal_remote,
+             '--threads=%u' % threads, '--split-mode=host',
+             '--output=%s/' % self.output],
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+            universal_newlines=True, env=env, close_fds=False,
+            preexec_fn=pass_fds)
+
+    def send(self, client, host, first, n):
+        data = ''
+        for i in range(first, first + n):
+            data += ('__REALTIME_TIMESTAMP=%u\n'
+                     '_HOSTNAME=%s\n'
+                     'MESSAGE=Message %u\n'
+                     '\n') % (1000000000 + i, host, i)
+        client.sendall(data.encode('ascii'))
+
+    def wait(self, proc):
+        '''Wait for journal-remote to exit by itself, return its output'''
+        try:
+            (out, err) = proc.communicate(timeout=60)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            (out, err) = proc.communicate()
+            self.fail('journal-remote did not exit after all connections ended:\n' + out)
+
+        self.assertEqual(proc.returncode, 0, out)
+        return out
+
+    def written(self, out):
+        m = re.search(r'Finishing after writing (\d+) entries', out)
+        self.assertTrue(m, out)
+        return int(m.group(1))
+
+    def check_exit(self, threads):
+        '''Run journal-remote on connections closed by the other side.
+
+        It has to exit by itself once the last one is processed.
+        '''
+        self.connect(N_CONNECTIONS)
+
+        proc = self.run_journal_remote(threads)
+        for s in self.servers:
+            s.close()
+
+        for i, c in enumerate(self.clients):
+            self.send(c, 'host%u' % i, i * N_ENTRIES, N_ENTRIES)
+            c.shutdown(socket.SHUT_WR)
+
+        out = self.wait(proc)
+        self.assertEqual(self.written(out), N_CONNECTIONS * N_ENTRIES, out)
+        self.assertTrue(any(f.endswith('.journal') for f in os.listdir(self.output)))
+
+    def test_single(self):
+        self.check_exit(1)
+
+    def test_threads(self):
+        self.check_exit(4)
+
+    def test_one_connection(self):
+        '''More threads than connections'''
+
+        self.connect(1)
+        proc = self.run_journal_remote(4)
+        self.servers[0].close()
+
+        self.send(self.clients[0], 'host0', 0, N_ENTRIES)
+        self.clients[0].shutdown(socket.SHUT_WR)
+
+        out = self.wait(proc)
+        self.assertEqual(self.written(out), N_ENTRIES, out)
+
+
+if __name__ == '__main__':
+    if not os.path.exists(journal_remote):
+        sys.stderr.write('%s does not exist, skipping\n' % journal_remote)
+        sys.exit(77)
+    if not os.path.exists('/etc/machine-id'):
+        sys.stderr.write('no machine id, skipping\n')
+        sys.exit(77)
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
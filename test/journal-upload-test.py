@@ -0,0 +1,309 @@
+# systemd-journal-upload and systemd-journal-remote batch upload test
+#
+# systemd is free software; you can redistribute it and/or modify it
+# under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+
+# systemd is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with systemd; If not, see <http://www.gnu.org/licenses/>.
+
+import unittest
+import sys
+import os
+import re
+import lzma
+import signal
+import socket
+import subprocess
+import struct
+import tempfile
+import threading
+import shutil
+
+from http.server import HTTPServer, BaseHTTPRequestHandler
+from socketserver import ThreadingMixIn
+from http.client import HTTPConnection
+
+builddir = os.environ.get('builddir', '.')
+journal_upload = os.path.join(builddir, 'systemd-journal-upload')
+journal_remote = os.path.join(builddir, 'systemd-journal-remote')
+
+N_ENTRIES = 1050
+BATCH_SIZE = 100
+
+# Must match journal-remote.c
+UPLOAD_DECOMPRESSED_MAX = 256 * 1024 * 1024
+
+
+def export_entries(first, n):
+    data = ''
+    for i in range(first, first + n):
+        data += ('__REALTIME_TIMESTAMP=%u\n'
+                 'MESSAGE=Message %u\n'
+                 'NUMBER=%u\n'
+                 '\n') % (1000000000 + i, i, i)
+    return data.encode('ascii')
+
+
+def zstd_compress(data):
+    '''Compresses into a single frame which records the content size'''
+    with tempfile.NamedTemporaryFile() as f:
+        f.write(data)
+        f.flush()
+        return subprocess.check_output(['zstd', '-q', '-1', '-c', f.name])
+
+
+class ThreadingHTTPServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+class UploadHandler(BaseHTTPRequestHandler):
+    '''Records the batches uploaded, and fails the one containing
+    server.fail_number'''
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers['Content-Length']))
+        encoding = self.headers.get('Content-Encoding')
+        if encoding == 'xz':
+            body = lzma.decompress(body)
+        else:
+            assert encoding is None, encoding
+
+        entries = []
+        for entry in body.decode('ascii').split('\n\n'):
+            fields = dict(l.split('=', 1) for l in entry.split('\n') if '=' in l)
+            if fields:
+                entries.append((int(fields['NUMBER']), fields['__CURSOR']))
+
+        server = self.server
+        with server.lock:
+            if server.fail_number in [n for (n, c) in entries]:
+                self.send_response(500)
+                self.end_headers()
+                self.wfile.write(b'Failing on purpose.\n')
+                return
+
+            server.batches.append((encoding, entries))
+
+        self.send_response(202)
+        self.end_headers()
+        self.wfile.write(b'OK.\n')
+
+
+@unittest.skipUnless(os.path.exists(journal_upload), 'systemd-journal-upload not built')
+class JournalUploadTest(unittest.TestCase):
+    def setUp(self):
+        self.workdir = tempfile.mkdtemp(prefix='journal-upload-test.')
+        self.journal_dir = os.path.join(self.workdir, 'journal')
+        os.mkdir(self.journal_dir)
+        self.state = os.path.join(self.workdir, 'state')
+
+        # Let journal-remote write the journal file we upload from
+        export = os.path.join(self.workdir, 'export')
+        with open(export, 'wb') as f:
+            f.write(export_entries(0, N_ENTRIES))
+        subprocess.check_call(
+            [journal_remote, '--split-mode=none',
+             '--output=%s/source.journal' % self.journal_dir, export],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+        self.server = ThreadingHTTPServer(('127.0.0.1', 0), UploadHandler)
+        self.server.lock = threading.Lock()
+        self.server.batches = []
+        self.server.fail_number = None
+        self.thread = threading.Thread(target=self.server.serve_forever)
+        self.thread.start()
+
+    def tearDown(self):
+        self.server.shutdown()
+        self.server.server_close()
+        self.thread.join()
+        shutil.rmtree(self.workdir)
+
+    def run_upload(self, *args):
+        '''Upload the journal, return the exit code'''
+
+        url = 'http://127.0.0.1:%u' % self.server.server_address[1]
+        return subprocess.call(
+            [journal_upload, '--url=' + url, '--directory=' + self.journal_dir,
+             '--follow=no', '--save-state=' + self.state,
+             '--batch-size=%u' % BATCH_SIZE] + list(args),
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    def saved_cursor(self):
+        if not os.path.exists(self.state):
+            return None
+        with open(self.state) as f:
+            m = re.search(r'^LAST_CURSOR=(.*)$', f.read(), re.M)
+        return m.group(1)
+
+    def uploaded(self):
+        '''Return the entries uploaded so far, in order, and check
+        that each batch was a run of consecutive entries'''
+
+        entries = []
+        for (encoding, batch) in self.server.batches:
+            self.assertTrue(0 < len(batch) <= BATCH_SIZE, len(batch))
+            numbers = [n for (n, c) in batch]
+            self.assertEqual(numbers, list(range(numbers[0], numbers[0] + len(batch))))
+            entries += batch
+
+        return sorted(entries)
+
+    def check_batches(self, *args):
+        self.assertEqual(self.run_upload(*args), 0)
+
+        self.assertEqual(len(self.server.batches), (N_ENTRIES + BATCH_SIZE - 1) // BATCH_SIZE)
+
+        entries = self.uploaded()
+        self.assertEqual([n for (n, c) in entries], list(range(N_ENTRIES)))
+
+        # The cursor is saved once everything has been acknowledged
+        self.assertEqual(self.saved_cursor(), entries[-1][1])
+
+        # Nothing left to do the next time
+        del self.server.batches[:]
+        self.assertEqual(self.run_upload(*args), 0)
+        self.assertEqual(self.server.batches, [])
+
+    def test_batches(self):
+        self.check_batches()
+
+    def test_parallel(self):
+        self.check_batches('--parallel-uploads=4')
+
+    def test_compressed(self):
+        self.check_batches('--parallel-uploads=4', '--compress=xz')
+        # Well, our entries are very compressible
+        self.assertTrue(all(e == 'xz' for (e, b) in self.server.batches))
+
+    def test_acknowledge(self):
+        '''The saved cursor never moves past a batch that failed'''
+
+        failed = 5 * BATCH_SIZE + 7
+        self.server.fail_number = failed
+        self.assertNotEqual(self.run_upload('--parallel-uploads=4'), 0)
+
+        cursors = dict((c, n) for (n, c) in self.uploaded())
+        cursor = self.saved_cursor()
+        if cursor is None:
+            last = -1
+        else:
+            # The last entry of a batch which was acknowledged, along
+            # with all before it
+            last = cursors[cursor]
+            self.assertEqual(last % BATCH_SIZE, BATCH_SIZE - 1)
+            self.assertEqual([n for (n, c) in self.uploaded() if n <= last],
+                             list(range(last + 1)))
+        self.assertTrue(last < failed, last)
+
+        # Resume right after the saved cursor
+        del self.server.batches[:]
+        self.server.fail_number = None
+        self.assertEqual(self.run_upload('--parallel-uploads=4'), 0)
+
+        entries = self.uploaded()
+        self.assertEqual([n for (n, c) in entries], list(range(last + 1, N_ENTRIES)))
+        self.assertEqual(self.saved_cursor(), entries[-1][1])
+
+
+class JournalRemoteUploadTest(unittest.TestCase):
+    def setUp(self):
+        self.workdir = tempfile.mkdtemp(prefix='journal-remote-upload-test.')
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.bind(('127.0.0.1', 0))
+        listener.listen(8)
+        self.port = listener.getsockname()[1]
+
+        fd = listener.fileno()
+
+        def pass_fd():
+            os.dup2(fd, 3)
+
+        env = os.environ.copy()
+        env['SYSTEMD_LOG_LEVEL'] = 'info'
+        env['SYSTEMD_LOG_TARGET'] = 'console'
+        env['LISTEN_FDS'] = '1'
+        self.proc = subprocess.Popen(
+            ['sh', '-c', 'LISTEN_PID=$$ exec "$0" "$@"', journal_remote,
+             '--listen-http=-3', '--split-mode=none',
+             '--output=%s/remote.journal' % self.workdir],
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+            universal_newlines=True, env=env, close_fds=False,
+            preexec_fn=pass_fd)
+        listener.close()
+
+    def tearDown(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+            self.proc.communicate()
+        shutil.rmtree(self.workdir)
+
+    def post(self, body, encoding=None):
+        '''Upload body, return the status code'''
+
+        headers = {'Content-Type': 'application/vnd.fdo.journal'}
+        if encoding:
+            headers['Content-Encoding'] = encoding
+
+        conn = HTTPConnection('127.0.0.1', self.port, timeout=120)
+        conn.request('POST', '/upload', body, headers)
+        status = conn.getresponse().status
+        conn.close()
+        return status
+
+    def finish(self):
+        '''Stop journal-remote, return the number of entries written'''
+
+        self.proc.send_signal(signal.SIGTERM)
+        (out, err) = self.proc.communicate(timeout=60)
+        m = re.search(r'Finishing after writing (\d+) entries', out)
+        self.assertTrue(m, out)
+        return int(m.group(1))
+
+    def test_compressed(self):
+        self.assertEqual(self.post(export_entries(0, 100)), 202)
+        self.assertEqual(self.post(lzma.compress(export_entries(100, 100)), 'xz'), 202)
+        self.assertEqual(self.finish(), 200)
+
+    def test_garbage(self):
+        data = lzma.compress(export_entries(0, 100))
+
+        self.assertEqual(self.post(b'garbage' * 100, 'xz'), 422)
+        self.assertEqual(self.post(data[:len(data) // 2], 'xz'), 422)
+        # Not supported in every build
+        self.assertIn(self.post(struct.pack('<Q', 1000) + b'\xff' * 100, 'lz4'), (415, 422))
+        self.assertEqual(self.post(data, 'gzip'), 415)
+
+        # None of this had any effect
+        self.assertEqual(self.post(data, 'xz'), 202)
+        self.assertEqual(self.finish(), 100)
+
+    def test_oversized(self):
+        # Decompresses to one byte more than allowed, must not be
+        # truncated and parsed
+        entry = export_entries(0, 1)
+        data = entry + b'X' * (UPLOAD_DECOMPRESSED_MAX + 1 - len(entry))
+        self.assertEqual(self.post(lzma.compress(data, preset=0), 'xz'), 413)
+        if shutil.which('zstd'):
+            # Not supported in every build
+            self.assertIn(self.post(zstd_compress(data), 'zstd'), (413, 415))
+
+        self.assertEqual(self.post(lzma.compress(export_entries(0, 100)), 'xz'), 202)
+        self.assertEqual(self.finish(), 100)
+
+
+if __name__ == '__main__':
+    if not os.path.exists(journal_remote) or not os.path.exists('/etc/machine-id'):
+        sys.stderr.write('systemd-journal-remote or machine id not available, skipping\n')
+        sys.exit(77)
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
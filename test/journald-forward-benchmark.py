@@ -0,0 +1,119 @@
+#!/usr/bin/python
+# Sends syslog messages to /dev/log and receives what systemd-journald
+# forwards to /run/systemd/journal/syslog, reporting the end-to-end
+# throughput and the CPU time journald spent on it.
+#
+# Needs root, a journald running with ForwardToSyslog=yes, and no
+# syslog daemon listening on /run/systemd/journal/syslog (stop
+# syslog.socket first). Messages journald can't forward because the
+# receiver is behind are dropped and show up as "missed"; raise
+# net.unix.max_dgram_qlen to see the forwarding path itself.
+
+from __future__ import print_function
+import sys
+import os
+import socket
+import argparse
+import subprocess
+import threading
+import time
+
+PARSER = argparse.ArgumentParser()
+PARSER.add_argument('--messages', type=int, default=100000)
+PARSER.add_argument('--senders', type=int, default=4,
+                    help='number of concurrent senders')
+PARSER.add_argument('--timeout', type=float, default=5,
+                    help='seconds to wait for stragglers')
+PARSER.add_argument('--pid', type=int, default=None,
+                    help='PID of systemd-journald')
+OPTIONS = PARSER.parse_args()
+
+SYSLOG_PATH = '/run/systemd/journal/syslog'
+TAG = 'forward-benchmark-{}'.format(os.getpid())
+
+def journald_pid():
+    if OPTIONS.pid:
+        return OPTIONS.pid
+    out = subprocess.check_output(['systemctl', 'show', '-p', 'MainPID',
+                                   'systemd-journald.service'])
+    return int(out.decode('ascii').strip().split('=', 1)[1])
+
+def cpu_seconds(pid):
+    with open('/proc/{}/stat'.format(pid)) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime, fields 14 and 15 counting from one
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+
+def receive(sock, counts, done):
+    sock.settimeout(0.2)
+    while not done.is_set() or counts['idle'] < OPTIONS.timeout / 0.2:
+        try:
+            data = sock.recv(4096)
+        except socket.timeout:
+            counts['idle'] += 1
+            continue
+        counts['idle'] = 0
+        if TAG.encode('ascii') in data:
+            counts['received'] += 1
+            if counts['received'] >= OPTIONS.messages:
+                return
+
+def send(index, n, errors):
+    try:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        s.connect('/dev/log')
+        for i in range(n):
+            s.send('<14>{}: message {} from sender {}'.format(TAG, i, index).encode('ascii'))
+        s.close()
+    except socket.error as e:
+        errors.append((index, e))
+
+if os.path.exists(SYSLOG_PATH):
+    probe = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    try:
+        probe.connect(SYSLOG_PATH)
+        sys.exit('{} is in use by a syslog daemon, stop it first.'.format(SYSLOG_PATH))
+    except socket.error:
+        os.unlink(SYSLOG_PATH)
+    finally:
+        probe.close()
+
+receiver = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+receiver.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 * 1024 * 1024)
+receiver.bind(SYSLOG_PATH)
+
+pid = journald_pid()
+counts = {'received': 0, 'idle': 0}
+done = threading.Event()
+errors = []
+
+per_sender = OPTIONS.messages // OPTIONS.senders
+OPTIONS.messages = per_sender * OPTIONS.senders
+
+reader = threading.Thread(target=receive, args=(receiver, counts, done))
+senders = [threading.Thread(target=send, args=(i, per_sender, errors))
+           for i in range(OPTIONS.senders)]
+
+cpu_start = cpu_seconds(pid)
+start = time.time()
+reader.start()
+for t in senders:
+    t.start()
+for t in senders:
+    t.join()
+done.set()
+reader.join()
+elapsed = time.time() - start - (OPTIONS.timeout if counts['received'] < OPTIONS.messages else 0)
+cpu = cpu_seconds(pid) - cpu_start
+
+receiver.close()
+os.unlink(SYSLOG_PATH)
+
+for index, e in errors:
+    print('sender {}: {}'.format(index, e), file=sys.stderr)
+
+print('{} messages sent, {} forwarded in {:.2f}s: {:.0f} messages/s, journald used {:.2f}s CPU ({:.1f} us/message)'.format(
+    OPTIONS.messages, counts['received'], elapsed, counts['received'] / elapsed,
+    cpu, cpu * 1e6 / max(OPTIONS.messages, 1)))
+
+sys.exit(1 if errors else 0)